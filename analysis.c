@@ -23,65 +23,31 @@
 #include "main.h"
 #include "star.h"
 #include "util.h"
+#include "ephemeris.h"
+#include "attitude.h"
+#include "platesolve.h"
+#include "globalfit.h"
+#include "prefetch.h"
+#include "framecache.h"
+#include "sweep.h"
+#include "l1listing.h"
+#include "startrack.h"
+#include "pixelindex.h"
+#include "detectability.h"
 
 #include <stdio.h>
 #include <stdbool.h>
-#include <fts.h>
 #include <string.h>
 #include <math.h>
 #include <libgen.h>
+#include <unistd.h>
 
 #include <cdf.h>
 
 #include <gsl/gsl_statistics_float.h>
 #include <gsl/gsl_sort_float.h>
-#include <gsl/gsl_matrix.h>
-#include <gsl/gsl_blas.h>
-#include <gsl/gsl_linalg.h>
 
 
-int sortL1Listing(const FTSENT **first, const FTSENT **second)
-{
-    // Push abnormal entries to the end...
-    // Otherwise sort by date and UT
-
-    if (first == NULL)
-        return 1;
-    else if (second == NULL)
-        return -1;
-
-    const FTSENT *a = *first;
-    const FTSENT *b = *second;
-
-    if (a == NULL)
-        return 1;
-    else if (b == NULL)
-        return -1;
-
-    const char *file1 = a->fts_name;
-    const char *file2 = b->fts_name;
-
-    if (file1 == NULL)
-        return 1;
-    else if (file2 == NULL)
-        return -1;
-
-    if (strlen(file1) != 34)
-        return 1;
-    else if (strlen(file2) != 34)
-        return -1;
-
-    int datesCompared = strncmp(file1 + 16, file2 + 16, 10);
-
-    if (datesCompared > 0)
-        return 1;
-    else if (datesCompared < 0)
-        return -1;
-    else
-        return 0;
-        
-}
-
 int analyzeImagery(ProgramState *state)
 {
 
@@ -104,12 +70,13 @@ int analyzeImagery(ProgramState *state)
 
     int status = ASCC_OK;
 
-    // Only one version of each L1 file can be in the l1dir
-    char *dir[2] = {state->l1dir, NULL};
-
-    // Open directory listing to get expected number of images 
-    FTS *fts = fts_open(dir, FTS_LOGICAL, &sortL1Listing);
-    FTSENT *e = fts_read(fts);
+    // Files overlapping the interval in time order, highest version of each hour
+    L1Listing listing = {0};
+    status = listL1Files(state, &listing);
+    if (status != ASCC_OK)
+        return status;
+    if (state->verbose)
+        fprintf(stderr, "Listed %zu L1 files from %zu directories%s.\n", listing.nPaths, listing.nDirectoriesRead, listing.walked ? " (walked)" : "");
 
     double fileStartEpoch = 0;
     double fileStopEpoch = 0;
@@ -117,41 +84,129 @@ int analyzeImagery(ProgramState *state)
     double t1 = state->firstCalTime;
     double t2 = state->lastCalTime;
 
-    while (e != NULL)
+    char startString[EPOCH4_STRING_LEN+1];
+    char stopString[EPOCH4_STRING_LEN+1];
+
+    char **l1files = NULL;
+    // The files read ahead: cubes of cached L1 files, the L1 files otherwise
+    char **prefetchFiles = NULL;
+    // Images expected from each file until it has been analyzed
+    size_t *expectedImages = NULL;
+    size_t nL1Files = 0;
+    L1Prefetcher prefetcher = {0};
+    bool prefetching = false;
+
+    l1files = calloc(listing.nPaths > 0 ? listing.nPaths : 1, sizeof *l1files);
+    prefetchFiles = calloc(listing.nPaths > 0 ? listing.nPaths : 1, sizeof *prefetchFiles);
+    expectedImages = calloc(listing.nPaths > 0 ? listing.nPaths : 1, sizeof *expectedImages);
+    if (l1files == NULL || prefetchFiles == NULL || expectedImages == NULL)
     {
-        fileStartEpoch = epochFromL1Filename(e->fts_name);
-        fileStopEpoch = fileStartEpoch + 3600000; // one hour: L1 files cover 1 hour intervals
-        if (fileStartEpoch != ILLEGAL_EPOCH_VALUE && !((fileStartEpoch < t1 && fileStopEpoch <= t1) || (fileStartEpoch >= t2 && fileStopEpoch > t2)))
-            state->expectedNumberOfImages += numberOfL1FileImagesToProcess(fts->fts_path, t1, t2);
+        status = ASCC_MEM;
+        goto cleanup;
+    }
 
-        e = fts_read(fts);
+    for (size_t i = 0; i < listing.nPaths; i++)
+    {
+        char *name = strrchr(listing.paths[i], '/');
+        name = name != NULL ? name + 1 : listing.paths[i];
+        fileStartEpoch = epochFromL1Filename(name);
+        fileStopEpoch = fileStartEpoch + 3600000; // one hour: L1 files cover 1 hour intervals
+        // Skip files recorded in daylight or twilight without opening them
+        if (l1FileTooBright(state, fileStartEpoch, fileStopEpoch))
+        {
+            state->nL1FilesSkippedTooBright++;
+            if (state->verbose)
+            {
+                encodeEPOCH4(fileStartEpoch, startString);
+                encodeEPOCH4(fileStopEpoch, stopString);
+                fprintf(stderr, "Skipping %s: sky too bright from %s to %s\n", name, startString, stopString);
+            }
+            continue;
+        }
+        // No L1 file is opened before the prefetcher starts reading ahead
+        expectedImages[nL1Files] = estimatedL1FileImagesToProcess(state, listing.paths[i], fileStartEpoch, t1, t2);
+        state->expectedNumberOfImages += expectedImages[nL1Files];
+
+        l1files[nL1Files] = listing.paths[i];
+        listing.paths[i] = NULL;
+        // Cached files are read from their cubes. The analysis still gets the
+        // L1 file, which loadFrameCube() checks the cube against.
+        char cubeFile[FILENAME_MAX + 1];
+        bool cached = false;
+        if (state->frameCacheDir != NULL)
+        {
+            frameCubeFilename(state, l1files[nL1Files], cubeFile);
+            cached = access(cubeFile, R_OK) == 0;
+        }
+        prefetchFiles[nL1Files] = strdup(cached ? cubeFile : l1files[nL1Files]);
+        nL1Files++;
+        if (prefetchFiles[nL1Files - 1] == NULL)
+        {
+            status = ASCC_MEM;
+            goto cleanup;
+        }
     }
-    fts_close(fts);
 
-    if (state->expectedNumberOfImages == 0)
-        return ASCC_CDF_EXPORT_NO_DATA;
+    if ((state->skipDaylight || state->skipMoonlight) && state->verbose)
+        fprintf(stderr, "Skipped %zu L1 files recorded in a bright sky.\n", state->nL1FilesSkippedTooBright);
+
+    if (nL1Files == 0)
+    {
+        status = ASCC_CDF_EXPORT_NO_DATA;
+        goto cleanup;
+    }
 
     if (state->verbose)
-        fprintf(stderr, "Found %zu images to process.\n", state->expectedNumberOfImages);
+        fprintf(stderr, "About %zu images to process.\n", state->expectedNumberOfImages);
 
-    // Re-open listing to do the processing
-    fts = fts_open(dir, FTS_LOGICAL, &sortL1Listing);
-    e = fts_read(fts);
+    // Read the next files ahead while the current one is analyzed
+    if (state->prefetchDepth > 0 && nL1Files > 1)
+        prefetching = startL1Prefetcher(&prefetcher, prefetchFiles, nL1Files, state->prefetchDepth) == ASCC_OK;
 
-    while (e != NULL)
+    for (size_t f = 0; f < nL1Files; f++)
     {
-        fileStartEpoch = epochFromL1Filename(e->fts_name);
-        fileStopEpoch = fileStartEpoch + 3600000; // one hour: L1 files cover 1 hour intervals
-        if (fileStartEpoch != ILLEGAL_EPOCH_VALUE && !((fileStartEpoch < t1 && fileStopEpoch <= t1) || (fileStartEpoch >= t2 && fileStopEpoch > t2)))
-            analyzeL1FileImages(state, fts->fts_path);
+        if (prefetching)
+            waitForL1File(&prefetcher, f);
+        size_t nImagesBefore = state->nImages;
+        analyzeL1FileImages(state, l1files[f]);
+        // The estimate for the file becomes the number of images it had
+        state->expectedNumberOfImages += state->nImages - nImagesBefore;
+        state->expectedNumberOfImages -= expectedImages[f];
+    }
 
-        e = fts_read(fts);
+    if (state->nImages == 0)
+    {
+        status = ASCC_CDF_EXPORT_NO_DATA;
+        goto cleanup;
     }
 
+    // Give back the room reserved for more images
+    if (state->imageCapacity > state->nImages)
+        status = resizeImageArrays(state, state->nImages);
+
 cleanup:
 
-    if (fts != NULL)
-        fts_close(fts);
+    if (prefetching)
+    {
+        stopL1Prefetcher(&prefetcher);
+        state->nL1FilesPrefetched += prefetcher.nFilesPrefetched;
+        state->l1BytesPrefetched += prefetcher.bytesPrefetched;
+        state->l1PrefetchStallSeconds += prefetcher.stallSeconds;
+    }
+
+    for (size_t f = 0; f < nL1Files; f++)
+    {
+        free(l1files[f]);
+        free(prefetchFiles[f]);
+    }
+    if (l1files != NULL)
+        free(l1files);
+    if (prefetchFiles != NULL)
+        free(prefetchFiles);
+    if (expectedImages != NULL)
+        free(expectedImages);
+    freeL1Listing(&listing);
+    freeAnalysisScratch(state);
 
     return status;
 }
@@ -193,490 +248,1085 @@ int analyzeL1FileImages(ProgramState *state, char *l1file)
         return ASCC_ARGUMENTS;
 
     CDFid cdf = NULL;
-    CDFstatus cdfStatus = CDFopen(l1file, &cdf);
-    if (cdfStatus != CDF_OK)
-        return ASCC_L1_FILE;
+    CDFstatus cdfStatus = CDF_OK;
+
+    int status = ASCC_OK;
+
+    long maxFileRecord = 0;
+    long nFileImages = 0;
+    double *epochs = NULL;
+    long *records = NULL;
+    long nRecords = 0;
+    CalibrationStar *anchorStars = NULL;
+    CalibrationStar *nextAnchorStars = NULL;
+    size_t calStarsSize = state->nCalibrationStars * sizeof(CalibrationStar);
+    // Frame cubes return their image times on the heap
+    bool epochsFromCube = false;
+
+    // The workspace and per-file buffers come from the scratch arena of the run
+    status = createAnalysisScratch(state);
+    if (status != ASCC_OK)
+        return status;
+    AnalysisScratch *scratch = state->analysisScratch;
+    ImageWorkspace *work = &scratch->work;
+    resetImageWorkspace(state, work);
+    arenaRelease(&scratch->arena, scratch->fileMark);
+
+    // Frames and image times from the frame cube cache when enabled, otherwise from the L1 file
+    if (state->frameCacheDir != NULL)
+    {
+        status = loadFrameCube(state, l1file, &work->frames, &epochs, &nFileImages);
+        if (status == ASCC_MEM)
+            goto cleanup;
+        epochsFromCube = epochs != NULL;
+        status = ASCC_OK;
+    }
+
+    if (!work->frames.mapped)
+    {
+        cdfStatus = CDFopen(l1file, &cdf);
+        if (cdfStatus != CDF_OK)
+        {
+            cdf = NULL;
+            status = ASCC_L1_FILE;
+            goto cleanup;
+        }
+
+        if (state->directL1Reads && openL1FrameMap(state, cdf, l1file, &work->frames) == ASCC_MEM)
+        {
+            status = ASCC_MEM;
+            goto cleanup;
+        }
+
+        char cdfVarName[CDF_VAR_NAME_LEN + 1] = {0};
+
+        // Get time and continue only if within requested analysis time range
+        snprintf(cdfVarName, CDF_VAR_NAME_LEN + 1, "thg_asf_%s_epoch", state->site);
+        cdfStatus = CDFgetzVarMaxWrittenRecNum(cdf, CDFgetVarNum(cdf, cdfVarName), &maxFileRecord);
+        if (cdfStatus != CDF_OK || maxFileRecord == 0)
+        {
+            status = ASCC_L1_FILE;
+            goto cleanup;
+        }
+
+        nFileImages = maxFileRecord + 1;
+
+        // Image times for the whole file are needed up front to interpolate attitudes
+        epochs = arenaAlloc(&scratch->arena, nFileImages * sizeof *epochs);
+        if (epochs == NULL)
+        {
+            status = ASCC_MEM;
+            goto cleanup;
+        }
+        cdfStatus = CDFgetVarRangeRecordsByVarName(cdf, cdfVarName, 0, maxFileRecord, epochs);
+        if (cdfStatus != CDF_OK)
+        {
+            status = ASCC_L1_FILE;
+            goto cleanup;
+        }
+    }
+
+    records = arenaAlloc(&scratch->arena, nFileImages * sizeof *records);
+    if (records == NULL)
+    {
+        status = ASCC_MEM;
+        goto cleanup;
+    }
+
+    // Contiguous runs of images skipped because the sky is too bright
+    size_t nBrightImages = 0;
+    double firstBrightTime = 0.0;
+    double lastBrightTime = 0.0;
+
+    for (long ind = 0; ind < nFileImages; ind++)
+    {
+        if (epochs[ind] < state->firstCalTime || epochs[ind] > state->lastCalTime)
+            continue;
+        if (!skyDarkEnough(state, epochs[ind]))
+        {
+            if (nBrightImages == 0)
+                firstBrightTime = epochs[ind];
+            lastBrightTime = epochs[ind];
+            nBrightImages++;
+            state->nImagesSkippedTooBright++;
+            continue;
+        }
+        if (nBrightImages > 0)
+        {
+            reportBrightImages(state, nBrightImages, firstBrightTime, lastBrightTime);
+            nBrightImages = 0;
+        }
+        records[nRecords++] = ind;
+    }
+    if (nBrightImages > 0)
+        reportBrightImages(state, nBrightImages, firstBrightTime, lastBrightTime);
+
+    size_t startImage = state->nImages;
+    size_t imageCounter = startImage;
+    status = reserveImageArrays(state, startImage + nRecords);
+    if (status != ASCC_OK)
+        goto cleanup;
+    state->nImages = startImage + nRecords;
+
+    // Images that cannot be read keep a NAN time and are removed below
+    for (size_t i = startImage; i < state->nImages; i++)
+        state->imageTimes[i] = NAN;
+
+    bool firstImageOfFile = true;
+
+    if (state->decimationStride <= 1)
+    {
+        for (long k = 0; k < nRecords && status == ASCC_OK; k++)
+        {
+            status = analyzeL1Record(state, cdf, work, records[k], epochs[records[k]], &firstImageOfFile, startImage + k);
+            showImageProgress(state, startImage + k + 1);
+        }
+    }
+    else
+    {
+        // Adaptive temporal decimation: analyze every decimationStride-th image (anchors),
+        // and analyze the images in between only if the attitude changed too much
+        // or stars were lost between anchors. Otherwise interpolate the attitude.
+        anchorStars = arenaAlloc(&scratch->arena, calStarsSize);
+        nextAnchorStars = arenaAlloc(&scratch->arena, calStarsSize);
+        if (anchorStars == NULL || nextAnchorStars == NULL)
+        {
+            status = ASCC_MEM;
+            goto cleanup;
+        }
+
+        long k = 0;
+        long next = 0;
+        if (nRecords > 0)
+        {
+            status = analyzeL1Record(state, cdf, work, records[0], epochs[records[0]], &firstImageOfFile, startImage);
+            showImageProgress(state, startImage + 1);
+        }
+        while (k < nRecords - 1 && status == ASCC_OK)
+        {
+            next = k + state->decimationStride;
+            if (next > nRecords - 1)
+                next = nRecords - 1;
+
+            memcpy(anchorStars, work->calStars, calStarsSize);
+            status = analyzeL1Record(state, cdf, work, records[next], epochs[records[next]], &firstImageOfFile, startImage + next);
+            if (status != ASCC_OK)
+                break;
+
+            if (next > k + 1)
+            {
+                if (decimationNeedsBackfill(state, startImage + k, startImage + next))
+                {
+                    memcpy(nextAnchorStars, work->calStars, calStarsSize);
+                    memcpy(work->calStars, anchorStars, calStarsSize);
+                    for (long j = k + 1; j < next && status == ASCC_OK; j++)
+                        status = analyzeL1Record(state, cdf, work, records[j], epochs[records[j]], &firstImageOfFile, startImage + j);
+                    memcpy(work->calStars, nextAnchorStars, calStarsSize);
+                }
+                else
+                {
+                    for (long j = k + 1; j < next; j++)
+                        state->imageTimes[startImage + j] = epochs[records[j]];
+                    interpolateAttitudes(state, startImage + k, startImage + next);
+                }
+            }
+            k = next;
+            showImageProgress(state, startImage + k + 1);
+        }
+    }
+
+    if (state->trackStars)
+    {
+        state->nLocksAcquired += work->nLocksAcquired;
+        state->nLocksLost += work->nLocksLost;
+        state->nTrackedMeasurements += work->nTrackedMeasurements;
+        state->nGlobalSearches += work->nGlobalSearches;
+        if (state->verbose)
+        {
+            if (state->showProgress)
+                fprintf(stderr, "\n");
+            fprintf(stderr, "%s: %zu star locks acquired, %zu lost, %zu tracked measurements, %zu global searches\n", basename(l1file), work->nLocksAcquired, work->nLocksLost, work->nTrackedMeasurements, work->nGlobalSearches);
+        }
+    }
+
+    // Remove images that could not be read
+    for (size_t i = startImage; i < state->nImages; i++)
+    {
+        if (isnan(state->imageTimes[i]))
+            continue;
+        if (i != imageCounter)
+            moveImageResult(state, i, imageCounter);
+        imageCounter++;
+    }
+
+    if (imageCounter > startImage)
+    {
+        state->nl1filenames++;
+        void *mem = realloc(state->l1filenames, state->nl1filenames * sizeof(char*));
+        if (mem == NULL)
+        {
+            status = ASCC_MEM;
+            goto cleanup;
+        }
+        state->l1filenames = mem;
+        state->l1filenames[state->nl1filenames - 1] = strdup(l1file);
+        if (state->l1filenames[state->nl1filenames - 1] == NULL)
+        {
+            status = ASCC_MEM;
+            goto cleanup;
+        }
+    }
+    // The arrays are trimmed to the number of images analyzed at the end of the run
+    state->nImages = imageCounter;
+
+
+cleanup:
+    if (cdf != NULL)
+        CDFclose(cdf);
+
+    closeL1FrameMap(&work->frames);
+
+    if (epochsFromCube)
+        free(epochs);
+
+    return status;
+}
+
+int allocateImageWorkspace(ProgramState *state, ImageWorkspace *work)
+{
+    if (state == NULL || work == NULL)
+        return ASCC_ARGUMENTS;
+
+    work->calStars = calloc(state->nCalibrationStars, sizeof *work->calStars);
+    if (state->printStarInfo)
+        work->calStarDiagnostics = calloc(state->nCalibrationStars, sizeof *work->calStarDiagnostics);
+    work->azVals = calloc(state->nCalibrationStars, sizeof *work->azVals);
+    work->elVals = calloc(state->nCalibrationStars, sizeof *work->elVals);
+    work->predictedAzElXYZ = calloc(state->nCalibrationStars, 3 * (sizeof *work->predictedAzElXYZ));
+    work->measuredAzElXYZ = calloc(state->nCalibrationStars, 3 * (sizeof *work->measuredAzElXYZ));
+    work->imagery = calloc(IMAGE_COLUMNS, sizeof *work->imagery);
+    // calloc zeroes the halo of the padded image
+    work->padded = calloc(1, sizeof *work->padded);
+    work->windows = calloc(state->nCalibrationStars, sizeof *work->windows);
+    if (state->pyramidSearch)
+        work->pyramid = calloc(1, sizeof *work->pyramid);
+    if (work->calStars == NULL || (state->printStarInfo && work->calStarDiagnostics == NULL) || work->azVals == NULL || work->elVals == NULL || work->predictedAzElXYZ == NULL || work->measuredAzElXYZ == NULL || work->imagery == NULL || work->padded == NULL || work->windows == NULL || (state->pyramidSearch && work->pyramid == NULL))
+    {
+        freeImageWorkspace(work);
+        return ASCC_MEM;
+    }
+
+    return ASCC_OK;
+}
+
+int allocateImageWorkspaceInArena(ProgramState *state, ImageWorkspace *work, Arena *arena)
+{
+    if (state == NULL || work == NULL || arena == NULL)
+        return ASCC_ARGUMENTS;
+
+    memset(work, 0, sizeof *work);
+    work->inArena = true;
+    // Arena memory is zeroed, including the halo of the padded image
+    work->calStars = arenaAlloc(arena, state->nCalibrationStars * sizeof *work->calStars);
+    if (state->printStarInfo)
+        work->calStarDiagnostics = arenaAlloc(arena, state->nCalibrationStars * sizeof *work->calStarDiagnostics);
+    work->azVals = arenaAlloc(arena, state->nCalibrationStars * sizeof *work->azVals);
+    work->elVals = arenaAlloc(arena, state->nCalibrationStars * sizeof *work->elVals);
+    work->predictedAzElXYZ = arenaAlloc(arena, state->nCalibrationStars * 3 * (sizeof *work->predictedAzElXYZ));
+    work->measuredAzElXYZ = arenaAlloc(arena, state->nCalibrationStars * 3 * (sizeof *work->measuredAzElXYZ));
+    work->imagery = arenaAlloc(arena, IMAGE_COLUMNS * sizeof *work->imagery);
+    work->padded = arenaAlloc(arena, sizeof *work->padded);
+    work->windows = arenaAlloc(arena, state->nCalibrationStars * sizeof *work->windows);
+    if (state->pyramidSearch)
+        work->pyramid = arenaAlloc(arena, sizeof *work->pyramid);
+    if (work->calStars == NULL || (state->printStarInfo && work->calStarDiagnostics == NULL) || work->azVals == NULL || work->elVals == NULL || work->predictedAzElXYZ == NULL || work->measuredAzElXYZ == NULL || work->imagery == NULL || work->padded == NULL || work->windows == NULL || (state->pyramidSearch && work->pyramid == NULL))
+    {
+        memset(work, 0, sizeof *work);
+        return ASCC_MEM;
+    }
+
+    return ASCC_OK;
+}
+
+// Returns a workspace to its newly allocated state for the next L1 file. The
+// images are overwritten for each record; the padded image halo stays zero.
+void resetImageWorkspace(ProgramState *state, ImageWorkspace *work)
+{
+    if (state == NULL || work == NULL)
+        return;
+
+    memset(work->calStars, 0, state->nCalibrationStars * sizeof *work->calStars);
+    if (work->calStarDiagnostics != NULL)
+        memset(work->calStarDiagnostics, 0, state->nCalibrationStars * sizeof *work->calStarDiagnostics);
+    memset(work->azVals, 0, state->nCalibrationStars * sizeof *work->azVals);
+    memset(work->elVals, 0, state->nCalibrationStars * sizeof *work->elVals);
+    memset(work->predictedAzElXYZ, 0, state->nCalibrationStars * 3 * (sizeof *work->predictedAzElXYZ));
+    memset(work->measuredAzElXYZ, 0, state->nCalibrationStars * 3 * (sizeof *work->measuredAzElXYZ));
+    memset(work->windows, 0, state->nCalibrationStars * sizeof *work->windows);
+    memset(&work->frames, 0, sizeof work->frames);
+    work->nLocksAcquired = 0;
+    work->nLocksLost = 0;
+    work->nTrackedMeasurements = 0;
+    work->nGlobalSearches = 0;
+    work->nCalStars = 0;
+    work->nCalStarsKept = 0;
+    work->nConsistentStars = 0;
+    work->stoppedEarly = false;
+
+    return;
+}
+
+void freeImageWorkspace(ImageWorkspace *work)
+{
+    if (work == NULL)
+        return;
+
+    // Arena memory is released with the arena
+    if (work->inArena)
+    {
+        memset(work, 0, sizeof *work);
+        return;
+    }
+
+    if (work->calStars != NULL)
+        free(work->calStars);
+    if (work->calStarDiagnostics != NULL)
+        free(work->calStarDiagnostics);
+    if (work->azVals != NULL)
+        free(work->azVals);
+    if (work->elVals != NULL)
+        free(work->elVals);
+    if (work->predictedAzElXYZ != NULL)
+        free(work->predictedAzElXYZ);
+    if (work->measuredAzElXYZ != NULL)
+        free(work->measuredAzElXYZ);
+    if (work->imagery != NULL)
+        free(work->imagery);
+    if (work->padded != NULL)
+        free(work->padded);
+    if (work->windows != NULL)
+        free(work->windows);
+    if (work->pyramid != NULL)
+        free(work->pyramid);
+
+    work->calStars = NULL;
+    work->calStarDiagnostics = NULL;
+    work->azVals = NULL;
+    work->elVals = NULL;
+    work->predictedAzElXYZ = NULL;
+    work->measuredAzElXYZ = NULL;
+    work->imagery = NULL;
+    work->padded = NULL;
+    work->windows = NULL;
+    work->pyramid = NULL;
+
+    return;
+}
+
+// One arena per run, sized for the image workspace and the buffers of an
+// hourly L1 file, so that analyzing files makes no heap allocations for
+// scratch. Longer files add a block, which is kept for later files.
+int createAnalysisScratch(ProgramState *state)
+{
+    if (state == NULL)
+        return ASCC_ARGUMENTS;
+    if (state->analysisScratch != NULL)
+        return ASCC_OK;
+
+    AnalysisScratch *scratch = calloc(1, sizeof *scratch);
+    if (scratch == NULL)
+        return ASCC_MEM;
+
+    size_t nStars = state->nCalibrationStars;
+    size_t workspaceBytes = nStars * (sizeof(CalibrationStar) + (state->printStarInfo ? sizeof(CalibrationStarDiagnostics) : 0) + 2 * sizeof(float) + 6 * sizeof(double) + sizeof(StarWindow)) + IMAGE_COLUMNS * sizeof *scratch->work.imagery + sizeof(PaddedImage) + (state->pyramidSearch ? sizeof(ImagePyramid) : 0);
+    // Image times, record numbers and the decimation anchor stars
+    size_t fileBytes = L1_FILE_IMAGES * (sizeof(double) + sizeof(long)) + 2 * nStars * sizeof(CalibrationStar);
+    // Each allocation is padded to the arena alignment
+    size_t paddingBytes = 16 * ARENA_ALIGNMENT;
+
+    int status = initArena(&scratch->arena, workspaceBytes + fileBytes + paddingBytes);
+    if (status == ASCC_OK)
+        status = allocateImageWorkspaceInArena(state, &scratch->work, &scratch->arena);
+    if (status != ASCC_OK)
+    {
+        freeArena(&scratch->arena);
+        free(scratch);
+        return status;
+    }
+    scratch->fileMark = arenaMark(&scratch->arena);
+    state->analysisScratch = scratch;
+
+    return ASCC_OK;
+}
+
+void freeAnalysisScratch(ProgramState *state)
+{
+    if (state == NULL || state->analysisScratch == NULL)
+        return;
+
+    AnalysisScratch *scratch = state->analysisScratch;
+    // Scratch heap allocations of the run, for the report
+    state->nScratchHeapAllocations += scratch->arena.nBlocks + 1;
+    state->scratchBytes = scratch->arena.bytesReserved;
+    freeImageWorkspace(&scratch->work);
+    freeArena(&scratch->arena);
+    free(scratch);
+    state->analysisScratch = NULL;
+
+    return;
+}
+
+int resizeImageArrays(ProgramState *state, size_t nImages)
+{
+    if (state == NULL)
+        return ASCC_ARGUMENTS;
+
+    // realloc(ptr, 0) may return NULL
+    if (nImages == 0)
+        nImages = 1;
+
+    void *mem = realloc(state->imageTimes, sizeof(double) * nImages);
+    if (mem == NULL)
+        return ASCC_MEM;
+    state->imageTimes = mem;
+
+    mem = realloc(state->attitudeQuaternions, 4 * sizeof(float) * nImages);
+    if (mem == NULL)
+        return ASCC_MEM;
+    state->attitudeQuaternions = mem;
+
+    mem = realloc(state->nCalibrationStarsUsed, sizeof(uint16_t) * nImages);
+    if (mem == NULL)
+        return ASCC_MEM;
+    state->nCalibrationStarsUsed = mem;
+
+    mem = realloc(state->attitudeInterpolated, sizeof(uint8_t) * nImages);
+    if (mem == NULL)
+        return ASCC_MEM;
+    state->attitudeInterpolated = mem;
+    state->imageCapacity = nImages;
+    state->nImageArrayResizes++;
+
+    return ASCC_OK;
+}
+
+// Makes room for at least nImages, growing the arrays geometrically so that
+// adding the images of each L1 file rarely reallocates them
+int reserveImageArrays(ProgramState *state, size_t nImages)
+{
+    if (state == NULL)
+        return ASCC_ARGUMENTS;
+    if (nImages <= state->imageCapacity && state->imageTimes != NULL)
+        return ASCC_OK;
+
+    size_t capacity = state->imageCapacity > L1_FILE_IMAGES ? state->imageCapacity : L1_FILE_IMAGES;
+    while (capacity < nImages)
+        capacity *= 2;
+
+    return resizeImageArrays(state, capacity);
+}
+
+void moveImageResult(ProgramState *state, size_t from, size_t to)
+{
+    state->imageTimes[to] = state->imageTimes[from];
+    for (int m = 0; m < 4; m++)
+        state->attitudeQuaternions[to * 4 + m] = state->attitudeQuaternions[from * 4 + m];
+    state->nCalibrationStarsUsed[to] = state->nCalibrationStarsUsed[from];
+    state->attitudeInterpolated[to] = state->attitudeInterpolated[from];
+
+    return;
+}
+
+void setImageResultInvalid(ProgramState *state, size_t imageCounter)
+{
+    for (int m = 0; m < 4; m++)
+        state->attitudeQuaternions[imageCounter * 4 + m] = NAN;
+    state->nCalibrationStarsUsed[imageCounter] = 0;
+    state->attitudeInterpolated[imageCounter] = 0;
+
+    return;
+}
+
+void showImageProgress(ProgramState *state, size_t nImagesProcessed)
+{
+    if (state->showProgress)
+    {
+        fprintf(stderr, "\r%zu of %zu images processed", nImagesProcessed, state->expectedNumberOfImages);
+    }
+
+    return;
+}
+
+// Reads an image and loads it without the CCD offsets into the padded workspace image.
+// Cached and uncompressed records are taken directly from the mapped file, others through the CDF library.
+int readL1Image(ProgramState *state, CDFid cdf, long record, ImageWorkspace *work)
+{
+    char cdfVarName[CDF_VAR_NAME_LEN + 1] = {0};
+
+    // Assume sensible file validation - same number of images as epochs
+    double readStart = monotonicSeconds();
+    const uint16_t *frame = l1Frame(&work->frames, record);
+    if (frame != NULL)
+    {
+        uint16_t (*image)[IMAGE_ROWS] = (uint16_t (*)[IMAGE_ROWS])frame;
+        if (work->frames.offsetsSubtracted)
+            copyPaddedImage(work->padded, image);
+        else if (work->frames.swapBytes)
+            loadPaddedImageByteSwapped(work->padded, image, state->sitePixelOffsets);
+        else
+            loadPaddedImage(work->padded, image, state->sitePixelOffsets);
+        state->nL1FramesMapped++;
+    }
+    else if (cdf != NULL)
+    {
+        snprintf(cdfVarName, CDF_VAR_NAME_LEN + 1, "thg_asf_%s", state->site);
+        CDFstatus cdfStatus = CDFgetVarRangeRecordsByVarName(cdf, cdfVarName, record, record, &work->imagery[0][0]);
+        if (cdfStatus != CDF_OK)
+            return ASCC_CDF_READ;
+        loadPaddedImage(work->padded, work->imagery, state->sitePixelOffsets);
+        state->nL1FramesReadByLibrary++;
+    }
+    else
+        return ASCC_CDF_READ;
+    state->l1FrameReadSeconds += monotonicSeconds() - readStart;
+    if (work->pyramid != NULL)
+        buildImagePyramid(work->pyramid, work->padded);
+
+    return ASCC_OK;
+}
+
+// Returns ASCC_OK if the image could not be read: that image is left out of the results.
+int analyzeL1Record(ProgramState *state, CDFid cdf, ImageWorkspace *work, long record, double imageTime, bool *firstImageOfFile, size_t imageCounter)
+{
+    if (readL1Image(state, cdf, record, work) != ASCC_OK)
+    {
+        state->imageTimes[imageCounter] = NAN;
+        setImageResultInvalid(state, imageCounter);
+        return ASCC_OK;
+    }
+    state->imageTimes[imageCounter] = imageTime;
+
+    int status = ASCC_OK;
+    if (state->sweep != NULL)
+        status = sweepImage(state, work, imageTime, *firstImageOfFile);
+    else
+        status = analyzeImage(state, work, imageTime, *firstImageOfFile, imageCounter);
+    *firstImageOfFile = false;
+
+    return status;
+}
+
+// Calculate dRa and dDec from measuremed (interpolated) values minus predicted values
+void calculateStarPositionError(const CalibrationStar *cal, CalibrationStarDiagnostics *diagnostics)
+{
+    float dx = cal->predictedAzElX - cal->measuredAzElX;
+    float dy = cal->predictedAzElY - cal->measuredAzElY;
+    float dz = cal->predictedAzElZ - cal->measuredAzElZ;
+
+    diagnostics->measuredAz = 90.0 - atan2(cal->measuredAzElY, cal->measuredAzElX) / M_PI * 180.0;
+    diagnostics->measuredEl = atan(cal->measuredAzElZ / hypotf(cal->measuredAzElX, cal->measuredAzElY)) / M_PI * 180.0;
+
+    // detlaAz and deltaEl
+    // rhat is measuredAzElX, measuredAzElY, measuredAzElZ
+    float azhatx = - cal->measuredAzElY;
+    float azhaty = cal->measuredAzElX;
+    float magnitude = sqrt(azhatx * azhatx + azhaty * azhaty);
+    azhatx /= magnitude;
+    azhaty /= magnitude;
+    float elhatx = - cal->measuredAzElZ * azhaty;
+    float elhaty = cal->measuredAzElZ * azhatx;
+    float elhatz = cal->measuredAzElX * cal->measuredAzElY - cal->measuredAzElY * cal->measuredAzElX;
+    magnitude = sqrt(elhatx * elhatx + elhaty * elhaty + elhatz * elhatz);
+    elhatx /= magnitude;
+    elhaty /= magnitude;
+    elhatz /= magnitude;
+    // TODO need to multiply stardRas by cos(dec)?
+    diagnostics->deltaAz= (dx * azhatx + dy * azhaty);
+    diagnostics->deltaEl = (dx * elhatx + dy * elhaty + dz * elhatz);
+
+    return;
+}
+
+// Finds the reference map pixel nearest to the star's predicted position.
+// Returns false if the reference map has no valid pixels.
+bool findNearestPixel(ProgramState *state, CalibrationStar *cal)
+{
+    float direction[3] = {cal->predictedAzElX, cal->predictedAzElY, cal->predictedAzElZ};
+    double predicted[3] = {0.0};
+    double seeded[3] = {0.0};
+
+    if (state->haveSeedAttitude)
+    {
+        // Search where the blind-solved attitude puts the star
+        for (int m = 0; m < 3; m++)
+            predicted[m] = direction[m];
+        rotateVector(state->seedDcm, predicted, seeded);
+        for (int m = 0; m < 3; m++)
+            direction[m] = seeded[m];
+    }
+
+    return nearestReferencePixel(state, direction, &cal->predictedImageColumn, &cal->predictedImageRow);
+}
+
+// Star tracking: sets up a small window around a locked star's last centroid
+void setTrackingWindow(ProgramState *state, CalibrationStar *cal, StarWindow *window)
+{
+    window->active = true;
+    window->centerColumn = cal->imageMomentColumn;
+    window->centerRow = cal->imageMomentRow;
+    // Same background estimate as for a global search, so that the
+    // threshold does not depend on whether the star is tracked
+    window->backgroundHalfWidth = state->starSearchBoxWidth / 2;
+    window->peakHalfWidth = TRACKING_BOX_HALF_WIDTH;
+
+    return;
+}
+
+// Sets up the search window around the reference map prediction. With a pyramid search
+// the window is centred on the brightest pixel within the pyramid search radius and only
+// refines the peak. The window is inactive if the pyramid search finds nothing.
+void setSearchWindow(ProgramState *state, ImageWorkspace *work, CalibrationStar *cal, StarWindow *window)
+{
+    int peakColumn = 0;
+    int peakRow = 0;
+
+    window->active = true;
+    window->centerColumn = cal->predictedImageColumn;
+    window->centerRow = cal->predictedImageRow;
+    window->backgroundHalfWidth = state->starSearchBoxWidth / 2;
+    window->peakHalfWidth = state->starSearchBoxWidth / 2;
+
+    if (work->pyramid != NULL)
+    {
+        window->active = pyramidPeakSearch(work->pyramid, work->padded, cal->predictedImageColumn, cal->predictedImageRow, state->pyramidSearchRadius, &peakColumn, &peakRow) > 0;
+        window->centerColumn = peakColumn;
+        window->centerRow = peakRow;
+        window->peakHalfWidth = TRACKING_BOX_HALF_WIDTH;
+    }
+
+    return;
+}
+
+// Star tracking: centroids a locked star from its measured window.
+// Returns number of pixels used to construct moments, 0 if the lock is lost.
+int trackStar(ProgramState *state, PaddedImage *image, CalibrationStar *cal, StarWindow *window)
+{
+    float lastColumn = window->centerColumn;
+    float lastRow = window->centerRow;
+
+    if (!isfinite(window->meanSignal) || window->meanSignal > state->maxBackgroundSignalForMoments)
+        return 0;
+
+    if (window->nPeakPixels == 0)
+        return 0;
+
+    int momentCounter = calculatePaddedMoments(state, image, cal, 2, (float)window->peakColumn, (float)window->peakRow, roundf(window->meanSignal) + 10);
+    if (momentCounter == 0 || cal->meanImageSignalAboveThreshold <= 0.0)
+        return 0;
+
+    if (fabsf(cal->imageMomentColumn - lastColumn) >= state->starMaxJitterPixels || fabsf(cal->imageMomentRow - lastRow) >= state->starMaxJitterPixels)
+        return 0;
+
+    return momentCounter;
+}
+
+bool decimationNeedsBackfill(ProgramState *state, size_t anchor, size_t nextAnchor)
+{
+    uint16_t nStars = state->nCalibrationStarsUsed[anchor];
+    uint16_t nNextStars = state->nCalibrationStarsUsed[nextAnchor];
+
+    if (isnan(state->imageTimes[anchor]) || isnan(state->imageTimes[nextAnchor]) || nStars == 0 || nNextStars == 0)
+        return true;
+
+    if (nNextStars + DECIMATION_MAX_STAR_COUNT_DROP < nStars)
+        return true;
+
+    if (quaternionAngleBetween(&state->attitudeQuaternions[anchor * 4], &state->attitudeQuaternions[nextAnchor * 4]) > state->decimationMaxRotationChange)
+        return true;
+
+    return false;
+}
+
+// Fills the images between two anchors with attitudes interpolated in time
+void interpolateAttitudes(ProgramState *state, size_t anchor, size_t nextAnchor)
+{
+    double q1[4] = {0.0};
+    double q2[4] = {0.0};
+    double q[4] = {0.0};
+
+    for (int m = 0; m < 4; m++)
+    {
+        q1[m] = state->attitudeQuaternions[anchor * 4 + m];
+        q2[m] = state->attitudeQuaternions[nextAnchor * 4 + m];
+    }
+
+    double t1 = state->imageTimes[anchor];
+    double t2 = state->imageTimes[nextAnchor];
+
+    for (size_t i = anchor + 1; i < nextAnchor; i++)
+    {
+        quaternionSlerp(q1, q2, t2 > t1 ? (state->imageTimes[i] - t1) / (t2 - t1) : 0.0, q);
+        // Same sign convention as storeAttitudeQuaternion()
+        for (int m = 0; m < 4; m++)
+            state->attitudeQuaternions[i * 4 + m] = q[0] < 0.0 ? -q[m] : q[m];
+        state->nCalibrationStarsUsed[i] = 0;
+        state->attitudeInterpolated[i] = 1;
+    }
+    state->nImagesInterpolated += nextAnchor - anchor - 1;
+
+    return;
+}
+
+// Star statistics of the image, from the measurement that was kept
+static int recordMeasuredStars(ProgramState *state, ImageWorkspace *work)
+{
+    state->nStarsMeasured += work->nCalStars;
+    if (work->stoppedEarly)
+        state->nEarlyStops++;
+
+    // Detection statistics only from images clear enough for a fit, so that
+    // clouds and bright skies do not count against the stars
+    if (work->nCalStarsKept < MIN_N_CALIBRATION_STARS_PER_IMAGE)
+        return ASCC_OK;
+    for (int i = 0; i < work->nCalStars; i++)
+    {
+        CalibrationStar *cal = &work->calStars[i];
+        if (recordStarDetection(state, cal->catalogIndex, cal->skyRegion, cal->includeInCalibration) != ASCC_OK)
+            return ASCC_MEM;
+    }
+
+    return ASCC_OK;
+}
+
+// Estimates the pointing error for the offset-corrected image in the workspace
+// and stores it at imageCounter. With blind solving, an image whose stars do not
+// agree with the fitted attitude is plate solved and analyzed again.
+int analyzeImage(ProgramState *state, ImageWorkspace *work, double imageTime, bool firstImageOfFile, size_t imageCounter)
+{
+    state->nImagesAnalyzed++;
+    size_t nGlobalObservations = state->nGlobalObservations;
+
+    int status = estimatePointingError(state, work, imageTime, firstImageOfFile, imageCounter);
+    if (status == ASCC_MEM)
+        return status;
+    if (status != ASCC_OK || !state->blindSolve)
+        return recordMeasuredStars(state, work) == ASCC_OK ? status : ASCC_MEM;
+
+    if (work->nConsistentStars >= PLATE_SOLVE_MIN_MATCH_FRACTION * work->nCalStars && work->nCalStars > 0)
+    {
+        // Follow slow changes in the attitude
+        if (state->haveSeedAttitude)
+            attitudeQuaternionToDcm(&state->attitudeQuaternions[imageCounter * 4], state->seedDcm);
+        return recordMeasuredStars(state, work);
+    }
+
+    int nMatched = 0;
+    double t0 = monotonicSeconds();
+    int solveStatus = blindSolveAttitude(state, work->padded, imageTime, state->seedDcm, &nMatched);
+    state->blindSolveSeconds += monotonicSeconds() - t0;
+    state->nBlindSolves++;
+    if (solveStatus != ASCC_OK)
+        return recordMeasuredStars(state, work);
+
+    state->nBlindSolvesSucceeded++;
+    state->haveSeedAttitude = true;
+    // Stars are searched for again around the new predictions
+    for (int i = 0; i < state->nCalibrationStars; i++)
+        work->calStars[i].locked = false;
+    state->nGlobalObservations = nGlobalObservations;
+
+    // The first measurement is replaced and not counted
+    status = estimatePointingError(state, work, imageTime, true, imageCounter);
+    if (status == ASCC_MEM)
+        return status;
+
+    return recordMeasuredStars(state, work) == ASCC_OK ? status : ASCC_MEM;
+}
+
+// Locates, measures and centroids calibration stars first to last - 1.
+// Returns the number of stars centroided.
+static int measureCalibrationStars(ProgramState *state, ImageWorkspace *work, int first, int last)
+{
+    PaddedImage *padded = work->padded;
+    StarWindow *windows = work->windows;
+    StarWindow *window = NULL;
+    CalibrationStar *calStars = work->calStars;
+    CalibrationStar *cal = NULL;
+    int nKept = 0;
+    int momentCounter = 0;
+
+    // Set up the search window of each star, then measure all windows in one pass over the image
+    for (int i = first; i < last; i++)
+    {
+        cal = &calStars[i];
+        windows[i].active = false;
+        cal->includeInCalibration = false;
+        if (cal->locked && !cal->newStarAtThisIndex)
+        {
+            // Tracking: centroid near the last measured position instead of
+            // searching the whole reference map for the predicted pixel
+            setTrackingWindow(state, cal, &windows[i]);
+            continue;
+        }
+        cal->locked = false;
+        if (state->trackStars)
+            work->nGlobalSearches++;
+        if (findNearestPixel(state, cal))
+            setSearchWindow(state, work, cal, &windows[i]);
+    }
+    measureStarWindows(padded, &windows[first], last - first);
+
+    for (int i = first; i < last; i++)
+    {
+        cal = &calStars[i];
+        window = &windows[i];
+        if (!window->active)
+            continue;
+        if (cal->locked)
+        {
+            if (trackStar(state, padded, cal, window) > 0)
+            {
+                work->nTrackedMeasurements++;
+                nKept++;
+                cal->includeInCalibration = true;
+                continue;
+            }
+            work->nLocksLost++;
+            cal->locked = false;
+            if (state->trackStars)
+                work->nGlobalSearches++;
+            if (!findNearestPixel(state, cal))
+                continue;
+            setSearchWindow(state, work, cal, window);
+            if (!window->active)
+                continue;
+            measureStarWindow(padded, window);
+        }
 
-    int status = ASCC_OK;    
- 
-    long nImagesAnalyzed = 0;
-    long maxFileRecord = 0;
-    long nFileImages = 0;
-    CalibrationStar *calStars = calloc(state->nCalibrationStars, sizeof *calStars);
-    if (calStars == NULL)
-        return ASCC_MEM;
-    CalibrationStar *cal = NULL;
+        momentCounter = 0.0;
+        // Do a first search of neighbors for actual star signal
+        if (!isfinite(window->meanSignal) || window->meanSignal > state->maxBackgroundSignalForMoments)
+            continue;
 
-    float *azVals = calloc(state->nCalibrationStars, sizeof *azVals);
-    float *elVals = calloc(state->nCalibrationStars, sizeof *elVals);
-    double *predictedAzElXYZ = calloc(state->nCalibrationStars, 3 * (sizeof *predictedAzElXYZ));
-    double *measuredAzElXYZ = calloc(state->nCalibrationStars, 3 * (sizeof *measuredAzElXYZ));
-    // TODO handle freeing memory better
-    if (azVals == NULL || elVals == NULL || predictedAzElXYZ == NULL || measuredAzElXYZ == NULL)
-        return ASCC_MEM;
+        if (window->nPeakPixels == 0)
+            continue;
 
-    char cdfVarName[CDF_VAR_NAME_LEN + 1] = {0};
+        // Refine search using new estimate for box center and a small box size
+        momentCounter = calculatePaddedMoments(state, padded, cal, 2, (float)window->peakColumn, (float)window->peakRow, roundf(window->meanSignal) + 10);
 
-    // Get time and continue only if within requested analysis time range
-    snprintf(cdfVarName, CDF_VAR_NAME_LEN + 1, "thg_asf_%s_epoch", state->site);
-    cdfStatus = CDFgetzVarMaxWrittenRecNum(cdf, CDFgetVarNum(cdf, cdfVarName), &maxFileRecord);
-    if (cdfStatus != CDF_OK || maxFileRecord == 0)
-    {
-        status = ASCC_L1_FILE;
-        goto cleanup;
+        if (momentCounter > 0 && cal->meanImageSignalAboveThreshold > 0.0)
+        {
+            nKept++;
+            cal->includeInCalibration = true;
+            if (state->trackStars)
+            {
+                cal->locked = true;
+                work->nLocksAcquired++;
+            }
+        }
+        else
+        {
+            // Flag this star as not used
+            cal->includeInCalibration = false;
+        }
     }
 
-    nFileImages = maxFileRecord + 1;
+    return nKept;
+}
 
-    size_t startImage = state->nImages;
-    size_t imageCounter = startImage;
-    state->nImages += nFileImages;
-    void *mem = realloc(state->imageTimes, sizeof(double) * state->nImages);
-    if (mem == NULL)
-    {
-        status = ASCC_MEM;
-        goto cleanup;
-    }
-    state->imageTimes = mem;
+// Stars centroided in this image that did not jump from the previous one
+static inline bool usableForFit(ProgramState *state, CalibrationStar *cal, bool firstImageOfFile)
+{
+    return cal->includeInCalibration && (firstImageOfFile || cal->newStarAtThisIndex || (fabsf(cal->imageMomentColumn - cal->previousImageMomentColumn) < state->starMaxJitterPixels && fabsf(cal->imageMomentRow - cal->previousImageMomentRow) < state->starMaxJitterPixels));
+}
 
-    mem = realloc(state->pointingErrorDcms, 9 * sizeof(float) * state->nImages);
-    if (mem == NULL)
-    {
-        status = ASCC_MEM;
-        goto cleanup;
-    }
-    state->pointingErrorDcms = mem;
+// Early stop: fits the attitude to the stars measured so far. Converged once the
+// fit changed by less than the early stop rotation change since the previous
+// batch and the stars constrain rotations about every axis.
+static bool earlyStopConverged(ProgramState *state, ImageWorkspace *work, int nMeasured, bool firstImageOfFile, double *previousDcm, bool *havePreviousDcm)
+{
+    int n = 0;
+    double dcm[9] = {0.0};
 
-    mem = realloc(state->rotationVectors, 3 * sizeof(float) * state->nImages);
-    if (mem == NULL)
+    for (int i = 0; i < nMeasured; i++)
     {
-        status = ASCC_MEM;
-        goto cleanup;
+        CalibrationStar *cal = &work->calStars[i];
+        if (!usableForFit(state, cal, firstImageOfFile))
+            continue;
+        work->predictedAzElXYZ[n*3] = (double)cal->predictedAzElX;
+        work->predictedAzElXYZ[n*3 + 1] = (double)cal->predictedAzElY;
+        work->predictedAzElXYZ[n*3 + 2] = (double)cal->predictedAzElZ;
+        work->measuredAzElXYZ[n*3] = (double)cal->measuredAzElX;
+        work->measuredAzElXYZ[n*3 + 1] = (double)cal->measuredAzElY;
+        work->measuredAzElXYZ[n*3 + 2] = (double)cal->measuredAzElZ;
+        n++;
     }
-    state->rotationVectors = mem;
-
-    mem = realloc(state->rotationAngles, sizeof(float) * state->nImages);
-    if (mem == NULL)
+    if (n < MIN_N_CALIBRATION_STARS_PER_IMAGE || fitRotation(work->predictedAzElXYZ, work->measuredAzElXYZ, n, dcm) != ASCC_OK)
     {
-        status = ASCC_MEM;
-        goto cleanup;
+        *havePreviousDcm = false;
+        return false;
     }
-    state->rotationAngles = mem;
 
-    mem = realloc(state->nCalibrationStarsUsed, sizeof(uint16_t) * state->nImages);
-    if (mem == NULL)
-    {
-        status = ASCC_MEM;
-        goto cleanup;
-    }
-    state->nCalibrationStarsUsed = mem;
+    bool converged = *havePreviousDcm && dcmAngleBetweenDouble(previousDcm, dcm) < state->earlyStopRotationChange && fitConditioning(work->predictedAzElXYZ, n) >= state->earlyStopConditioning;
+    memcpy(previousDcm, dcm, sizeof dcm);
+    *havePreviousDcm = true;
 
-    double imageTime = 0.0;
-    char timeString[EPOCH4_STRING_LEN+1];
+    return converged;
+}
 
-    uint16_t imagery[256][256] = {0};
-    uint16_t *imagePointer = &imagery[0][0];
-    long index = 0;
+// Estimates the pointing error from the calibration stars
+int estimatePointingError(ProgramState *state, ImageWorkspace *work, double imageTime, bool firstImageOfFile, size_t imageCounter)
+{
+    StarWindow *windows = work->windows;
+    CalibrationStar *calStars = work->calStars;
+    CalibrationStar *cal = NULL;
+    // Angles and catalog values are only worked out for printing
+    CalibrationStarDiagnostics *diagnostics = state->printStarInfo ? work->calStarDiagnostics : NULL;
+    float *azVals = work->azVals;
+    float *elVals = work->elVals;
+    double *predictedAzElXYZ = work->predictedAzElXYZ;
+    double *measuredAzElXYZ = work->measuredAzElXYZ;
 
     // Updated on each function call
     int nCalStars = 0;
     int nCalStarsKept = 0;
-    float starAzElDistance = 0.0;
-    float starMinAzElDistance = 0.0;
-    int cmax = 0;
-    int rmax = 0;
-    float totalOuter = 0.0;
-    int momentCounter = 0;
-    float starx = 0.0;
-    float stary = 0.0;
-    float starz = 0.0;
-    float dx = 0.0;
-    float dy = 0.0;
-    float dz = 0.0;
-    float magnitude = 0.0;
-    float azhatx = 0.0;
-    float azhaty = 0.0;
-    float elhatx = 0.0;
-    float elhaty = 0.0;
-    float elhatz = 0.0;
-
-    float meanSignal = 0.0;
-
-    bool foundNearest = false;
-
-    int boxHalfWidth = state->starSearchBoxWidth / 2;
 
     // For rotation matrix estimation
-    double cArr[9] = {0.0};
-    double vArr[9] = {0.0};
-    double v1Arr[9] = {0.0};
-    double sArr[3] = {0.0};
-    double workArr[3] = {0.0};
     double dcmArr[9] = {0.0};
-    double cDetSignArr[9] = {0.0};
     double rotationVectorArr[3] = {0.0};
-    double rotationVectorLength = 0.0;
     double rotationAngle = 0.0;
 
-    gsl_matrix_view c = gsl_matrix_view_array(cArr, 3, 3);
-    gsl_matrix_view v = gsl_matrix_view_array(vArr, 3, 3);
-    gsl_matrix_view v1 = gsl_matrix_view_array(v1Arr, 3, 3);
-    gsl_vector_view s = gsl_vector_view_array(sArr, 3);
-    gsl_vector_view work = gsl_vector_view_array(workArr, 3);
-    gsl_matrix_view dcm = gsl_matrix_view_array(dcmArr, 3, 3);
-    gsl_matrix_view cDetSign = gsl_matrix_view_array(cDetSignArr, 3, 3);
-    gsl_vector_view rotationVector = gsl_vector_view_array(rotationVectorArr, 3);
-
     float statAz = 0.0;
     float statEl = 0.0;
 
-    for (long ind = 0; ind < nFileImages; ind++)
-    {
-        index = ind;
-        snprintf(cdfVarName, CDF_VAR_NAME_LEN + 1, "thg_asf_%s_epoch", state->site);
-        cdfStatus = CDFgetVarRangeRecordsByVarName(cdf, cdfVarName, index, index, &imageTime);
-        if (cdfStatus != CDF_OK)
-            continue;
-        if (imageTime < state->firstCalTime || imageTime > state->lastCalTime)
-            continue;
-        state->imageTimes[imageCounter] = imageTime;
-        encodeEPOCH4(imageTime, timeString);
-
-        // Assume sensible file validation - same number of images as epochs
-        snprintf(cdfVarName, CDF_VAR_NAME_LEN + 1, "thg_asf_%s", state->site);
-        cdfStatus = CDFgetVarRangeRecordsByVarName(cdf, cdfVarName, index, index, imagePointer);
-        if (cdfStatus != CDF_OK)
-            continue;
-
-        for (int c = 0; c < IMAGE_COLUMNS; c++)
-            for (int r = 0; r < IMAGE_ROWS; r++)
-            {
-                if (imagery[c][r] > state->sitePixelOffsets[c][r])
-                    imagery[c][r] -= state->sitePixelOffsets[c][r];
-                else
-                    imagery[c][r] = 0;
-            }
+    state->attitudeInterpolated[imageCounter] = 0;
+    work->nConsistentStars = 0;
 
-        nCalStars = selectStars(state, imageTime, calStars);
+    nCalStars = selectStars(state, imageTime, calStars, diagnostics);
 
-        nCalStarsKept = 0;
+    // All stars at once, or in growing batches until the attitude converges
+    int nMeasured = 0;
+    int batchEnd = state->earlyStop && nCalStars > EARLY_STOP_FIRST_BATCH ? EARLY_STOP_FIRST_BATCH : nCalStars;
+    double batchDcm[9] = {0.0};
+    bool haveBatchDcm = false;
+    while (nMeasured < nCalStars)
+    {
+        nCalStarsKept += measureCalibrationStars(state, work, nMeasured, batchEnd);
+        nMeasured = batchEnd;
+        if (nMeasured == nCalStars)
+            break;
+        if (earlyStopConverged(state, work, nMeasured, firstImageOfFile, batchDcm, &haveBatchDcm))
+            break;
+        batchEnd = nMeasured + nMeasured / 2 < nCalStars ? nMeasured + nMeasured / 2 : nCalStars;
+    }
+    // Stars left out are searched for again when next measured, and are not
+    // held to the jitter limit as their last centroid is out of date
+    for (int i = nMeasured; i < nCalStars; i++)
+    {
+        calStars[i].includeInCalibration = false;
+        calStars[i].locked = false;
+        calStars[i].catalogIndex = -1;
+        windows[i].active = false;
+    }
+    work->nCalStars = nMeasured;
+    work->nCalStarsKept = nCalStarsKept;
+    work->stoppedEarly = nMeasured < nCalStars;
 
-        float azelX = 0.0;
-        float azelY = 0.0;
-        float azelZ = 0.0;
+    if (nCalStarsKept >= MIN_N_CALIBRATION_STARS_PER_IMAGE)
+    {
+        int statCounter = 0;
+        // Observations are kept for the global camera model only if the image's fit succeeds
+        size_t firstGlobalObservation = state->nGlobalObservations;
 
         for (int i = 0; i < nCalStars; i++)
         {
             cal = &calStars[i];
-            starMinAzElDistance = 10000000000.0;
-            foundNearest = false;
-            cmax = 0;
-            rmax = 0;
-            for (int c = 0; c < IMAGE_COLUMNS; c++)
-            {
-                for (int r = 0; r < IMAGE_COLUMNS; r++)
-                {
-                    if (!isfinite(state->referenceAzimuths[c][r]) || !isfinite(state->referenceElevations[c][r]))
-                        continue;
-                    // TODO use a GPU
-                    starx = cos((90.0 - cal->predictedAz)*M_PI/180.0) * cos(cal->predictedEl*M_PI/180.0);
-                    stary = sin((90.0 - cal->predictedAz)*M_PI/180.0) * cos(cal->predictedEl*M_PI/180.0);
-                    starz = sin(cal->predictedEl*M_PI/180.0);
-                    cal->predictedAzElX = starx;
-                    cal->predictedAzElY = stary;
-                    cal->predictedAzElZ = starz;
-                    dx = starx - state->pixelX[c][r];
-                    dy = stary - state->pixelY[c][r];
-                    dz = starz - state->pixelZ[c][r];
-                    starAzElDistance = sqrt(dx * dx + dy * dy + dz * dz);
-                    if (starAzElDistance < starMinAzElDistance)
-                    {
-                        starMinAzElDistance = starAzElDistance;
-                        cal->predictedImageColumn = c;
-                        cal->predictedImageRow = r;
-                        foundNearest = true;
-                    }
-                }
-            }
-            if (foundNearest)
+            if (diagnostics != NULL && cal->includeInCalibration)
             {
-                momentCounter = 0.0;
-                // Do a first search of neighbors for actual star signal
-                meanSignal = calculateMeanSignal(imagery, boxHalfWidth, cal->predictedImageColumn, cal->predictedImageRow);
-                if (!isfinite(meanSignal) || meanSignal > MAX_BACKGROUND_SIGNAL_FOR_MOMENTS)
-                    continue;
-
-                momentCounter = calculatePositionOfMax(imagery, boxHalfWidth, cal->predictedImageColumn, cal->predictedImageRow, &cmax, &rmax);
-                if (momentCounter == 0)
-                    continue;
-
-                // Refine search using new estimate for box center and a small box size
-                momentCounter = calculateMoments(state, imagery, cal, 2, (float)cmax, (float)rmax, roundf(meanSignal) + 10);
-
-                if (momentCounter > 0 && cal->meanImageSignalAboveThreshold > 0.0)
-                {
-                    nCalStarsKept++;
-                    cal->includeInCalibration = true;
-                    // Calculate dRa and dDec from measuremed (interpolated) values minus predicted values
-                    dx = cal->predictedAzElX - cal->measuredAzElX;
-                    dy = cal->predictedAzElY - cal->measuredAzElY;
-                    dz = cal->predictedAzElZ - cal->measuredAzElZ;
-
-                    cal->measuredAz = 90.0 - atan2(cal->measuredAzElY, cal->measuredAzElX) / M_PI * 180.0;
-                    cal->measuredEl = atan(cal->measuredAzElZ / hypotf(cal->measuredAzElX, cal->measuredAzElY)) / M_PI * 180.0;
-
-                    // detlaAz and deltaEl
-                    // rhat is measuredAzElX, measuredAzElY, measuredAzElZ
-                    azhatx = - cal->measuredAzElY;
-                    azhaty = cal->measuredAzElX;
-                    magnitude = sqrt(azhatx * azhatx + azhaty * azhaty);
-                    azhatx /= magnitude;
-                    azhaty /= magnitude;
-                    elhatx = - cal->measuredAzElZ * azhaty;
-                    elhaty = cal->measuredAzElZ * azhatx;
-                    elhatz = cal->measuredAzElX * cal->measuredAzElY - cal->measuredAzElY * cal->measuredAzElX;
-                    magnitude = sqrt(elhatx * elhatx + elhaty * elhaty + elhatz * elhatz);
-                    elhatx /= magnitude;
-                    elhaty /= magnitude;
-                    elhatz /= magnitude;
-                    // TODO need to multiply stardRas by cos(dec)?
-                    cal->deltaAz= (dx * azhatx + dy * azhaty);
-                    cal->deltaEl = (dx * elhatx + dy * elhaty + dz * elhatz);
-                }
-                else
-                {
-                    // Flag this star as not used
-                    cal->includeInCalibration = false;
-                }
+                calculateStarPositionError(cal, &diagnostics[i]);
+                diagnostics[i].backgroundThreshold = roundf(windows[i].meanSignal) + 10;
             }
-        }
-        if (nCalStarsKept >= MIN_N_CALIBRATION_STARS_PER_IMAGE)
-        {
-            int statCounter = 0;
-
-            for (int i = 0; i < nCalStars; i++)
+            if (usableForFit(state, cal, firstImageOfFile))
             {
-                cal = &calStars[i];
-                if (cal->includeInCalibration && (imageCounter == startImage || cal->newStarAtThisIndex || (fabsf(cal->imageMomentColumn - cal->previousImageMomentColumn) < STAR_MAX_PIXEL_JITTER && fabsf(cal->imageMomentRow - cal->previousImageMomentRow) < STAR_MAX_PIXEL_JITTER)))
+                if (diagnostics != NULL)
                 {
                     // A rotation away from zenith (in declination)
                     // will be positive on one side and negative on the other
                     // TODO improve this estimate taking this into account?
                     // For now, take magnitude of error only for elevations
-                    azVals[statCounter] = cal->deltaAz;
-                    elVals[statCounter] = fabsf(cal->deltaEl);
+                    azVals[statCounter] = diagnostics[i].deltaAz;
+                    elVals[statCounter] = fabsf(diagnostics[i].deltaEl);
+                }
 
-                    // For rotation matrix estimation
-                    // Using double type to be able to use GSL SVD
-                    predictedAzElXYZ[statCounter*3] = (double)cal->predictedAzElX;
-                    predictedAzElXYZ[statCounter*3 + 1] = (double)cal->predictedAzElY;
-                    predictedAzElXYZ[statCounter*3 + 2] = (double)cal->predictedAzElZ;
+                // For rotation matrix estimation
+                // Using double type to be able to use GSL SVD
+                predictedAzElXYZ[statCounter*3] = (double)cal->predictedAzElX;
+                predictedAzElXYZ[statCounter*3 + 1] = (double)cal->predictedAzElY;
+                predictedAzElXYZ[statCounter*3 + 2] = (double)cal->predictedAzElZ;
 
-                    measuredAzElXYZ[statCounter*3] = (double)cal->measuredAzElX;
-                    measuredAzElXYZ[statCounter*3 + 1] = (double)cal->measuredAzElY;
-                    measuredAzElXYZ[statCounter*3 + 2] = (double)cal->measuredAzElZ;
+                measuredAzElXYZ[statCounter*3] = (double)cal->measuredAzElX;
+                measuredAzElXYZ[statCounter*3 + 1] = (double)cal->measuredAzElY;
+                measuredAzElXYZ[statCounter*3 + 2] = (double)cal->measuredAzElZ;
 
-                    statCounter++;
-                }
-                cal->previousImageMomentColumn = cal->imageMomentColumn;
-                cal->previousImageMomentRow = cal->imageMomentRow;
+                if (state->globalFit && addGlobalObservation(state, cal) != ASCC_OK)
+                    return ASCC_MEM;
+
+                statCounter++;
             }
-            if (statCounter > 0)
+            cal->previousImageMomentColumn = cal->imageMomentColumn;
+            cal->previousImageMomentRow = cal->imageMomentRow;
+        }
+        if (statCounter > 0)
+        {
+            // The medians are only printed
+            if (diagnostics != NULL)
             {
                 statAz = gsl_stats_float_median(azVals, 1, statCounter);
                 statEl = gsl_stats_float_median(elVals, 1, statCounter);
-
-                // Calculate rotation matrix for this image
-                // statCounter x 3 matrices
-                gsl_matrix_view a = gsl_matrix_view_array(predictedAzElXYZ, statCounter, 3);
-                gsl_matrix_view b = gsl_matrix_view_array(measuredAzElXYZ, statCounter, 3);
-                // These are Nx3 matrices. Using the method of https://cnx.org/contents/HV-RsdwL@23/Molecular-Distance-Measures, the matrices should be 3xN.
-                // calculate C = X^T * Y
-                int gslStatus = gsl_blas_dgemm(CblasTrans, CblasNoTrans, 1.0, &a.matrix, &b.matrix, 0, &c.matrix);
-                if (gslStatus != GSL_SUCCESS)
-                    goto cleanup;
-
-                gsl_matrix *d = &c.matrix;
-                // From wikipedia article for determinant
-                double da = gsl_matrix_get(d, 0, 0);
-                double db = gsl_matrix_get(d, 0, 1);
-                double dc = gsl_matrix_get(d, 0, 2);
-                double dd = gsl_matrix_get(d, 1, 0);
-                double de = gsl_matrix_get(d, 1, 1);
-                double df = gsl_matrix_get(d, 1, 2);
-                double dg = gsl_matrix_get(d, 2, 0);
-                double dh = gsl_matrix_get(d, 2, 1);
-                double di = gsl_matrix_get(d, 2, 2);
-                double cDet = da*de*di + db*df*dg + dc*dd*dh - dc*de*dg - db*dd*di - da*df*dh;
-                gsl_matrix_set(&cDetSign.matrix, 0, 0, 1.0);
-                gsl_matrix_set(&cDetSign.matrix, 1, 1, 1.0);
-                gsl_matrix_set(&cDetSign.matrix, 2, 2, cDet >= 0.0 ? 1.0 : -1.0);
-
-                gslStatus = gsl_linalg_SV_decomp(&c.matrix, &v.matrix, &s.vector, &work.vector);
-                if (gslStatus != GSL_SUCCESS)
-                    goto cleanup;
-
-                // C now contains W for the SVD of C as W S V^T
-                // The DCM is then
-                gslStatus = gsl_blas_dgemm(CblasNoTrans, CblasTrans, 1.0, &cDetSign.matrix, &v.matrix, 0, &v1.matrix);
-                if (gslStatus != GSL_SUCCESS)
-                    goto cleanup;
-
-                gslStatus = gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, 1.0, &c.matrix, &v1.matrix, 0, &dcm.matrix);
-                if (gslStatus != GSL_SUCCESS)
-                    goto cleanup;
-
-                // Probably safe to assume that the DCM is not symmetric. 
-                // TODO check this
-
-                // from https://en.wikipedia.org/wiki/Rotation_matrix#Conversion_from_rotation_matrix_to_axis–angle
-                gsl_vector_set(&rotationVector.vector, 0, gsl_matrix_get(&dcm.matrix, 2, 1) - gsl_matrix_get(&dcm.matrix, 1, 2));
-                gsl_vector_set(&rotationVector.vector, 1, gsl_matrix_get(&dcm.matrix, 0, 2) - gsl_matrix_get(&dcm.matrix, 2, 0));
-                gsl_vector_set(&rotationVector.vector, 2, gsl_matrix_get(&dcm.matrix, 1, 0) - gsl_matrix_get(&dcm.matrix, 0, 1));
-                double *r = rotationVectorArr;
-                rotationVectorLength = sqrt(r[0] * r[0] + r[1] * r[1] + r[2] * r[2]);
-                rotationAngle = asin(rotationVectorLength / 2.0) / M_PI * 180.0;
-                if (rotationVectorLength > 0.0)
-                {
-                    r[0] /= rotationVectorLength;
-                    r[1] /= rotationVectorLength;
-                    r[2] /= rotationVectorLength;
-                }
-                else
-                {
-                    r[0] = 1.0;
-                    r[1] = 0.0;
-                    r[2] = 0.0;
-                }
-                // Store fit for later export
-                for (int m = 0; m < 9; m++)
-                    state->pointingErrorDcms[imageCounter * 9 + m] = dcmArr[m];
-                for (int m = 0; m < 3; m++)
-                    state->rotationVectors[imageCounter* 3 + m] = rotationVectorArr[m];
-                state->rotationAngles[imageCounter] = rotationAngle;
-                state->nCalibrationStarsUsed[imageCounter] = (uint16_t)statCounter;
             }
-            else
-            {
-                for (int m = 0; m < 9; m++)
-                    state->pointingErrorDcms[imageCounter * 9 + m] = NAN;
-                for (int m = 0; m < 3; m++)
-                    state->rotationVectors[imageCounter* 3 + m] = NAN;
-                state->rotationAngles[imageCounter] = NAN;
-                state->nCalibrationStarsUsed[imageCounter] = 0;
 
-            }
-            for (int i = 0; i < nCalStars && state->printStarInfo; i++)
+            // Calculate rotation matrix for this image
+            if (fitRotation(predictedAzElXYZ, measuredAzElXYZ, statCounter, dcmArr) != ASCC_OK)
             {
-                cal = &calStars[i];
-                if (cal->includeInCalibration && statCounter > 0)
-                {
-                    printf("%lf %ld %ld %.3f %.3f %.3f %.4f %.4f %.4f %.4f %.4f %.4f %.4f %.4f %.9lf %.9lf %.9lf %.9lf %.9lf %.9lf %.9lf %.9lf %.9lf %.6lf %.6lf %.6lf %.6lf\n", imageTime, cal->predictedImageColumn, cal->predictedImageRow, cal->imageMomentColumn, cal->imageMomentRow, cal->magnitude, cal->predictedAz, cal->predictedEl, cal->measuredAz, cal->measuredEl, cal->deltaAz / M_PI * 180.0, cal->deltaEl / M_PI * 180.0, statAz / M_PI * 180.0, statEl / M_PI * 180.0, dcmArr[0], dcmArr[1], dcmArr[2], dcmArr[3], dcmArr[4], dcmArr[5], dcmArr[6], dcmArr[7], dcmArr[8], rotationVectorArr[0], rotationVectorArr[1], rotationVectorArr[2], rotationAngle);
-                }
-                else
-                {
-                    printf("%lf %ld %ld %.3f %.3f %.3f %.4f %.4f %.4f %.4f %.4f %.4f %.4f %.4f %.9lf %.9lf %.9lf %.9lf %.9lf %.9lf %.9lf %.9lf %.9lf\n", imageTime, cal->predictedImageColumn, cal->predictedImageRow, NAN, NAN, cal->magnitude, cal->predictedAz, cal->predictedEl, NAN, NAN, NAN, NAN, NAN, NAN, NAN, NAN, NAN, NAN, NAN, NAN, NAN, NAN, NAN);
-                }
+                state->nGlobalObservations = firstGlobalObservation;
+                setImageResultInvalid(state, imageCounter);
+                return ASCC_ROTATION_FIT;
             }
+
+            work->nConsistentStars = countConsistentStars(predictedAzElXYZ, measuredAzElXYZ, statCounter, dcmArr, PLATE_SOLVE_MATCH_RADIUS_DEGREES);
+
+            // Probably safe to assume that the DCM is not symmetric.
+            // TODO check this
+            dcmToAxisAngle(dcmArr, rotationVectorArr, &rotationAngle);
+
+            // Store fit for later export
+            storeAttitudeQuaternion(dcmArr, &state->attitudeQuaternions[imageCounter * 4]);
+            state->nCalibrationStarsUsed[imageCounter] = (uint16_t)statCounter;
         }
         else
         {
-            for (int m = 0; m < 9; m++)
-                state->pointingErrorDcms[imageCounter * 9 + m] = NAN;
-            for (int m = 0; m < 3; m++)
-                state->rotationVectors[imageCounter * 3 + m] = NAN;
-            state->rotationAngles[imageCounter] = NAN;
-            state->nCalibrationStarsUsed[imageCounter] = 0;
-        }
-        imageCounter++;
-        if (state->showProgress)
-        {
-            fprintf(stderr, "\r%zu of %zu images processed", imageCounter, state->expectedNumberOfImages);
-        }
-    }
-    if (imageCounter > startImage)
-    {
-        state->nl1filenames++;
-        mem = realloc(state->l1filenames, state->nl1filenames * sizeof(char*));
-        if (mem == NULL)
-        {
-            status = ASCC_MEM;
-            goto cleanup;
+            setImageResultInvalid(state, imageCounter);
         }
-        state->l1filenames = mem;
-        state->l1filenames[state->nl1filenames - 1] = strdup(l1file);
-        if (state->l1filenames[state->nl1filenames - 1] == NULL)
+        for (int i = 0; i < nCalStars && diagnostics != NULL; i++)
         {
-            status = ASCC_MEM;
-            goto cleanup;
+            cal = &calStars[i];
+            CalibrationStarDiagnostics *diag = &diagnostics[i];
+            if (cal->includeInCalibration && statCounter > 0)
+            {
+                printf("%lf %d %d %.3f %.3f %.3f %.4f %.4f %.4f %.4f %.4f %.4f %.4f %.4f %.9lf %.9lf %.9lf %.9lf %.9lf %.9lf %.9lf %.9lf %.9lf %.6lf %.6lf %.6lf %.6lf\n", imageTime, cal->predictedImageColumn, cal->predictedImageRow, cal->imageMomentColumn, cal->imageMomentRow, diag->magnitude, diag->predictedAz, diag->predictedEl, diag->measuredAz, diag->measuredEl, diag->deltaAz / M_PI * 180.0, diag->deltaEl / M_PI * 180.0, statAz / M_PI * 180.0, statEl / M_PI * 180.0, dcmArr[0], dcmArr[1], dcmArr[2], dcmArr[3], dcmArr[4], dcmArr[5], dcmArr[6], dcmArr[7], dcmArr[8], rotationVectorArr[0], rotationVectorArr[1], rotationVectorArr[2], rotationAngle);
+            }
+            else
+            {
+                printf("%lf %d %d %.3f %.3f %.3f %.4f %.4f %.4f %.4f %.4f %.4f %.4f %.4f %.9lf %.9lf %.9lf %.9lf %.9lf %.9lf %.9lf %.9lf %.9lf\n", imageTime, cal->predictedImageColumn, cal->predictedImageRow, NAN, NAN, diag->magnitude, diag->predictedAz, diag->predictedEl, NAN, NAN, NAN, NAN, NAN, NAN, NAN, NAN, NAN, NAN, NAN, NAN, NAN, NAN, NAN);
+            }
         }
     }
-    if (state->nImages != imageCounter)
+    else
     {
-        state->nImages = imageCounter;
-        // Resize to match number of images analyzed
-        mem = realloc(state->imageTimes, sizeof(double) * state->nImages);
-        if (mem == NULL)
-        {
-            status = ASCC_MEM;
-            goto cleanup;
-        }
-        state->imageTimes = mem;
-
-        mem = realloc(state->pointingErrorDcms, 9 * sizeof(float) * state->nImages);
-        if (mem == NULL)
-        {
-            status = ASCC_MEM;
-            goto cleanup;
-        }
-        state->pointingErrorDcms = mem;
-
-        mem = realloc(state->rotationVectors, 3 * sizeof(float) * state->nImages);
-        if (mem == NULL)
-        {
-            status = ASCC_MEM;
-            goto cleanup;
-        }
-        state->rotationVectors = mem;
-
-        mem = realloc(state->rotationAngles, sizeof(float) * state->nImages);
-        if (mem == NULL)
-        {
-            status = ASCC_MEM;
-            goto cleanup;
-        }
-        state->rotationAngles = mem;
-
-        mem = realloc(state->nCalibrationStarsUsed, sizeof(uint16_t) * state->nImages);
-        if (mem == NULL)
-        {
-            status = ASCC_MEM;
-            goto cleanup;
-        }
-        state->nCalibrationStarsUsed = mem;
+        setImageResultInvalid(state, imageCounter);
     }
 
-
-cleanup:
-    if (cdf != NULL)
-        CDFclose(cdf);
-
-    if (calStars != NULL)
-        free(calStars);
-
-    if (azVals != NULL)
-        free(azVals);
-
-    if (elVals != NULL)
-        free(elVals);
-
-    if (predictedAzElXYZ != NULL)
-        free(predictedAzElXYZ);
-
-    if (measuredAzElXYZ != NULL)
-        free(measuredAzElXYZ);
-
-    return status;
+    return ASCC_OK;
 }
 
 int radecToazel(double time, float geodeticLatitudeDeg, float longitudeDeg, float altitudeM, float ra, float dec, float *az, float *el)
@@ -894,7 +1544,11 @@ void geodeticToXYZ(float glat, float glon, float altm, float *x, float *y, float
     return;
 }
 
-int selectStars(ProgramState *state, double imageTime, CalibrationStar *calStars)
+// Selects the brightest stars above the elevation bound and predicts their
+// directions. With star sectors, each sector and elevation band takes at most
+// its share of the stars, so that the stars cover the field of view.
+// Catalog values and angles go to diagnostics unless it is NULL.
+int selectStars(ProgramState *state, double imageTime, CalibrationStar *calStars, CalibrationStarDiagnostics *diagnostics)
 {
     if (state == NULL || calStars == NULL)
         return 0;
@@ -914,27 +1568,70 @@ int selectStars(ProgramState *state, double imageTime, CalibrationStar *calStars
 
     int nStars = 0;
 
+    // Positions from the night's star tracks unless exact positions were requested
+    bool useTracks = !state->exactStarPositions && prepareStarTracks(state, imageTime) == ASCC_OK;
+    double siderealAngle = useTracks ? localSiderealAngle(imageTime, state->siteLongitudeGeodetic) : 0.0;
+    bool visible = false;
+
+    int nSectors = state->starSectors;
+    int sectorStars[2 * MAX_STAR_SECTORS] = {0};
+    int sectorBudget = nSectors > 0 ? (state->nCalibrationStars + 2 * nSectors - 1) / (2 * nSectors) : 0;
+    int sector = 0;
+    uint8_t skyRegion = 0;
+
     while (nStars < state->nCalibrationStars && starInd < state->nStars)
     {
         star = &state->starData[starInd];
-        starRa = fmod(star->rightAscensionRadian + star->raProperMotionRadianPerYear * yearsSinceJ2000, 2.0 * M_PI);
-        starDec = fmod(star->declinationRadian + star->decProperMotionRadianPerYear * yearsSinceJ2000, 2.0 * M_PI);
+        if (useTracks)
+            visible = predictStarAzEl(state, starInd, siderealAngle, &starAz, &starEl);
+        else
+        {
+            starRa = fmod(star->rightAscensionRadian + star->raProperMotionRadianPerYear * yearsSinceJ2000, 2.0 * M_PI);
+            starDec = fmod(star->declinationRadian + star->decProperMotionRadianPerYear * yearsSinceJ2000, 2.0 * M_PI);
 
-        // Convert RA and DEC to az and el
-        radecToazel(imageTime, state->siteLatitudeGeodetic, state->siteLongitudeGeodetic, state->siteAltitudeMetres, starRa, starDec, &starAz, &starEl);
+            // Convert RA and DEC to az and el
+            radecToazel(imageTime, state->siteLatitudeGeodetic, state->siteLongitudeGeodetic, state->siteAltitudeMetres, starRa, starDec, &starAz, &starEl);
+            visible = starEl > CALIBRATION_ELEVATION_BOUND;
+        }
+        skyRegion = visible ? starSkyRegion(starAz, starEl) : 0;
+        if (visible && nSectors > 0)
+        {
+            float azimuth = fmodf(starAz, 360.0);
+            if (azimuth < 0.0)
+                azimuth += 360.0;
+            sector = (int)(azimuth / 360.0 * nSectors);
+            if (sector >= nSectors)
+                sector = nSectors - 1;
+            if (starEl > STAR_SECTOR_BAND_ELEVATION)
+                sector += nSectors;
+            if (sectorStars[sector] == sectorBudget)
+                visible = false;
+        }
+        // Chronically undetected stars give way to the next brightest
+        if (visible && skipUndetectedStar(state, starInd, skyRegion))
+            visible = false;
+        if (visible && nSectors > 0)
+            sectorStars[sector]++;
         // If star is in field of view, increase nCalStars
         // and store this star's index in the list of calibration stars
-        if (starEl > CALIBRATION_ELEVATION_BOUND)
+        if (visible)
         {
-            calStars[nStars].star = star;
             if (starInd != calStars[nStars].catalogIndex)
                 calStars[nStars].newStarAtThisIndex = true;
             else
                 calStars[nStars].newStarAtThisIndex = false;
             calStars[nStars].catalogIndex = starInd;
-            calStars[nStars].predictedAz = starAz;
-            calStars[nStars].predictedEl = starEl;
-            calStars[nStars].magnitude = star->visualMagnitudeTimes100 / 100.0;
+            calStars[nStars].skyRegion = skyRegion;
+            calStars[nStars].predictedAzElX = cos((90.0 - starAz)*M_PI/180.0) * cos(starEl*M_PI/180.0);
+            calStars[nStars].predictedAzElY = sin((90.0 - starAz)*M_PI/180.0) * cos(starEl*M_PI/180.0);
+            calStars[nStars].predictedAzElZ = sin(starEl*M_PI/180.0);
+            if (diagnostics != NULL)
+            {
+                diagnostics[nStars].star = star;
+                diagnostics[nStars].predictedAz = starAz;
+                diagnostics[nStars].predictedEl = starEl;
+                diagnostics[nStars].magnitude = star->visualMagnitudeTimes100 / 100.0;
+            }
             // Used to reject stars which have moved too much from one image to the next
             calStars[nStars].previousImageMomentColumn= calStars[nStars].imageMomentColumn;
             calStars[nStars].previousImageMomentRow = calStars[nStars].imageMomentRow;
@@ -977,7 +1674,7 @@ int calculateMoments(ProgramState *state, uint16_t image[IMAGE_COLUMNS][IMAGE_RO
             if (c0 >=0 && c0 < IMAGE_COLUMNS && r0 >= 0 && r0 < IMAGE_ROWS)
             {
                 pixVal = image[c0][r0];
-                if (pixVal < pixelThreshold || pixVal > MAX_PEAK_SIGNAL_FOR_MOMENTS)
+                if (pixVal < pixelThreshold || pixVal > state->maxPeakSignalForMoments)
                     continue;
                 pixVal -= pixelThreshold;
                 if (pixVal < 0)
@@ -1002,7 +1699,6 @@ int calculateMoments(ProgramState *state, uint16_t image[IMAGE_COLUMNS][IMAGE_RO
         cal->measuredAzElY = meanAzElY / (float)boxTotal;
         cal->measuredAzElZ = meanAzElZ / (float)boxTotal;
         cal->meanImageSignalAboveThreshold = (float)boxTotal / (float)momentCounter;
-        cal->backgroundThreshold = (float)pixelThreshold;
     }
     else
     {
@@ -1012,7 +1708,6 @@ int calculateMoments(ProgramState *state, uint16_t image[IMAGE_COLUMNS][IMAGE_RO
         cal->measuredAzElY = 0.0;
         cal->measuredAzElZ = 0.0;
         cal->meanImageSignalAboveThreshold = 0.0;
-        cal->backgroundThreshold = 0.0;
     }
 
     return momentCounter;
@@ -1090,8 +1785,45 @@ int calculatePositionOfMax(uint16_t image[IMAGE_COLUMNS][IMAGE_ROWS], int boxHal
 
 }
 
-size_t numberOfL1FileImagesToProcess(char *l1file, double firstCalTime, double lastCalTime)
+void reportBrightImages(ProgramState *state, size_t nImages, double firstTime, double lastTime)
+{
+    if (state == NULL || !state->verbose)
+        return;
+
+    char firstString[EPOCH4_STRING_LEN+1];
+    char lastString[EPOCH4_STRING_LEN+1];
+    encodeEPOCH4(firstTime, firstString);
+    encodeEPOCH4(lastTime, lastString);
+    if (state->showProgress)
+        fprintf(stderr, "\n");
+    fprintf(stderr, "Skipped %zu images: sky too bright from %s to %s\n", nImages, firstString, lastString);
+
+    return;
+}
+
+// Images of an L1 file in the time interval with a dark enough sky
+static size_t countImagesToProcess(ProgramState *state, const double *epochs, long nImages, double firstCalTime, double lastCalTime)
+{
+    size_t n = 0;
+    for (long ind = 0; ind < nImages; ind++)
+        if (epochs[ind] >= firstCalTime && epochs[ind] <= lastCalTime && skyDarkEnough(state, epochs[ind]))
+            n++;
+
+    return n;
+}
+
+size_t numberOfL1FileImagesToProcess(ProgramState *state, char *l1file, double firstCalTime, double lastCalTime)
 {
+    // A cached file is counted from its cube, without opening the CDF
+    double *cubeEpochs = NULL;
+    long nCubeImages = 0;
+    if (state->frameCacheDir != NULL && frameCubeEpochs(state, l1file, &cubeEpochs, &nCubeImages) == ASCC_OK)
+    {
+        size_t n = countImagesToProcess(state, cubeEpochs, nCubeImages, firstCalTime, lastCalTime);
+        free(cubeEpochs);
+        return n;
+    }
+
     CDFid cdf = NULL;
     CDFstatus cdfStatus = CDFopen(l1file, &cdf);
     if (cdfStatus != CDF_OK)
@@ -1127,6 +1859,8 @@ size_t numberOfL1FileImagesToProcess(char *l1file, double firstCalTime, double l
             continue;
         if (imageTime < firstCalTime || imageTime > lastCalTime)
             continue;
+        if (!skyDarkEnough(state, imageTime))
+            continue;
 
         expectedNumberOfImagesToProcess++;
     }
@@ -1138,12 +1872,70 @@ cleanup:
 
 }
 
+// Like numberOfL1FileImagesToProcess, but without opening the L1 file: a cached
+// file is counted from its cube, other files as a full hour of images at the
+// nominal cadence starting at fileStartEpoch.
+size_t estimatedL1FileImagesToProcess(ProgramState *state, char *l1file, double fileStartEpoch, double firstCalTime, double lastCalTime)
+{
+    double *epochs = NULL;
+    long nImages = 0;
+    size_t n = 0;
 
-int updateCalibration(ProgramState *state)
+    if (state->frameCacheDir != NULL && frameCubeEpochs(state, l1file, &epochs, &nImages) == ASCC_OK)
+    {
+        n = countImagesToProcess(state, epochs, nImages, firstCalTime, lastCalTime);
+        free(epochs);
+        return n;
+    }
+
+    double cadence = L1_FILE_MILLISECONDS / L1_FILE_IMAGES;
+    for (long ind = 0; ind < L1_FILE_IMAGES; ind++)
+    {
+        double imageTime = fileStartEpoch + ind * cadence;
+        if (imageTime >= firstCalTime && imageTime <= lastCalTime && skyDarkEnough(state, imageTime))
+            n++;
+    }
+
+    return n;
+}
+
+
+// Each DCM element and image time is rounded to a fixed point value once, and
+// the sums are exact integers, so the mean attitude does not depend on the
+// order in which images, or partial results of different runs, are added.
+void addImageToCalibrationSums(CalibrationSums *sums, double imageTime, const float *q)
 {
-    int status = ASCC_OK;
+    sums->epoch += (__int128)ldexp(imageTime, CALIBRATION_SUM_EPOCH_BITS);
+    sums->nImages++;
 
-    if (state == NULL)
+    // A NAN attitude leaves the calibration undefined
+    if (!isfinite(q[0]) || !isfinite(q[1]) || !isfinite(q[2]) || !isfinite(q[3]))
+        return;
+
+    double dcmArr[9] = {0.0};
+    attitudeQuaternionToDcm(q, dcmArr);
+    for (int m = 0; m < 9; m++)
+        sums->dcm[m] += (__int128)ldexp((double)(float)dcmArr[m], CALIBRATION_SUM_DCM_BITS);
+    sums->nAttitudes++;
+
+    return;
+}
+
+void addCalibrationSums(CalibrationSums *sums, const CalibrationSums *other)
+{
+    for (int m = 0; m < 9; m++)
+        sums->dcm[m] += other->dcm[m];
+    sums->epoch += other->epoch;
+    sums->nImages += other->nImages;
+    sums->nAttitudes += other->nAttitudes;
+
+    return;
+}
+
+// Calibrated pixel directions from the mean attitude
+int calibrationFromSums(ProgramState *state, const CalibrationSums *sums)
+{
+    if (state == NULL || sums == NULL)
         return ASCC_ARGUMENTS;
 
     // Default: invalid calibration signaled by NANs 
@@ -1154,49 +1946,46 @@ int updateCalibration(ProgramState *state)
             state->calibratedAzimuths[c][r] = NAN;
         }
 
-    if (state->nImages == 0)
+    if (sums->nImages == 0)
         return ASCC_NO_CALIBRATION_DATA;
 
-
-    float xEnu[IMAGE_COLUMNS][IMAGE_ROWS] = {0.0};
-    float yEnu[IMAGE_COLUMNS][IMAGE_ROWS] = {0.0};
-    float zEnu[IMAGE_COLUMNS][IMAGE_ROWS] = {0.0};
-
-    float *dcm = NULL;
-    float degree = M_PI / 180.0;
-
-    double meanCalibrationEpoch = 0.0;
-
-    for (int i = 0; i < state->nImages; i++)
-    {
-        meanCalibrationEpoch += state->imageTimes[i];
-        dcm = &state->pointingErrorDcms[i*9];
-        for (int c = 0; c < IMAGE_COLUMNS; c++)
-        {
-            for (int r = 0; r < IMAGE_ROWS; r++)
-            {
-                xEnu[c][r] += dcm[0] * state->pixelX[c][r] + dcm[3] * state->pixelY[c][r] + dcm[6] * state->pixelZ[c][r];
-                yEnu[c][r] += dcm[1] * state->pixelX[c][r] + dcm[4] * state->pixelY[c][r] + dcm[7] * state->pixelZ[c][r];
-                zEnu[c][r] += dcm[2] * state->pixelX[c][r] + dcm[5] * state->pixelY[c][r] + dcm[8] * state->pixelZ[c][r];
-            }
-        }
-    }
-    meanCalibrationEpoch /= (double)state->nImages;
+    state->calibratedEpoch = ldexp((double)sums->epoch, -CALIBRATION_SUM_EPOCH_BITS) / (double)sums->nImages;
+    state->calibrationUpdated = true;
+    if (sums->nAttitudes < sums->nImages)
+        return ASCC_OK;
+
+    // The mean of the rotated pixel directions is the mean DCM applied to each pixel.
+    // fitRotation gives measured = predicted * DCM for row vectors, so the sky
+    // direction of a pixel is DCM * reference for column vectors, as in the
+    // global camera model.
+    double dcm[9] = {0.0};
+    for (int m = 0; m < 9; m++)
+        dcm[m] = ldexp((double)sums->dcm[m], -CALIBRATION_SUM_DCM_BITS) / (double)sums->nAttitudes;
+    double degree = M_PI / 180.0;
     for (int c = 0; c < IMAGE_COLUMNS; c++)
     {
         for (int r = 0; r < IMAGE_ROWS; r++)
         {
-            xEnu[c][r] /= (float)state->nImages;
-            yEnu[c][r] /= (float)state->nImages;
-            zEnu[c][r] /= (float)state->nImages;
+            double xEnu = dcm[0] * state->pixelX[c][r] + dcm[1] * state->pixelY[c][r] + dcm[2] * state->pixelZ[c][r];
+            double yEnu = dcm[3] * state->pixelX[c][r] + dcm[4] * state->pixelY[c][r] + dcm[5] * state->pixelZ[c][r];
+            double zEnu = dcm[6] * state->pixelX[c][r] + dcm[7] * state->pixelY[c][r] + dcm[8] * state->pixelZ[c][r];
 
-            state->calibratedElevations[c][r] = atanf(zEnu[c][r] / sqrtf(xEnu[c][r]*xEnu[c][r] + yEnu[c][r]*yEnu[c][r])) / degree;
-            state->calibratedAzimuths[c][r] = fmod(360+(90.0 - atan2f(yEnu[c][r], xEnu[c][r]) / degree), 360.0);
+            state->calibratedElevations[c][r] = (float)(atan(zEnu / sqrt(xEnu*xEnu + yEnu*yEnu)) / degree);
+            state->calibratedAzimuths[c][r] = (float)fmod(360+(90.0 - atan2(yEnu, xEnu) / degree), 360.0);
         }
     }
 
-    state->calibratedEpoch = meanCalibrationEpoch;
-    state->calibrationUpdated = true;
+    return ASCC_OK;
+}
 
-    return status;
+int updateCalibration(ProgramState *state)
+{
+    if (state == NULL)
+        return ASCC_ARGUMENTS;
+
+    CalibrationSums sums = {0};
+    for (size_t i = 0; i < state->nImages; i++)
+        addImageToCalibrationSums(&sums, state->imageTimes[i], &state->attitudeQuaternions[i*4]);
+
+    return calibrationFromSums(state, &sums);
 }
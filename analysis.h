@@ -23,25 +23,124 @@
 
 #include "main.h"
 #include "star.h"
+#include "measure.h"
+#include "l1reader.h"
+#include "arena.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <cdf.h>
+
+// Fixed point fraction bits of the calibration sums: DCM elements are exact
+// to float precision down to 2^-56, CDF_EPOCH times to 2^-16 ms
+#define CALIBRATION_SUM_DCM_BITS 80
+#define CALIBRATION_SUM_EPOCH_BITS 16
+
+// Per-file scratch for analyzing images
+typedef struct ImageWorkspace
+{
+    CalibrationStar *calStars;
+    // Only allocated for --print-star-info
+    CalibrationStarDiagnostics *calStarDiagnostics;
+    float *azVals;
+    float *elVals;
+    double *predictedAzElXYZ;
+    double *measuredAzElXYZ;
+    uint16_t (*imagery)[IMAGE_ROWS];
+    PaddedImage *padded;
+    // Only allocated for pyramid searches
+    ImagePyramid *pyramid;
+    StarWindow *windows;
+    // Image records read in place from the mapped L1 file when possible
+    L1FrameMap frames;
+
+    // Star tracking statistics for the current file
+    size_t nLocksAcquired;
+    size_t nLocksLost;
+    size_t nTrackedMeasurements;
+    size_t nGlobalSearches;
+
+    // Calibration stars measured, centroided and agreeing with the fitted attitude for the last image
+    int nCalStars;
+    int nCalStarsKept;
+    int nConsistentStars;
+    // Measuring stopped before the last selected star
+    bool stoppedEarly;
+
+    // Arrays belong to an arena, not the heap
+    bool inArena;
+} ImageWorkspace;
+
+// Scratch for analyzing L1 files, allocated once per run from one arena:
+// the image workspace, then the per-file buffers above fileMark, which are
+// released after each file
+typedef struct AnalysisScratch
+{
+    Arena arena;
+    ImageWorkspace work;
+    ArenaMark fileMark;
+} AnalysisScratch;
+
+// Sufficient statistics of the calibrated maps: fixed point sums of the
+// attitude DCMs and image times. Sums of disjoint sets of images add exactly.
+typedef struct CalibrationSums
+{
+    __int128 dcm[9];
+    __int128 epoch;
+    uint64_t nImages;
+    // Images with a finite attitude
+    uint64_t nAttitudes;
+} CalibrationSums;
 
 int analyzeImagery(ProgramState *state);
 double epochFromL1Filename(char *filenameNoPath);
 int analyzeL1FileImages(ProgramState *state, char *l1file);
 
+int allocateImageWorkspace(ProgramState *state, ImageWorkspace *work);
+int allocateImageWorkspaceInArena(ProgramState *state, ImageWorkspace *work, Arena *arena);
+void resetImageWorkspace(ProgramState *state, ImageWorkspace *work);
+void freeImageWorkspace(ImageWorkspace *work);
+int createAnalysisScratch(ProgramState *state);
+void freeAnalysisScratch(ProgramState *state);
+int resizeImageArrays(ProgramState *state, size_t nImages);
+int reserveImageArrays(ProgramState *state, size_t nImages);
+void moveImageResult(ProgramState *state, size_t from, size_t to);
+void setImageResultInvalid(ProgramState *state, size_t imageCounter);
+void showImageProgress(ProgramState *state, size_t nImagesProcessed);
+
+int readL1Image(ProgramState *state, CDFid cdf, long record, ImageWorkspace *work);
+int analyzeL1Record(ProgramState *state, CDFid cdf, ImageWorkspace *work, long record, double imageTime, bool *firstImageOfFile, size_t imageCounter);
+int analyzeImage(ProgramState *state, ImageWorkspace *work, double imageTime, bool firstImageOfFile, size_t imageCounter);
+int estimatePointingError(ProgramState *state, ImageWorkspace *work, double imageTime, bool firstImageOfFile, size_t imageCounter);
+
+void calculateStarPositionError(const CalibrationStar *cal, CalibrationStarDiagnostics *diagnostics);
+bool findNearestPixel(ProgramState *state, CalibrationStar *cal);
+void setTrackingWindow(ProgramState *state, CalibrationStar *cal, StarWindow *window);
+void setSearchWindow(ProgramState *state, ImageWorkspace *work, CalibrationStar *cal, StarWindow *window);
+int trackStar(ProgramState *state, PaddedImage *image, CalibrationStar *cal, StarWindow *window);
+
+bool decimationNeedsBackfill(ProgramState *state, size_t anchor, size_t nextAnchor);
+void interpolateAttitudes(ProgramState *state, size_t anchor, size_t nextAnchor);
+
 
 int radecToazel(double time, float geodeticLatitudeDeg, float longitudeDeg, float altitudeM, float ra, float dec, float *az, float *el);
 int azelToradec(double time, float geodeticLatitudeDeg, float longitudeDeg, float altitudeM, float az, float el, float *ra, float *dec);
 void geodeticToXYZ(float glat, float glon, float altm, float *x, float *y, float *z, float *dVal);
 
-int selectStars(ProgramState *state, double imageTime, CalibrationStar *calStars);
+int selectStars(ProgramState *state, double imageTime, CalibrationStar *calStars, CalibrationStarDiagnostics *diagnostics);
 
 int calculateMoments(ProgramState *state, uint16_t image[IMAGE_COLUMNS][IMAGE_ROWS], CalibrationStar *cal, int boxHalfWidth, float boxCenterColumn, float boxCenterRow, int pixelThreshold);
 float calculateMeanSignal(uint16_t image[IMAGE_COLUMNS][IMAGE_ROWS], int boxHalfWidth, float boxCenterColumn, float boxCenterRow);
 int calculatePositionOfMax(uint16_t image[IMAGE_COLUMNS][IMAGE_ROWS], int boxHalfWidth, float boxCenterColumn, float boxCenterRow, int *cmax, int *rmax);
 
-size_t numberOfL1FileImagesToProcess(char *l1file, double firstCalTime, double lastCaltime);
+size_t numberOfL1FileImagesToProcess(ProgramState *state, char *l1file, double firstCalTime, double lastCaltime);
+size_t estimatedL1FileImagesToProcess(ProgramState *state, char *l1file, double fileStartEpoch, double firstCalTime, double lastCalTime);
+void reportBrightImages(ProgramState *state, size_t nImages, double firstTime, double lastTime);
 
 
+void addImageToCalibrationSums(CalibrationSums *sums, double imageTime, const float *q);
+void addCalibrationSums(CalibrationSums *sums, const CalibrationSums *other);
+int calibrationFromSums(ProgramState *state, const CalibrationSums *sums);
 int updateCalibration(ProgramState *state);
 
 #endif // _ANALYSIS_H
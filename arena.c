@@ -0,0 +1,134 @@
+/*
+
+    AllSkyCameraCal: arena.c
+
+    Copyright (C) 2022  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include "arena.h"
+
+#include "main.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static size_t alignedBytes(size_t nBytes)
+{
+    return (nBytes + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+}
+
+static uint8_t *blockMemory(ArenaBlock *block)
+{
+    return (uint8_t *)block + alignedBytes(sizeof *block);
+}
+
+static ArenaBlock *newBlock(Arena *arena, size_t capacity)
+{
+    ArenaBlock *block = NULL;
+    if (posix_memalign((void **)&block, ARENA_ALIGNMENT, alignedBytes(sizeof *block) + capacity) != 0)
+        return NULL;
+    block->next = NULL;
+    block->capacity = capacity;
+    block->used = 0;
+    arena->nBlocks++;
+    arena->bytesReserved += capacity;
+
+    return block;
+}
+
+int initArena(Arena *arena, size_t blockBytes)
+{
+    if (arena == NULL || blockBytes == 0)
+        return ASCC_ARGUMENTS;
+
+    memset(arena, 0, sizeof *arena);
+    arena->blockBytes = alignedBytes(blockBytes);
+    arena->first = newBlock(arena, arena->blockBytes);
+    if (arena->first == NULL)
+        return ASCC_MEM;
+    arena->current = arena->first;
+
+    return ASCC_OK;
+}
+
+void *arenaAlloc(Arena *arena, size_t nBytes)
+{
+    if (arena == NULL || arena->current == NULL)
+        return NULL;
+
+    size_t n = alignedBytes(nBytes > 0 ? nBytes : 1);
+    ArenaBlock *block = arena->current;
+    // Blocks after the current one are free for reuse
+    while (block->capacity - block->used < n)
+    {
+        if (block->next != NULL && block->next->capacity >= n)
+        {
+            block = block->next;
+            block->used = 0;
+            continue;
+        }
+        ArenaBlock *added = newBlock(arena, n > arena->blockBytes ? n : arena->blockBytes);
+        if (added == NULL)
+            return NULL;
+        added->next = block->next;
+        block->next = added;
+        block = added;
+    }
+    arena->current = block;
+
+    uint8_t *memory = blockMemory(block) + block->used;
+    block->used += n;
+    memset(memory, 0, n);
+    arena->nAllocations++;
+
+    return memory;
+}
+
+ArenaMark arenaMark(Arena *arena)
+{
+    ArenaMark mark = {arena->current, arena->current != NULL ? arena->current->used : 0};
+
+    return mark;
+}
+
+void arenaRelease(Arena *arena, ArenaMark mark)
+{
+    if (arena == NULL || mark.block == NULL)
+        return;
+
+    arena->current = mark.block;
+    arena->current->used = mark.used;
+
+    return;
+}
+
+void freeArena(Arena *arena)
+{
+    if (arena == NULL)
+        return;
+
+    ArenaBlock *block = arena->first;
+    while (block != NULL)
+    {
+        ArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    memset(arena, 0, sizeof *arena);
+
+    return;
+}
@@ -0,0 +1,68 @@
+/*
+
+    AllSkyCameraCal: arena.h
+
+    Copyright (C) 2022  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+// Bump allocator for scratch memory that lives as long as a run. Memory is
+// taken from large blocks and released in bulk back to a mark, so the
+// blocks are reused instead of returned to the heap.
+
+#ifndef _ARENA_H
+#define _ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ARENA_ALIGNMENT 64
+
+typedef struct ArenaBlock
+{
+    struct ArenaBlock *next;
+    size_t capacity;
+    size_t used;
+    // Memory follows at ARENA_ALIGNMENT
+} ArenaBlock;
+
+typedef struct Arena
+{
+    ArenaBlock *first;
+    ArenaBlock *current;
+    size_t blockBytes;
+    // Heap allocations made by the arena, and bytes held
+    size_t nBlocks;
+    size_t bytesReserved;
+    // Allocations served
+    size_t nAllocations;
+} Arena;
+
+typedef struct ArenaMark
+{
+    ArenaBlock *block;
+    size_t used;
+} ArenaMark;
+
+int initArena(Arena *arena, size_t blockBytes);
+// Zeroed and ARENA_ALIGNMENT aligned, NULL if out of memory
+void *arenaAlloc(Arena *arena, size_t nBytes);
+ArenaMark arenaMark(Arena *arena);
+// Frees everything allocated after mark was taken
+void arenaRelease(Arena *arena, ArenaMark mark);
+void freeArena(Arena *arena);
+
+#endif // _ARENA_H
@@ -0,0 +1,375 @@
+/*
+
+    AllSkyCameraCal: ascc.c
+
+    Copyright (C) 2022  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "ascc.h"
+
+#include "main.h"
+#include "import.h"
+#include "analysis.h"
+#include "measure.h"
+#include "globalfit.h"
+#include "attitude.h"
+#include "startrack.h"
+#include "pixelindex.h"
+#include "calindex.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+// The pipeline keeps all of its state in the ProgramState, so a context is
+// one ProgramState plus the image workspace of the frame interface.
+struct AsccContext
+{
+    ProgramState state;
+    ImageWorkspace work;
+    bool haveWorkspace;
+    bool haveSiteModel;
+    bool haveCatalog;
+    // L2 files found so far, for switching reference calibrations between frames
+    CalibrationIndex calibrationIndex;
+    // Copies of the strings the ProgramState points to
+    char *site;
+    char *l2dir;
+    char *stardir;
+};
+
+// The CDF and IDL save file readers are not known to be reentrant
+static pthread_mutex_t loaderMutex = PTHREAD_MUTEX_INITIALIZER;
+
+void asccDefaultSettings(AsccSettings *settings)
+{
+    if (settings == NULL)
+        return;
+
+    settings->nCalibrationStars = N_CALIBRATION_STARS;
+    settings->starSearchBoxWidth = STAR_SEARCH_BOX_WIDTH;
+    settings->starMaxJitterPixels = STAR_MAX_PIXEL_JITTER;
+    settings->maxBackgroundSignal = MAX_BACKGROUND_SIGNAL_FOR_MOMENTS;
+    settings->maxPeakSignal = MAX_PEAK_SIGNAL_FOR_MOMENTS;
+    settings->trackStars = false;
+    settings->globalFit = false;
+    settings->globalFitThreads = 1;
+    settings->verbose = false;
+
+    return;
+}
+
+AsccContext *asccCreateContext(const char *site, const AsccSettings *settings)
+{
+    AsccSettings defaults;
+    asccDefaultSettings(&defaults);
+    if (settings == NULL)
+        settings = &defaults;
+
+    if (site == NULL || strlen(site) != 4 || settings->nCalibrationStars < MIN_N_CALIBRATION_STARS_PER_IMAGE || settings->starSearchBoxWidth < MIN_STAR_SEARCH_BOX_WIDTH || settings->starMaxJitterPixels <= 0.0 || settings->maxBackgroundSignal <= 0 || settings->maxPeakSignal <= 0 || settings->globalFitThreads < 1)
+        return NULL;
+
+    // Several MB of site model arrays: always on the heap
+    AsccContext *context = calloc(1, sizeof *context);
+    if (context == NULL)
+        return NULL;
+    context->site = strdup(site);
+    if (context->site == NULL)
+    {
+        free(context);
+        return NULL;
+    }
+
+    ProgramState *state = &context->state;
+    state->site = context->site;
+    state->nCalibrationStars = settings->nCalibrationStars;
+    state->starSearchBoxWidth = settings->starSearchBoxWidth;
+    state->starMaxJitterPixels = settings->starMaxJitterPixels;
+    state->maxBackgroundSignalForMoments = settings->maxBackgroundSignal;
+    state->maxPeakSignalForMoments = settings->maxPeakSignal;
+    state->trackStars = settings->trackStars;
+    state->globalFit = settings->globalFit;
+    state->globalFitThreads = settings->globalFitThreads;
+    state->verbose = settings->verbose;
+    state->decimationStride = 1;
+    state->firstCalTime = NAN;
+    state->lastCalTime = NAN;
+    openCalibrationIndex(&context->calibrationIndex, NULL);
+    state->calibrationIndex = &context->calibrationIndex;
+
+    return context;
+}
+
+void asccFreeContext(AsccContext *context)
+{
+    if (context == NULL)
+        return;
+
+    ProgramState *state = &context->state;
+    if (context->haveWorkspace)
+        freeImageWorkspace(&context->work);
+    free(state->starData);
+    freeStarTracks(state);
+    freeReferencePixelIndex(state);
+    free(state->imageTimes);
+    free(state->attitudeQuaternions);
+    free(state->nCalibrationStarsUsed);
+    free(state->attitudeInterpolated);
+    free(state->globalObservations);
+    free(state->l2filename);
+    free(state->skymapfilename);
+    free(state->calibrationDateUsed);
+    free(state->calibrationDateGenerated);
+    freeCalibrationIndex(&context->calibrationIndex);
+    free(context->site);
+    free(context->l2dir);
+    free(context->stardir);
+    free(context);
+
+    return;
+}
+
+int asccLoadSiteModelL2(AsccContext *context, const char *l2dir, double epoch)
+{
+    if (context == NULL || l2dir == NULL)
+        return ASCC_ARGUMENTS;
+
+    char *dir = strdup(l2dir);
+    if (dir == NULL)
+        return ASCC_MEM;
+
+    // The model in use, and the directory it came from, stay if loading fails
+    ProgramState *state = &context->state;
+    state->l2dir = dir;
+    pthread_mutex_lock(&loaderMutex);
+    int status = loadThemisLevel2(state, epoch);
+    pthread_mutex_unlock(&loaderMutex);
+    if (status != ASCC_OK)
+    {
+        state->l2dir = context->l2dir;
+        free(dir);
+        return status;
+    }
+    free(context->l2dir);
+    context->l2dir = dir;
+    state->skymap = false;
+    context->haveSiteModel = true;
+
+    return ASCC_OK;
+}
+
+int asccLoadSiteModelSkymap(AsccContext *context, const char *skymapFile)
+{
+    if (context == NULL || skymapFile == NULL)
+        return ASCC_ARGUMENTS;
+
+    char *path = strdup(skymapFile);
+    if (path == NULL)
+        return ASCC_MEM;
+
+    ProgramState *state = &context->state;
+    pthread_mutex_lock(&loaderMutex);
+    int status = loadSiteModel(state, path, state->l2filename, true);
+    pthread_mutex_unlock(&loaderMutex);
+    if (status != ASCC_OK)
+    {
+        free(path);
+        return status;
+    }
+    free(state->skymapfilename);
+    state->skymapfilename = path;
+    state->skymap = true;
+    // A skymap file given by the caller is used as is
+    state->siteModelFromIndex = false;
+    context->haveSiteModel = true;
+
+    return ASCC_OK;
+}
+
+int asccLoadCatalog(AsccContext *context, const char *stardir)
+{
+    if (context == NULL || stardir == NULL)
+        return ASCC_ARGUMENTS;
+
+    ProgramState *state = &context->state;
+    free(context->stardir);
+    context->stardir = strdup(stardir);
+    if (context->stardir == NULL)
+        return ASCC_MEM;
+    state->stardir = context->stardir;
+    free(state->starData);
+    state->starData = NULL;
+    freeStarTracks(state);
+    context->haveCatalog = false;
+
+    int status = loadStars(state);
+    if (status != ASCC_OK)
+        return status;
+    // BSC5 stores a negative star count for J2000 coordinates
+    if (state->nStars > 0)
+        return ASCC_STAR_FILE;
+    state->nStars = -state->nStars;
+    context->haveCatalog = true;
+
+    return ASCC_OK;
+}
+
+static void copyAttitude(const ProgramState *state, size_t index, AsccAttitude *attitude)
+{
+    attitude->epoch = state->imageTimes[index];
+    expandAttitudeQuaternion(&state->attitudeQuaternions[index * 4], attitude->pointingErrorDcm, attitude->rotationAxis, &attitude->rotationAngleDegrees);
+    attitude->nCalibrationStars = state->nCalibrationStarsUsed[index];
+
+    return;
+}
+
+int asccAnalyzeFrame(AsccContext *context, double epoch, const uint16_t *frame, bool firstFrameOfSequence, AsccAttitude *attitude)
+{
+    if (context == NULL || frame == NULL || !isfinite(epoch))
+        return ASCC_ARGUMENTS;
+    if (!context->haveSiteModel)
+        return ASCC_L2_FILE;
+    if (!context->haveCatalog)
+        return ASCC_STAR_FILE;
+
+    ProgramState *state = &context->state;
+    if (!context->haveWorkspace)
+    {
+        int status = allocateImageWorkspace(state, &context->work);
+        if (status != ASCC_OK)
+        {
+            freeImageWorkspace(&context->work);
+            return status;
+        }
+        context->haveWorkspace = true;
+    }
+
+    // The L2 file that applies to this frame. Star histories do not carry
+    // over to another reference map.
+    bool switched = false;
+    pthread_mutex_lock(&loaderMutex);
+    int status = selectSiteModel(state, epoch, &switched);
+    pthread_mutex_unlock(&loaderMutex);
+    if (status != ASCC_OK)
+        return status;
+    if (switched)
+        firstFrameOfSequence = true;
+
+    size_t imageCounter = state->nImages;
+    status = reserveImageArrays(state, imageCounter + 1);
+    if (status != ASCC_OK)
+        return status;
+    state->nImages = imageCounter + 1;
+    state->imageTimes[imageCounter] = epoch;
+    setImageResultInvalid(state, imageCounter);
+    if (isnan(state->firstCalTime) || epoch < state->firstCalTime)
+        state->firstCalTime = epoch;
+    if (isnan(state->lastCalTime) || epoch > state->lastCalTime)
+        state->lastCalTime = epoch;
+
+    // The padded image is a copy, the caller's frame is not modified
+    loadPaddedImage(context->work.padded, (uint16_t (*)[IMAGE_ROWS])frame, state->sitePixelOffsets);
+    status = analyzeImage(state, &context->work, epoch, firstFrameOfSequence, imageCounter);
+
+    if (attitude != NULL)
+        copyAttitude(state, imageCounter, attitude);
+
+    // Too few stars or a failed fit leave a NAN attitude, as for L1 files
+    if (status == ASCC_ROTATION_FIT)
+        status = ASCC_OK;
+
+    return status;
+}
+
+int asccFit(AsccContext *context)
+{
+    if (context == NULL)
+        return ASCC_ARGUMENTS;
+
+    ProgramState *state = &context->state;
+    if (state->nImages == 0)
+        return ASCC_NO_CALIBRATION_DATA;
+
+    int status = updateCalibration(state);
+    if (status != ASCC_OK)
+        return status;
+
+    if (state->globalFit)
+    {
+        status = solveGlobalCameraModel(state);
+        updateGlobalCalibration(state);
+    }
+
+    return status;
+}
+
+size_t asccNumberOfResults(const AsccContext *context)
+{
+    if (context == NULL)
+        return 0;
+
+    return context->state.nImages;
+}
+
+int asccGetResult(const AsccContext *context, size_t index, AsccAttitude *attitude)
+{
+    if (context == NULL || attitude == NULL || index >= context->state.nImages)
+        return ASCC_ARGUMENTS;
+
+    copyAttitude(&context->state, index, attitude);
+
+    return ASCC_OK;
+}
+
+int asccGetCalibration(const AsccContext *context, float *elevations, float *azimuths, double *calibrationEpoch)
+{
+    if (context == NULL || elevations == NULL || azimuths == NULL)
+        return ASCC_ARGUMENTS;
+
+    const ProgramState *state = &context->state;
+    if (!state->calibrationUpdated)
+        return ASCC_NO_CALIBRATION_DATA;
+
+    memcpy(elevations, &state->calibratedElevations[0][0], sizeof state->calibratedElevations);
+    memcpy(azimuths, &state->calibratedAzimuths[0][0], sizeof state->calibratedAzimuths);
+    if (calibrationEpoch != NULL)
+        *calibrationEpoch = state->calibratedEpoch;
+
+    return ASCC_OK;
+}
+
+void asccClearResults(AsccContext *context)
+{
+    if (context == NULL)
+        return;
+
+    ProgramState *state = &context->state;
+    state->nImages = 0;
+    state->nGlobalObservations = 0;
+    state->calibrationUpdated = false;
+    state->globalFitSolved = false;
+    state->firstCalTime = NAN;
+    state->lastCalTime = NAN;
+    // Star histories refer to the dropped frames
+    if (context->haveWorkspace)
+    {
+        freeImageWorkspace(&context->work);
+        context->haveWorkspace = false;
+    }
+
+    return;
+}
@@ -0,0 +1,122 @@
+/*
+
+    AllSkyCameraCal: ascc.h
+
+    Copyright (C) 2022  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// Public interface of libascc. Each context holds its own site model, star
+// catalog, scratch images and results, so contexts can be used concurrently
+// from different threads. A single context must not be used by two threads
+// at the same time.
+
+#ifndef _ASCC_H
+#define _ASCC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define ASCC_IMAGE_COLUMNS 256
+#define ASCC_IMAGE_ROWS 256
+
+enum ASCC_STATUS
+{
+    ASCC_OK = 0,
+    ASCC_L1_FILE = 1,
+    ASCC_L2_FILE = 2,
+    ASCC_BSC5_FILE = 3,
+    ASCC_MEM = 4,
+    ASCC_ARGUMENTS = 5,
+    ASCC_CDF_READ = 6,
+    ASCC_STAR_FILE = 7,
+    ASCC_SKYMAP_FILE = 8,
+    ASCC_CDF_EXPORT_NO_DATA = 9,
+    ASCC_CDF_WRITE = 10,
+    ASCC_NO_CALIBRATION_DATA = 11,
+    ASCC_ROTATION_FIT = 12,
+    ASCC_BLIND_SOLVE = 13,
+    ASCC_FRAME_CACHE = 14,
+    ASCC_COLUMN_EXPORT = 15,
+    ASCC_SITE_MODEL_CACHE = 16,
+    ASCC_CALIBRATION_INDEX = 17,
+    ASCC_PARTIAL_RESULTS = 18,
+    ASCC_STAR_DETECTABILITY = 19
+};
+
+typedef struct AsccContext AsccContext;
+
+// Analysis settings, see allskycameracal --help for their meaning
+typedef struct AsccSettings
+{
+    int nCalibrationStars;
+    int starSearchBoxWidth;
+    float starMaxJitterPixels;
+    int maxBackgroundSignal;
+    int maxPeakSignal;
+    bool trackStars;
+    bool globalFit;
+    int globalFitThreads;
+    bool verbose;
+} AsccSettings;
+
+// Pointing error of one image
+typedef struct AsccAttitude
+{
+    // CDF_EPOCH milliseconds
+    double epoch;
+    float pointingErrorDcm[9];
+    float rotationAxis[3];
+    float rotationAngleDegrees;
+    int nCalibrationStars;
+} AsccAttitude;
+
+void asccDefaultSettings(AsccSettings *settings);
+
+// Returns NULL if out of memory or the arguments are invalid
+AsccContext *asccCreateContext(const char *site, const AsccSettings *settings);
+void asccFreeContext(AsccContext *context);
+
+// Site position, CCD offsets and reference pixel directions from a THEMIS L2
+// calibration file in l2dir, or from an IDL skymap file. These replace the
+// model loaded before, which is kept if the new one fails to load.
+// The L2 file is the one that applies at epoch (CDF_EPOCH milliseconds), the
+// newest if epoch is NAN, and asccAnalyzeFrame() switches to the L2 file that
+// applies to each frame. A skymap file is used for every frame.
+int asccLoadSiteModelL2(AsccContext *context, const char *l2dir, double epoch);
+int asccLoadSiteModelSkymap(AsccContext *context, const char *skymapFile);
+// Bright star catalog BSC5ra in stardir
+int asccLoadCatalog(AsccContext *context, const char *stardir);
+
+// Analyzes one L1 image (256 x 256 counts in the layout of the thg_asf_<site>
+// L1 variable, CCD offsets included). Frames must be passed in time order;
+// set firstFrameOfSequence after a gap. attitude may be NULL.
+// Images without enough stars are kept with a NAN attitude.
+int asccAnalyzeFrame(AsccContext *context, double epoch, const uint16_t *frame, bool firstFrameOfSequence, AsccAttitude *attitude);
+
+// Averages the attitudes of the analyzed frames into calibrated pixel
+// elevations and azimuths, and fits the global camera model if enabled
+int asccFit(AsccContext *context);
+
+size_t asccNumberOfResults(const AsccContext *context);
+int asccGetResult(const AsccContext *context, size_t index, AsccAttitude *attitude);
+// 256 x 256 arrays in the layout of the L2 elevations and azimuths, NAN where undefined.
+// Available after asccFit().
+int asccGetCalibration(const AsccContext *context, float *elevations, float *azimuths, double *calibrationEpoch);
+// Drops the analyzed frames, keeping the site model and catalog
+void asccClearResults(AsccContext *context);
+
+#endif // _ASCC_H
@@ -0,0 +1,381 @@
+/*
+
+    AllSkyCameraCal: attitude.c
+
+    Copyright (C) 2022  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "attitude.h"
+
+#include "main.h"
+
+#include <math.h>
+
+#include <gsl/gsl_matrix.h>
+#include <gsl/gsl_blas.h>
+#include <gsl/gsl_linalg.h>
+
+// Shepperd's method: pick the largest of w, x, y, z to avoid dividing by a small number
+void dcmToQuaternion(const double *dcm, double *q)
+{
+    double trace = dcm[0] + dcm[4] + dcm[8];
+    double s = 0.0;
+
+    if (trace > dcm[0] && trace > dcm[4] && trace > dcm[8])
+    {
+        s = 2.0 * sqrt(1.0 + trace);
+        q[0] = 0.25 * s;
+        q[1] = (dcm[7] - dcm[5]) / s;
+        q[2] = (dcm[2] - dcm[6]) / s;
+        q[3] = (dcm[3] - dcm[1]) / s;
+    }
+    else if (dcm[0] > dcm[4] && dcm[0] > dcm[8])
+    {
+        s = 2.0 * sqrt(1.0 + dcm[0] - dcm[4] - dcm[8]);
+        q[0] = (dcm[7] - dcm[5]) / s;
+        q[1] = 0.25 * s;
+        q[2] = (dcm[1] + dcm[3]) / s;
+        q[3] = (dcm[2] + dcm[6]) / s;
+    }
+    else if (dcm[4] > dcm[8])
+    {
+        s = 2.0 * sqrt(1.0 + dcm[4] - dcm[0] - dcm[8]);
+        q[0] = (dcm[2] - dcm[6]) / s;
+        q[1] = (dcm[1] + dcm[3]) / s;
+        q[2] = 0.25 * s;
+        q[3] = (dcm[5] + dcm[7]) / s;
+    }
+    else
+    {
+        s = 2.0 * sqrt(1.0 + dcm[8] - dcm[0] - dcm[4]);
+        q[0] = (dcm[3] - dcm[1]) / s;
+        q[1] = (dcm[2] + dcm[6]) / s;
+        q[2] = (dcm[5] + dcm[7]) / s;
+        q[3] = 0.25 * s;
+    }
+
+    // Keep the scalar part positive so that equal rotations have equal quaternions
+    double norm = sqrt(q[0] * q[0] + q[1] * q[1] + q[2] * q[2] + q[3] * q[3]);
+    if (q[0] < 0.0)
+        norm = -norm;
+    for (int i = 0; i < 4; i++)
+        q[i] /= norm;
+
+    return;
+}
+
+void quaternionToDcm(const double *q, double *dcm)
+{
+    double w = q[0];
+    double x = q[1];
+    double y = q[2];
+    double z = q[3];
+
+    dcm[0] = 1.0 - 2.0 * (y * y + z * z);
+    dcm[1] = 2.0 * (x * y - w * z);
+    dcm[2] = 2.0 * (x * z + w * y);
+    dcm[3] = 2.0 * (x * y + w * z);
+    dcm[4] = 1.0 - 2.0 * (x * x + z * z);
+    dcm[5] = 2.0 * (y * z - w * x);
+    dcm[6] = 2.0 * (x * z - w * y);
+    dcm[7] = 2.0 * (y * z + w * x);
+    dcm[8] = 1.0 - 2.0 * (x * x + y * y);
+
+    return;
+}
+
+// Spherical linear interpolation from q1 (fraction = 0) to q2 (fraction = 1)
+void quaternionSlerp(const double *q1, const double *q2, double fraction, double *q)
+{
+    double dot = q1[0] * q2[0] + q1[1] * q2[1] + q1[2] * q2[2] + q1[3] * q2[3];
+    double sign = 1.0;
+    // Take the shortest path
+    if (dot < 0.0)
+    {
+        dot = -dot;
+        sign = -1.0;
+    }
+
+    double w1 = 1.0 - fraction;
+    double w2 = fraction;
+    if (dot < 0.9995)
+    {
+        double theta = acos(dot);
+        double sinTheta = sin(theta);
+        w1 = sin((1.0 - fraction) * theta) / sinTheta;
+        w2 = sin(fraction * theta) / sinTheta;
+    }
+
+    double norm = 0.0;
+    for (int i = 0; i < 4; i++)
+    {
+        q[i] = w1 * q1[i] + sign * w2 * q2[i];
+        norm += q[i] * q[i];
+    }
+    norm = sqrt(norm);
+    for (int i = 0; i < 4; i++)
+        q[i] /= norm;
+
+    return;
+}
+
+// from https://en.wikipedia.org/wiki/Rotation_matrix#Conversion_from_rotation_matrix_to_axis–angle
+void dcmToAxisAngle(const double *dcm, double *axis, double *angleDegrees)
+{
+    axis[0] = dcm[7] - dcm[5];
+    axis[1] = dcm[2] - dcm[6];
+    axis[2] = dcm[3] - dcm[1];
+    double length = sqrt(axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2]);
+    *angleDegrees = asin(length / 2.0) / M_PI * 180.0;
+    if (length > 0.0)
+    {
+        axis[0] /= length;
+        axis[1] /= length;
+        axis[2] /= length;
+    }
+    else
+    {
+        axis[0] = 1.0;
+        axis[1] = 0.0;
+        axis[2] = 0.0;
+    }
+
+    return;
+}
+
+// Rotation angle in degrees of a DCM from its trace
+static double angleFromTrace(double trace)
+{
+    double cosAngle = (trace - 1.0) / 2.0;
+    if (cosAngle > 1.0)
+        cosAngle = 1.0;
+    else if (cosAngle < -1.0)
+        cosAngle = -1.0;
+
+    return acos(cosAngle) / M_PI * 180.0;
+}
+
+// Angle in degrees of the rotation taking dcm1 to dcm2
+double dcmAngleBetween(const float *dcm1, const float *dcm2)
+{
+    // trace(dcm1^T dcm2)
+    double trace = 0.0;
+    for (int i = 0; i < 9; i++)
+        trace += (double)dcm1[i] * (double)dcm2[i];
+
+    return angleFromTrace(trace);
+}
+
+// As dcmAngleBetween(), for double DCMs
+double dcmAngleBetweenDouble(const double *dcm1, const double *dcm2)
+{
+    double trace = 0.0;
+    for (int i = 0; i < 9; i++)
+        trace += dcm1[i] * dcm2[i];
+
+    return angleFromTrace(trace);
+}
+
+// Stores a DCM as a unit quaternion. A NAN DCM gives a NAN quaternion.
+void storeAttitudeQuaternion(const double *dcm, float *q)
+{
+    double qd[4] = {0.0};
+
+    dcmToQuaternion(dcm, qd);
+    for (int i = 0; i < 4; i++)
+        q[i] = (float)qd[i];
+
+    return;
+}
+
+void attitudeQuaternionToDcm(const float *q, double *dcm)
+{
+    double qd[4] = {q[0], q[1], q[2], q[3]};
+    double norm = sqrt(qd[0] * qd[0] + qd[1] * qd[1] + qd[2] * qd[2] + qd[3] * qd[3]);
+
+    // Undo float rounding of the norm
+    for (int i = 0; i < 4; i++)
+        qd[i] /= norm;
+    quaternionToDcm(qd, dcm);
+
+    return;
+}
+
+// DCM, rotation axis and angle of a stored attitude, as exported
+void expandAttitudeQuaternion(const float *q, float *dcm, float *axis, float *angleDegrees)
+{
+    double dcmArr[9] = {0.0};
+    double axisArr[3] = {0.0};
+    double angle = 0.0;
+
+    if (!isfinite(q[0]))
+    {
+        for (int m = 0; m < 9; m++)
+            dcm[m] = NAN;
+        for (int m = 0; m < 3; m++)
+            axis[m] = NAN;
+        *angleDegrees = NAN;
+        return;
+    }
+
+    attitudeQuaternionToDcm(q, dcmArr);
+    dcmToAxisAngle(dcmArr, axisArr, &angle);
+    for (int m = 0; m < 9; m++)
+        dcm[m] = (float)dcmArr[m];
+    for (int m = 0; m < 3; m++)
+        axis[m] = (float)axisArr[m];
+    *angleDegrees = (float)angle;
+
+    return;
+}
+
+// Angle in degrees of the rotation taking q1 to q2
+double quaternionAngleBetween(const float *q1, const float *q2)
+{
+    double dot = 0.0;
+    double norm1 = 0.0;
+    double norm2 = 0.0;
+    for (int i = 0; i < 4; i++)
+    {
+        dot += (double)q1[i] * (double)q2[i];
+        norm1 += (double)q1[i] * (double)q1[i];
+        norm2 += (double)q2[i] * (double)q2[i];
+    }
+
+    double cosHalfAngle = fabs(dot) / sqrt(norm1 * norm2);
+    if (cosHalfAngle > 1.0)
+        cosHalfAngle = 1.0;
+
+    return 2.0 * acos(cosHalfAngle) / M_PI * 180.0;
+}
+
+// Least-squares rotation taking n predicted unit vectors to n measured unit vectors
+// (row vectors, measured = predicted * dcm). Both arrays are n x 3.
+int fitRotation(double *predicted, double *measured, int n, double *dcmArr)
+{
+    double cArr[9] = {0.0};
+    double vArr[9] = {0.0};
+    double v1Arr[9] = {0.0};
+    double sArr[3] = {0.0};
+    double workArr[3] = {0.0};
+    double cDetSignArr[9] = {0.0};
+
+    gsl_matrix_view c = gsl_matrix_view_array(cArr, 3, 3);
+    gsl_matrix_view v = gsl_matrix_view_array(vArr, 3, 3);
+    gsl_matrix_view v1 = gsl_matrix_view_array(v1Arr, 3, 3);
+    gsl_vector_view s = gsl_vector_view_array(sArr, 3);
+    gsl_vector_view work3 = gsl_vector_view_array(workArr, 3);
+    gsl_matrix_view dcm = gsl_matrix_view_array(dcmArr, 3, 3);
+    gsl_matrix_view cDetSign = gsl_matrix_view_array(cDetSignArr, 3, 3);
+
+    // n x 3 matrices
+    gsl_matrix_view a = gsl_matrix_view_array(predicted, n, 3);
+    gsl_matrix_view b = gsl_matrix_view_array(measured, n, 3);
+    // These are Nx3 matrices. Using the method of https://cnx.org/contents/HV-RsdwL@23/Molecular-Distance-Measures, the matrices should be 3xN.
+    // calculate C = X^T * Y
+    int gslStatus = gsl_blas_dgemm(CblasTrans, CblasNoTrans, 1.0, &a.matrix, &b.matrix, 0, &c.matrix);
+    if (gslStatus != GSL_SUCCESS)
+        return ASCC_ROTATION_FIT;
+
+    gsl_matrix *d = &c.matrix;
+    // From wikipedia article for determinant
+    double da = gsl_matrix_get(d, 0, 0);
+    double db = gsl_matrix_get(d, 0, 1);
+    double dc = gsl_matrix_get(d, 0, 2);
+    double dd = gsl_matrix_get(d, 1, 0);
+    double de = gsl_matrix_get(d, 1, 1);
+    double df = gsl_matrix_get(d, 1, 2);
+    double dg = gsl_matrix_get(d, 2, 0);
+    double dh = gsl_matrix_get(d, 2, 1);
+    double di = gsl_matrix_get(d, 2, 2);
+    double cDet = da*de*di + db*df*dg + dc*dd*dh - dc*de*dg - db*dd*di - da*df*dh;
+    gsl_matrix_set(&cDetSign.matrix, 0, 0, 1.0);
+    gsl_matrix_set(&cDetSign.matrix, 1, 1, 1.0);
+    gsl_matrix_set(&cDetSign.matrix, 2, 2, cDet >= 0.0 ? 1.0 : -1.0);
+
+    gslStatus = gsl_linalg_SV_decomp(&c.matrix, &v.matrix, &s.vector, &work3.vector);
+    if (gslStatus != GSL_SUCCESS)
+        return ASCC_ROTATION_FIT;
+
+    // C now contains W for the SVD of C as W S V^T
+    // The DCM is then
+    gslStatus = gsl_blas_dgemm(CblasNoTrans, CblasTrans, 1.0, &cDetSign.matrix, &v.matrix, 0, &v1.matrix);
+    if (gslStatus != GSL_SUCCESS)
+        return ASCC_ROTATION_FIT;
+
+    gslStatus = gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, 1.0, &c.matrix, &v1.matrix, 0, &dcm.matrix);
+    if (gslStatus != GSL_SUCCESS)
+        return ASCC_ROTATION_FIT;
+
+    return ASCC_OK;
+}
+
+// How well n unit vectors (n x 3) constrain a rotation: the smallest
+// eigenvalue of sum(I - p p^T) / n, the normal matrix of a small rotation
+// fit. It is 0 when all stars lie along one direction, so the rotation
+// about it is undetermined, and at most 2/3, for stars spread over the
+// whole sky.
+double fitConditioning(const double *predicted, int n)
+{
+    if (n <= 0)
+        return 0.0;
+
+    // Scatter matrix S = sum(p p^T) / n: the answer is its trace, 1 for unit
+    // vectors, minus its largest eigenvalue
+    double s[3][3] = {{0.0}};
+    for (int i = 0; i < n; i++)
+        for (int j = 0; j < 3; j++)
+            for (int k = 0; k < 3; k++)
+                s[j][k] += predicted[i * 3 + j] * predicted[i * 3 + k];
+    double trace = 0.0;
+    for (int j = 0; j < 3; j++)
+    {
+        for (int k = 0; k < 3; k++)
+            s[j][k] /= (double)n;
+        trace += s[j][j];
+    }
+
+    // Eigenvalues of a symmetric 3x3 matrix in closed form
+    double q = trace / 3.0;
+    double offDiagonal = s[0][1] * s[0][1] + s[0][2] * s[0][2] + s[1][2] * s[1][2];
+    double p2 = (s[0][0] - q) * (s[0][0] - q) + (s[1][1] - q) * (s[1][1] - q) + (s[2][2] - q) * (s[2][2] - q) + 2.0 * offDiagonal;
+    double largest = q;
+    if (p2 > 0.0)
+    {
+        double p = sqrt(p2 / 6.0);
+        double b[3][3];
+        for (int j = 0; j < 3; j++)
+            for (int k = 0; k < 3; k++)
+                b[j][k] = (s[j][k] - (j == k ? q : 0.0)) / p;
+        double r = (b[0][0] * (b[1][1] * b[2][2] - b[1][2] * b[2][1]) - b[0][1] * (b[1][0] * b[2][2] - b[1][2] * b[2][0]) + b[0][2] * (b[1][0] * b[2][1] - b[1][1] * b[2][0])) / 2.0;
+        if (r > 1.0)
+            r = 1.0;
+        else if (r < -1.0)
+            r = -1.0;
+        largest = q + 2.0 * p * cos(acos(r) / 3.0);
+    }
+
+    return trace - largest > 0.0 ? trace - largest : 0.0;
+}
+
+// Rotates row vector v by dcm: out = v * dcm
+void rotateVector(const double *dcm, const double *v, double *out)
+{
+    for (int j = 0; j < 3; j++)
+        out[j] = v[0] * dcm[j] + v[1] * dcm[3 + j] + v[2] * dcm[6 + j];
+
+    return;
+}
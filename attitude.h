@@ -0,0 +1,45 @@
+/*
+
+    AllSkyCameraCal: attitude.h
+
+    Copyright (C) 2022  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef _ATTITUDE_H
+#define _ATTITUDE_H
+
+// DCMs are 3x3 row-major arrays.
+// Quaternions are scalar first: w, x, y, z. Image attitudes are stored as
+// float quaternions in ProgramState.attitudeQuaternions, with w >= 0.
+
+void dcmToQuaternion(const double *dcm, double *q);
+void quaternionToDcm(const double *q, double *dcm);
+void quaternionSlerp(const double *q1, const double *q2, double fraction, double *q);
+
+void dcmToAxisAngle(const double *dcm, double *axis, double *angleDegrees);
+double dcmAngleBetween(const float *dcm1, const float *dcm2);
+double dcmAngleBetweenDouble(const double *dcm1, const double *dcm2);
+
+void storeAttitudeQuaternion(const double *dcm, float *q);
+void attitudeQuaternionToDcm(const float *q, double *dcm);
+void expandAttitudeQuaternion(const float *q, float *dcm, float *axis, float *angleDegrees);
+double quaternionAngleBetween(const float *q1, const float *q2);
+
+int fitRotation(double *predicted, double *measured, int n, double *dcmArr);
+double fitConditioning(const double *predicted, int n);
+void rotateVector(const double *dcm, const double *v, double *out);
+
+#endif // _ATTITUDE_H
@@ -0,0 +1,144 @@
+/*
+
+    AllSkyCameraCal: benchmark_attitude_memory.c
+
+    Copyright (C) 2022  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// Memory used by per-image results for a synthetic run: one image every
+// 3 s for a year by default, grown one hourly L1 file at a time as in the
+// analysis, then expanded for export as exportCdf() does.
+
+#include "main.h"
+
+#include "analysis.h"
+#include "attitude.h"
+#include "export.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <sys/resource.h>
+
+#define BENCHMARK_DAYS 365
+#define BENCHMARK_CADENCE_SECONDS 3
+
+// A slowly wandering attitude of up to about 0.5 degrees
+static void syntheticDcm(size_t i, double *dcm)
+{
+    double t = (double)i * BENCHMARK_CADENCE_SECONDS / 86400.0;
+    double angle = (0.3 + 0.2 * sin(2.0 * M_PI * t / 27.0)) * M_PI / 180.0;
+    double axis[3] = {cos(t), sin(t), 0.2};
+    double length = sqrt(axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2]);
+    double q[4] = {cos(angle / 2.0), 0.0, 0.0, 0.0};
+    for (int m = 0; m < 3; m++)
+        q[m + 1] = sin(angle / 2.0) * axis[m] / length;
+
+    quaternionToDcm(q, dcm);
+
+    return;
+}
+
+static double peakResidentMegabytes(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    // Linux reports kilobytes
+    return (double)usage.ru_maxrss / 1024.0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 2)
+    {
+        fprintf(stderr, "Usage: %s [days]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    int days = argc == 2 ? atoi(argv[1]) : BENCHMARK_DAYS;
+    if (days < 1)
+    {
+        fprintf(stderr, "Number of days must be at least 1.\n");
+        return EXIT_FAILURE;
+    }
+
+    size_t imagesPerFile = 3600 / BENCHMARK_CADENCE_SECONDS;
+    size_t nImages = (size_t)days * 24 * imagesPerFile;
+    double dcm[9] = {0.0};
+    double startRss = peakResidentMegabytes();
+
+    ProgramState *state = calloc(1, sizeof *state);
+    if (state == NULL)
+        return EXIT_FAILURE;
+
+    double t0 = monotonicSeconds();
+    for (size_t first = 0; first < nImages; first += imagesPerFile)
+    {
+        if (resizeImageArrays(state, first + imagesPerFile) != ASCC_OK)
+        {
+            fprintf(stderr, "Out of memory after %zu images.\n", first);
+            return EXIT_FAILURE;
+        }
+        for (size_t i = first; i < first + imagesPerFile; i++)
+        {
+            syntheticDcm(i, dcm);
+            state->imageTimes[i] = J200EPOCH + 1000.0 * BENCHMARK_CADENCE_SECONDS * (double)i;
+            storeAttitudeQuaternion(dcm, &state->attitudeQuaternions[i * 4]);
+            state->nCalibrationStarsUsed[i] = N_CALIBRATION_STARS;
+            state->attitudeInterpolated[i] = 0;
+        }
+        state->nImages = first + imagesPerFile;
+    }
+    double storeSeconds = monotonicSeconds() - t0;
+    double analysisRss = peakResidentMegabytes();
+
+    // Export path: expand a block at a time and compare with the original DCMs
+    float dcms[EXPORT_ATTITUDE_BLOCK_RECORDS * 9];
+    float axes[EXPORT_ATTITUDE_BLOCK_RECORDS * 3];
+    float angles[EXPORT_ATTITUDE_BLOCK_RECORDS];
+    double maxDcmError = 0.0;
+    t0 = monotonicSeconds();
+    for (size_t first = 0; first < state->nImages; first += EXPORT_ATTITUDE_BLOCK_RECORDS)
+    {
+        size_t n = state->nImages - first < EXPORT_ATTITUDE_BLOCK_RECORDS ? state->nImages - first : EXPORT_ATTITUDE_BLOCK_RECORDS;
+        for (size_t i = 0; i < n; i++)
+            expandAttitudeQuaternion(&state->attitudeQuaternions[(first + i) * 4], &dcms[i * 9], &axes[i * 3], &angles[i]);
+        syntheticDcm(first + n - 1, dcm);
+        for (int m = 0; m < 9; m++)
+            maxDcmError = fmax(maxDcmError, fabs(dcms[(n - 1) * 9 + m] - dcm[m]));
+    }
+    double expandSeconds = monotonicSeconds() - t0;
+
+    size_t bytesPerImage = sizeof(double) + 4 * sizeof(float) + sizeof(uint16_t) + sizeof(uint8_t);
+    // Time, DCM, rotation axis and angle, star count, interpolation flag
+    size_t previousBytesPerImage = sizeof(double) + 13 * sizeof(float) + sizeof(uint16_t) + sizeof(uint8_t);
+
+    printf("Synthetic run: %d days, %zu images\n", days, nImages);
+    printf("Per-image results: %zu bytes per image, %.1f MB (DCM, axis and angle storage: %zu bytes per image, %.1f MB)\n", bytesPerImage, (double)(bytesPerImage * nImages) / 1e6, previousBytesPerImage, (double)(previousBytesPerImage * nImages) / 1e6);
+    printf("Peak resident memory: %.1f MB at start, %.1f MB after analysis\n", startRss, analysisRss);
+    printf("Storing attitudes: %.1f ns per image\n", 1e9 * storeSeconds / (double)nImages);
+    printf("Expanding for export: %.1f ns per image, largest DCM element error %.2e (last image of each block)\n", 1e9 * expandSeconds / (double)nImages, maxDcmError);
+
+    free(state->imageTimes);
+    free(state->attitudeQuaternions);
+    free(state->nCalibrationStarsUsed);
+    free(state->attitudeInterpolated);
+    free(state);
+
+    return EXIT_SUCCESS;
+}
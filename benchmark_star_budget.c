@@ -0,0 +1,223 @@
+/*
+
+    AllSkyCameraCal: benchmark_star_budget.c
+
+    Copyright (C) 2022  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// Cost of the per-image star pipeline against the star budget: a synthetic
+// fisheye reference map and catalog, one image with a star at each selected
+// star's nearest pixel, and estimatePointingError() timed for 20 to 1000
+// stars. The reference map search is also timed against a full map scan.
+
+#include "main.h"
+
+#include "analysis.h"
+#include "measure.h"
+#include "pixelindex.h"
+#include "startrack.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+
+#define BENCHMARK_IMAGES 200
+#define BENCHMARK_CATALOG_STARS 6000
+#define BENCHMARK_BACKGROUND 500
+#define BENCHMARK_STAR_PEAK 3000
+
+static const int starBudgets[] = {20, 50, 100, 200, 500, 1000};
+
+// Equidistant fisheye with the horizon 125 pixels from the centre
+static void syntheticReferenceMap(ProgramState *state)
+{
+    for (int c = 0; c < IMAGE_COLUMNS; c++)
+    {
+        for (int r = 0; r < IMAGE_ROWS; r++)
+        {
+            double dc = c - (IMAGE_COLUMNS - 1) / 2.0;
+            double dr = r - (IMAGE_ROWS - 1) / 2.0;
+            double el = 90.0 - hypot(dc, dr) * 90.0 / 125.0;
+            double az = atan2(dc, dr) / M_PI * 180.0;
+            if (el < 0.0)
+            {
+                state->referenceElevations[c][r] = NAN;
+                state->referenceAzimuths[c][r] = NAN;
+                state->pixelX[c][r] = NAN;
+                state->pixelY[c][r] = NAN;
+                state->pixelZ[c][r] = NAN;
+                continue;
+            }
+            state->referenceElevations[c][r] = el;
+            state->referenceAzimuths[c][r] = az;
+            state->pixelX[c][r] = cos((90.0 - az)*M_PI/180.0) * cos(el*M_PI/180.0);
+            state->pixelY[c][r] = sin((90.0 - az)*M_PI/180.0) * cos(el*M_PI/180.0);
+            state->pixelZ[c][r] = sin(el*M_PI/180.0);
+        }
+    }
+
+    return;
+}
+
+// Uniform on the sky, brightest first
+static int syntheticCatalog(ProgramState *state)
+{
+    state->starData = calloc(BENCHMARK_CATALOG_STARS, sizeof *state->starData);
+    if (state->starData == NULL)
+        return ASCC_MEM;
+    state->nStars = BENCHMARK_CATALOG_STARS;
+
+    srand(48);
+    for (int i = 0; i < BENCHMARK_CATALOG_STARS; i++)
+    {
+        Star *star = &state->starData[i];
+        star->catalogNumber = i + 1;
+        star->rightAscensionRadian = 2.0 * M_PI * (rand() / (double)RAND_MAX);
+        star->declinationRadian = asin(2.0 * (rand() / (double)RAND_MAX) - 1.0);
+        star->visualMagnitudeTimes100 = (int16_t)(i * 600 / BENCHMARK_CATALOG_STARS);
+    }
+
+    return ASCC_OK;
+}
+
+static void renderStars(ImageWorkspace *work, int nStars)
+{
+    for (int c = 0; c < IMAGE_COLUMNS; c++)
+        for (int r = 0; r < IMAGE_ROWS; r++)
+            work->imagery[c][r] = BENCHMARK_BACKGROUND;
+
+    for (int i = 0; i < nStars; i++)
+    {
+        CalibrationStar *cal = &work->calStars[i];
+        for (int c = cal->predictedImageColumn - 2; c <= cal->predictedImageColumn + 2; c++)
+        {
+            for (int r = cal->predictedImageRow - 2; r <= cal->predictedImageRow + 2; r++)
+            {
+                if (c < 0 || c >= IMAGE_COLUMNS || r < 0 || r >= IMAGE_ROWS)
+                    continue;
+                double d2 = (c - cal->predictedImageColumn) * (c - cal->predictedImageColumn) + (r - cal->predictedImageRow) * (r - cal->predictedImageRow);
+                double value = work->imagery[c][r] + BENCHMARK_STAR_PEAK * exp(-d2 / 2.0);
+                work->imagery[c][r] = value > MAX_PEAK_SIGNAL_FOR_MOMENTS ? MAX_PEAK_SIGNAL_FOR_MOMENTS : (uint16_t)value;
+            }
+        }
+    }
+
+    return;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 2)
+    {
+        fprintf(stderr, "Usage: %s [images]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    int nImages = argc == 2 ? atoi(argv[1]) : BENCHMARK_IMAGES;
+    if (nImages < 1)
+    {
+        fprintf(stderr, "Number of images must be at least 1.\n");
+        return EXIT_FAILURE;
+    }
+
+    // Several MB of site model arrays: always on the heap
+    ProgramState *state = calloc(1, sizeof *state);
+    if (state == NULL)
+        return EXIT_FAILURE;
+    state->siteLatitudeGeodetic = 62.828;
+    state->siteLongitudeGeodetic = -92.113;
+    state->siteAltitudeMetres = 30.0;
+    state->starSearchBoxWidth = STAR_SEARCH_BOX_WIDTH;
+    state->starMaxJitterPixels = STAR_MAX_PIXEL_JITTER;
+    state->maxBackgroundSignalForMoments = MAX_BACKGROUND_SIGNAL_FOR_MOMENTS;
+    state->maxPeakSignalForMoments = MAX_PEAK_SIGNAL_FOR_MOMENTS;
+    state->decimationStride = 1;
+    syntheticReferenceMap(state);
+    if (syntheticCatalog(state) != ASCC_OK || reserveImageArrays(state, 1) != ASCC_OK || buildReferencePixelIndex(state) != ASCC_OK)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        return EXIT_FAILURE;
+    }
+    state->nImages = 1;
+
+    // Local midnight in winter
+    double imageTime = J200EPOCH + 8000.0 * 86400000.0 + 6.0 * 3600000.0;
+
+    printf("# stars selected fitted usPerImage nsPerStar indexSearchNsPerStar mapScanNsPerStar searchMismatches\n");
+    for (size_t b = 0; b < sizeof starBudgets / sizeof starBudgets[0]; b++)
+    {
+        ImageWorkspace work = {0};
+        state->nCalibrationStars = starBudgets[b];
+        if (allocateImageWorkspace(state, &work) != ASCC_OK)
+        {
+            fprintf(stderr, "Out of memory.\n");
+            return EXIT_FAILURE;
+        }
+
+        // The stars of the image are where the reference map search puts them
+        int nSelected = selectStars(state, imageTime, work.calStars, NULL);
+        int nMismatches = 0;
+        int32_t column = 0;
+        int32_t row = 0;
+        for (int i = 0; i < nSelected; i++)
+        {
+            CalibrationStar *cal = &work.calStars[i];
+            float direction[3] = {cal->predictedAzElX, cal->predictedAzElY, cal->predictedAzElZ};
+            findNearestPixel(state, cal);
+            if (!nearestReferencePixelExhaustive(state, direction, &column, &row) || column != cal->predictedImageColumn || row != cal->predictedImageRow)
+                nMismatches++;
+        }
+        renderStars(&work, nSelected);
+        loadPaddedImage(work.padded, work.imagery, state->sitePixelOffsets);
+
+        double t0 = monotonicSeconds();
+        for (int i = 0; i < nImages; i++)
+            estimatePointingError(state, &work, imageTime, true, 0);
+        double imageSeconds = (monotonicSeconds() - t0) / nImages;
+
+        t0 = monotonicSeconds();
+        for (int n = 0; n < nImages; n++)
+            for (int i = 0; i < nSelected; i++)
+                findNearestPixel(state, &work.calStars[i]);
+        double indexSeconds = (monotonicSeconds() - t0) / nImages;
+
+        t0 = monotonicSeconds();
+        for (int i = 0; i < nSelected; i++)
+        {
+            CalibrationStar *cal = &work.calStars[i];
+            float direction[3] = {cal->predictedAzElX, cal->predictedAzElY, cal->predictedAzElZ};
+            nearestReferencePixelExhaustive(state, direction, &column, &row);
+        }
+        double scanSeconds = monotonicSeconds() - t0;
+
+        int nSelectedStars = nSelected > 0 ? nSelected : 1;
+        printf("%d %d %d %.1f %.1f %.1f %.1f %d\n", starBudgets[b], nSelected, (int)state->nCalibrationStarsUsed[0], 1e6 * imageSeconds, 1e9 * imageSeconds / nSelectedStars, 1e9 * indexSeconds / nSelectedStars, 1e9 * scanSeconds / nSelectedStars, nMismatches);
+
+        freeImageWorkspace(&work);
+    }
+
+    freeReferencePixelIndex(state);
+    freeStarTracks(state);
+    free(state->starData);
+    free(state->imageTimes);
+    free(state->attitudeQuaternions);
+    free(state->nCalibrationStarsUsed);
+    free(state->attitudeInterpolated);
+    free(state);
+
+    return EXIT_SUCCESS;
+}
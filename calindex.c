@@ -0,0 +1,511 @@
+/*
+
+    AllSkyCameraCal: calindex.c
+
+    Copyright (C) 2022  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include "calindex.h"
+
+#include "main.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <cdf.h>
+
+static double epochFromDate(const char *text)
+{
+    long y = 0;
+    long m = 0;
+    long d = 0;
+    for (int i = 0; i < 8; i++)
+        if (text[i] < '0' || text[i] > '9')
+            return ILLEGAL_EPOCH_VALUE;
+    if (sscanf(text, "%4ld%2ld%2ld", &y, &m, &d) != 3)
+        return ILLEGAL_EPOCH_VALUE;
+
+    return computeEPOCH(y, m, d, 0, 0, 0, 0);
+}
+
+// Version number after "_v", 0 if not a number
+static int versionFromName(const char *text)
+{
+    if (strncmp(text, "_v", 2) != 0)
+        return -1;
+
+    return atoi(text + 2);
+}
+
+bool parseCalibrationFilename(const char *name, CalibrationFile *file)
+{
+    if (name == NULL || file == NULL)
+        return false;
+
+    memset(file, 0, sizeof *file);
+    size_t n = strlen(name);
+    if (n == 32 && strncmp(name, "thg_l2_asc_", 11) == 0 && strcmp(name + n - 4, ".cdf") == 0)
+    {
+        // thg_l2_asc_<site>_<yyyymmdd>_v<nn>.cdf
+        file->type = CALIBRATION_L2;
+        memcpy(file->site, name + 11, 4);
+        file->validFrom = name[15] == '_' ? epochFromDate(name + 16) : ILLEGAL_EPOCH_VALUE;
+        file->validUntil = INFINITY;
+        file->version = versionFromName(name + 24);
+    }
+    else if (n >= 34 && strncmp(name, "themis_skymap_", 14) == 0 && strcmp(name + n - 4, ".sav") == 0)
+    {
+        // themis_skymap_<site>_<yyyymmdd>-+_v<nn>.sav or themis_skymap_<site>_<yyyymmdd>-<yyyymmdd>_v<nn>.sav
+        file->type = CALIBRATION_SKYMAP;
+        memcpy(file->site, name + 14, 4);
+        file->validFrom = name[18] == '_' ? epochFromDate(name + 19) : ILLEGAL_EPOCH_VALUE;
+        if (name[27] != '-')
+            return false;
+        if (name[28] == '+')
+        {
+            file->validUntil = INFINITY;
+            file->version = versionFromName(name + 29);
+        }
+        else
+        {
+            double lastDay = n >= 41 ? epochFromDate(name + 28) : ILLEGAL_EPOCH_VALUE;
+            file->validUntil = lastDay == ILLEGAL_EPOCH_VALUE ? ILLEGAL_EPOCH_VALUE : lastDay + 86400000.0;
+            file->version = n >= 41 ? versionFromName(name + 36) : -1;
+        }
+        if (file->validUntil == ILLEGAL_EPOCH_VALUE)
+            return false;
+    }
+    else
+        return false;
+
+    return file->validFrom != ILLEGAL_EPOCH_VALUE && file->version >= 0;
+}
+
+static int compareCalibrationFiles(const void *first, const void *second)
+{
+    const CalibrationFile *a = (const CalibrationFile *)first;
+    const CalibrationFile *b = (const CalibrationFile *)second;
+
+    int c = strcmp(a->site, b->site);
+    if (c != 0)
+        return c;
+    if (a->type != b->type)
+        return a->type < b->type ? -1 : 1;
+    if (a->validFrom != b->validFrom)
+        return a->validFrom < b->validFrom ? -1 : 1;
+    if (a->version != b->version)
+        return a->version < b->version ? -1 : 1;
+
+    return strcmp(a->path, b->path);
+}
+
+static size_t directorySlot(const CalibrationIndex *index, uint64_t device, uint64_t inode)
+{
+    uint64_t key = (device * 0x9e3779b97f4a7c15ULL) ^ inode;
+    size_t slot = (size_t)(key * 0xff51afd7ed558ccdULL) & (index->directoryTableSize - 1);
+    while (index->directoryTable[slot] != 0)
+    {
+        const IndexedDirectory *d = &index->directories[index->directoryTable[slot] - 1];
+        if (d->device == device && d->inode == inode)
+            break;
+        slot = (slot + 1) & (index->directoryTableSize - 1);
+    }
+
+    return slot;
+}
+
+static int rebuildDirectoryTable(CalibrationIndex *index, size_t minimumSize)
+{
+    size_t size = 64;
+    while (size < 2 * minimumSize)
+        size *= 2;
+    free(index->directoryTable);
+    index->directoryTable = calloc(size, sizeof *index->directoryTable);
+    index->directoryTableSize = size;
+    if (index->directoryTable == NULL)
+    {
+        index->directoryTableSize = 0;
+        return ASCC_MEM;
+    }
+    for (size_t d = 0; d < index->nDirectories; d++)
+        if (!index->directories[d].removed)
+            index->directoryTable[directorySlot(index, index->directories[d].device, index->directories[d].inode)] = d + 1;
+
+    return ASCC_OK;
+}
+
+// Adds a directory not yet in the index. It is read at the next update.
+static int addDirectory(CalibrationIndex *index, const char *path, uint64_t device, uint64_t inode, struct timespec modified)
+{
+    if (index->directoryTableSize < 2 * (index->nDirectories + 1))
+    {
+        int status = rebuildDirectoryTable(index, index->nDirectories + 1);
+        if (status != ASCC_OK)
+            return status;
+    }
+    size_t slot = directorySlot(index, device, inode);
+    // Also the end of symbolic link cycles
+    if (index->directoryTable[slot] != 0)
+        return ASCC_OK;
+
+    if (index->nDirectories == index->directoriesSize)
+    {
+        size_t size = index->directoriesSize == 0 ? 64 : 2 * index->directoriesSize;
+        IndexedDirectory *mem = realloc(index->directories, size * sizeof *mem);
+        if (mem == NULL)
+            return ASCC_MEM;
+        index->directories = mem;
+        index->directoriesSize = size;
+    }
+    IndexedDirectory *d = &index->directories[index->nDirectories];
+    memset(d, 0, sizeof *d);
+    d->path = strdup(path);
+    if (d->path == NULL)
+        return ASCC_MEM;
+    d->device = device;
+    d->inode = inode;
+    d->modified = modified;
+    index->directoryTable[slot] = ++index->nDirectories;
+    index->changed = true;
+
+    return ASCC_OK;
+}
+
+static int addFile(CalibrationIndex *index, const char *path, const CalibrationFile *parsed)
+{
+    if (index->nFiles == index->filesSize)
+    {
+        size_t size = index->filesSize == 0 ? 64 : 2 * index->filesSize;
+        CalibrationFile *mem = realloc(index->files, size * sizeof *mem);
+        if (mem == NULL)
+            return ASCC_MEM;
+        index->files = mem;
+        index->filesSize = size;
+    }
+    CalibrationFile *file = &index->files[index->nFiles];
+    *file = *parsed;
+    file->path = strdup(path);
+    if (file->path == NULL)
+        return ASCC_MEM;
+    index->nFiles++;
+    index->changed = true;
+
+    return ASCC_OK;
+}
+
+static bool inDirectory(const char *path, const char *directory)
+{
+    size_t n = strlen(directory);
+
+    return strncmp(path, directory, n) == 0 && path[n] == '/' && strchr(path + n + 1, '/') == NULL;
+}
+
+// Drops the files listed for a directory that was removed or is being reread
+static void removeDirectoryFiles(CalibrationIndex *index, const char *directory)
+{
+    size_t kept = 0;
+    for (size_t f = 0; f < index->nFiles; f++)
+    {
+        if (inDirectory(index->files[f].path, directory))
+        {
+            free(index->files[f].path);
+            index->changed = true;
+        }
+        else
+            index->files[kept++] = index->files[f];
+    }
+    index->nFiles = kept;
+
+    return;
+}
+
+static int readDirectory(CalibrationIndex *index, size_t directoryNumber)
+{
+    DIR *dir = opendir(index->directories[directoryNumber].path);
+    if (dir == NULL)
+        return ASCC_OK;
+
+    int status = ASCC_OK;
+    char path[FILENAME_MAX + 1];
+    struct dirent *entry = NULL;
+    struct stat info;
+    CalibrationFile parsed;
+    while (status == ASCC_OK && (entry = readdir(dir)) != NULL)
+    {
+        if (entry->d_name[0] == '.')
+            continue;
+        bool isDirectory = entry->d_type == DT_DIR;
+        bool maybeDirectory = isDirectory || entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN;
+        bool candidate = parseCalibrationFilename(entry->d_name, &parsed);
+        if (!maybeDirectory && !candidate)
+            continue;
+        // The directory array can move when subdirectories are added
+        snprintf(path, FILENAME_MAX + 1, "%s/%s", index->directories[directoryNumber].path, entry->d_name);
+        if (candidate)
+            status = addFile(index, path, &parsed);
+        else if (stat(path, &info) == 0 && S_ISDIR(info.st_mode))
+        {
+            // Read when the update reaches it
+            struct timespec unread = {0};
+            status = addDirectory(index, path, (uint64_t)info.st_dev, (uint64_t)info.st_ino, unread);
+        }
+    }
+    closedir(dir);
+
+    return status;
+}
+
+static void sortFiles(CalibrationIndex *index)
+{
+    if (index->nFiles > 1)
+        qsort(index->files, index->nFiles, sizeof *index->files, compareCalibrationFiles);
+
+    return;
+}
+
+// Reads a saved index if filename is given and exists. Without a filename the index lives in memory.
+int openCalibrationIndex(CalibrationIndex *index, const char *filename)
+{
+    if (index == NULL)
+        return ASCC_ARGUMENTS;
+
+    memset(index, 0, sizeof *index);
+    if (filename == NULL)
+        return ASCC_OK;
+    index->filename = strdup(filename);
+    if (index->filename == NULL)
+        return ASCC_MEM;
+
+    FILE *f = fopen(filename, "r");
+    if (f == NULL)
+        return ASCC_OK;
+
+    int status = ASCC_OK;
+    char line[FILENAME_MAX + 128];
+    if (fgets(line, sizeof line, f) == NULL || strncmp(line, CALIBRATION_INDEX_HEADER, strlen(CALIBRATION_INDEX_HEADER)) != 0)
+    {
+        // Not an index, or an older one: rebuilt by the first update
+        fclose(f);
+        return ASCC_OK;
+    }
+    CalibrationFile parsed;
+    while (status == ASCC_OK && fgets(line, sizeof line, f) != NULL)
+    {
+        line[strcspn(line, "\n")] = '\0';
+        unsigned long long device = 0;
+        unsigned long long inode = 0;
+        long long seconds = 0;
+        long nanoseconds = 0;
+        int pathStart = 0;
+        if (line[0] == 'D' && sscanf(line, "D %llu %llu %lld %ld %n", &device, &inode, &seconds, &nanoseconds, &pathStart) == 4 && pathStart > 0)
+        {
+            struct timespec modified = {.tv_sec = (time_t)seconds, .tv_nsec = nanoseconds};
+            status = addDirectory(index, line + pathStart, device, inode, modified);
+        }
+        else if (strncmp(line, "F ", 2) == 0)
+        {
+            const char *name = strrchr(line + 2, '/');
+            if (parseCalibrationFilename(name != NULL ? name + 1 : line + 2, &parsed))
+                status = addFile(index, line + 2, &parsed);
+        }
+    }
+    fclose(f);
+    sortFiles(index);
+    index->changed = false;
+
+    return status;
+}
+
+// Adds root if new, then rereads each directory whose modification time
+// changed. New files and subdirectories change their parent's
+// modification time, so unchanged directories need only a stat.
+int updateCalibrationIndex(CalibrationIndex *index, const char *root)
+{
+    if (index == NULL || root == NULL)
+        return ASCC_ARGUMENTS;
+
+    struct stat info;
+    if (stat(root, &info) != 0 || !S_ISDIR(info.st_mode))
+        return ASCC_ARGUMENTS;
+    struct timespec unread = {0};
+    int status = addDirectory(index, root, (uint64_t)info.st_dev, (uint64_t)info.st_ino, unread);
+
+    bool removedDirectories = false;
+    for (size_t d = 0; d < index->nDirectories && status == ASCC_OK; d++)
+    {
+        IndexedDirectory *directory = &index->directories[d];
+        if (directory->removed)
+            continue;
+        if (stat(directory->path, &info) != 0 || !S_ISDIR(info.st_mode) || (uint64_t)info.st_ino != directory->inode)
+        {
+            removeDirectoryFiles(index, directory->path);
+            directory->removed = true;
+            removedDirectories = true;
+            index->changed = true;
+            continue;
+        }
+        if (info.st_mtim.tv_sec == directory->modified.tv_sec && info.st_mtim.tv_nsec == directory->modified.tv_nsec)
+            continue;
+        if (directory->modified.tv_sec != 0 || directory->modified.tv_nsec != 0)
+            removeDirectoryFiles(index, directory->path);
+        directory->modified = info.st_mtim;
+        index->changed = true;
+        status = readDirectory(index, d);
+    }
+
+    if (removedDirectories && status == ASCC_OK)
+    {
+        size_t kept = 0;
+        for (size_t d = 0; d < index->nDirectories; d++)
+        {
+            if (index->directories[d].removed)
+                free(index->directories[d].path);
+            else
+                index->directories[kept++] = index->directories[d];
+        }
+        index->nDirectories = kept;
+        status = rebuildDirectoryTable(index, kept);
+    }
+
+    if (index->changed)
+        sortFiles(index);
+
+    return status;
+}
+
+int saveCalibrationIndex(CalibrationIndex *index)
+{
+    if (index == NULL)
+        return ASCC_ARGUMENTS;
+    if (index->filename == NULL || !index->changed)
+        return ASCC_OK;
+
+    char tmpFilename[FILENAME_MAX + 1];
+    snprintf(tmpFilename, FILENAME_MAX, "%s.tmp.%ld", index->filename, (long)getpid());
+    FILE *f = fopen(tmpFilename, "w");
+    if (f == NULL)
+        return ASCC_CALIBRATION_INDEX;
+
+    bool written = fprintf(f, "%s\n", CALIBRATION_INDEX_HEADER) > 0;
+    for (size_t d = 0; d < index->nDirectories && written; d++)
+    {
+        const IndexedDirectory *directory = &index->directories[d];
+        written = fprintf(f, "D %llu %llu %lld %ld %s\n", (unsigned long long)directory->device, (unsigned long long)directory->inode, (long long)directory->modified.tv_sec, (long)directory->modified.tv_nsec, directory->path) > 0;
+    }
+    for (size_t i = 0; i < index->nFiles && written; i++)
+        written = fprintf(f, "F %s\n", index->files[i].path) > 0;
+    if (fclose(f) != 0)
+        written = false;
+
+    if (!written || rename(tmpFilename, index->filename) != 0)
+    {
+        remove(tmpFilename);
+        return ASCC_CALIBRATION_INDEX;
+    }
+    index->changed = false;
+
+    return ASCC_OK;
+}
+
+// Path under which the index lists the files of directory, which may differ
+// from the path given, e.g. for a subdirectory of an earlier root
+const char *indexedDirectoryPath(const CalibrationIndex *index, const char *directory)
+{
+    struct stat info;
+    if (index == NULL || directory == NULL || index->directoryTableSize == 0 || stat(directory, &info) != 0)
+        return directory;
+
+    size_t d = index->directoryTable[directorySlot(index, (uint64_t)info.st_dev, (uint64_t)info.st_ino)];
+
+    return d == 0 ? directory : index->directories[d - 1].path;
+}
+
+static bool underRoot(const char *path, const char *root)
+{
+    if (root == NULL)
+        return true;
+    size_t n = strlen(root);
+
+    return strncmp(path, root, n) == 0 && (path[n] == '/' || (n > 0 && root[n - 1] == '/'));
+}
+
+// The file of the given site and type with the latest start of validity
+// not after epoch, and the highest version for that start. A NAN epoch
+// selects the latest file. root, if not NULL, restricts the search to files
+// under that directory. Returns NULL if no file applies at epoch.
+const CalibrationFile *bestCalibrationFile(const CalibrationIndex *index, const char *site, int type, double epoch, const char *root)
+{
+    if (index == NULL || site == NULL || index->nFiles == 0)
+        return NULL;
+
+    CalibrationFile key = {0};
+    snprintf(key.site, sizeof key.site, "%s", site);
+    key.type = type;
+    key.validFrom = isnan(epoch) ? INFINITY : epoch;
+    key.version = INT32_MAX;
+    key.path = "\xff";
+
+    // First file ordered after the key
+    size_t low = 0;
+    size_t high = index->nFiles;
+    while (low < high)
+    {
+        size_t mid = low + (high - low) / 2;
+        if (compareCalibrationFiles(&index->files[mid], &key) <= 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    // Back to the best file of this site and type, skipping files outside root
+    for (size_t f = low; f > 0; f--)
+    {
+        const CalibrationFile *file = &index->files[f - 1];
+        if (strcmp(file->site, key.site) != 0 || file->type != type)
+            return NULL;
+        if (!underRoot(file->path, root))
+            continue;
+        if (!isnan(epoch) && epoch >= file->validUntil)
+            return NULL;
+        return file;
+    }
+
+    return NULL;
+}
+
+void freeCalibrationIndex(CalibrationIndex *index)
+{
+    if (index == NULL)
+        return;
+
+    for (size_t d = 0; d < index->nDirectories; d++)
+        free(index->directories[d].path);
+    for (size_t f = 0; f < index->nFiles; f++)
+        free(index->files[f].path);
+    free(index->directories);
+    free(index->directoryTable);
+    free(index->files);
+    free(index->filename);
+    memset(index, 0, sizeof *index);
+
+    return;
+}
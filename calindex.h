@@ -0,0 +1,87 @@
+/*
+
+    AllSkyCameraCal: calindex.h
+
+    Copyright (C) 2022  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef _CALINDEX_H
+#define _CALINDEX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define CALIBRATION_INDEX_HEADER "# AllSkyCameraCal calibration index 1"
+
+enum CALIBRATION_FILE_TYPE
+{
+    CALIBRATION_L2 = 0,
+    CALIBRATION_SKYMAP = 1
+};
+
+// An L2 CDF (thg_l2_asc_<site>_<yyyymmdd>_v<nn>.cdf) or IDL skymap
+// (themis_skymap_<site>_<yyyymmdd>-+_v<nn>.sav, or with a closing
+// <yyyymmdd> in place of "+") and the CDF_EPOCH interval it applies to
+typedef struct CalibrationFile
+{
+    char site[5];
+    int type;
+    double validFrom;
+    // INFINITY for files without an end date
+    double validUntil;
+    int version;
+    char *path;
+} CalibrationFile;
+
+typedef struct IndexedDirectory
+{
+    char *path;
+    uint64_t device;
+    uint64_t inode;
+    struct timespec modified;
+    bool removed;
+} IndexedDirectory;
+
+// Calibration files of every directory tree the index has been updated
+// with, sorted by site, type, validFrom and version. A directory's files
+// are reread only when its modification time changes.
+typedef struct CalibrationIndex
+{
+    char *filename;
+    IndexedDirectory *directories;
+    size_t nDirectories;
+    size_t directoriesSize;
+    // Directory number + 1 by device and inode, 0 for empty slots
+    size_t *directoryTable;
+    size_t directoryTableSize;
+    CalibrationFile *files;
+    size_t nFiles;
+    size_t filesSize;
+    bool changed;
+} CalibrationIndex;
+
+bool parseCalibrationFilename(const char *name, CalibrationFile *file);
+int openCalibrationIndex(CalibrationIndex *index, const char *filename);
+int updateCalibrationIndex(CalibrationIndex *index, const char *root);
+int saveCalibrationIndex(CalibrationIndex *index);
+const char *indexedDirectoryPath(const CalibrationIndex *index, const char *directory);
+const CalibrationFile *bestCalibrationFile(const CalibrationIndex *index, const char *site, int type, double epoch, const char *root);
+void freeCalibrationIndex(CalibrationIndex *index);
+
+#endif // _CALINDEX_H
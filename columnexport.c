@@ -0,0 +1,302 @@
+/*
+
+    AllSkyCameraCal: columnexport.c
+
+    Copyright (C) 2022  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include "columnexport.h"
+#include "columnfile.h"
+#include "main.h"
+#include "attitude.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define COLUMN_EXPORT_SWAP_BYTES 1
+#else
+#define COLUMN_EXPORT_SWAP_BYTES 0
+#endif
+
+// Fills records first to first + n - 1 of a column that is not stored as is
+typedef void (*ColumnFill)(const ProgramState *state, size_t first, size_t n, void *out);
+
+typedef struct ColumnSource
+{
+    ColumnFileEntry entry;
+    size_t nElements;
+    const void *data;
+    ColumnFill fill;
+} ColumnSource;
+
+static void swapElements(void *data, size_t elementBytes, size_t nElements)
+{
+    if (!COLUMN_EXPORT_SWAP_BYTES || elementBytes == 1)
+        return;
+
+    uint8_t *bytes = (uint8_t*)data;
+    for (size_t e = 0; e < nElements; e++, bytes += elementBytes)
+        for (size_t b = 0; b < elementBytes / 2; b++)
+        {
+            uint8_t tmp = bytes[b];
+            bytes[b] = bytes[elementBytes - 1 - b];
+            bytes[elementBytes - 1 - b] = tmp;
+        }
+
+    return;
+}
+
+#define SWAP_FIELD(field) swapElements(&(field), sizeof (field), 1)
+
+static int writeLittleEndian(FILE *file, const void *data, size_t elementBytes, size_t nElements)
+{
+    if (!COLUMN_EXPORT_SWAP_BYTES || elementBytes == 1)
+        return fwrite(data, elementBytes, nElements, file) == nElements ? ASCC_OK : ASCC_COLUMN_EXPORT;
+
+    uint8_t buffer[65536];
+    size_t perChunk = sizeof buffer / elementBytes;
+    const uint8_t *bytes = (const uint8_t*)data;
+    for (size_t first = 0; first < nElements; first += perChunk)
+    {
+        size_t n = nElements - first < perChunk ? nElements - first : perChunk;
+        memcpy(buffer, bytes + first * elementBytes, n * elementBytes);
+        swapElements(buffer, elementBytes, n);
+        if (fwrite(buffer, elementBytes, n, file) != n)
+            return ASCC_COLUMN_EXPORT;
+    }
+
+    return ASCC_OK;
+}
+
+static void fillDcms(const ProgramState *state, size_t first, size_t n, void *out)
+{
+    float axis[3];
+    float angle;
+    for (size_t i = 0; i < n; i++)
+        expandAttitudeQuaternion(&state->attitudeQuaternions[(first + i) * 4], (float*)out + i * 9, axis, &angle);
+
+    return;
+}
+
+static void fillAxes(const ProgramState *state, size_t first, size_t n, void *out)
+{
+    float dcm[9];
+    float angle;
+    for (size_t i = 0; i < n; i++)
+        expandAttitudeQuaternion(&state->attitudeQuaternions[(first + i) * 4], dcm, (float*)out + i * 3, &angle);
+
+    return;
+}
+
+static void fillAngles(const ProgramState *state, size_t first, size_t n, void *out)
+{
+    float dcm[9];
+    float axis[3];
+    for (size_t i = 0; i < n; i++)
+        expandAttitudeQuaternion(&state->attitudeQuaternions[(first + i) * 4], dcm, axis, (float*)out + i);
+
+    return;
+}
+
+static void addColumn(ColumnSource *columns, uint32_t *nColumns, const char *name, uint32_t dataType, uint32_t elementBytes, uint32_t dim0, uint32_t dim1, size_t nRecords, bool recordVarying, const void *data, ColumnFill fill)
+{
+    ColumnSource *column = &columns[(*nColumns)++];
+    memset(column, 0, sizeof *column);
+    snprintf(column->entry.name, COLUMN_FILE_NAME_LEN, "%s", name);
+    column->entry.dataType = dataType;
+    column->entry.elementBytes = elementBytes;
+    column->entry.nDims = (dim0 > 1) + (dim1 > 1);
+    column->entry.dimSizes[0] = dim0;
+    column->entry.dimSizes[1] = dim1;
+    column->entry.recordVarying = recordVarying;
+    column->nElements = (size_t)dim0 * dim1 * nRecords;
+    column->entry.bytes = column->nElements * elementBytes;
+    column->data = data;
+    column->fill = fill;
+
+    return;
+}
+
+static uint64_t alignOffset(uint64_t offset)
+{
+    return (offset + COLUMN_FILE_ALIGNMENT - 1) / COLUMN_FILE_ALIGNMENT * COLUMN_FILE_ALIGNMENT;
+}
+
+static int writeColumn(FILE *file, const ProgramState *state, const ColumnSource *column)
+{
+    if (column->entry.bytes == 0)
+        return ASCC_OK;
+    if (column->fill == NULL)
+        return writeLittleEndian(file, column->data, column->entry.elementBytes, column->nElements);
+
+    // Per-image column expanded a block of records at a time
+    size_t elementsPerRecord = (size_t)column->entry.dimSizes[0] * column->entry.dimSizes[1];
+    uint8_t *buffer = malloc(COLUMN_EXPORT_BLOCK_RECORDS * elementsPerRecord * column->entry.elementBytes);
+    if (buffer == NULL)
+        return ASCC_MEM;
+
+    int status = ASCC_OK;
+    for (size_t first = 0; first < state->nImages && status == ASCC_OK; first += COLUMN_EXPORT_BLOCK_RECORDS)
+    {
+        size_t n = state->nImages - first < COLUMN_EXPORT_BLOCK_RECORDS ? state->nImages - first : COLUMN_EXPORT_BLOCK_RECORDS;
+        column->fill(state, first, n, buffer);
+        status = writeLittleEndian(file, buffer, column->entry.elementBytes, n * elementsPerRecord);
+    }
+    free(buffer);
+
+    return status;
+}
+
+// Writes the variables of the calibration CDF as an uncompressed columnar
+// file next to it, with the CDF's extension replaced by COLUMN_FILE_EXTENSION.
+// Call after exportCdf().
+int exportColumns(ProgramState *state)
+{
+    if (state == NULL)
+        return ASCC_ARGUMENTS;
+    if (state->nImages == 0)
+        return ASCC_CDF_EXPORT_NO_DATA;
+
+    size_t baseLength = strlen(state->cdfFullFilename);
+    if (baseLength > 4 && strcmp(state->cdfFullFilename + baseLength - 4, ".cdf") == 0)
+        baseLength -= 4;
+    snprintf(state->columnFilename, FILENAME_MAX, "%.*s%s", (int)baseLength, state->cdfFullFilename, COLUMN_FILE_EXTENSION);
+    if (access(state->columnFilename, F_OK) == 0 && !state->overwriteCdf)
+    {
+        fprintf(stderr, "%s exists. Use --overwrite-cdf to replace it.\n", state->columnFilename);
+        return ASCC_COLUMN_EXPORT;
+    }
+
+    // Same names, types and shapes as the CDF variables
+    ColumnSource columns[COLUMN_EXPORT_MAX_COLUMNS];
+    uint32_t nColumns = 0;
+    size_t n = state->nImages;
+    addColumn(columns, &nColumns, "Timestamp", COLUMN_FILE_EPOCH, sizeof(double), 1, 1, n, true, state->imageTimes, NULL);
+    addColumn(columns, &nColumns, "AttitudeQuaternion", COLUMN_FILE_REAL4, sizeof(float), 4, 1, n, true, state->attitudeQuaternions, NULL);
+    addColumn(columns, &nColumns, "PointingErrorDCM", COLUMN_FILE_REAL4, sizeof(float), 3, 3, n, true, NULL, fillDcms);
+    addColumn(columns, &nColumns, "RotationAxis", COLUMN_FILE_REAL4, sizeof(float), 3, 1, n, true, NULL, fillAxes);
+    addColumn(columns, &nColumns, "RotationAngle", COLUMN_FILE_REAL4, sizeof(float), 1, 1, n, true, NULL, fillAngles);
+    addColumn(columns, &nColumns, "CalibrationStarCount", COLUMN_FILE_UINT2, sizeof(uint16_t), 1, 1, n, true, state->nCalibrationStarsUsed, NULL);
+    addColumn(columns, &nColumns, "AttitudeInterpolated", COLUMN_FILE_UINT1, sizeof(uint8_t), 1, 1, n, true, state->attitudeInterpolated, NULL);
+    addColumn(columns, &nColumns, "SiteAbbreviation", COLUMN_FILE_CHAR, strlen(state->site), 1, 1, 1, false, state->site, NULL);
+    addColumn(columns, &nColumns, "SiteLatitude", COLUMN_FILE_REAL4, sizeof(float), 1, 1, 1, false, &state->siteLatitudeGeodetic, NULL);
+    addColumn(columns, &nColumns, "SiteLongitude", COLUMN_FILE_REAL4, sizeof(float), 1, 1, 1, false, &state->siteLongitudeGeodetic, NULL);
+    addColumn(columns, &nColumns, "SiteAltitude", COLUMN_FILE_REAL4, sizeof(float), 1, 1, 1, false, &state->siteAltitudeMetres, NULL);
+    if (state->calibrationDateGenerated != NULL)
+        addColumn(columns, &nColumns, "ReferenceDateGenerated", COLUMN_FILE_CHAR, strlen(state->calibrationDateGenerated), 1, 1, 1, false, state->calibrationDateGenerated, NULL);
+    if (state->calibrationDateUsed != NULL)
+        addColumn(columns, &nColumns, "ReferenceDateUsed", COLUMN_FILE_CHAR, strlen(state->calibrationDateUsed), 1, 1, 1, false, state->calibrationDateUsed, NULL);
+    addColumn(columns, &nColumns, "CCDOffsets", COLUMN_FILE_UINT2, sizeof(uint16_t), IMAGE_COLUMNS, IMAGE_ROWS, 1, false, state->sitePixelOffsets, NULL);
+    addColumn(columns, &nColumns, "ReferenceElevations", COLUMN_FILE_REAL4, sizeof(float), IMAGE_COLUMNS, IMAGE_ROWS, 1, false, state->referenceElevations, NULL);
+    addColumn(columns, &nColumns, "ReferenceAzimuths", COLUMN_FILE_REAL4, sizeof(float), IMAGE_COLUMNS, IMAGE_ROWS, 1, false, state->referenceAzimuths, NULL);
+    addColumn(columns, &nColumns, "CalibrationEpoch", COLUMN_FILE_EPOCH, sizeof(double), 1, 1, 1, false, &state->calibratedEpoch, NULL);
+    addColumn(columns, &nColumns, "CalibratedElevations", COLUMN_FILE_REAL4, sizeof(float), IMAGE_COLUMNS, IMAGE_ROWS, 1, false, state->calibratedElevations, NULL);
+    addColumn(columns, &nColumns, "CalibratedAzimuths", COLUMN_FILE_REAL4, sizeof(float), IMAGE_COLUMNS, IMAGE_ROWS, 1, false, state->calibratedAzimuths, NULL);
+
+    float globalDcm[9];
+    uint32_t nGlobalObservationsUsed = (uint32_t)state->nGlobalFitObservationsUsed;
+    if (state->globalFitSolved)
+    {
+        for (int m = 0; m < 9; m++)
+            globalDcm[m] = (float)state->globalDcm[m];
+        addColumn(columns, &nColumns, "GlobalCalibratedElevations", COLUMN_FILE_REAL4, sizeof(float), IMAGE_COLUMNS, IMAGE_ROWS, 1, false, state->globalCalibratedElevations, NULL);
+        addColumn(columns, &nColumns, "GlobalCalibratedAzimuths", COLUMN_FILE_REAL4, sizeof(float), IMAGE_COLUMNS, IMAGE_ROWS, 1, false, state->globalCalibratedAzimuths, NULL);
+        addColumn(columns, &nColumns, "GlobalPointingErrorDCM", COLUMN_FILE_REAL4, sizeof(float), 3, 3, 1, false, globalDcm, NULL);
+        addColumn(columns, &nColumns, "GlobalRadialDistortion", COLUMN_FILE_REAL8, sizeof(double), 2, 1, 1, false, state->globalRadialDistortion, NULL);
+        addColumn(columns, &nColumns, "GlobalFitResidualRms", COLUMN_FILE_REAL4, sizeof(float), 1, 1, 1, false, &state->globalFitResidualRms, NULL);
+        addColumn(columns, &nColumns, "GlobalFitObservationCount", COLUMN_FILE_UINT4, sizeof(uint32_t), 1, 1, 1, false, &nGlobalObservationsUsed, NULL);
+    }
+
+    ColumnFileHeader header = {0};
+    memcpy(header.magic, COLUMN_FILE_MAGIC, sizeof COLUMN_FILE_MAGIC);
+    header.version = COLUMN_FILE_VERSION;
+    header.flags = COLUMN_FILE_TIME_SORTED;
+    for (size_t i = 1; i < state->nImages; i++)
+        if (!(state->imageTimes[i] >= state->imageTimes[i-1]))
+            header.flags &= ~COLUMN_FILE_TIME_SORTED;
+    header.nRecords = state->nImages;
+    header.nColumns = nColumns;
+    header.alignment = COLUMN_FILE_ALIGNMENT;
+    snprintf(header.site, sizeof header.site, "%s", state->site);
+    header.firstTime = state->firstCalTime;
+    header.lastTime = state->lastCalTime;
+
+    uint64_t offset = sizeof header + nColumns * sizeof(ColumnFileEntry);
+    for (uint32_t c = 0; c < nColumns; c++)
+    {
+        offset = alignOffset(offset);
+        columns[c].entry.offset = offset;
+        offset += columns[c].entry.bytes;
+    }
+    header.fileBytes = offset;
+
+    // Readers never see a partial file
+    char tmpFilename[FILENAME_MAX];
+    snprintf(tmpFilename, FILENAME_MAX, "%s.tmp", state->columnFilename);
+    FILE *file = fopen(tmpFilename, "wb");
+    if (file == NULL)
+        return ASCC_COLUMN_EXPORT;
+
+    int status = ASCC_OK;
+    ColumnFileHeader fileHeader = header;
+    SWAP_FIELD(fileHeader.version);
+    SWAP_FIELD(fileHeader.flags);
+    SWAP_FIELD(fileHeader.nRecords);
+    SWAP_FIELD(fileHeader.fileBytes);
+    SWAP_FIELD(fileHeader.nColumns);
+    SWAP_FIELD(fileHeader.alignment);
+    SWAP_FIELD(fileHeader.firstTime);
+    SWAP_FIELD(fileHeader.lastTime);
+    if (fwrite(&fileHeader, sizeof fileHeader, 1, file) != 1)
+        status = ASCC_COLUMN_EXPORT;
+    for (uint32_t c = 0; c < nColumns && status == ASCC_OK; c++)
+    {
+        ColumnFileEntry entry = columns[c].entry;
+        SWAP_FIELD(entry.dataType);
+        SWAP_FIELD(entry.elementBytes);
+        SWAP_FIELD(entry.nDims);
+        SWAP_FIELD(entry.dimSizes[0]);
+        SWAP_FIELD(entry.dimSizes[1]);
+        SWAP_FIELD(entry.recordVarying);
+        SWAP_FIELD(entry.offset);
+        SWAP_FIELD(entry.bytes);
+        if (fwrite(&entry, sizeof entry, 1, file) != 1)
+            status = ASCC_COLUMN_EXPORT;
+    }
+
+    static const uint8_t padding[COLUMN_FILE_ALIGNMENT] = {0};
+    for (uint32_t c = 0; c < nColumns && status == ASCC_OK; c++)
+    {
+        long position = ftell(file);
+        if (position < 0 || (uint64_t)position > columns[c].entry.offset || fwrite(padding, 1, columns[c].entry.offset - (uint64_t)position, file) != columns[c].entry.offset - (uint64_t)position)
+            status = ASCC_COLUMN_EXPORT;
+        else
+            status = writeColumn(file, state, &columns[c]);
+    }
+
+    if (fclose(file) != 0 && status == ASCC_OK)
+        status = ASCC_COLUMN_EXPORT;
+    if (status == ASCC_OK && rename(tmpFilename, state->columnFilename) != 0)
+        status = ASCC_COLUMN_EXPORT;
+    if (status != ASCC_OK)
+        remove(tmpFilename);
+
+    return status;
+}
@@ -0,0 +1,35 @@
+/*
+
+    AllSkyCameraCal: columnexport.h
+
+    Copyright (C) 2022  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef _COLUMNEXPORT_H
+#define _COLUMNEXPORT_H
+
+#include "main.h"
+#include "columnfile.h"
+
+#define COLUMN_FILE_EXTENSION ".asccol"
+// Attitude records expanded from quaternions per write
+#define COLUMN_EXPORT_BLOCK_RECORDS 4096
+#define COLUMN_EXPORT_MAX_COLUMNS 32
+
+int exportColumns(ProgramState *state);
+
+#endif // _COLUMNEXPORT_H
@@ -0,0 +1,89 @@
+/*
+
+    AllSkyCameraCal: columnfile.h
+
+    Copyright (C) 2022  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+// Layout of the columnar export (--export-columns). The file is uncompressed
+// and little-endian: a ColumnFileHeader, nColumns ColumnFileEntry records,
+// then each column at a COLUMN_FILE_ALIGNMENT aligned offset. Columns are the
+// variables of the calibration CDF under the same names and types, plus
+// AttitudeQuaternion. Per-image columns have nRecords records; the others
+// have one. A reader can mmap the file and use the columns in place.
+
+#ifndef _COLUMNFILE_H
+#define _COLUMNFILE_H
+
+#include <stdint.h>
+
+#define COLUMN_FILE_MAGIC "ASCCCOL"
+#define COLUMN_FILE_VERSION 1
+#define COLUMN_FILE_ALIGNMENT 64
+#define COLUMN_FILE_NAME_LEN 48
+
+// Timestamp is in non-decreasing order and can be binary searched
+#define COLUMN_FILE_TIME_SORTED 0x1
+
+// Data type codes are the CDF data type numbers
+enum COLUMN_FILE_TYPE
+{
+    COLUMN_FILE_UINT1 = 11,
+    COLUMN_FILE_UINT2 = 12,
+    COLUMN_FILE_UINT4 = 14,
+    COLUMN_FILE_REAL4 = 21,
+    COLUMN_FILE_REAL8 = 22,
+    COLUMN_FILE_EPOCH = 31,
+    COLUMN_FILE_CHAR = 51
+};
+
+typedef struct ColumnFileHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    uint64_t nRecords;
+    uint64_t fileBytes;
+    uint32_t nColumns;
+    uint32_t alignment;
+    char site[8];
+    // CDF_EPOCH milliseconds of the start and end of the calibration
+    // interval, as in the CDF file name; image times are in the Timestamp column
+    double firstTime;
+    double lastTime;
+} ColumnFileHeader;
+
+typedef struct ColumnFileEntry
+{
+    char name[COLUMN_FILE_NAME_LEN];
+    uint32_t dataType;
+    // Size of one element, or the string length for COLUMN_FILE_CHAR
+    uint32_t elementBytes;
+    // 0 for scalars. Unused sizes are 1, so a record has
+    // dimSizes[0] * dimSizes[1] elements.
+    uint32_t nDims;
+    uint32_t dimSizes[2];
+    uint32_t recordVarying;
+    uint64_t offset;
+    uint64_t bytes;
+    uint64_t reserved;
+} ColumnFileEntry;
+
+_Static_assert(sizeof(ColumnFileHeader) == 64, "column file header must be 64 bytes");
+_Static_assert(sizeof(ColumnFileEntry) == 96, "column file entry must be 96 bytes");
+
+#endif // _COLUMNFILE_H
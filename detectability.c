@@ -0,0 +1,298 @@
+/*
+
+    AllSkyCameraCal: detectability.c
+
+    Copyright (C) 2022  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "detectability.h"
+
+#include "main.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+// Upper edges of the elevation bands, absolute elevation in degrees; the
+// lowest band starts at CALIBRATION_ELEVATION_BOUND
+static const float bandTops[STAR_DETECTABILITY_ELEVATION_BANDS - 1] = {35.0, 50.0, 70.0};
+
+static void starDetectabilityFilename(ProgramState *state, char *filename)
+{
+    snprintf(filename, FILENAME_MAX, "%s/themis_%s_star_detectability%s", state->starDetectabilityDir, state->site, STAR_DETECTABILITY_EXTENSION);
+
+    return;
+}
+
+static inline size_t entrySlot(const StarDetectability *table, long catalogIndex, uint8_t skyRegion)
+{
+    uint32_t key = (uint32_t)catalogIndex * (STAR_DETECTABILITY_AZIMUTH_SECTORS * STAR_DETECTABILITY_ELEVATION_BANDS) + skyRegion;
+
+    // Fibonacci hashing; capacity is a power of 2
+    return (size_t)(key * 2654435769U) & (table->capacity - 1);
+}
+
+static StarDetectabilityEntry *findEntry(const StarDetectability *table, long catalogIndex, uint8_t skyRegion)
+{
+    size_t slot = entrySlot(table, catalogIndex, skyRegion);
+    StarDetectabilityEntry *entry = NULL;
+    for (;;)
+    {
+        entry = &table->entries[slot];
+        if (entry->catalogIndex < 0 || (entry->catalogIndex == catalogIndex && entry->skyRegion == skyRegion))
+            return entry;
+        slot = (slot + 1) & (table->capacity - 1);
+    }
+}
+
+static int allocateEntries(StarDetectability *table, size_t capacity)
+{
+    StarDetectabilityEntry *entries = malloc(capacity * sizeof *entries);
+    if (entries == NULL)
+        return ASCC_MEM;
+    for (size_t i = 0; i < capacity; i++)
+    {
+        memset(&entries[i], 0, sizeof entries[i]);
+        entries[i].catalogIndex = -1;
+    }
+    table->entries = entries;
+    table->capacity = capacity;
+    table->nEntries = 0;
+
+    return ASCC_OK;
+}
+
+// Copies entry into the table, growing it to stay at most half full
+static int insertEntry(StarDetectability *table, const StarDetectabilityEntry *entry)
+{
+    if (2 * (table->nEntries + 1) > table->capacity)
+    {
+        StarDetectabilityEntry *old = table->entries;
+        size_t oldCapacity = table->capacity;
+        if (allocateEntries(table, 2 * oldCapacity) != ASCC_OK)
+        {
+            table->entries = old;
+            table->capacity = oldCapacity;
+            return ASCC_MEM;
+        }
+        for (size_t i = 0; i < oldCapacity; i++)
+        {
+            if (old[i].catalogIndex < 0)
+                continue;
+            *findEntry(table, old[i].catalogIndex, old[i].skyRegion) = old[i];
+            table->nEntries++;
+        }
+        free(old);
+    }
+
+    StarDetectabilityEntry *slot = findEntry(table, entry->catalogIndex, entry->skyRegion);
+    if (slot->catalogIndex < 0)
+        table->nEntries++;
+    *slot = *entry;
+
+    return ASCC_OK;
+}
+
+static inline bool chronicallyUndetected(const StarDetectabilityEntry *entry)
+{
+    return entry->attempts >= STAR_DETECTABILITY_MIN_ATTEMPTS && (double)entry->detections < STAR_DETECTABILITY_MIN_RATE * (double)entry->attempts;
+}
+
+uint8_t starSkyRegion(float azimuthDegrees, float elevationDegrees)
+{
+    float azimuth = fmodf(azimuthDegrees, 360.0);
+    if (azimuth < 0.0)
+        azimuth += 360.0;
+    int sector = (int)(azimuth / 360.0 * STAR_DETECTABILITY_AZIMUTH_SECTORS);
+    if (sector >= STAR_DETECTABILITY_AZIMUTH_SECTORS)
+        sector = STAR_DETECTABILITY_AZIMUTH_SECTORS - 1;
+    int band = 0;
+    while (band < STAR_DETECTABILITY_ELEVATION_BANDS - 1 && elevationDegrees >= bandTops[band])
+        band++;
+
+    return (uint8_t)(band * STAR_DETECTABILITY_AZIMUTH_SECTORS + sector);
+}
+
+// Reads the site's statistics, or starts them over if there are none for this catalog
+int loadStarDetectability(ProgramState *state)
+{
+    if (state == NULL || state->starDetectabilityDir == NULL)
+        return ASCC_ARGUMENTS;
+
+    freeStarDetectability(state);
+    StarDetectability *table = calloc(1, sizeof *table);
+    if (table == NULL)
+        return ASCC_MEM;
+    if (allocateEntries(table, STAR_DETECTABILITY_INITIAL_CAPACITY) != ASCC_OK)
+    {
+        free(table);
+        return ASCC_MEM;
+    }
+    state->starDetectability = table;
+
+    char filename[FILENAME_MAX + 1];
+    starDetectabilityFilename(state, filename);
+    FILE *file = fopen(filename, "r");
+    if (file == NULL)
+        return ASCC_OK;
+
+    int status = ASCC_OK;
+    StarDetectabilityHeader header;
+    StarDetectabilityEntry entry;
+    bool valid = fread(&header, sizeof header, 1, file) == 1;
+    valid = valid && memcmp(header.magic, STAR_DETECTABILITY_MAGIC, 8) == 0 && header.byteOrder == STAR_DETECTABILITY_BYTE_ORDER;
+    valid = valid && header.nCatalogStars == state->nStars && strncmp(header.site, state->site, sizeof header.site) == 0;
+    for (uint64_t i = 0; valid && i < header.nEntries; i++)
+    {
+        valid = fread(&entry, sizeof entry, 1, file) == 1 && entry.catalogIndex >= 0 && entry.catalogIndex < state->nStars && entry.skyRegion < STAR_DETECTABILITY_AZIMUTH_SECTORS * STAR_DETECTABILITY_ELEVATION_BANDS;
+        if (valid)
+        {
+            status = insertEntry(table, &entry);
+            if (status != ASCC_OK)
+                break;
+        }
+    }
+    fclose(file);
+
+    // The statistics only steer the star selection: a file that does not fit is started over
+    if (!valid || status != ASCC_OK)
+    {
+        free(table->entries);
+        if (allocateEntries(table, STAR_DETECTABILITY_INITIAL_CAPACITY) != ASCC_OK)
+        {
+            freeStarDetectability(state);
+            return ASCC_MEM;
+        }
+        if (state->verbose)
+            fprintf(stderr, "Star detectability file %s does not match the site or catalog; starting over.\n", filename);
+    }
+
+    return ASCC_OK;
+}
+
+int saveStarDetectability(ProgramState *state)
+{
+    if (state == NULL || state->starDetectabilityDir == NULL || state->starDetectability == NULL)
+        return ASCC_ARGUMENTS;
+
+    StarDetectability *table = state->starDetectability;
+    char filename[FILENAME_MAX + 1];
+    char tmpFilename[FILENAME_MAX + 1];
+    starDetectabilityFilename(state, filename);
+    snprintf(tmpFilename, FILENAME_MAX, "%s.tmp.%ld", filename, (long)getpid());
+
+    StarDetectabilityHeader header;
+    memset(&header, 0, sizeof header);
+    memcpy(header.magic, STAR_DETECTABILITY_MAGIC, 8);
+    header.byteOrder = STAR_DETECTABILITY_BYTE_ORDER;
+    header.nCatalogStars = state->nStars;
+    strncpy(header.site, state->site, sizeof header.site);
+    header.nEntries = table->nEntries;
+
+    int status = ASCC_OK;
+    FILE *file = fopen(tmpFilename, "w");
+    if (file == NULL)
+        return ASCC_STAR_DETECTABILITY;
+    bool written = fwrite(&header, sizeof header, 1, file) == 1;
+    for (size_t i = 0; written && i < table->capacity; i++)
+        if (table->entries[i].catalogIndex >= 0)
+            written = fwrite(&table->entries[i], sizeof table->entries[i], 1, file) == 1;
+    if (fclose(file) != 0)
+        written = false;
+
+    // Concurrent runs for the site each replace the whole file
+    if (!written || rename(tmpFilename, filename) != 0)
+    {
+        remove(tmpFilename);
+        status = ASCC_STAR_DETECTABILITY;
+    }
+
+    return status;
+}
+
+// Called for each visible candidate star in selectStars(). A chronically
+// undetected star is skipped, except every STAR_DETECTABILITY_REPROBE_INTERVAL
+// selections to see whether it can be found again.
+bool skipUndetectedStar(ProgramState *state, long catalogIndex, uint8_t skyRegion)
+{
+    StarDetectability *table = state->starDetectability;
+    if (table == NULL)
+        return false;
+
+    StarDetectabilityEntry *entry = findEntry(table, catalogIndex, skyRegion);
+    if (entry->catalogIndex < 0 || !chronicallyUndetected(entry))
+        return false;
+
+    if (++entry->skipped < STAR_DETECTABILITY_REPROBE_INTERVAL)
+    {
+        table->nStarsSkipped++;
+        return true;
+    }
+    entry->skipped = 0;
+    table->nReprobes++;
+
+    return false;
+}
+
+// Counts a measurement attempt of a selected star
+int recordStarDetection(ProgramState *state, long catalogIndex, uint8_t skyRegion, bool detected)
+{
+    StarDetectability *table = state->starDetectability;
+    if (table == NULL || catalogIndex < 0)
+        return ASCC_OK;
+
+    table->nAttemptsRecorded++;
+    StarDetectabilityEntry *entry = findEntry(table, catalogIndex, skyRegion);
+    if (entry->catalogIndex < 0)
+    {
+        StarDetectabilityEntry newEntry = {.catalogIndex = (int32_t)catalogIndex, .skyRegion = skyRegion, .attempts = 1, .detections = detected ? 1 : 0};
+        return insertEntry(table, &newEntry);
+    }
+
+    if (detected && chronicallyUndetected(entry))
+    {
+        // Found on a re-probe: the star is selected as usual until it builds up a new record
+        table->nReprobesDetected++;
+        entry->attempts = 0;
+        entry->detections = 0;
+        entry->skipped = 0;
+    }
+    entry->attempts++;
+    if (detected)
+        entry->detections++;
+    // Older nights count for less, so that a change at the site is picked up
+    if (entry->attempts >= STAR_DETECTABILITY_MAX_ATTEMPTS)
+    {
+        entry->attempts /= 2;
+        entry->detections /= 2;
+    }
+
+    return ASCC_OK;
+}
+
+void freeStarDetectability(ProgramState *state)
+{
+    if (state == NULL || state->starDetectability == NULL)
+        return;
+
+    free(state->starDetectability->entries);
+    free(state->starDetectability);
+    state->starDetectability = NULL;
+
+    return;
+}
@@ -0,0 +1,87 @@
+/*
+
+    AllSkyCameraCal: detectability.h
+
+    Copyright (C) 2022  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// Detection statistics of each catalog star in each region of the sky at a
+// site, kept from run to run, so that stars the camera never sees (behind a
+// building, in a vignetted corner, too faint for the imager) are left out of
+// the calibration star selection. A star left out is still tried every
+// STAR_DETECTABILITY_REPROBE_INTERVAL selections, and is used again once found.
+
+#ifndef _DETECTABILITY_H
+#define _DETECTABILITY_H
+
+#include "main.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define STAR_DETECTABILITY_MAGIC "ASCCDET1"
+#define STAR_DETECTABILITY_EXTENSION ".dat"
+// Written in host byte order; statistics from a host of the other order are started over
+#define STAR_DETECTABILITY_BYTE_ORDER 0x01020304U
+// Sky regions: azimuth sectors times elevation bands above CALIBRATION_ELEVATION_BOUND
+#define STAR_DETECTABILITY_AZIMUTH_SECTORS 16
+#define STAR_DETECTABILITY_ELEVATION_BANDS 4
+#define STAR_DETECTABILITY_INITIAL_CAPACITY 4096
+
+typedef struct StarDetectabilityEntry
+{
+    // -1 for an empty slot
+    int32_t catalogIndex;
+    uint8_t skyRegion;
+    uint8_t reserved[3];
+    uint32_t attempts;
+    uint32_t detections;
+    // Selections left out since the star was last tried
+    uint32_t skipped;
+} StarDetectabilityEntry;
+
+// The statistics file: this header, then nEntries entries
+typedef struct StarDetectabilityHeader
+{
+    char magic[8];
+    uint32_t byteOrder;
+    // Statistics are for one catalog: started over if the number of stars changes
+    int32_t nCatalogStars;
+    char site[8];
+    uint64_t nEntries;
+} StarDetectabilityHeader;
+
+// Open addressing on catalog index and sky region
+typedef struct StarDetectability
+{
+    StarDetectabilityEntry *entries;
+    size_t capacity;
+    size_t nEntries;
+
+    size_t nAttemptsRecorded;
+    size_t nStarsSkipped;
+    size_t nReprobes;
+    size_t nReprobesDetected;
+} StarDetectability;
+
+uint8_t starSkyRegion(float azimuthDegrees, float elevationDegrees);
+int loadStarDetectability(ProgramState *state);
+int saveStarDetectability(ProgramState *state);
+bool skipUndetectedStar(ProgramState *state, long catalogIndex, uint8_t skyRegion);
+int recordStarDetection(ProgramState *state, long catalogIndex, uint8_t skyRegion, bool detected);
+void freeStarDetectability(ProgramState *state);
+
+#endif // _DETECTABILITY_H
@@ -0,0 +1,153 @@
+/*
+
+    AllSkyCameraCal: ephemeris.c
+
+    Copyright (C) 2022  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "ephemeris.h"
+
+#include "main.h"
+#include "analysis.h"
+
+#include <math.h>
+
+// Low precision solar coordinates from the Astronomical Almanac,
+// good to about 0.01 degree between 1950 and 2050.
+// Returns J2000 right ascension and declination in radian.
+void sunRaDec(double epoch, double *ra, double *dec)
+{
+    double degree = M_PI / 180.0;
+    double n = (epoch - J200EPOCH) / 1000.0 / 86400.0;
+
+    double meanLongitude = fmod(280.460 + 0.9856474 * n, 360.0);
+    double meanAnomaly = fmod(357.528 + 0.9856003 * n, 360.0) * degree;
+    double eclipticLongitude = (meanLongitude + 1.915 * sin(meanAnomaly) + 0.020 * sin(2.0 * meanAnomaly)) * degree;
+    double obliquity = (23.439 - 0.0000004 * n) * degree;
+
+    double raVal = atan2(cos(obliquity) * sin(eclipticLongitude), cos(eclipticLongitude));
+    if (raVal < 0.0)
+        raVal += 2.0 * M_PI;
+
+    if (ra != NULL)
+        *ra = raVal;
+    if (dec != NULL)
+        *dec = asin(sin(obliquity) * sin(eclipticLongitude));
+
+    return;
+}
+
+// Low precision geocentric lunar coordinates from the Astronomical Almanac,
+// good to a few tenths of a degree. Topocentric parallax (up to 1 degree)
+// is ignored: this is only used to decide whether the moon is up.
+void moonRaDec(double epoch, double *ra, double *dec)
+{
+    double degree = M_PI / 180.0;
+    double t = (epoch - J200EPOCH) / 1000.0 / 86400.0 / 36525.0;
+
+    double eclipticLongitude = 218.32 + 481267.881 * t
+        + 6.29 * sin((134.9 + 477198.85 * t) * degree)
+        - 1.27 * sin((259.2 - 413335.38 * t) * degree)
+        + 0.66 * sin((235.7 + 890534.23 * t) * degree)
+        + 0.21 * sin((269.9 + 954397.70 * t) * degree)
+        - 0.19 * sin((357.5 + 35999.05 * t) * degree)
+        - 0.11 * sin((186.6 + 966404.05 * t) * degree);
+    double eclipticLatitude = 5.13 * sin((93.3 + 483202.03 * t) * degree)
+        + 0.28 * sin((228.2 + 960400.87 * t) * degree)
+        - 0.28 * sin((318.3 + 6003.18 * t) * degree)
+        - 0.17 * sin((217.6 - 407332.20 * t) * degree);
+
+    double lambda = fmod(eclipticLongitude, 360.0) * degree;
+    double beta = eclipticLatitude * degree;
+    double obliquity = 23.439 * degree;
+
+    double x = cos(beta) * cos(lambda);
+    double y = cos(obliquity) * cos(beta) * sin(lambda) - sin(obliquity) * sin(beta);
+    double z = sin(obliquity) * cos(beta) * sin(lambda) + cos(obliquity) * sin(beta);
+
+    double raVal = atan2(y, x);
+    if (raVal < 0.0)
+        raVal += 2.0 * M_PI;
+
+    if (ra != NULL)
+        *ra = raVal;
+    if (dec != NULL)
+        *dec = asin(z);
+
+    return;
+}
+
+float sunElevation(ProgramState *state, double epoch)
+{
+    double ra = 0.0;
+    double dec = 0.0;
+    float az = 0.0;
+    float el = NAN;
+
+    sunRaDec(epoch, &ra, &dec);
+    radecToazel(epoch, state->siteLatitudeGeodetic, state->siteLongitudeGeodetic, state->siteAltitudeMetres, (float)ra, (float)dec, &az, &el);
+
+    return el;
+}
+
+float moonElevation(ProgramState *state, double epoch)
+{
+    double ra = 0.0;
+    double dec = 0.0;
+    float az = 0.0;
+    float el = NAN;
+
+    moonRaDec(epoch, &ra, &dec);
+    radecToazel(epoch, state->siteLatitudeGeodetic, state->siteLongitudeGeodetic, state->siteAltitudeMetres, (float)ra, (float)dec, &az, &el);
+
+    return el;
+}
+
+// True if neither the sun nor (optionally) the moon rule out finding stars
+bool skyDarkEnough(ProgramState *state, double epoch)
+{
+    if (state == NULL)
+        return true;
+
+    if (state->skipDaylight && sunElevation(state, epoch) > -state->sunDepressionAngle)
+        return false;
+
+    if (state->skipMoonlight && moonElevation(state, epoch) > state->moonMaxElevation)
+        return false;
+
+    return true;
+}
+
+// True if the sky is too bright at every sample time in the part of the
+// L1 file interval that overlaps the requested calibration interval.
+// The sun moves at most about 15 degrees per hour, so a few samples per file suffice.
+bool l1FileTooBright(ProgramState *state, double fileStartEpoch, double fileStopEpoch)
+{
+    if (state == NULL || (!state->skipDaylight && !state->skipMoonlight))
+        return false;
+
+    double t1 = fileStartEpoch > state->firstCalTime ? fileStartEpoch : state->firstCalTime;
+    double t2 = fileStopEpoch < state->lastCalTime ? fileStopEpoch : state->lastCalTime;
+    double step = EPHEMERIS_FILE_SAMPLE_MINUTES * 60000.0;
+
+    for (double t = t1; t < t2 + step; t += step)
+    {
+        if (skyDarkEnough(state, t > t2 ? t2 : t))
+            return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,41 @@
+/*
+
+    AllSkyCameraCal: ephemeris.h
+
+    Copyright (C) 2022  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef _EPHEMERIS_H
+#define _EPHEMERIS_H
+
+#include "main.h"
+
+#include <stdbool.h>
+
+// Minutes between sun and moon evaluations when deciding whether
+// an entire L1 file can be skipped
+#define EPHEMERIS_FILE_SAMPLE_MINUTES 10
+
+void sunRaDec(double epoch, double *ra, double *dec);
+void moonRaDec(double epoch, double *ra, double *dec);
+
+float sunElevation(ProgramState *state, double epoch);
+float moonElevation(ProgramState *state, double epoch);
+
+bool skyDarkEnough(ProgramState *state, double epoch);
+bool l1FileTooBright(ProgramState *state, double fileStartEpoch, double fileStopEpoch);
+
+#endif // _EPHEMERIS_H
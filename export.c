@@ -21,15 +21,290 @@
 #include "export.h"
 #include "main.h"
 #include "util.h"
+#include "attitude.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <libgen.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 #include <cdf.h>
 
+static int parseCompression(const char *text, ExportCompression *compression)
+{
+    char *end = NULL;
+
+    if (strcmp(text, "none") == 0)
+    {
+        compression->type = NO_COMPRESSION;
+        compression->level = 0;
+    }
+    else if (strcmp(text, "rle") == 0)
+    {
+        compression->type = RLE_COMPRESSION;
+        compression->level = RLE_OF_ZEROs;
+    }
+    else if (strncmp(text, "gzip", 4) == 0)
+    {
+        compression->type = GZIP_COMPRESSION;
+        compression->level = EXPORT_GZIP_LEVEL;
+        if (text[4] != '\0')
+        {
+            compression->level = strtol(text + 4, &end, 10);
+            if (*end != '\0' || compression->level < 1 || compression->level > 9)
+                return ASCC_ARGUMENTS;
+        }
+    }
+    else
+        return ASCC_ARGUMENTS;
+
+    return ASCC_OK;
+}
+
+static bool compressedVariable(const char *name)
+{
+    static const char *variables[] = EXPORT_COMPRESSED_VARIABLES;
+    for (size_t v = 0; v < sizeof variables / sizeof variables[0]; v++)
+        if (strcmp(variables[v], name) == 0)
+            return true;
+
+    return false;
+}
+
+// Parses a profile such as "gzip6" or "rle,PointingErrorDCM=gzip9,CCDOffsets=none".
+// NULL gives the default profile. An override of a variable that is not
+// exported is an error, with the name in profile->unknownVariable.
+int parseExportProfile(const char *spec, ExportProfile *profile)
+{
+    if (profile == NULL)
+        return ASCC_ARGUMENTS;
+
+    memset(profile, 0, sizeof *profile);
+    profile->compression.type = GZIP_COMPRESSION;
+    profile->compression.level = EXPORT_GZIP_LEVEL;
+    snprintf(profile->spec, EXPORT_PROFILE_SPEC_LEN + 1, "%s", spec == NULL ? EXPORT_DEFAULT_PROFILE : spec);
+    if (spec == NULL)
+        return ASCC_OK;
+
+    int status = ASCC_OK;
+    char tokens[EXPORT_PROFILE_SPEC_LEN + 1];
+    snprintf(tokens, EXPORT_PROFILE_SPEC_LEN + 1, "%s", spec);
+    if (strlen(spec) > EXPORT_PROFILE_SPEC_LEN)
+        return ASCC_ARGUMENTS;
+
+    char *save = NULL;
+    char *token = strtok_r(tokens, ",", &save);
+    while (token != NULL && status == ASCC_OK)
+    {
+        char *value = strchr(token, '=');
+        if (value == NULL)
+            status = parseCompression(token, &profile->compression);
+        else if (profile->nOverrides == EXPORT_MAX_COMPRESSION_OVERRIDES || value - token > EXPORT_VARIABLE_NAME_LEN)
+            status = ASCC_ARGUMENTS;
+        else
+        {
+            *value++ = '\0';
+            if (!compressedVariable(token))
+            {
+                snprintf(profile->unknownVariable, EXPORT_VARIABLE_NAME_LEN + 1, "%s", token);
+                return ASCC_ARGUMENTS;
+            }
+            snprintf(profile->overrideNames[profile->nOverrides], EXPORT_VARIABLE_NAME_LEN + 1, "%s", token);
+            status = parseCompression(value, &profile->overrides[profile->nOverrides]);
+            profile->nOverrides++;
+        }
+        token = strtok_r(NULL, ",", &save);
+    }
+
+    return status;
+}
+
+// Blocking factor sized to the records written, and the profile's compression for this variable
+static CDFstatus setVariableStorage(CDFid cdf, long varNum, const char *name, size_t recordBytes, size_t nRecords, ExportProfile *profile)
+{
+    ExportCompression *compression = &profile->compression;
+    for (int i = 0; i < profile->nOverrides; i++)
+        if (strcmp(profile->overrideNames[i], name) == 0)
+            compression = &profile->overrides[i];
+
+    // Whole variable in one block when small, otherwise blocks of about EXPORT_BLOCK_BYTES
+    size_t blockingFactor = EXPORT_BLOCK_BYTES / (recordBytes > 0 ? recordBytes : 1);
+    if (blockingFactor > nRecords)
+        blockingFactor = nRecords;
+    if (blockingFactor < 1)
+        blockingFactor = 1;
+
+    CDFstatus cdfstatus = CDFsetzVarBlockingFactor(cdf, varNum, (long)blockingFactor);
+    if (cdfstatus != CDF_OK || compression->type == NO_COMPRESSION)
+        return cdfstatus;
+
+    long compressionParam[1] = {compression->level};
+
+    return CDFsetzVarCompression(cdf, varNum, compression->type, compressionParam);
+}
+
+typedef struct AttitudeBlock
+{
+    size_t first;
+    size_t n;
+    float *dcms;
+    float *axes;
+    float *angles;
+} AttitudeBlock;
+
+// Blocks expanded by the worker and written by the exporting thread, in
+// turn through two buffers
+typedef struct AttitudeExpansion
+{
+    const ProgramState *state;
+    AttitudeBlock blocks[2];
+    size_t nBlocks;
+    size_t nExpanded;
+    size_t nWritten;
+    bool stop;
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+} AttitudeExpansion;
+
+static void expandAttitudeBlock(const ProgramState *state, AttitudeBlock *block, size_t index)
+{
+    block->first = index * EXPORT_ATTITUDE_BLOCK_RECORDS;
+    block->n = state->nImages - block->first < EXPORT_ATTITUDE_BLOCK_RECORDS ? state->nImages - block->first : EXPORT_ATTITUDE_BLOCK_RECORDS;
+    for (size_t i = 0; i < block->n; i++)
+        expandAttitudeQuaternion(&state->attitudeQuaternions[(block->first + i) * 4], &block->dcms[i * 9], &block->axes[i * 3], &block->angles[i]);
+
+    return;
+}
+
+static void *expandAttitudeBlocks(void *arg)
+{
+    AttitudeExpansion *expansion = (AttitudeExpansion*)arg;
+
+    for (size_t k = 0; k < expansion->nBlocks; k++)
+    {
+        // Wait for the block that used this buffer to be written
+        pthread_mutex_lock(&expansion->mutex);
+        while (!expansion->stop && k >= expansion->nWritten + 2)
+            pthread_cond_wait(&expansion->changed, &expansion->mutex);
+        bool stop = expansion->stop;
+        pthread_mutex_unlock(&expansion->mutex);
+        if (stop)
+            break;
+
+        expandAttitudeBlock(expansion->state, &expansion->blocks[k % 2], k);
+
+        pthread_mutex_lock(&expansion->mutex);
+        expansion->nExpanded = k + 1;
+        pthread_cond_broadcast(&expansion->changed);
+        pthread_mutex_unlock(&expansion->mutex);
+    }
+
+    return NULL;
+}
+
+// Expands the stored attitude quaternions a block at a time. One worker
+// thread expands the next block while the CDF library compresses and writes
+// the current one.
+static int exportAttitudes(CDFid cdf, ProgramState *state, long dcmVarNum, long axisVarNum, long angleVarNum)
+{
+    int status = ASCC_OK;
+    CDFstatus cdfstatus = CDF_OK;
+
+    AttitudeExpansion expansion = {0};
+    expansion.state = state;
+    expansion.nBlocks = (state->nImages + EXPORT_ATTITUDE_BLOCK_RECORDS - 1) / EXPORT_ATTITUDE_BLOCK_RECORDS;
+    pthread_t worker;
+    bool workerRunning = false;
+    bool synchronized = false;
+    for (int b = 0; b < 2; b++)
+    {
+        expansion.blocks[b].dcms = malloc(EXPORT_ATTITUDE_BLOCK_RECORDS * 9 * sizeof *expansion.blocks[b].dcms);
+        expansion.blocks[b].axes = malloc(EXPORT_ATTITUDE_BLOCK_RECORDS * 3 * sizeof *expansion.blocks[b].axes);
+        expansion.blocks[b].angles = malloc(EXPORT_ATTITUDE_BLOCK_RECORDS * sizeof *expansion.blocks[b].angles);
+        if (expansion.blocks[b].dcms == NULL || expansion.blocks[b].axes == NULL || expansion.blocks[b].angles == NULL)
+        {
+            status = ASCC_MEM;
+            goto cleanup;
+        }
+    }
+
+    // Expand in this thread if a worker is not available
+    if (expansion.nBlocks > 1 && pthread_mutex_init(&expansion.mutex, NULL) == 0)
+    {
+        if (pthread_cond_init(&expansion.changed, NULL) == 0)
+        {
+            synchronized = true;
+            workerRunning = pthread_create(&worker, NULL, expandAttitudeBlocks, &expansion) == 0;
+        }
+        else
+            pthread_mutex_destroy(&expansion.mutex);
+    }
+
+    for (size_t k = 0; k < expansion.nBlocks; k++)
+    {
+        AttitudeBlock *current = &expansion.blocks[k % 2];
+        if (workerRunning)
+        {
+            pthread_mutex_lock(&expansion.mutex);
+            while (expansion.nExpanded <= k)
+                pthread_cond_wait(&expansion.changed, &expansion.mutex);
+            pthread_mutex_unlock(&expansion.mutex);
+        }
+        else
+            expandAttitudeBlock(state, current, k);
+
+        long first = (long)current->first;
+        long last = (long)(current->first + current->n - 1);
+        cdfstatus = CDFputzVarRangeRecordsByVarID(cdf, dcmVarNum, first, last, current->dcms);
+        if (cdfstatus == CDF_OK)
+            cdfstatus = CDFputzVarRangeRecordsByVarID(cdf, axisVarNum, first, last, current->axes);
+        if (cdfstatus == CDF_OK)
+            cdfstatus = CDFputzVarRangeRecordsByVarID(cdf, angleVarNum, first, last, current->angles);
+        if (cdfstatus != CDF_OK)
+        {
+            status = ASCC_CDF_WRITE;
+            break;
+        }
+
+        if (workerRunning)
+        {
+            pthread_mutex_lock(&expansion.mutex);
+            expansion.nWritten = k + 1;
+            pthread_cond_broadcast(&expansion.changed);
+            pthread_mutex_unlock(&expansion.mutex);
+        }
+    }
+
+    if (workerRunning)
+    {
+        pthread_mutex_lock(&expansion.mutex);
+        expansion.stop = true;
+        pthread_cond_broadcast(&expansion.changed);
+        pthread_mutex_unlock(&expansion.mutex);
+        pthread_join(worker, NULL);
+    }
+    if (synchronized)
+    {
+        pthread_cond_destroy(&expansion.changed);
+        pthread_mutex_destroy(&expansion.mutex);
+    }
+
+cleanup:
+    for (int b = 0; b < 2; b++)
+    {
+        free(expansion.blocks[b].dcms);
+        free(expansion.blocks[b].axes);
+        free(expansion.blocks[b].angles);
+    }
+
+    return status;
+}
+
+// Writes the run to exportdir with the --export-compression profile
 int exportCdf(ProgramState *state)
 {
     if (state == NULL)
@@ -38,8 +313,10 @@ int exportCdf(ProgramState *state)
     if (state->nImages == 0)
         return ASCC_CDF_EXPORT_NO_DATA;
 
-    CDFid cdf = NULL;
-    char statusMessage[CDF_STATUSTEXT_LEN+1] = {0};
+    ExportProfile profile;
+    int status = parseExportProfile(state->exportCompression, &profile);
+    if (status != ASCC_OK)
+        return status;
 
     char cdfFilename[CDF_PATHNAME_LEN+1];
     char firstTime[EPOCHx_STRING_MAX];
@@ -49,8 +326,6 @@ int exportCdf(ProgramState *state)
     encodeEPOCHx(state->lastCalTime, format, lastTime);
     snprintf(cdfFilename, CDF_PATHNAME_LEN, "%s/themis_%s_camera_pointing_errors_%s_%s_%s", state->exportdir, state->site, firstTime, lastTime, EXPORT_CDF_VERSION_STRING);
 
-    CDFstatus cdfstatus = CDF_OK;
-    
     snprintf(state->cdfFullFilename, CDF_PATHNAME_LEN + 5, "%s.cdf", cdfFilename);
     if (access(state->cdfFullFilename, F_OK) == 0 && state->overwriteCdf)
     {
@@ -59,6 +334,61 @@ int exportCdf(ProgramState *state)
         remove(state->cdfFullFilename);
     }
 
+    double t0 = monotonicSeconds();
+    status = writeCdfFile(state, cdfFilename, &profile);
+    state->exportSeconds = monotonicSeconds() - t0;
+    struct stat info;
+    state->exportBytes = stat(state->cdfFullFilename, &info) == 0 ? (size_t)info.st_size : 0;
+    if (status != ASCC_OK)
+        return status;
+    if (state->verbose)
+        fprintf(stderr, "Export profile %s: %.2f MB written in %.2f s\n", profile.spec, (double)state->exportBytes / 1e6, state->exportSeconds);
+
+    if (state->compareExportProfiles)
+        compareExportProfiles(state);
+
+    return ASCC_OK;
+}
+
+// Writes the same run with each standard profile to a scratch CDF in exportdir,
+// reporting write time and file size, and removes the scratch files
+int compareExportProfiles(ProgramState *state)
+{
+    static const char *profiles[] = EXPORT_COMPARISON_PROFILES;
+    ExportProfile profile;
+    char cdfFilename[CDF_PATHNAME_LEN+1];
+    char fullFilename[CDF_PATHNAME_LEN+5];
+    struct stat info;
+
+    fprintf(stderr, "Profile     Size (MB)  Write time (s)\n");
+    for (size_t p = 0; p < sizeof profiles / sizeof profiles[0]; p++)
+    {
+        int status = parseExportProfile(profiles[p], &profile);
+        if (status != ASCC_OK)
+            return status;
+        snprintf(cdfFilename, CDF_PATHNAME_LEN, "%s/themis_%s_export_profile_%s", state->exportdir, state->site, profiles[p]);
+        snprintf(fullFilename, CDF_PATHNAME_LEN + 5, "%s.cdf", cdfFilename);
+        remove(fullFilename);
+
+        double t0 = monotonicSeconds();
+        status = writeCdfFile(state, cdfFilename, &profile);
+        double seconds = monotonicSeconds() - t0;
+        if (status == ASCC_OK && stat(fullFilename, &info) == 0)
+            fprintf(stderr, "%-10s %10.2f %15.2f\n", profiles[p], (double)info.st_size / 1e6, seconds);
+        else
+            fprintf(stderr, "%-10s could not be written\n", profiles[p]);
+        remove(fullFilename);
+    }
+
+    return ASCC_OK;
+}
+
+int writeCdfFile(ProgramState *state, char *cdfFilename, ExportProfile *profile)
+{
+    CDFid cdf = NULL;
+    char statusMessage[CDF_STATUSTEXT_LEN+1] = {0};
+    CDFstatus cdfstatus = CDF_OK;
+
     cdfstatus = CDFcreateCDF(cdfFilename, &cdf);
 
     if (cdfstatus != CDF_OK)
@@ -82,10 +412,6 @@ int exportCdf(ProgramState *state)
         return ASCC_CDF_WRITE;
     }
 
-    // TODO
-    // Blocking factor
-
-
     int status = ASCC_OK;
 
     // Timestamp
@@ -94,14 +420,13 @@ int exportCdf(ProgramState *state)
     long recVariance = VARY;
     long dimsVariance[2] = {VARY,VARY};
     long varNum = 0;
-    long compressionParam[1] = {6};
     cdfstatus = CDFcreatezVar(cdf, "Timestamp", CDF_EPOCH, 1, nDims, dimSizes, recVariance, dimsVariance, &varNum);
     if (cdfstatus != CDF_OK)
     {
         status = ASCC_CDF_WRITE;
         goto cleanup;
     }
-    cdfstatus = CDFsetzVarCompression(cdf, varNum, GZIP_COMPRESSION, compressionParam);
+    cdfstatus = setVariableStorage(cdf, varNum, "Timestamp", sizeof(double), state->nImages, profile);
     if (cdfstatus != CDF_OK)
     {
         status = ASCC_CDF_WRITE;
@@ -125,18 +450,13 @@ int exportCdf(ProgramState *state)
         status = ASCC_CDF_WRITE;
         goto cleanup;
     }
-    cdfstatus = CDFsetzVarCompression(cdf, varNum, GZIP_COMPRESSION, compressionParam);
-    if (cdfstatus != CDF_OK)
-    {
-        status = ASCC_CDF_WRITE;
-        goto cleanup;
-    }
-    cdfstatus = CDFputzVarAllRecordsByVarID(cdf, varNum, state->nImages, state->pointingErrorDcms);
+    cdfstatus = setVariableStorage(cdf, varNum, "PointingErrorDCM", 9 * sizeof(float), state->nImages, profile);
     if (cdfstatus != CDF_OK)
     {
         status = ASCC_CDF_WRITE;
         goto cleanup;
     }
+    long dcmVarNum = varNum;
 
     nDims = 1;
     dimSizes[0] = 3;
@@ -147,18 +467,13 @@ int exportCdf(ProgramState *state)
         status = ASCC_CDF_WRITE;
         goto cleanup;
     }
-    cdfstatus = CDFsetzVarCompression(cdf, varNum, GZIP_COMPRESSION, compressionParam);
-    if (cdfstatus != CDF_OK)
-    {
-        status = ASCC_CDF_WRITE;
-        goto cleanup;
-    }
-    cdfstatus = CDFputzVarAllRecordsByVarID(cdf, varNum, state->nImages, state->rotationVectors);
+    cdfstatus = setVariableStorage(cdf, varNum, "RotationAxis", 3 * sizeof(float), state->nImages, profile);
     if (cdfstatus != CDF_OK)
     {
         status = ASCC_CDF_WRITE;
         goto cleanup;
     }
+    long axisVarNum = varNum;
 
     nDims = 0;
     cdfstatus = CDFcreatezVar(cdf, "RotationAngle", CDF_REAL4, 1, nDims, dimSizes, recVariance, dimsVariance, &varNum);
@@ -167,18 +482,15 @@ int exportCdf(ProgramState *state)
         status = ASCC_CDF_WRITE;
         goto cleanup;
     }
-    cdfstatus = CDFsetzVarCompression(cdf, varNum, GZIP_COMPRESSION, compressionParam);
+    cdfstatus = setVariableStorage(cdf, varNum, "RotationAngle", sizeof(float), state->nImages, profile);
     if (cdfstatus != CDF_OK)
     {
         status = ASCC_CDF_WRITE;
         goto cleanup;
     }
-    cdfstatus = CDFputzVarAllRecordsByVarID(cdf, varNum, state->nImages, state->rotationAngles);
-    if (cdfstatus != CDF_OK)
-    {
-        status = ASCC_CDF_WRITE;
+    status = exportAttitudes(cdf, state, dcmVarNum, axisVarNum, varNum);
+    if (status != ASCC_OK)
         goto cleanup;
-    }
 
     nDims = 0;
     recVariance = VARY;
@@ -279,7 +591,7 @@ int exportCdf(ProgramState *state)
         status = ASCC_CDF_WRITE;
         goto cleanup;
     }
-    cdfstatus = CDFsetzVarCompression(cdf, varNum, GZIP_COMPRESSION, compressionParam);
+    cdfstatus = setVariableStorage(cdf, varNum, "CCDOffsets", sizeof state->sitePixelOffsets, 1, profile);
     if (cdfstatus != CDF_OK)
     {
         status = ASCC_CDF_WRITE;
@@ -297,7 +609,7 @@ int exportCdf(ProgramState *state)
         status = ASCC_CDF_WRITE;
         goto cleanup;
     }
-    cdfstatus = CDFsetzVarCompression(cdf, varNum, GZIP_COMPRESSION, compressionParam);
+    cdfstatus = setVariableStorage(cdf, varNum, "ReferenceElevations", sizeof state->referenceElevations, 1, profile);
     if (cdfstatus != CDF_OK)
     {
         status = ASCC_CDF_WRITE;
@@ -315,7 +627,7 @@ int exportCdf(ProgramState *state)
         status = ASCC_CDF_WRITE;
         goto cleanup;
     }
-    cdfstatus = CDFsetzVarCompression(cdf, varNum, GZIP_COMPRESSION, compressionParam);
+    cdfstatus = setVariableStorage(cdf, varNum, "ReferenceAzimuths", sizeof state->referenceAzimuths, 1, profile);
     if (cdfstatus != CDF_OK)
     {
         status = ASCC_CDF_WRITE;
@@ -354,7 +666,7 @@ int exportCdf(ProgramState *state)
         status = ASCC_CDF_WRITE;
         goto cleanup;
     }
-    cdfstatus = CDFsetzVarCompression(cdf, varNum, GZIP_COMPRESSION, compressionParam);
+    cdfstatus = setVariableStorage(cdf, varNum, "CalibratedElevations", sizeof state->calibratedElevations, 1, profile);
     if (cdfstatus != CDF_OK)
     {
         status = ASCC_CDF_WRITE;
@@ -372,7 +684,7 @@ int exportCdf(ProgramState *state)
         status = ASCC_CDF_WRITE;
         goto cleanup;
     }
-    cdfstatus = CDFsetzVarCompression(cdf, varNum, GZIP_COMPRESSION, compressionParam);
+    cdfstatus = setVariableStorage(cdf, varNum, "CalibratedAzimuths", sizeof state->calibratedAzimuths, 1, profile);
     if (cdfstatus != CDF_OK)
     {
         status = ASCC_CDF_WRITE;
@@ -393,7 +705,7 @@ int exportCdf(ProgramState *state)
         status = ASCC_CDF_WRITE;
         goto cleanup;
     }
-    cdfstatus = CDFsetzVarCompression(cdf, varNum, GZIP_COMPRESSION, compressionParam);
+    cdfstatus = setVariableStorage(cdf, varNum, "CalibrationStarCount", sizeof(uint16_t), state->nImages, profile);
     if (cdfstatus != CDF_OK)
     {
         status = ASCC_CDF_WRITE;
@@ -406,6 +718,134 @@ int exportCdf(ProgramState *state)
         goto cleanup;
     }
 
+    nDims = 0;
+    recVariance = VARY;
+    cdfstatus = CDFcreatezVar(cdf, "AttitudeInterpolated", CDF_UINT1, 1, nDims, dimSizes, recVariance, dimsVariance, &varNum);
+    if (cdfstatus != CDF_OK)
+    {
+        status = ASCC_CDF_WRITE;
+        goto cleanup;
+    }
+    cdfstatus = setVariableStorage(cdf, varNum, "AttitudeInterpolated", sizeof(uint8_t), state->nImages, profile);
+    if (cdfstatus != CDF_OK)
+    {
+        status = ASCC_CDF_WRITE;
+        goto cleanup;
+    }
+    cdfstatus = CDFputzVarAllRecordsByVarID(cdf, varNum, state->nImages, state->attitudeInterpolated);
+    if (cdfstatus != CDF_OK)
+    {
+        status = ASCC_CDF_WRITE;
+        goto cleanup;
+    }
+
+    if (state->globalFitSolved)
+    {
+        float globalDcm[9];
+        for (int m = 0; m < 9; m++)
+            globalDcm[m] = (float)state->globalDcm[m];
+        uint32_t nGlobalObservationsUsed = (uint32_t)state->nGlobalFitObservationsUsed;
+
+        nDims = 2;
+        dimSizes[0] = IMAGE_COLUMNS;
+        dimSizes[1] = IMAGE_ROWS;
+        dimsVariance[0] = VARY;
+        dimsVariance[1] = VARY;
+        recVariance = VARY;
+        cdfstatus = CDFcreatezVar(cdf, "GlobalCalibratedElevations", CDF_REAL4, 1, nDims, dimSizes, recVariance, dimsVariance, &varNum);
+        if (cdfstatus != CDF_OK)
+        {
+            status = ASCC_CDF_WRITE;
+            goto cleanup;
+        }
+        cdfstatus = setVariableStorage(cdf, varNum, "GlobalCalibratedElevations", sizeof state->globalCalibratedElevations, 1, profile);
+        if (cdfstatus != CDF_OK)
+        {
+            status = ASCC_CDF_WRITE;
+            goto cleanup;
+        }
+        cdfstatus = CDFputzVarAllRecordsByVarID(cdf, varNum, 1, state->globalCalibratedElevations);
+        if (cdfstatus != CDF_OK)
+        {
+            status = ASCC_CDF_WRITE;
+            goto cleanup;
+        }
+        cdfstatus = CDFcreatezVar(cdf, "GlobalCalibratedAzimuths", CDF_REAL4, 1, nDims, dimSizes, recVariance, dimsVariance, &varNum);
+        if (cdfstatus != CDF_OK)
+        {
+            status = ASCC_CDF_WRITE;
+            goto cleanup;
+        }
+        cdfstatus = setVariableStorage(cdf, varNum, "GlobalCalibratedAzimuths", sizeof state->globalCalibratedAzimuths, 1, profile);
+        if (cdfstatus != CDF_OK)
+        {
+            status = ASCC_CDF_WRITE;
+            goto cleanup;
+        }
+        cdfstatus = CDFputzVarAllRecordsByVarID(cdf, varNum, 1, state->globalCalibratedAzimuths);
+        if (cdfstatus != CDF_OK)
+        {
+            status = ASCC_CDF_WRITE;
+            goto cleanup;
+        }
+
+        dimSizes[0] = 3;
+        dimSizes[1] = 3;
+        cdfstatus = CDFcreatezVar(cdf, "GlobalPointingErrorDCM", CDF_REAL4, 1, nDims, dimSizes, recVariance, dimsVariance, &varNum);
+        if (cdfstatus != CDF_OK)
+        {
+            status = ASCC_CDF_WRITE;
+            goto cleanup;
+        }
+        cdfstatus = CDFputzVarAllRecordsByVarID(cdf, varNum, 1, globalDcm);
+        if (cdfstatus != CDF_OK)
+        {
+            status = ASCC_CDF_WRITE;
+            goto cleanup;
+        }
+
+        nDims = 1;
+        dimSizes[0] = 2;
+        cdfstatus = CDFcreatezVar(cdf, "GlobalRadialDistortion", CDF_REAL8, 1, nDims, dimSizes, recVariance, dimsVariance, &varNum);
+        if (cdfstatus != CDF_OK)
+        {
+            status = ASCC_CDF_WRITE;
+            goto cleanup;
+        }
+        cdfstatus = CDFputzVarAllRecordsByVarID(cdf, varNum, 1, state->globalRadialDistortion);
+        if (cdfstatus != CDF_OK)
+        {
+            status = ASCC_CDF_WRITE;
+            goto cleanup;
+        }
+
+        nDims = 0;
+        cdfstatus = CDFcreatezVar(cdf, "GlobalFitResidualRms", CDF_REAL4, 1, nDims, dimSizes, recVariance, dimsVariance, &varNum);
+        if (cdfstatus != CDF_OK)
+        {
+            status = ASCC_CDF_WRITE;
+            goto cleanup;
+        }
+        cdfstatus = CDFputzVarAllRecordsByVarID(cdf, varNum, 1, &state->globalFitResidualRms);
+        if (cdfstatus != CDF_OK)
+        {
+            status = ASCC_CDF_WRITE;
+            goto cleanup;
+        }
+        cdfstatus = CDFcreatezVar(cdf, "GlobalFitObservationCount", CDF_UINT4, 1, nDims, dimSizes, recVariance, dimsVariance, &varNum);
+        if (cdfstatus != CDF_OK)
+        {
+            status = ASCC_CDF_WRITE;
+            goto cleanup;
+        }
+        cdfstatus = CDFputzVarAllRecordsByVarID(cdf, varNum, 1, &nGlobalObservationsUsed);
+        if (cdfstatus != CDF_OK)
+        {
+            status = ASCC_CDF_WRITE;
+            goto cleanup;
+        }
+    }
+
     // Global attributes
     long attrNum = 0;
     long entry = 0;
@@ -530,7 +970,9 @@ int exportCdf(ProgramState *state)
         status = ASCC_CDF_WRITE;
         goto cleanup;
     }
-    char *cdfBasename = basename(state->cdfFullFilename);
+    char cdfFullFilename[CDF_PATHNAME_LEN + 5];
+    snprintf(cdfFullFilename, CDF_PATHNAME_LEN + 5, "%s.cdf", cdfFilename);
+    char *cdfBasename = basename(cdfFullFilename);
     cdfstatus = CDFputAttrgEntry(cdf, attrNum, entry, CDF_CHAR, strlen(cdfBasename), cdfBasename);
     if (cdfstatus != CDF_OK)
     {
@@ -699,13 +1141,60 @@ int exportCdf(ProgramState *state)
         goto cleanup;
     }
 
-    cdfstatus = addVariableAttributes(cdf, "CalibrationStarCount", "Number of stars used to estimate pointing error", "-");
+    cdfstatus = addVariableAttributes(cdf, "CalibrationStarCount", "Number of stars used to estimate pointing error. 0 for interpolated attitudes.", "-");
+    if (cdfstatus != CDF_OK)
+    {
+        status = ASCC_CDF_WRITE;
+        goto cleanup;
+    }
+
+    cdfstatus = addVariableAttributes(cdf, "AttitudeInterpolated", "1 if the pointing error was interpolated in time between analyzed images (--decimate), 0 if it was estimated from this image.", "-");
     if (cdfstatus != CDF_OK)
     {
         status = ASCC_CDF_WRITE;
         goto cleanup;
     }
 
+    if (state->globalFitSolved)
+    {
+        cdfstatus = addVariableAttributes(cdf, "GlobalCalibratedElevations", "Calibration of elevations centred on each pixel from the global camera model (--global-fit)", "degree");
+        if (cdfstatus != CDF_OK)
+        {
+            status = ASCC_CDF_WRITE;
+            goto cleanup;
+        }
+        cdfstatus = addVariableAttributes(cdf, "GlobalCalibratedAzimuths", "Calibration of azimuths centred on each pixel from the global camera model (--global-fit)", "degree");
+        if (cdfstatus != CDF_OK)
+        {
+            status = ASCC_CDF_WRITE;
+            goto cleanup;
+        }
+        cdfstatus = addVariableAttributes(cdf, "GlobalPointingErrorDCM", "Direction cosine matrix of the global camera model fitted to all calibration star observations. Same convention as PointingErrorDCM. ENU system.", "-");
+        if (cdfstatus != CDF_OK)
+        {
+            status = ASCC_CDF_WRITE;
+            goto cleanup;
+        }
+        cdfstatus = addVariableAttributes(cdf, "GlobalRadialDistortion", "Coefficients k1 and k2 of the global camera model radial distortion theta = theta0 (1 + k1 theta0^2 + k2 theta0^4), theta0 in radians from the optical axis.", "-");
+        if (cdfstatus != CDF_OK)
+        {
+            status = ASCC_CDF_WRITE;
+            goto cleanup;
+        }
+        cdfstatus = addVariableAttributes(cdf, "GlobalFitResidualRms", "RMS angular residual of the global camera model over the observations used.", "degree");
+        if (cdfstatus != CDF_OK)
+        {
+            status = ASCC_CDF_WRITE;
+            goto cleanup;
+        }
+        cdfstatus = addVariableAttributes(cdf, "GlobalFitObservationCount", "Number of star observations used in the global camera model fit.", "-");
+        if (cdfstatus != CDF_OK)
+        {
+            status = ASCC_CDF_WRITE;
+            goto cleanup;
+        }
+    }
+
 cleanup:
     if (cdf != NULL)
         CDFclose(cdf);
@@ -716,7 +1205,7 @@ cleanup:
         fprintf(stderr, "export.c: %s\n", statusMessage);
     }
 
-    return ASCC_OK;
+    return status;
 }
 
 int addVariableAttributes(CDFid cdf, char *name, char *description, char *units)
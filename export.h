@@ -25,7 +25,41 @@
 
 #include <cdf.h>
 
+// Attitude records expanded from quaternions per CDF write
+#define EXPORT_ATTITUDE_BLOCK_RECORDS 4096
+// Target size of a CDF variable block; smaller variables are one block
+#define EXPORT_BLOCK_BYTES 1048576
+#define EXPORT_GZIP_LEVEL 6
+#define EXPORT_DEFAULT_PROFILE "gzip6"
+#define EXPORT_COMPARISON_PROFILES {"none", "rle", "gzip1", "gzip6", "gzip9"}
+// Variables a profile can set the compression of
+#define EXPORT_COMPRESSED_VARIABLES {"Timestamp", "PointingErrorDCM", "RotationAxis", "RotationAngle", "CCDOffsets", "ReferenceElevations", "ReferenceAzimuths", "CalibratedElevations", "CalibratedAzimuths", "CalibrationStarCount", "AttitudeInterpolated", "GlobalCalibratedElevations", "GlobalCalibratedAzimuths"}
+#define EXPORT_PROFILE_SPEC_LEN 1023
+#define EXPORT_MAX_COMPRESSION_OVERRIDES 32
+#define EXPORT_VARIABLE_NAME_LEN 63
+
+typedef struct ExportCompression
+{
+    long type;
+    long level;
+} ExportCompression;
+
+// Compression for all variables, with overrides for named variables
+typedef struct ExportProfile
+{
+    char spec[EXPORT_PROFILE_SPEC_LEN + 1];
+    ExportCompression compression;
+    int nOverrides;
+    char overrideNames[EXPORT_MAX_COMPRESSION_OVERRIDES][EXPORT_VARIABLE_NAME_LEN + 1];
+    ExportCompression overrides[EXPORT_MAX_COMPRESSION_OVERRIDES];
+    // Set when an override names a variable that is not exported
+    char unknownVariable[EXPORT_VARIABLE_NAME_LEN + 1];
+} ExportProfile;
+
 int exportCdf(ProgramState *state);
+int writeCdfFile(ProgramState *state, char *cdfFilename, ExportProfile *profile);
+int compareExportProfiles(ProgramState *state);
+int parseExportProfile(const char *spec, ExportProfile *profile);
 
 int addVariableAttributes(CDFid cdf, char *name, char *description, char *units);
 
@@ -0,0 +1,419 @@
+/*
+
+    AllSkyCameraCal: framecache.c
+
+    Copyright (C) 2022  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "framecache.h"
+
+#include "main.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libgen.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <cdf.h>
+
+// L1 files are cached as uncompressed frame cubes named after the L1 file.
+// A cube is used only if it was made from a source file of the same size and
+// modification time. Using a cube updates its modification time, and the
+// least recently used cubes are removed when the cache exceeds its size.
+
+typedef struct CachedCube
+{
+    char *filename;
+    off_t size;
+    struct timespec modified;
+} CachedCube;
+
+void frameCubeFilename(ProgramState *state, char *l1file, char *cubeFile)
+{
+    char l1Copy[FILENAME_MAX + 1];
+    snprintf(l1Copy, FILENAME_MAX, "%s", l1file);
+    snprintf(cubeFile, FILENAME_MAX, "%s/%s%s", state->frameCacheDir, basename(l1Copy), FRAME_CUBE_EXTENSION);
+
+    return;
+}
+
+static size_t cubeFramesOffset(uint32_t nFrames)
+{
+    size_t offset = sizeof(FrameCubeHeader) + nFrames * sizeof(double);
+
+    return (offset + FRAME_CUBE_ALIGNMENT - 1) / FRAME_CUBE_ALIGNMENT * FRAME_CUBE_ALIGNMENT;
+}
+
+static uint64_t offsetsHash(ProgramState *state)
+{
+    return fnv1a64(state->sitePixelOffsets, sizeof state->sitePixelOffsets);
+}
+
+// Whether a cube of cubeSize bytes with this header was made from source with the requested options
+static bool validCubeHeader(ProgramState *state, const FrameCubeHeader *header, struct stat *source, size_t cubeSize)
+{
+    bool valid = memcmp(header->magic, FRAME_CUBE_MAGIC, 8) == 0 && header->byteOrder == FRAME_CUBE_BYTE_ORDER && header->columns == IMAGE_COLUMNS && header->rows == IMAGE_ROWS;
+    valid = valid && header->sourceSize == (uint64_t)source->st_size && header->sourceModifiedSeconds == (int64_t)source->st_mtim.tv_sec && header->sourceModifiedNanoseconds == (int64_t)source->st_mtim.tv_nsec;
+    valid = valid && (header->offsetsSubtracted != 0) == state->frameCacheSubtractOffsets && (!state->frameCacheSubtractOffsets || header->offsetsHash == offsetsHash(state));
+    valid = valid && header->nFrames > 0 && header->framesOffset == cubeFramesOffset(header->nFrames) && cubeSize == header->framesOffset + (size_t)header->nFrames * L1_FRAME_BYTES;
+
+    return valid;
+}
+
+// Maps the cube and checks it against its source file and the requested options
+static int mapFrameCube(ProgramState *state, char *cubeFile, struct stat *source, L1FrameMap *frames)
+{
+    memset(frames, 0, sizeof *frames);
+
+    int fd = open(cubeFile, O_RDONLY);
+    if (fd < 0)
+        return ASCC_FRAME_CACHE;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(FrameCubeHeader))
+    {
+        close(fd);
+        return ASCC_FRAME_CACHE;
+    }
+    void *base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED)
+    {
+        close(fd);
+        return ASCC_FRAME_CACHE;
+    }
+    frames->base = base;
+    frames->length = (size_t)st.st_size;
+
+    const FrameCubeHeader *header = (const FrameCubeHeader *)base;
+    if (!validCubeHeader(state, header, source, frames->length))
+    {
+        close(fd);
+        closeL1FrameMap(frames);
+        return ASCC_FRAME_CACHE;
+    }
+
+    frames->nRecords = header->nFrames;
+    frames->recordOffsets = calloc(frames->nRecords, sizeof *frames->recordOffsets);
+    if (frames->recordOffsets == NULL)
+    {
+        close(fd);
+        closeL1FrameMap(frames);
+        return ASCC_MEM;
+    }
+    for (long r = 0; r < frames->nRecords; r++)
+        frames->recordOffsets[r] = header->framesOffset + (uint64_t)r * L1_FRAME_BYTES;
+    frames->swapBytes = false;
+    frames->offsetsSubtracted = header->offsetsSubtracted != 0;
+    frames->mapped = true;
+
+    // Most recently used
+    futimens(fd, NULL);
+    close(fd);
+
+    return ASCC_OK;
+}
+
+// Provides the frames and epochs of an L1 file from the cache, making the cube
+// first if needed. The caller frees epochs and closes the frame map.
+int loadFrameCube(ProgramState *state, char *l1file, L1FrameMap *frames, double **epochs, long *nFrames)
+{
+    if (state == NULL || l1file == NULL || frames == NULL || epochs == NULL || nFrames == NULL || state->frameCacheDir == NULL)
+        return ASCC_ARGUMENTS;
+
+    char cubeFile[FILENAME_MAX + 1];
+    struct stat source;
+
+    if (stat(l1file, &source) != 0)
+        return ASCC_L1_FILE;
+
+    frameCubeFilename(state, l1file, cubeFile);
+
+    int status = mapFrameCube(state, cubeFile, &source, frames);
+    if (status == ASCC_OK)
+        state->nFrameCubeHits++;
+    else if (status == ASCC_FRAME_CACHE)
+    {
+        status = buildFrameCube(state, l1file, cubeFile);
+        if (status != ASCC_OK)
+            return status;
+        state->nFrameCubesBuilt++;
+        evictFrameCubes(state, cubeFile);
+        status = mapFrameCube(state, cubeFile, &source, frames);
+    }
+    if (status != ASCC_OK)
+        return status;
+
+    const FrameCubeHeader *header = (const FrameCubeHeader *)frames->base;
+    *epochs = malloc(header->nFrames * sizeof **epochs);
+    if (*epochs == NULL)
+    {
+        closeL1FrameMap(frames);
+        return ASCC_MEM;
+    }
+    memcpy(*epochs, frames->base + sizeof *header, header->nFrames * sizeof **epochs);
+    *nFrames = header->nFrames;
+
+    return ASCC_OK;
+}
+
+// The image times of an L1 file from a valid cube, reading only the header and
+// epochs. ASCC_FRAME_CACHE if the file has no valid cube. The caller frees epochs.
+int frameCubeEpochs(ProgramState *state, char *l1file, double **epochs, long *nFrames)
+{
+    if (state == NULL || l1file == NULL || epochs == NULL || nFrames == NULL || state->frameCacheDir == NULL)
+        return ASCC_ARGUMENTS;
+
+    char cubeFile[FILENAME_MAX + 1];
+    struct stat source;
+    struct stat st;
+    FrameCubeHeader header;
+
+    if (stat(l1file, &source) != 0)
+        return ASCC_L1_FILE;
+    frameCubeFilename(state, l1file, cubeFile);
+
+    int fd = open(cubeFile, O_RDONLY);
+    if (fd < 0)
+        return ASCC_FRAME_CACHE;
+    if (fstat(fd, &st) != 0 || pread(fd, &header, sizeof header, 0) != (ssize_t)sizeof header || !validCubeHeader(state, &header, &source, (size_t)st.st_size))
+    {
+        close(fd);
+        return ASCC_FRAME_CACHE;
+    }
+
+    *epochs = malloc(header.nFrames * sizeof **epochs);
+    if (*epochs == NULL)
+    {
+        close(fd);
+        return ASCC_MEM;
+    }
+    size_t epochBytes = header.nFrames * sizeof **epochs;
+    if (pread(fd, *epochs, epochBytes, sizeof header) != (ssize_t)epochBytes)
+    {
+        free(*epochs);
+        *epochs = NULL;
+        close(fd);
+        return ASCC_FRAME_CACHE;
+    }
+    close(fd);
+    *nFrames = header.nFrames;
+
+    return ASCC_OK;
+}
+
+// Reads every record of the L1 file through the CDF library into a new cube
+int buildFrameCube(ProgramState *state, char *l1file, char *cubeFile)
+{
+    if (state == NULL || l1file == NULL || cubeFile == NULL)
+        return ASCC_ARGUMENTS;
+
+    struct stat source;
+    if (stat(l1file, &source) != 0)
+        return ASCC_L1_FILE;
+
+    CDFid cdf = NULL;
+    if (CDFopen(l1file, &cdf) != CDF_OK)
+        return ASCC_L1_FILE;
+
+    int status = ASCC_OK;
+    char cdfVarName[CDF_VAR_NAME_LEN + 1] = {0};
+    char tmpFilename[FILENAME_MAX + 1];
+    long maxFileRecord = 0;
+    double *epochs = NULL;
+    uint16_t (*image)[IMAGE_ROWS] = NULL;
+    FILE *cube = NULL;
+    static const char padding[FRAME_CUBE_ALIGNMENT] = {0};
+
+    snprintf(tmpFilename, FILENAME_MAX, "%s.tmp.%ld", cubeFile, (long)getpid());
+
+    snprintf(cdfVarName, CDF_VAR_NAME_LEN + 1, "thg_asf_%s_epoch", state->site);
+    if (CDFgetzVarMaxWrittenRecNum(cdf, CDFgetVarNum(cdf, cdfVarName), &maxFileRecord) != CDF_OK || maxFileRecord <= 0)
+    {
+        status = ASCC_L1_FILE;
+        goto cleanup;
+    }
+
+    FrameCubeHeader header = {0};
+    memcpy(header.magic, FRAME_CUBE_MAGIC, 8);
+    header.byteOrder = FRAME_CUBE_BYTE_ORDER;
+    header.nFrames = (uint32_t)(maxFileRecord + 1);
+    header.columns = IMAGE_COLUMNS;
+    header.rows = IMAGE_ROWS;
+    header.offsetsSubtracted = state->frameCacheSubtractOffsets ? 1 : 0;
+    header.sourceSize = (uint64_t)source.st_size;
+    header.sourceModifiedSeconds = (int64_t)source.st_mtim.tv_sec;
+    header.sourceModifiedNanoseconds = (int64_t)source.st_mtim.tv_nsec;
+    header.offsetsHash = state->frameCacheSubtractOffsets ? offsetsHash(state) : 0;
+    header.framesOffset = cubeFramesOffset(header.nFrames);
+
+    epochs = calloc(header.nFrames, sizeof *epochs);
+    image = calloc(IMAGE_COLUMNS, sizeof *image);
+    if (epochs == NULL || image == NULL)
+    {
+        status = ASCC_MEM;
+        goto cleanup;
+    }
+    if (CDFgetVarRangeRecordsByVarName(cdf, cdfVarName, 0, maxFileRecord, epochs) != CDF_OK)
+    {
+        status = ASCC_L1_FILE;
+        goto cleanup;
+    }
+
+    cube = fopen(tmpFilename, "w");
+    if (cube == NULL)
+    {
+        status = ASCC_FRAME_CACHE;
+        goto cleanup;
+    }
+    size_t nPadding = header.framesOffset - sizeof header - header.nFrames * sizeof *epochs;
+    if (fwrite(&header, sizeof header, 1, cube) != 1 || fwrite(epochs, sizeof *epochs, header.nFrames, cube) != header.nFrames || fwrite(padding, 1, nPadding, cube) != nPadding)
+    {
+        status = ASCC_FRAME_CACHE;
+        goto cleanup;
+    }
+
+    snprintf(cdfVarName, CDF_VAR_NAME_LEN + 1, "thg_asf_%s", state->site);
+    for (long record = 0; record <= maxFileRecord; record++)
+    {
+        // A cube holds every record, so an unreadable record leaves the file uncached
+        if (CDFgetVarRangeRecordsByVarName(cdf, cdfVarName, record, record, &image[0][0]) != CDF_OK)
+        {
+            status = ASCC_CDF_READ;
+            goto cleanup;
+        }
+        if (state->frameCacheSubtractOffsets)
+        {
+            for (int c = 0; c < IMAGE_COLUMNS; c++)
+                for (int r = 0; r < IMAGE_ROWS; r++)
+                    image[c][r] = image[c][r] > state->sitePixelOffsets[c][r] ? image[c][r] - state->sitePixelOffsets[c][r] : 0;
+        }
+        if (fwrite(&image[0][0], L1_FRAME_BYTES, 1, cube) != 1)
+        {
+            status = ASCC_FRAME_CACHE;
+            goto cleanup;
+        }
+    }
+
+    if (fclose(cube) != 0 || rename(tmpFilename, cubeFile) != 0)
+        status = ASCC_FRAME_CACHE;
+    cube = NULL;
+
+cleanup:
+    if (cube != NULL)
+        fclose(cube);
+    if (status != ASCC_OK)
+        remove(tmpFilename);
+    if (epochs != NULL)
+        free(epochs);
+    if (image != NULL)
+        free(image);
+    CDFclose(cdf);
+
+    return status;
+}
+
+static int compareCubeAge(const void *first, const void *second)
+{
+    const CachedCube *a = (const CachedCube *)first;
+    const CachedCube *b = (const CachedCube *)second;
+
+    if (a->modified.tv_sec != b->modified.tv_sec)
+        return a->modified.tv_sec < b->modified.tv_sec ? -1 : 1;
+    if (a->modified.tv_nsec != b->modified.tv_nsec)
+        return a->modified.tv_nsec < b->modified.tv_nsec ? -1 : 1;
+
+    return 0;
+}
+
+// Removes the least recently used cubes until the cache fits in its size limit.
+// keepFile, the cube just made, is never removed.
+int evictFrameCubes(ProgramState *state, char *keepFile)
+{
+    if (state == NULL || state->frameCacheDir == NULL)
+        return ASCC_ARGUMENTS;
+
+    DIR *dir = opendir(state->frameCacheDir);
+    if (dir == NULL)
+        return ASCC_FRAME_CACHE;
+
+    int status = ASCC_OK;
+    CachedCube *cubes = NULL;
+    size_t nCubes = 0;
+    size_t capacity = 0;
+    uint64_t totalBytes = 0;
+    uint64_t maxBytes = (uint64_t)state->frameCacheMaxMegabytes * 1000000ULL;
+    size_t extensionLength = strlen(FRAME_CUBE_EXTENSION);
+    char filename[FILENAME_MAX + 1];
+    struct dirent *entry = NULL;
+    struct stat st;
+
+    while ((entry = readdir(dir)) != NULL)
+    {
+        size_t length = strlen(entry->d_name);
+        if (length <= extensionLength || strcmp(entry->d_name + length - extensionLength, FRAME_CUBE_EXTENSION) != 0)
+            continue;
+        snprintf(filename, FILENAME_MAX, "%s/%s", state->frameCacheDir, entry->d_name);
+        if (stat(filename, &st) != 0 || !S_ISREG(st.st_mode))
+            continue;
+        if (nCubes == capacity)
+        {
+            capacity = capacity == 0 ? 64 : 2 * capacity;
+            void *mem = realloc(cubes, capacity * sizeof *cubes);
+            if (mem == NULL)
+            {
+                status = ASCC_MEM;
+                goto cleanup;
+            }
+            cubes = mem;
+        }
+        cubes[nCubes].filename = strdup(filename);
+        if (cubes[nCubes].filename == NULL)
+        {
+            status = ASCC_MEM;
+            goto cleanup;
+        }
+        cubes[nCubes].size = st.st_size;
+        cubes[nCubes].modified = st.st_mtim;
+        totalBytes += (uint64_t)st.st_size;
+        nCubes++;
+    }
+
+    qsort(cubes, nCubes, sizeof *cubes, compareCubeAge);
+    for (size_t i = 0; i < nCubes && totalBytes > maxBytes; i++)
+    {
+        if (keepFile != NULL && strcmp(cubes[i].filename, keepFile) == 0)
+            continue;
+        if (unlink(cubes[i].filename) == 0)
+        {
+            totalBytes -= (uint64_t)cubes[i].size;
+            state->nFrameCubesEvicted++;
+        }
+    }
+
+cleanup:
+    for (size_t i = 0; i < nCubes; i++)
+        free(cubes[i].filename);
+    if (cubes != NULL)
+        free(cubes);
+    closedir(dir);
+
+    return status;
+}
@@ -0,0 +1,62 @@
+/*
+
+    AllSkyCameraCal: framecache.h
+
+    Copyright (C) 2022  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef _FRAMECACHE_H
+#define _FRAMECACHE_H
+
+#include "main.h"
+#include "l1reader.h"
+
+#include <stdint.h>
+
+#define FRAME_CUBE_MAGIC "ASCCCUB1"
+#define FRAME_CUBE_EXTENSION ".cube"
+// Written in host byte order; a cube from a host of the other order is rebuilt
+#define FRAME_CUBE_BYTE_ORDER 0x01020304U
+// Frames start on a page boundary
+#define FRAME_CUBE_ALIGNMENT 4096
+
+// A frame cube: this header, nFrames epochs (double), then nFrames
+// 256x256 uint16 images starting at framesOffset
+typedef struct FrameCubeHeader
+{
+    char magic[8];
+    uint32_t byteOrder;
+    uint32_t nFrames;
+    uint32_t columns;
+    uint32_t rows;
+    uint32_t offsetsSubtracted;
+    uint32_t reserved;
+    // Source L1 file the cube was made from
+    uint64_t sourceSize;
+    int64_t sourceModifiedSeconds;
+    int64_t sourceModifiedNanoseconds;
+    // FNV-1a hash of the CCD offsets, if subtracted
+    uint64_t offsetsHash;
+    uint64_t framesOffset;
+} FrameCubeHeader;
+
+void frameCubeFilename(ProgramState *state, char *l1file, char *cubeFile);
+int loadFrameCube(ProgramState *state, char *l1file, L1FrameMap *frames, double **epochs, long *nFrames);
+int frameCubeEpochs(ProgramState *state, char *l1file, double **epochs, long *nFrames);
+int buildFrameCube(ProgramState *state, char *l1file, char *cubeFile);
+int evictFrameCubes(ProgramState *state, char *keepFile);
+
+#endif // _FRAMECACHE_H
@@ -0,0 +1,424 @@
+/*
+
+    AllSkyCameraCal: globalfit.c
+
+    Copyright (C) 2022  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "globalfit.h"
+
+#include "main.h"
+#include "star.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#include <gsl/gsl_matrix.h>
+#include <gsl/gsl_vector.h>
+#include <gsl/gsl_permutation.h>
+#include <gsl/gsl_linalg.h>
+
+// Global camera model fitted to every calibration star observation of a run.
+// A reference map direction v0 at angle theta0 from the optical axis a is moved
+// radially to theta = theta0 (1 + k1 theta0^2 + k2 theta0^4), then rotated by the
+// global DCM: catalog = DCM v'. The DCM follows the PointingErrorDCM convention
+// (measured = predicted DCM for row vectors), the same sense in which the
+// per-image calibration map applies the mean attitude.
+// Gauss-Newton steps accumulate the 5x5 normal equations over the observations,
+// split among threads, so each iteration is linear in the number of observations.
+
+typedef struct GlobalFitTask
+{
+    GlobalObservation *observations;
+    size_t first;
+    size_t last;
+    const double *dcm;
+    const double *k;
+    const double *axis;
+    bool rejectOutliers;
+
+    double jtj[GLOBAL_FIT_N_PARAMETERS * GLOBAL_FIT_N_PARAMETERS];
+    double jtr[GLOBAL_FIT_N_PARAMETERS];
+    double sumOfSquares;
+    size_t nUsed;
+} GlobalFitTask;
+
+int addGlobalObservation(ProgramState *state, CalibrationStar *cal)
+{
+    if (state->nGlobalObservations == state->globalObservationCapacity)
+    {
+        size_t capacity = state->globalObservationCapacity == 0 ? 4096 : 2 * state->globalObservationCapacity;
+        void *mem = realloc(state->globalObservations, capacity * sizeof *state->globalObservations);
+        if (mem == NULL)
+            return ASCC_MEM;
+        state->globalObservations = mem;
+        state->globalObservationCapacity = capacity;
+    }
+
+    GlobalObservation *obs = &state->globalObservations[state->nGlobalObservations++];
+    obs->column = cal->imageMomentColumn;
+    obs->row = cal->imageMomentRow;
+    obs->reference[0] = cal->measuredAzElX;
+    obs->reference[1] = cal->measuredAzElY;
+    obs->reference[2] = cal->measuredAzElZ;
+    obs->catalog[0] = cal->predictedAzElX;
+    obs->catalog[1] = cal->predictedAzElY;
+    obs->catalog[2] = cal->predictedAzElZ;
+
+    return ASCC_OK;
+}
+
+// Model direction for a reference direction. Also returns the direction's
+// derivative with respect to theta and theta0 if requested.
+static void modelDirection(const double *dcm, const double *k, const double *axis, const double *reference, double *direction, double *dDirection, double *theta0Out)
+{
+    double v0[3] = {reference[0], reference[1], reference[2]};
+    double norm = sqrt(v0[0] * v0[0] + v0[1] * v0[1] + v0[2] * v0[2]);
+    double e[3] = {0.0};
+    double v[3] = {0.0};
+    double dv[3] = {0.0};
+    double cosTheta0 = 0.0;
+    double sinTheta0 = 0.0;
+    double theta0 = 0.0;
+    double theta = 0.0;
+
+    for (int i = 0; i < 3; i++)
+        v0[i] /= norm;
+    cosTheta0 = v0[0] * axis[0] + v0[1] * axis[1] + v0[2] * axis[2];
+    if (cosTheta0 > 1.0)
+        cosTheta0 = 1.0;
+    else if (cosTheta0 < -1.0)
+        cosTheta0 = -1.0;
+    theta0 = acos(cosTheta0);
+    sinTheta0 = sin(theta0);
+
+    if (sinTheta0 < 1e-9)
+    {
+        // On the optical axis distortion does nothing
+        for (int i = 0; i < 3; i++)
+            v[i] = v0[i];
+    }
+    else
+    {
+        for (int i = 0; i < 3; i++)
+            e[i] = (v0[i] - cosTheta0 * axis[i]) / sinTheta0;
+        theta = theta0 * (1.0 + k[0] * theta0 * theta0 + k[1] * theta0 * theta0 * theta0 * theta0);
+        for (int i = 0; i < 3; i++)
+        {
+            v[i] = cos(theta) * axis[i] + sin(theta) * e[i];
+            dv[i] = -sin(theta) * axis[i] + cos(theta) * e[i];
+        }
+    }
+
+    for (int i = 0; i < 3; i++)
+    {
+        direction[i] = dcm[i * 3] * v[0] + dcm[i * 3 + 1] * v[1] + dcm[i * 3 + 2] * v[2];
+        if (dDirection != NULL)
+            dDirection[i] = dcm[i * 3] * dv[0] + dcm[i * 3 + 1] * dv[1] + dcm[i * 3 + 2] * dv[2];
+    }
+    if (theta0Out != NULL)
+        *theta0Out = theta0;
+
+    return;
+}
+
+static void *accumulateNormalEquations(void *arg)
+{
+    GlobalFitTask *task = (GlobalFitTask*)arg;
+    GlobalObservation *obs = NULL;
+    double reference[3] = {0.0};
+    double u[3] = {0.0};
+    double du[3] = {0.0};
+    double r[3] = {0.0};
+    double j[3][GLOBAL_FIT_N_PARAMETERS] = {{0.0}};
+    double theta0 = 0.0;
+    double residualSquared = 0.0;
+    double maxResidual = 2.0 * sin(GLOBAL_FIT_MAX_RESIDUAL_DEGREES * M_PI / 180.0 / 2.0);
+    double maxResidualSquared = maxResidual * maxResidual;
+
+    memset(task->jtj, 0, sizeof task->jtj);
+    memset(task->jtr, 0, sizeof task->jtr);
+    task->sumOfSquares = 0.0;
+    task->nUsed = 0;
+
+    for (size_t n = task->first; n < task->last; n++)
+    {
+        obs = &task->observations[n];
+        for (int i = 0; i < 3; i++)
+            reference[i] = obs->reference[i];
+        modelDirection(task->dcm, task->k, task->axis, reference, u, du, &theta0);
+        for (int i = 0; i < 3; i++)
+            r[i] = u[i] - obs->catalog[i];
+        residualSquared = r[0] * r[0] + r[1] * r[1] + r[2] * r[2];
+        if (!isfinite(residualSquared) || (task->rejectOutliers && residualSquared > maxResidualSquared))
+            continue;
+
+        // Small rotation d of the model direction: d x u
+        j[0][0] = 0.0;
+        j[0][1] = u[2];
+        j[0][2] = -u[1];
+        j[1][0] = -u[2];
+        j[1][1] = 0.0;
+        j[1][2] = u[0];
+        j[2][0] = u[1];
+        j[2][1] = -u[0];
+        j[2][2] = 0.0;
+        for (int i = 0; i < 3; i++)
+        {
+            j[i][3] = du[i] * theta0 * theta0 * theta0;
+            j[i][4] = du[i] * theta0 * theta0 * theta0 * theta0 * theta0;
+        }
+
+        for (int a = 0; a < GLOBAL_FIT_N_PARAMETERS; a++)
+        {
+            for (int b = a; b < GLOBAL_FIT_N_PARAMETERS; b++)
+                task->jtj[a * GLOBAL_FIT_N_PARAMETERS + b] += j[0][a] * j[0][b] + j[1][a] * j[1][b] + j[2][a] * j[2][b];
+            task->jtr[a] += j[0][a] * r[0] + j[1][a] * r[1] + j[2][a] * r[2];
+        }
+        task->sumOfSquares += residualSquared;
+        task->nUsed++;
+    }
+
+    return NULL;
+}
+
+// Left-multiplies dcm by the rotation d x (Rodrigues formula)
+static void applySmallRotation(double *dcm, const double *d)
+{
+    double angle = sqrt(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+    double rotation[9] = {1.0, 0.0, 0.0, 0.0, 1.0, 0.0, 0.0, 0.0, 1.0};
+    double product[9] = {0.0};
+
+    if (angle > 0.0)
+    {
+        double x = d[0] / angle;
+        double y = d[1] / angle;
+        double z = d[2] / angle;
+        double s = sin(angle);
+        double c = 1.0 - cos(angle);
+        double kMatrix[9] = {0.0, -z, y, z, 0.0, -x, -y, x, 0.0};
+        double k2[9] = {0.0};
+        for (int i = 0; i < 3; i++)
+            for (int jj = 0; jj < 3; jj++)
+                for (int m = 0; m < 3; m++)
+                    k2[i * 3 + jj] += kMatrix[i * 3 + m] * kMatrix[m * 3 + jj];
+        for (int i = 0; i < 9; i++)
+            rotation[i] += s * kMatrix[i] + c * k2[i];
+    }
+
+    for (int i = 0; i < 3; i++)
+        for (int jj = 0; jj < 3; jj++)
+            for (int m = 0; m < 3; m++)
+                product[i * 3 + jj] += rotation[i * 3 + m] * dcm[m * 3 + jj];
+    memcpy(dcm, product, sizeof product);
+
+    return;
+}
+
+// One pass over the observations with nThreads threads.
+// Partial sums are added in thread order so results do not depend on scheduling.
+static int accumulate(ProgramState *state, GlobalFitTask *tasks, int nThreads, const double *dcm, const double *k, bool rejectOutliers, double *jtj, double *jtr, double *sumOfSquares, size_t *nUsed)
+{
+    pthread_t threads[nThreads];
+    size_t n = state->nGlobalObservations;
+    int nStarted = 0;
+
+    for (int t = 0; t < nThreads; t++)
+    {
+        tasks[t].observations = state->globalObservations;
+        tasks[t].first = n * t / nThreads;
+        tasks[t].last = n * (t + 1) / nThreads;
+        tasks[t].dcm = dcm;
+        tasks[t].k = k;
+        tasks[t].axis = state->globalOpticalAxis;
+        tasks[t].rejectOutliers = rejectOutliers;
+    }
+    for (int t = 1; t < nThreads; t++)
+    {
+        if (pthread_create(&threads[t], NULL, accumulateNormalEquations, &tasks[t]) != 0)
+            break;
+        nStarted++;
+    }
+    // This thread does the first part and any parts that did not get a thread
+    accumulateNormalEquations(&tasks[0]);
+    for (int t = nStarted + 1; t < nThreads; t++)
+        accumulateNormalEquations(&tasks[t]);
+    for (int t = 1; t <= nStarted; t++)
+        pthread_join(threads[t], NULL);
+
+    memset(jtj, 0, GLOBAL_FIT_N_PARAMETERS * GLOBAL_FIT_N_PARAMETERS * sizeof(double));
+    memset(jtr, 0, GLOBAL_FIT_N_PARAMETERS * sizeof(double));
+    *sumOfSquares = 0.0;
+    *nUsed = 0;
+    for (int t = 0; t < nThreads; t++)
+    {
+        for (int i = 0; i < GLOBAL_FIT_N_PARAMETERS * GLOBAL_FIT_N_PARAMETERS; i++)
+            jtj[i] += tasks[t].jtj[i];
+        for (int i = 0; i < GLOBAL_FIT_N_PARAMETERS; i++)
+            jtr[i] += tasks[t].jtr[i];
+        *sumOfSquares += tasks[t].sumOfSquares;
+        *nUsed += tasks[t].nUsed;
+    }
+    // Only the upper triangle was accumulated
+    for (int a = 0; a < GLOBAL_FIT_N_PARAMETERS; a++)
+        for (int b = 0; b < a; b++)
+            jtj[a * GLOBAL_FIT_N_PARAMETERS + b] = jtj[b * GLOBAL_FIT_N_PARAMETERS + a];
+
+    return ASCC_OK;
+}
+
+int solveGlobalCameraModel(ProgramState *state)
+{
+    if (state == NULL)
+        return ASCC_ARGUMENTS;
+
+    state->globalFitSolved = false;
+    if (state->nGlobalObservations < GLOBAL_FIT_MIN_OBSERVATIONS)
+        return ASCC_NO_CALIBRATION_DATA;
+
+    int nThreads = state->globalFitThreads;
+    if (nThreads < 1)
+        nThreads = 1;
+    if ((size_t)nThreads > state->nGlobalObservations)
+        nThreads = (int)state->nGlobalObservations;
+
+    GlobalFitTask *tasks = calloc(nThreads, sizeof *tasks);
+    if (tasks == NULL)
+        return ASCC_MEM;
+
+    int status = ASCC_OK;
+
+    // Optical axis from the reference map at the image centre, zenith if unavailable
+    int c0 = IMAGE_COLUMNS / 2;
+    int r0 = IMAGE_ROWS / 2;
+    double axis[3] = {state->pixelX[c0][r0], state->pixelY[c0][r0], state->pixelZ[c0][r0]};
+    double axisNorm = sqrt(axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2]);
+    if (!isfinite(axisNorm) || axisNorm == 0.0)
+    {
+        axis[0] = 0.0;
+        axis[1] = 0.0;
+        axis[2] = 1.0;
+        axisNorm = 1.0;
+    }
+    for (int i = 0; i < 3; i++)
+        state->globalOpticalAxis[i] = axis[i] / axisNorm;
+
+    double dcm[9] = {1.0, 0.0, 0.0, 0.0, 1.0, 0.0, 0.0, 0.0, 1.0};
+    double k[2] = {0.0};
+    double jtjArr[GLOBAL_FIT_N_PARAMETERS * GLOBAL_FIT_N_PARAMETERS] = {0.0};
+    double jtrArr[GLOBAL_FIT_N_PARAMETERS] = {0.0};
+    double stepArr[GLOBAL_FIT_N_PARAMETERS] = {0.0};
+    double sumOfSquares = 0.0;
+    size_t nUsed = 0;
+    double stepSize = 0.0;
+    int signum = 0;
+    int iteration = 0;
+
+    gsl_matrix_view jtj = gsl_matrix_view_array(jtjArr, GLOBAL_FIT_N_PARAMETERS, GLOBAL_FIT_N_PARAMETERS);
+    gsl_vector_view jtr = gsl_vector_view_array(jtrArr, GLOBAL_FIT_N_PARAMETERS);
+    gsl_vector_view step = gsl_vector_view_array(stepArr, GLOBAL_FIT_N_PARAMETERS);
+    gsl_permutation *permutation = gsl_permutation_alloc(GLOBAL_FIT_N_PARAMETERS);
+    if (permutation == NULL)
+    {
+        free(tasks);
+        return ASCC_MEM;
+    }
+
+    for (iteration = 0; iteration < GLOBAL_FIT_MAX_ITERATIONS; iteration++)
+    {
+        accumulate(state, tasks, nThreads, dcm, k, iteration >= GLOBAL_FIT_OUTLIER_ITERATION, jtjArr, jtrArr, &sumOfSquares, &nUsed);
+        if (nUsed < GLOBAL_FIT_MIN_OBSERVATIONS)
+        {
+            status = ASCC_NO_CALIBRATION_DATA;
+            goto cleanup;
+        }
+        // Solve JtJ step = -Jtr
+        for (int i = 0; i < GLOBAL_FIT_N_PARAMETERS; i++)
+            jtrArr[i] = -jtrArr[i];
+        if (gsl_linalg_LU_decomp(&jtj.matrix, permutation, &signum) != GSL_SUCCESS || gsl_linalg_LU_solve(&jtj.matrix, permutation, &jtr.vector, &step.vector) != GSL_SUCCESS)
+        {
+            status = ASCC_ROTATION_FIT;
+            goto cleanup;
+        }
+
+        applySmallRotation(dcm, stepArr);
+        k[0] += stepArr[3];
+        k[1] += stepArr[4];
+
+        stepSize = 0.0;
+        for (int i = 0; i < GLOBAL_FIT_N_PARAMETERS; i++)
+            stepSize += stepArr[i] * stepArr[i];
+        if (iteration >= GLOBAL_FIT_OUTLIER_ITERATION && stepSize < GLOBAL_FIT_CONVERGENCE)
+            break;
+    }
+
+    // Final residuals with outliers rejected
+    accumulate(state, tasks, nThreads, dcm, k, true, jtjArr, jtrArr, &sumOfSquares, &nUsed);
+
+    memcpy(state->globalDcm, dcm, sizeof dcm);
+    state->globalRadialDistortion[0] = k[0];
+    state->globalRadialDistortion[1] = k[1];
+    state->nGlobalFitObservationsUsed = nUsed;
+    // Chord length is the angle in radians for small residuals
+    state->globalFitResidualRms = nUsed > 0 ? sqrt(sumOfSquares / (double)nUsed) / M_PI * 180.0 : NAN;
+    state->globalFitSolved = nUsed >= GLOBAL_FIT_MIN_OBSERVATIONS;
+
+    if (state->verbose)
+        fprintf(stderr, "Global camera model: %zu of %zu observations used, %d iterations, residual %.4f deg RMS, k1 = %.6g, k2 = %.6g\n", nUsed, state->nGlobalObservations, iteration + 1, state->globalFitResidualRms, k[0], k[1]);
+
+cleanup:
+    gsl_permutation_free(permutation);
+    free(tasks);
+
+    return status;
+}
+
+// Sky direction of a reference map direction according to the global model
+void globalModelDirection(ProgramState *state, const double *reference, double *direction)
+{
+    modelDirection(state->globalDcm, state->globalRadialDistortion, state->globalOpticalAxis, reference, direction, NULL, NULL);
+
+    return;
+}
+
+void updateGlobalCalibration(ProgramState *state)
+{
+    double reference[3] = {0.0};
+    double direction[3] = {0.0};
+    float degree = M_PI / 180.0;
+
+    for (int c = 0; c < IMAGE_COLUMNS; c++)
+    {
+        for (int r = 0; r < IMAGE_ROWS; r++)
+        {
+            state->globalCalibratedElevations[c][r] = NAN;
+            state->globalCalibratedAzimuths[c][r] = NAN;
+            if (!state->globalFitSolved || !isfinite(state->pixelX[c][r]) || !isfinite(state->pixelY[c][r]) || !isfinite(state->pixelZ[c][r]))
+                continue;
+            reference[0] = state->pixelX[c][r];
+            reference[1] = state->pixelY[c][r];
+            reference[2] = state->pixelZ[c][r];
+            globalModelDirection(state, reference, direction);
+            state->globalCalibratedElevations[c][r] = atan(direction[2] / sqrt(direction[0] * direction[0] + direction[1] * direction[1])) / degree;
+            state->globalCalibratedAzimuths[c][r] = fmod(360+(90.0 - atan2(direction[1], direction[0]) / degree), 360.0);
+        }
+    }
+
+    return;
+}
@@ -0,0 +1,53 @@
+/*
+
+    AllSkyCameraCal: globalfit.h
+
+    Copyright (C) 2022  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef _GLOBALFIT_H
+#define _GLOBALFIT_H
+
+#include "main.h"
+#include "star.h"
+
+#define GLOBAL_FIT_N_PARAMETERS 5
+#define GLOBAL_FIT_MAX_ITERATIONS 20
+#define GLOBAL_FIT_MIN_OBSERVATIONS 50
+// Observations further than this from the model are dropped after the first iterations
+#define GLOBAL_FIT_MAX_RESIDUAL_DEGREES 1.0
+#define GLOBAL_FIT_OUTLIER_ITERATION 2
+#define GLOBAL_FIT_CONVERGENCE 1e-12
+
+// A calibration star measured in one image
+typedef struct GlobalObservation
+{
+    // Star centroid in pixels
+    float column;
+    float row;
+    // Direction of the centroid according to the reference map (east, north, up)
+    float reference[3];
+    // Catalog direction at the image time (east, north, up)
+    float catalog[3];
+} GlobalObservation;
+
+int addGlobalObservation(ProgramState *state, CalibrationStar *cal);
+
+void globalModelDirection(ProgramState *state, const double *reference, double *direction);
+int solveGlobalCameraModel(ProgramState *state);
+void updateGlobalCalibration(ProgramState *state);
+
+#endif // _GLOBALFIT_H
@@ -19,12 +19,14 @@
 */
 
 #include "import.h"
+#include "sitecache.h"
+#include "calindex.h"
+#include "pixelindex.h"
 
 #include <readsave.h>
 
 #include <stdlib.h>
 #include <stdio.h>
-#include <fts.h>
 #include <string.h>
 #include <stdbool.h>
 #include <math.h>
@@ -32,160 +34,225 @@
 
 #include <cdf.h>
 
-int sortL2Listing(const FTSENT **first, const FTSENT **second)
+// Path of the calibration file of the given type that applies to the site at
+// epoch, the newest if epoch is NAN, using the program's calibration index if it has one
+static int findCalibrationFile(ProgramState *state, const char *root, int type, double epoch, char **path)
 {
-    // Push abnormal entries to the end...
-
-    if (first == NULL)
-        return 1;
-    else if (second == NULL)
-        return -1;
-
-    const FTSENT *a = *first;
-    const FTSENT *b = *second;
-
-    if (a == NULL)
-        return 1;
-    else if (b == NULL)
-        return -1;
+    CalibrationIndex localIndex;
+    CalibrationIndex *index = state->calibrationIndex;
+    if (index == NULL)
+    {
+        openCalibrationIndex(&localIndex, NULL);
+        index = &localIndex;
+    }
 
-    const char *file1 = a->fts_name;
-    const char *file2 = b->fts_name;
+    int notFound = type == CALIBRATION_L2 ? ASCC_L2_FILE : ASCC_SKYMAP_FILE;
+    int status = updateCalibrationIndex(index, root);
+    if (status == ASCC_OK)
+    {
+        const CalibrationFile *file = bestCalibrationFile(index, state->site, type, epoch, indexedDirectoryPath(index, root));
+        if (file == NULL)
+            status = notFound;
+        else
+        {
+            *path = strdup(file->path);
+            if (*path == NULL)
+                status = ASCC_MEM;
+        }
+    }
+    else if (status != ASCC_MEM)
+        status = notFound;
 
-    if (file1 == NULL)
-        return 1;
-    else if (file2 == NULL)
-        return -1;
+    if (index == &localIndex)
+        freeCalibrationIndex(&localIndex);
+    else if (saveCalibrationIndex(index) != ASCC_OK && state->verbose)
+        fprintf(stderr, "Could not save the calibration index %s\n", index->filename);
 
-    if (strlen(file1) != 32)
-        return 1;
-    else if (strlen(file2) != 32)
-        return -1;
+    return status;
+}
 
-    int versionsCompared = strncmp(file1 + a->fts_namelen - 7, file2 + b->fts_namelen - 7, 3);
+int loadThemisLevel2(ProgramState *state, double epoch)
+{
+    char *path = NULL;
+    int status = findCalibrationFile(state, state->l2dir, CALIBRATION_L2, epoch, &path);
+    if (status != ASCC_OK)
+        return status;
 
-    if (versionsCompared > 0)
-        return -1;
-    else if (versionsCompared < 0)
-        return 1;
+    // Track input files, but full path not needed.
+    const char *name = strrchr(path, '/');
+    char *l2filename = strdup(name != NULL ? name + 1 : path);
+    if (l2filename == NULL)
+        status = ASCC_MEM;
     else
-        return 0;
-        
+        status = loadSiteModel(state, path, l2filename, false);
+    if (status == ASCC_OK)
+    {
+        free(state->l2filename);
+        state->l2filename = l2filename;
+        state->siteModelFromIndex = true;
+    }
+    else
+        free(l2filename);
+    free(path);
+
+    return status;
 }
 
-int loadThemisLevel2(ProgramState *state)
+// Loads the L2 or skymap file at path into a scratch state and moves the site
+// model into state only once all of it has loaded, so a file that fails to
+// load leaves the model in use intact. name is the L2 file name for messages.
+int loadSiteModel(ProgramState *state, const char *path, const char *name, bool skymap)
 {
-    char *dir[2] = {state->l2dir, NULL};
-    FTS *fts = fts_open(dir, FTS_LOGICAL, &sortL2Listing);
-    if (fts == NULL)
-        return ASCC_L2_FILE;
+    if (state == NULL || path == NULL)
+        return ASCC_ARGUMENTS;
+
+    ProgramState *model = calloc(1, sizeof *model);
+    if (model == NULL)
+        return ASCC_MEM;
+    model->site = state->site;
+    model->siteModelCacheDir = state->siteModelCacheDir;
+    model->verbose = state->verbose;
+    model->l2filename = (char*)name;
+    model->skymapfilename = (char*)path;
 
-    FTSENT *e = fts_read(fts);
+    int status = skymap ? loadSkymapFromFile(model) : loadThemisLevel2File(model, path);
+    if (status != ASCC_OK)
+    {
+        free(model->calibrationDateGenerated);
+        free(model->calibrationDateUsed);
+        free(model);
+        return status;
+    }
+
+    free(state->calibrationDateGenerated);
+    free(state->calibrationDateUsed);
+    state->calibrationDateGenerated = model->calibrationDateGenerated;
+    state->calibrationDateUsed = model->calibrationDateUsed;
+    state->siteLatitudeGeodetic = model->siteLatitudeGeodetic;
+    state->siteLongitudeGeodetic = model->siteLongitudeGeodetic;
+    state->siteAltitudeMetres = model->siteAltitudeMetres;
+    memcpy(state->sitePixelOffsets, model->sitePixelOffsets, sizeof state->sitePixelOffsets);
+    memcpy(state->referenceElevations, model->referenceElevations, sizeof state->referenceElevations);
+    memcpy(state->referenceAzimuths, model->referenceAzimuths, sizeof state->referenceAzimuths);
+    memcpy(state->pixelX, model->pixelX, sizeof state->pixelX);
+    memcpy(state->pixelY, model->pixelY, sizeof state->pixelY);
+    memcpy(state->pixelZ, model->pixelZ, sizeof state->pixelZ);
+    free(model);
+    // Built again from the new reference map when first needed
+    freeReferencePixelIndex(state);
+
+    return ASCC_OK;
+}
 
+int loadThemisLevel2File(ProgramState *state, const char *path)
+{
     int status = ASCC_L2_FILE;
 
     CDFid cdf = NULL;
     CDFstatus cdfStatus = 0;
-    long numRecs = 0;
-    CDFdata data = NULL;
     float *pointer = NULL;
     uint16_t *pointeru16 = NULL;
 
-    while (e)
+    uint64_t sourceHash = 0;
+    bool cacheModel = state->siteModelCacheDir != NULL && hashSiteModelSource(path, &sourceHash) == ASCC_OK;
+    if (cacheModel && loadSiteModelCache(state, sourceHash) == ASCC_OK)
     {
-        if ((strncmp(e->fts_name, "thg_l2_asc_", 11) == 0) && (strncmp(e->fts_name + 11, state->site, 4) == 0) && strncmp(e->fts_name + e->fts_namelen - 4, ".cdf", 4) == 0)
-        {
-            state->l2filename = strdup(e->fts_name); // Track input files, but full path not needed.
-            cdfStatus = CDFopen(e->fts_path, &cdf);
-            if (cdfStatus != CDF_OK)
-            {
-                status = ASCC_L2_FILE;
-                break;
-            }
-            state->siteLatitudeGeodetic = getCdfFloat(cdf, state->site, "thg_asc_%s_glat");
-            state->siteLongitudeGeodetic = getCdfFloat(cdf, state->site, "thg_asc_%s_glon");
-            state->siteAltitudeMetres = getCdfFloat(cdf, state->site, "thg_asc_%s_alti");
+        if (state->verbose)
+            fprintf(stderr, "Site model for %s loaded from %s\n", state->l2filename, state->siteModelCacheDir);
+        return ASCC_OK;
+    }
+    cdfStatus = CDFopen((char*)path, &cdf);
+    if (cdfStatus != CDF_OK)
+    {
+        status = ASCC_L2_FILE;
+        goto cleanup;
+    }
+    state->siteLatitudeGeodetic = getCdfFloat(cdf, state->site, "thg_asc_%s_glat");
+    state->siteLongitudeGeodetic = getCdfFloat(cdf, state->site, "thg_asc_%s_glon");
+    state->siteAltitudeMetres = getCdfFloat(cdf, state->site, "thg_asc_%s_alti");
 
-            if (!isfinite(state->siteLatitudeGeodetic) || !isfinite(state->siteLongitudeGeodetic) || !isfinite(state->siteAltitudeMetres))
-            {
-                status = ASCC_L2_FILE;
-                break;
-            }
+    if (!isfinite(state->siteLatitudeGeodetic) || !isfinite(state->siteLongitudeGeodetic) || !isfinite(state->siteAltitudeMetres))
+    {
+        status = ASCC_L2_FILE;
+        goto cleanup;
+    }
 
-            pointer = &state->referenceElevations[0][0];
-            status = getCdfFloatArray(cdf, state->site, "thg_asf_%s_elev", 0, (void*)&pointer);
-            if (status != ASCC_OK)
-                break;
+    pointer = &state->referenceElevations[0][0];
+    status = getCdfFloatArray(cdf, state->site, "thg_asf_%s_elev", 0, (void*)&pointer);
+    if (status != ASCC_OK)
+        goto cleanup;
 
-            pointer = &state->referenceAzimuths[0][0];
-            status = getCdfFloatArray(cdf, state->site, "thg_asf_%s_azim", 0, (void*)&pointer);
-            if (status != ASCC_OK)
-                break;
+    pointer = &state->referenceAzimuths[0][0];
+    status = getCdfFloatArray(cdf, state->site, "thg_asf_%s_azim", 0, (void*)&pointer);
+    if (status != ASCC_OK)
+        goto cleanup;
 
-            pointeru16 = &state->sitePixelOffsets[0][0];
-            status = getCdfFloatArray(cdf, state->site, "thg_asf_%s_offset", 0, (void*)&pointeru16);
-            if (status != ASCC_OK)
-                break;
+    pointeru16 = &state->sitePixelOffsets[0][0];
+    status = getCdfFloatArray(cdf, state->site, "thg_asf_%s_offset", 0, (void*)&pointeru16);
+    if (status != ASCC_OK)
+        goto cleanup;
 
-            long attrNum = CDFgetAttrNum(cdf, "Generation_date");
-            if (attrNum < 0)
-            {
-                status = ASCC_CDF_READ;
-                break;
-            }
-            long dataType = 0;
-            long nVals = 0;
-            status = CDFattrEntryInquire(cdf, attrNum, 0, &dataType, &nVals);
-            if (status != CDF_OK)
-                break;
-            state->calibrationDateGenerated = calloc(nVals + 1, 1);
-            if (state->calibrationDateGenerated == NULL)
+    long attrNum = CDFgetAttrNum(cdf, "Generation_date");
+    if (attrNum < 0)
+    {
+        status = ASCC_CDF_READ;
+        goto cleanup;
+    }
+    long dataType = 0;
+    long nVals = 0;
+    status = CDFattrEntryInquire(cdf, attrNum, 0, &dataType, &nVals);
+    if (status != CDF_OK)
+        goto cleanup;
+    free(state->calibrationDateGenerated);
+    state->calibrationDateGenerated = calloc(nVals + 1, 1);
+    if (state->calibrationDateGenerated == NULL)
+    {
+        status = ASCC_MEM;
+        goto cleanup;
+    }
+    status = CDFgetAttrgEntry(cdf, attrNum, 0, state->calibrationDateGenerated);
+    if (status != CDF_OK)
+        goto cleanup;
+
+    // The date used for calibrations is not clear for L2 files. Set to unknown.
+    free(state->calibrationDateUsed);
+    state->calibrationDateUsed = strdup("unknown");
+    if (state->calibrationDateUsed == NULL)
+    {
+        status = ASCC_MEM;
+        goto cleanup;
+    }
+    
+    for (int c = 0; c < IMAGE_COLUMNS; c++)
+    {
+        for (int r = 0; r < IMAGE_ROWS; r++)
+        {
+            if (isfinite(state->referenceAzimuths[c][r]) && isfinite(state->referenceElevations[c][r]))
             {
-                status = ASCC_MEM;
-                break;
+                state->pixelX[c][r] = cos((90.0 - state->referenceAzimuths[c][r])*M_PI/180.0) * cos(state->referenceElevations[c][r]*M_PI/180.0);
+                state->pixelY[c][r] = sin((90.0 - state->referenceAzimuths[c][r])*M_PI/180.0) * cos(state->referenceElevations[c][r]*M_PI/180.0);
+                state->pixelZ[c][r] = sin(state->referenceElevations[c][r]*M_PI/180.0);
             }
-            status = CDFgetAttrgEntry(cdf, attrNum, 0, state->calibrationDateGenerated);
-            if (status != CDF_OK)
-                break;
-
-            // The date used for calibrations is not clear for L2 files. Set to unknown.
-            state->calibrationDateUsed = "unknown";
-            
-            for (int c = 0; c < IMAGE_COLUMNS; c++)
+            else
             {
-                for (int r = 0; r < IMAGE_ROWS; r++)
-                {
-                    if (isfinite(state->referenceAzimuths[c][r]) && isfinite(state->referenceElevations[c][r]))
-                    {
-                        state->pixelX[c][r] = cos((90.0 - state->referenceAzimuths[c][r])*M_PI/180.0) * cos(state->referenceElevations[c][r]*M_PI/180.0);
-                        state->pixelY[c][r] = sin((90.0 - state->referenceAzimuths[c][r])*M_PI/180.0) * cos(state->referenceElevations[c][r]*M_PI/180.0);
-                        state->pixelZ[c][r] = sin(state->referenceElevations[c][r]*M_PI/180.0);
-                    }
-                    else
-                    {
-                        state->pixelX[c][r] = NAN;
-                        state->pixelY[c][r] = NAN;
-                        state->pixelZ[c][r] = NAN;
-                    }
-                }
+                state->pixelX[c][r] = NAN;
+                state->pixelY[c][r] = NAN;
+                state->pixelZ[c][r] = NAN;
             }
-            if (state->verbose)
-                fprintf(stderr, "Site location (%s): %.3fN %.3fE, altitude %.0f m\n", state->site, state->siteLatitudeGeodetic, state->siteLongitudeGeodetic, state->siteAltitudeMetres);
-
-            status = ASCC_OK;
-            break;
-
         }
-        e = fts_read(fts);
     }
+    if (state->verbose)
+        fprintf(stderr, "Site location (%s): %.3fN %.3fE, altitude %.0f m\n", state->site, state->siteLatitudeGeodetic, state->siteLongitudeGeodetic, state->siteAltitudeMetres);
+
+    if (cacheModel && saveSiteModelCache(state, sourceHash) != ASCC_OK && state->verbose)
+        fprintf(stderr, "Could not save the site model to %s\n", state->siteModelCacheDir);
+
+    status = ASCC_OK;
 
-    if (data != NULL)
-        CDFdataFree(data);
+cleanup:
     if (cdf != NULL)
         CDFclose(cdf);
 
-    fts_close(fts);
-
     return status;
 }
 
@@ -403,58 +470,93 @@ void reverseBytes(uint8_t *word, int nBytes)
 }
 
 
-int loadSkymap(ProgramState *state)
+int loadSkymap(ProgramState *state, double epoch)
 {
     if (state == NULL)
         return ASCC_ARGUMENTS;
 
-    int status = ASCC_OK;
-    if (state->skymapfilename == NULL)
+    // A skymap file given by the user is used as is
+    if (state->skymapfilename != NULL)
+        return loadSiteModel(state, state->skymapfilename, state->l2filename, true);
+
+    char *path = NULL;
+    int status = findCalibrationFile(state, state->skymapdir, CALIBRATION_SKYMAP, epoch, &path);
+    if (status != ASCC_OK)
     {
-        char *dir[2] = {state->skymapdir, NULL};
-        // TODO sort FTS listings to get most recent prior skymap version first
-        FTS *fts = fts_open(dir, FTS_LOGICAL, NULL);
-        if (fts == NULL)
-        {
-            if (state->verbose)
-                fprintf(stderr, "Unable to read skymap directory %s.\n", state->skymapdir);
-            return ASCC_L2_FILE;
-        }
+        if (state->verbose)
+            fprintf(stderr, "Unable to find a skymap file for %s in %s.\n", state->site, state->skymapdir);
+        return status;
+    }
 
-        FTSENT *e = fts_read(fts);
+    status = loadSiteModel(state, path, state->l2filename, true);
+    if (status == ASCC_OK)
+    {
+        state->skymapfilename = path;
+        state->siteModelFromIndex = true;
+    }
+    else
+        free(path);
 
-        int status = ASCC_L2_FILE;
+    return status;
+}
 
-        CDFid cdf = NULL;
-        CDFstatus cdfStatus = 0;
-        long numRecs = 0;
-        CDFdata data = NULL;
-        float *pointer = NULL;
-        uint16_t *pointeru16 = NULL;
+// Switches to the reference calibration that applies at epoch, if the one
+// loaded was chosen from the calibration index and another file applies.
+int selectSiteModel(ProgramState *state, double epoch, bool *switched)
+{
+    if (state == NULL || switched == NULL)
+        return ASCC_ARGUMENTS;
 
-        while (e)
-        {
-            if ((strncmp(e->fts_name, "themis_skymap_", 14) == 0) && (strncmp(e->fts_name + 14, state->site, 4) == 0) && strncmp(e->fts_name + e->fts_namelen - 4, ".sav", 4) == 0)
-            {
-                // Likely a skymap file
-                state->skymapfilename = strdup(e->fts_path);
-                break;
-            }
-            e = fts_read(fts);
-        }
-        fts_close(fts);
-    }
+    *switched = false;
+    if (!state->siteModelFromIndex || state->calibrationIndex == NULL)
+        return ASCC_OK;
 
-    if (state->skymapfilename == NULL)
+    CalibrationIndex *index = state->calibrationIndex;
+    char *root = state->skymap ? state->skymapdir : state->l2dir;
+    int type = state->skymap ? CALIBRATION_SKYMAP : CALIBRATION_L2;
+    int status = updateCalibrationIndex(index, root);
+    if (status != ASCC_OK)
+        return status;
+    saveCalibrationIndex(index);
+    const CalibrationFile *file = bestCalibrationFile(index, state->site, type, epoch, indexedDirectoryPath(index, root));
+    if (file == NULL)
+        return ASCC_OK;
+
+    const char *name = strrchr(file->path, '/');
+    name = name != NULL ? name + 1 : file->path;
+    if ((state->skymap && strcmp(file->path, state->skymapfilename) == 0) || (!state->skymap && strcmp(name, state->l2filename) == 0))
+        return ASCC_OK;
+
+    char *path = strdup(file->path);
+    char *l2filename = strdup(name);
+    if (path == NULL || l2filename == NULL)
     {
-        if (state->verbose)
-            fprintf(stderr, "Unable to find skymap file.\n");
-        return ASCC_SKYMAP_FILE;
+        free(path);
+        free(l2filename);
+        return ASCC_MEM;
     }
+    status = loadSiteModel(state, path, l2filename, state->skymap);
+    if (status != ASCC_OK)
+    {
+        free(path);
+        free(l2filename);
+        return status;
+    }
+    if (state->skymap)
+    {
+        free(state->skymapfilename);
+        state->skymapfilename = path;
+        free(l2filename);
+    }
+    else
+    {
+        free(state->l2filename);
+        state->l2filename = l2filename;
+        free(path);
+    }
+    *switched = true;
 
-    status = loadSkymapFromFile(state);
-
-    return status;
+    return ASCC_OK;
 }
 
 int loadSkymapFromFile(ProgramState *state)
@@ -462,6 +564,15 @@ int loadSkymapFromFile(ProgramState *state)
     if (state == NULL)
         return ASCC_ARGUMENTS;
 
+    uint64_t sourceHash = 0;
+    bool cacheModel = state->siteModelCacheDir != NULL && hashSiteModelSource(state->skymapfilename, &sourceHash) == ASCC_OK;
+    if (cacheModel && loadSiteModelCache(state, sourceHash) == ASCC_OK)
+    {
+        if (state->verbose)
+            fprintf(stderr, "Site model for %s loaded from %s\n", state->skymapfilename, state->siteModelCacheDir);
+        return ASCC_OK;
+    }
+
     VariableList variables = {0};
     SaveInfo fileInfo = {0};
 
@@ -510,6 +621,7 @@ int loadSkymapFromFile(ProgramState *state)
     v = variableData(data, "skymap.generation_info.date_generated");
     if (v == NULL)
         return ASCC_SKYMAP_FILE;
+    free(state->calibrationDateGenerated);
     state->calibrationDateGenerated  = strdup((char*)v->data);
     if (state->calibrationDateGenerated == NULL)
         return ASCC_MEM;
@@ -517,6 +629,7 @@ int loadSkymapFromFile(ProgramState *state)
     v = variableData(data, "skymap.generation_info.date_time_used");
     if (v == NULL)
         return ASCC_SKYMAP_FILE;
+    free(state->calibrationDateUsed);
     state->calibrationDateUsed  = strdup((char*)v->data);
     if (state->calibrationDateUsed == NULL)
         return ASCC_MEM;
@@ -600,6 +713,9 @@ int loadSkymapFromFile(ProgramState *state)
         }
     }
 
+    if (cacheModel && saveSiteModelCache(state, sourceHash) != ASCC_OK && state->verbose)
+        fprintf(stderr, "Could not save the site model to %s\n", state->siteModelCacheDir);
+
     return ASCC_OK;
 
 }
\ No newline at end of file
@@ -24,7 +24,9 @@
 #include "main.h"
 #include <cdf.h>
 
-int loadThemisLevel2(ProgramState *state);
+int loadThemisLevel2(ProgramState *state, double epoch);
+int loadThemisLevel2File(ProgramState *state, const char *path);
+int loadSiteModel(ProgramState *state, const char *path, const char *name, bool skymap);
 
 float getCdfFloat(CDFid cdf, char *site, char *varNameTemplate);
 int getCdfFloatArray(CDFid cdf, char *site, char *varNameTemplate, long recordIndex, void **data);
@@ -33,8 +35,9 @@ int loadStars(ProgramState *state);
 int readBSC5Int32(FILE *f, int32_t *value);
 void reverseBytes(uint8_t *word, int nBytes);
 
-int loadSkymap(ProgramState *state);
+int loadSkymap(ProgramState *state, double epoch);
 int loadSkymapFromFile(ProgramState *state);
+int selectSiteModel(ProgramState *state, double epoch, bool *switched);
 
 
 #endif // _IMPORT_H
@@ -1,32 +1,75 @@
 #include "info.h"
 #include "main.h"
 #include "util.h"
+#include "platesolve.h"
+#include "export.h"
+#include "columnexport.h"
+#include "shard.h"
 
 #include <stdio.h>
 
 void usage(ProgramState *state, char *name)
 {
     printf("Usage: %s <site> <firstCalDate> <lastCalDate> [options] [--help] [--help-options]\n", name);
+    printf("       %s merge <partialResultsFile> ... [options]\n", name);
     printf("\nEstimate THEMIS ASI elevation and azimuth errors for <site> from <firstCalDate> to <lastCalDate>.\n");
     printf("\n<site> is a 4-letter THEMIS site abbreviation, lowercase (e.g., rank).\n");
     printf("\nDates have the form yyyy-mm-ddTHH:MM:SS.sss interpreted as universal times without leap seconds (THEMIS time).\n");
+    printf("\nmerge combines the partial results of runs with --partial-results over separate parts of a calibration interval into the calibration CDF for the whole interval. The result is the same as that of a single run over the interval, apart from the processing times and command recorded in its attributes. The reference calibration options must select the same L2 or skymap file as in those runs.\n");
     if (state->showOptions)
     {
         printf("\nOptions:\n");
         printOptMsg("--exportdir=<dir>", "sets the directory to export the results to. Defaults to \".\".");
-        printOptMsg("--l1dir=<dir>", "sets the directory containing THEMIS level 1 (ASI) files. Defaults to \".\". Only one version of each L1 file can be in this directory.");
+        printOptMsg("--l1dir=<dir>", "sets the directory containing THEMIS level 1 (ASI) files. Defaults to \".\". The highest version of each L1 file is used.");
+        printOptMsg("--l1-path-template=<template>", "read only the L1 directories that can hold files for the calibration interval. <template> is the directory of an hour's L1 file relative to the L1 directory, made of <site>, <year>, <month>, <day> and <hour>, e.g. <site>/<year>/<month> for the THEMIS archive. The L1 directory is searched in full if none of those directories exist.");
         printOptMsg("--l2dir=<dir>", "sets the directory containing THEMIS level 2 (calibration) files. Defaults to \".\".");
         printOptMsg("--stardir=<dir>", "sets the directory containing the Yale Bright Star Catalog file (BSC5ra). Defaults to \".\".");
         printOptMsg("--skymap", "use an IDL skymap file instead of a THEMIS L2 calibration file.");
         printOptMsg("--skymapdir=<dir>", "sets the directory containing the IDL skymap files. Defaults to \".\".");
+        printOptMsg("--calibration-index=<file>", "keep the list of L2 and skymap files found under the L2 and skymap directories in <file>, and in later runs reread only the directories that changed. The reference is the file for the site whose validity starts latest before the first calibration time, with the highest version. With --watch the reference is switched when another file applies to a new L1 file.");
         printOptMsg("--skymap=<file>", "use a specific IDL skymap file.");
         printOptMsg("--number-of-calibration-stars=N", "set the number of calibration stars. Defaults to " STR(N_CALIBRATION_STARS) ".");
         printOptMsg("--star-search-box-width=N", "set the width of the calibration star search box. Defaults to " STR(STAR_SEARCH_BOX_WIDTH) ".");
         printOptMsg("--star-max-jitter-pixels=<value>", "set the maximum change in star image position from previous image to be included in error estimation. Defaults to " STR(STAR_MAX_PIXEL_JITTER) ".");
+        printOptMsg("--max-background-signal=N", "skip a star if the mean signal in its search box exceeds N counts. Defaults to " STR(MAX_BACKGROUND_SIGNAL_FOR_MOMENTS) ".");
+        printOptMsg("--max-peak-signal=N", "leave pixels above N counts out of star centroids. Defaults to " STR(MAX_PEAK_SIGNAL_FOR_MOMENTS) ".");
+        printOptMsg("--watch", "keep running: analyze the L1 files already in the L1 directory, then each L1 file written or moved into it, until interrupted. Attitudes are appended to themis_<site>_attitude_rolling.txt in the export directory and the latest one is written to themis_<site>_attitude_latest.txt. Each row ends with the reference calibration file it is relative to. No calibration file is written. Use a late last date to watch indefinitely.");
+        printOptMsg("--sweep=<grid>", "analyze each image once with every combination of settings in <grid>, e.g. stars=10,20:box=7,9:jitter=1,2:background=4000:peak=30000, and export a table of star yield and attitude scatter per combination instead of the calibration file. Settings not in <grid> keep their option values. Star predictions are shared by all combinations. Decimation, tracking, pyramid search, blind solving, the global fit, star sectors and the early stop are not used.");
+        printOptMsg("--track-stars", "once a calibration star is found, look for it in the next image within " STR(TRACKING_BOX_HALF_WIDTH) " pixels of its last position instead of searching around the reference map prediction. The full search is repeated only when the star is first selected or is lost.");
+        printOptMsg("--exact-star-positions", "convert each candidate star's RA and Dec to azimuth and elevation for every image. By default star positions are evaluated from Chebyshev series in hour angle fitted once per night for the site's latitude, which agree with the conversion to far better than a pixel.");
+        printOptMsg("--spread-stars", "select calibration stars spread over the field of view instead of the brightest ones: the sky above " STR(CALIBRATION_ELEVATION_BOUND) " degrees elevation is divided into " STR(STAR_SECTORS) " azimuth sectors, each split at " STR(STAR_SECTOR_BAND_ELEVATION) " degrees elevation, and each part gets an equal share of the calibration stars, brightest first. A well-conditioned attitude fit then needs fewer stars.");
+        printOptMsg("--star-sectors=N", "like --spread-stars with N azimuth sectors, up to " STR(MAX_STAR_SECTORS) ".");
+        printOptMsg("--early-stop", "centroid calibration stars in batches, starting with the " STR(EARLY_STOP_FIRST_BATCH) " first stars and growing by half, and stop once the attitude fitted to the stars so far changes by less than the early stop rotation change from one batch to the next and the stars constrain rotations about every axis. Best used with a large number of calibration stars and --spread-stars. Not used with --sweep.");
+        printOptMsg("--early-stop-rotation-change=<value>", "set the early stop rotation change in degrees. Implies --early-stop. Defaults to " STR(EARLY_STOP_ROTATION_CHANGE) ".");
+        printOptMsg("--early-stop-conditioning=<value>", "set the smallest fit conditioning for an early stop, from 0 for stars all in one direction to 0.667 for stars over the whole sky (about 0.5 for stars spread evenly above " STR(CALIBRATION_ELEVATION_BOUND) " degrees). Implies --early-stop. Defaults to " STR(EARLY_STOP_CONDITIONING) ".");
+        printOptMsg("--star-detectability-dir=<dir>", "keep statistics of how often each catalog star is found in each part of the sky in themis_<site>_star_detectability.dat in <dir>, updated at the end of each run. A star found in fewer than " STR(STAR_DETECTABILITY_MIN_RATE) " of at least " STR(STAR_DETECTABILITY_MIN_ATTEMPTS) " attempts in a part of the sky, such as one behind a building or in a vignetted corner, is passed over for the next brightest star there, and tried again once every " STR(STAR_DETECTABILITY_REPROBE_INTERVAL) " images. Not used with --sweep, and cannot be combined with partial results.");
+        printOptMsg("--pyramid-search", "search for each star's brightest pixel within the pyramid search radius of its predicted position using 4x and 2x binned copies of the image, then refine it at full resolution. This tolerates large pointing drifts at nearly the cost of the default search box.");
+        printOptMsg("--pyramid-search-radius=N", "set the pyramid search radius in pixels. Defaults to " STR(PYRAMID_SEARCH_RADIUS) ".");
+        printOptMsg("--site-model-cache-dir=<dir>", "keep the site model read from the L2 or skymap file in <dir>, with the maps in L2 layout and the pixel directions precomputed, and load it from there in later runs instead of parsing the file. Models are keyed by a hash of the L2 or skymap file contents.");
+        printOptMsg("--frame-cache-dir=<dir>", "cache each L1 file in <dir> as an uncompressed frame cube the first time it is read, and read later runs from the cube. Cubes are remade when the L1 file's size or modification time changes.");
+        printOptMsg("--frame-cache-size-mb=N", "remove the least recently used frame cubes when the cache exceeds N MB. Defaults to " STR(FRAME_CACHE_MAX_MEGABYTES) ".");
+        printOptMsg("--frame-cache-subtract-offsets", "store frame cubes with the CCD offsets already subtracted.");
+        printOptMsg("--prefetch-depth=K", "read up to K L1 files ahead of the one being analyzed in a background thread. 0 disables prefetching. Defaults to " STR(L1_PREFETCH_DEPTH) ".");
+        printOptMsg("--cdf-library-reads", "read every L1 image through the CDF library. By default images stored uncompressed are read directly from the memory-mapped L1 file.");
+        printOptMsg("--global-fit", "also fit one camera attitude and a radial lens distortion correction to all calibration star observations of the run, and export the resulting GlobalCalibratedElevations and GlobalCalibratedAzimuths.");
+        printOptMsg("--global-fit-threads=N", "set the number of threads used by --global-fit. Defaults to the number of processors.");
+        printOptMsg("--blind-solve", "when fewer than half of the calibration stars agree with the fitted attitude, as after the camera has been moved, find the attitude by matching triangles of the brightest sources in the image with triangles of BSC5 stars, and use it to predict where to search for stars.");
+        printOptMsg("--plate-solve-index-file=<file>", "set the cached star triangle index used by --blind-solve. It is built from the star catalog when missing or out of date. Defaults to <stardir>/" PLATE_SOLVE_INDEX_FILENAME ".");
+        printOptMsg("--decimate", "analyze every " STR(DECIMATION_STRIDE) "th image and interpolate attitudes for the images in between, unless the attitude changes or stars are lost between analyzed images. Interpolated attitudes are flagged in the CDF.");
+        printOptMsg("--decimation-stride=N", "analyze every Nth image with --decimate. A stride of 1 (the default) analyzes every image.");
+        printOptMsg("--decimation-max-rotation-change=<value>", "set the largest change in pointing error in degrees between analyzed images for which attitudes are interpolated. This bounds the interpolation error. Defaults to " STR(DECIMATION_MAX_ROTATION_CHANGE) ".");
+        printOptMsg("--skip-daylight", "skip L1 files and images recorded while the sun is less than the sun depression angle below the horizon. Whole files are skipped without being opened.");
+        printOptMsg("--sun-depression-angle=<value>", "set the sun depression angle in degrees for --skip-daylight, and enable that option. Defaults to " STR(SUN_DEPRESSION_ANGLE) ".");
+        printOptMsg("--skip-moonlight", "skip L1 files and images recorded while the moon is above the moon maximum elevation.");
+        printOptMsg("--moon-max-elevation=<value>", "set the moon maximum elevation in degrees for --skip-moonlight, and enable that option. Defaults to " STR(MOON_MAX_ELEVATION) ".");
         printOptMsg("--print-star-info", "print calibration star information for each image.");
         printOptMsg("--show-progress", "show image processing progress.");
         printOptMsg("--exportdir=<dir>", "set the directory for the exported calibration CDF.");
         printOptMsg("--overwrite-cdf", "overwrite the target CDF if it exists.");
+        printOptMsg("--export-compression=<profile>", "set the CDF compression: none, rle, or gzip1 to gzip9, optionally followed by per-variable overrides, e.g. gzip6,PointingErrorDCM=gzip9,CCDOffsets=none. An override of a variable that is not exported is an error. Defaults to " EXPORT_DEFAULT_PROFILE ".");
+        printOptMsg("--export-columns", "also export the calibration CDF variables, plus the attitude quaternions, as an uncompressed little-endian columnar file with the same name and extension " COLUMN_FILE_EXTENSION ". Columns are 64-byte aligned for use with mmap; the layout is described in columnfile.h.");
+        printOptMsg("--partial-results", "write the per-image results and the sums the calibration is averaged from to themis_<site>_partial_results_<firstCalDate>_<lastCalDate>" SHARD_FILE_EXTENSION " in the export directory instead of the calibration CDF, for merging with the merge command. L1 files are analyzed independently, so an interval split into shards at L1 file boundaries gives the same per-image results as a single run, except that the --blind-solve attitude seed does not carry over from one shard to the next. --global-fit and --star-detectability-dir cannot be used.");
+        printOptMsg("--compare-export-profiles", "after exporting, also write the calibration with the none, rle, gzip1, gzip6 and gzip9 profiles to scratch files in the export directory and print the size and write time of each. The scratch files are removed.");
         printOptMsg("--verbose", "print more information during processing.");
         printOptMsg("--help", "show how to run this program.");
         printOptMsg("--help-options", "show program options.");
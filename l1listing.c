@@ -0,0 +1,281 @@
+/*
+
+    AllSkyCameraCal: l1listing.c
+
+    Copyright (C) 2022  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include "l1listing.h"
+
+#include "main.h"
+#include "analysis.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <dirent.h>
+#include <fts.h>
+
+#include <cdf.h>
+
+// The L1 files that can overlap [firstCalTime, lastCalTime), in time order,
+// with the highest version of each hour. With --l1-path-template only the
+// directories the template gives for the hours of the interval are read;
+// otherwise, or if none of those directories exist, l1dir is walked.
+
+typedef struct L1Candidate
+{
+    char *path;
+    double start;
+    int version;
+} L1Candidate;
+
+typedef struct L1Candidates
+{
+    L1Candidate *candidates;
+    size_t n;
+    size_t size;
+} L1Candidates;
+
+static bool l1FileOverlaps(ProgramState *state, double start)
+{
+    double stop = start + L1_FILE_MILLISECONDS;
+
+    return !((start < state->firstCalTime && stop <= state->firstCalTime) || (start >= state->lastCalTime && stop > state->lastCalTime));
+}
+
+// Adds directory/name if it is an L1 file of the site that overlaps the interval
+static int addCandidate(ProgramState *state, L1Candidates *list, const char *directory, size_t directoryLength, char *name)
+{
+    if (strlen(name) != L1_FILENAME_LENGTH || strncmp(name + 11, state->site, 4) != 0 || strncmp(name + 26, "_v", 2) != 0)
+        return ASCC_OK;
+    double start = epochFromL1Filename(name);
+    if (start == ILLEGAL_EPOCH_VALUE || !l1FileOverlaps(state, start))
+        return ASCC_OK;
+
+    if (list->n == list->size)
+    {
+        size_t size = list->size == 0 ? 64 : 2 * list->size;
+        L1Candidate *mem = realloc(list->candidates, size * sizeof *mem);
+        if (mem == NULL)
+            return ASCC_MEM;
+        list->candidates = mem;
+        list->size = size;
+    }
+    size_t n = directoryLength + 1 + L1_FILENAME_LENGTH + 1;
+    L1Candidate *candidate = &list->candidates[list->n];
+    candidate->path = malloc(n);
+    if (candidate->path == NULL)
+        return ASCC_MEM;
+    snprintf(candidate->path, n, "%.*s/%s", (int)directoryLength, directory, name);
+    candidate->start = start;
+    candidate->version = atoi(name + 28);
+    list->n++;
+
+    return ASCC_OK;
+}
+
+static int compareCandidates(const void *first, const void *second)
+{
+    const L1Candidate *a = (const L1Candidate *)first;
+    const L1Candidate *b = (const L1Candidate *)second;
+
+    if (a->start != b->start)
+        return a->start < b->start ? -1 : 1;
+    // Highest version first
+    if (a->version != b->version)
+        return a->version > b->version ? -1 : 1;
+
+    return strcmp(a->path, b->path);
+}
+
+// Replaces <site>, <year>, <month>, <day> and <hour> with the values for epoch
+int expandL1PathTemplate(const char *template, const char *site, double epoch, char *path, size_t pathSize)
+{
+    long y = 0;
+    long m = 0;
+    long d = 0;
+    long h = 0;
+    long min = 0;
+    long s = 0;
+    long ms = 0;
+    EPOCHbreakdown(epoch, &y, &m, &d, &h, &min, &s, &ms);
+
+    size_t n = 0;
+    const char *t = template;
+    while (*t != '\0' && n + 1 < pathSize)
+    {
+        int written = 0;
+        if (strncmp(t, "<site>", 6) == 0)
+        {
+            written = snprintf(path + n, pathSize - n, "%s", site);
+            t += 6;
+        }
+        else if (strncmp(t, "<year>", 6) == 0)
+        {
+            written = snprintf(path + n, pathSize - n, "%04ld", y);
+            t += 6;
+        }
+        else if (strncmp(t, "<month>", 7) == 0)
+        {
+            written = snprintf(path + n, pathSize - n, "%02ld", m);
+            t += 7;
+        }
+        else if (strncmp(t, "<day>", 5) == 0)
+        {
+            written = snprintf(path + n, pathSize - n, "%02ld", d);
+            t += 5;
+        }
+        else if (strncmp(t, "<hour>", 6) == 0)
+        {
+            written = snprintf(path + n, pathSize - n, "%02ld", h);
+            t += 6;
+        }
+        else
+        {
+            path[n] = *t++;
+            written = 1;
+        }
+        if (written < 0)
+            return ASCC_ARGUMENTS;
+        n += (size_t)written;
+    }
+    if (*t != '\0' || n >= pathSize)
+        return ASCC_ARGUMENTS;
+    path[n] = '\0';
+
+    return ASCC_OK;
+}
+
+// Reads the template directory of each hour of the interval once
+static int listTemplatedL1Files(ProgramState *state, L1Candidates *list, L1Listing *listing)
+{
+    char relative[FILENAME_MAX + 1];
+    char directory[FILENAME_MAX + 1];
+    char previous[FILENAME_MAX + 1] = {0};
+
+    // First hour that can overlap the interval
+    double hour = floor(state->firstCalTime / L1_FILE_MILLISECONDS) * L1_FILE_MILLISECONDS;
+    for (; hour < state->lastCalTime; hour += L1_FILE_MILLISECONDS)
+    {
+        if (expandL1PathTemplate(state->l1PathTemplate, state->site, hour, relative, sizeof relative) != ASCC_OK)
+            return ASCC_ARGUMENTS;
+        snprintf(directory, sizeof directory, "%s/%s", state->l1dir, relative);
+        size_t n = strlen(directory);
+        while (n > 1 && directory[n - 1] == '/')
+            directory[--n] = '\0';
+        if (strcmp(directory, previous) == 0)
+            continue;
+        snprintf(previous, sizeof previous, "%s", directory);
+
+        DIR *dir = opendir(directory);
+        if (dir == NULL)
+            continue;
+        listing->nDirectoriesRead++;
+        int status = ASCC_OK;
+        struct dirent *entry = NULL;
+        while (status == ASCC_OK && (entry = readdir(dir)) != NULL)
+            status = addCandidate(state, list, directory, n, entry->d_name);
+        closedir(dir);
+        if (status != ASCC_OK)
+            return status;
+    }
+
+    return ASCC_OK;
+}
+
+static int walkL1Files(ProgramState *state, L1Candidates *list, L1Listing *listing)
+{
+    char *dir[2] = {state->l1dir, NULL};
+    FTS *fts = fts_open(dir, FTS_LOGICAL, NULL);
+    if (fts == NULL)
+        return ASCC_L1_FILE;
+
+    int status = ASCC_OK;
+    FTSENT *e = NULL;
+    while (status == ASCC_OK && (e = fts_read(fts)) != NULL)
+    {
+        if (e->fts_info == FTS_D)
+            listing->nDirectoriesRead++;
+        else if (e->fts_info == FTS_F)
+            status = addCandidate(state, list, e->fts_path, e->fts_pathlen - e->fts_namelen - 1, e->fts_name);
+    }
+    fts_close(fts);
+    listing->walked = true;
+
+    return status;
+}
+
+int listL1Files(ProgramState *state, L1Listing *listing)
+{
+    if (state == NULL || listing == NULL)
+        return ASCC_ARGUMENTS;
+
+    memset(listing, 0, sizeof *listing);
+    L1Candidates list = {0};
+    int status = ASCC_OK;
+
+    if (state->l1PathTemplate != NULL)
+        status = listTemplatedL1Files(state, &list, listing);
+    // Flat directories, or a template that does not match the archive
+    if (status == ASCC_OK && listing->nDirectoriesRead == 0)
+        status = walkL1Files(state, &list, listing);
+    if (status != ASCC_OK)
+        goto cleanup;
+
+    if (list.n > 1)
+        qsort(list.candidates, list.n, sizeof *list.candidates, compareCandidates);
+
+    listing->paths = malloc((list.n > 0 ? list.n : 1) * sizeof *listing->paths);
+    if (listing->paths == NULL)
+    {
+        status = ASCC_MEM;
+        goto cleanup;
+    }
+    for (size_t i = 0; i < list.n; i++)
+    {
+        // Highest version sorts first for each hour
+        if (listing->nPaths > 0 && list.candidates[i].start == list.candidates[i - 1].start)
+            continue;
+        listing->paths[listing->nPaths++] = list.candidates[i].path;
+        list.candidates[i].path = NULL;
+    }
+
+cleanup:
+    for (size_t i = 0; i < list.n; i++)
+        free(list.candidates[i].path);
+    free(list.candidates);
+    if (status != ASCC_OK)
+        freeL1Listing(listing);
+
+    return status;
+}
+
+void freeL1Listing(L1Listing *listing)
+{
+    if (listing == NULL)
+        return;
+
+    for (size_t i = 0; i < listing->nPaths; i++)
+        free(listing->paths[i]);
+    free(listing->paths);
+    listing->paths = NULL;
+    listing->nPaths = 0;
+
+    return;
+}
@@ -0,0 +1,46 @@
+/*
+
+    AllSkyCameraCal: l1listing.h
+
+    Copyright (C) 2022  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef _L1LISTING_H
+#define _L1LISTING_H
+
+#include "main.h"
+
+#include <stddef.h>
+
+// L1 file names: thg_l1_asf_<site>_<yyyymmddhh>_v<nn>.cdf
+#define L1_FILENAME_LENGTH 34
+#define L1_FILE_MILLISECONDS 3600000.0
+
+typedef struct L1Listing
+{
+    char **paths;
+    size_t nPaths;
+    // Directories read to build the listing
+    size_t nDirectoriesRead;
+    bool walked;
+} L1Listing;
+
+int listL1Files(ProgramState *state, L1Listing *listing);
+void freeL1Listing(L1Listing *listing);
+int expandL1PathTemplate(const char *template, const char *site, double epoch, char *path, size_t pathSize);
+
+#endif // _L1LISTING_H
@@ -0,0 +1,288 @@
+/*
+
+    AllSkyCameraCal: l1reader.c
+
+    Copyright (C) 2022  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "l1reader.h"
+
+#include "main.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// The CDF library describes the image variable (type, shape, compression,
+// encoding, majority). It does not expose where records are stored, so the
+// version 3 variable index records (VXR) are walked to find the value records
+// (VVR) holding each image. Internal record fields are always big-endian.
+
+static bool readBigEndian32(L1FrameMap *map, uint64_t offset, uint32_t *value)
+{
+    if (offset > map->length || map->length - offset < 4)
+        return false;
+
+    const uint8_t *b = map->base + offset;
+    *value = ((uint32_t)b[0] << 24) | ((uint32_t)b[1] << 16) | ((uint32_t)b[2] << 8) | (uint32_t)b[3];
+
+    return true;
+}
+
+static bool readBigEndian64(L1FrameMap *map, uint64_t offset, uint64_t *value)
+{
+    uint32_t high = 0;
+    uint32_t low = 0;
+    if (!readBigEndian32(map, offset, &high) || !readBigEndian32(map, offset + 4, &low))
+        return false;
+    *value = ((uint64_t)high << 32) | (uint64_t)low;
+
+    return true;
+}
+
+// Record type of the internal record at offset
+static bool recordType(L1FrameMap *map, uint64_t offset, uint32_t *type)
+{
+    return offset != 0 && readBigEndian32(map, offset + 8, type);
+}
+
+static bool littleEndianEncoding(long encoding, bool *littleEndian)
+{
+    switch (encoding)
+    {
+        case VAX_ENCODING:
+        case DECSTATION_ENCODING:
+        case IBMPC_ENCODING:
+        case ALPHAOSF1_ENCODING:
+        case ALPHAVMSd_ENCODING:
+        case ALPHAVMSg_ENCODING:
+        case ALPHAVMSi_ENCODING:
+        case ARM_LITTLE_ENCODING:
+        case IA64VMSi_ENCODING:
+        case IA64VMSd_ENCODING:
+        case IA64VMSg_ENCODING:
+            *littleEndian = true;
+            return true;
+        case NETWORK_ENCODING:
+        case SUN_ENCODING:
+        case SGi_ENCODING:
+        case IBMRS_ENCODING:
+        case PPC_ENCODING:
+        case HP_ENCODING:
+        case NeXT_ENCODING:
+        case ARM_BIG_ENCODING:
+            *littleEndian = false;
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Records the pixel offsets of the records described by a VXR and its successors
+static bool indexRecords(L1FrameMap *map, uint64_t vxr, int depth)
+{
+    uint32_t type = 0;
+    uint32_t nEntries = 0;
+    uint32_t nUsedEntries = 0;
+    uint32_t first = 0;
+    uint32_t last = 0;
+    uint64_t offset = 0;
+    uint64_t next = 0;
+
+    if (depth > CDF3_MAX_VXR_DEPTH)
+        return false;
+
+    // Guard against cycles in a damaged file
+    for (int nVxrs = 0; vxr != 0; nVxrs++)
+    {
+        if (nVxrs > map->nRecords || !recordType(map, vxr, &type) || type != CDF3_VXR)
+            return false;
+        if (!readBigEndian64(map, vxr + 12, &next) || !readBigEndian32(map, vxr + 20, &nEntries) || !readBigEndian32(map, vxr + 24, &nUsedEntries) || nUsedEntries > nEntries)
+            return false;
+
+        for (uint32_t e = 0; e < nUsedEntries; e++)
+        {
+            if (!readBigEndian32(map, vxr + 28 + 4 * (uint64_t)e, &first) || !readBigEndian32(map, vxr + 28 + 4 * (uint64_t)(nEntries + e), &last) || !readBigEndian64(map, vxr + 28 + 8 * (uint64_t)nEntries + 8 * (uint64_t)e, &offset))
+                return false;
+            if (first > last || !recordType(map, offset, &type))
+                return false;
+            if (type == CDF3_VXR)
+            {
+                if (!indexRecords(map, offset, depth + 1))
+                    return false;
+            }
+            else if (type == CDF3_VVR)
+            {
+                uint64_t data = offset + 12;
+                uint64_t nBytes = ((uint64_t)last - first + 1) * L1_FRAME_BYTES;
+                if (data > map->length || map->length - data < nBytes)
+                    return false;
+                for (uint64_t r = first; r <= last && r < (uint64_t)map->nRecords; r++)
+                    map->recordOffsets[r] = data + (r - first) * L1_FRAME_BYTES;
+            }
+            else
+            {
+                // Compressed value records (CVVR) and anything unexpected
+                return false;
+            }
+        }
+        vxr = next;
+    }
+
+    return true;
+}
+
+// Maps the L1 file and locates the image records. Returns ASCC_OK only if every
+// condition for reading frames directly from the mapping holds; otherwise the
+// map is left unmapped and images are read through the CDF library.
+int openL1FrameMap(ProgramState *state, CDFid cdf, char *l1file, L1FrameMap *map)
+{
+    if (state == NULL || cdf == NULL || l1file == NULL || map == NULL)
+        return ASCC_ARGUMENTS;
+
+    memset(map, 0, sizeof *map);
+
+    char cdfVarName[CDF_VAR_NAME_LEN + 1] = {0};
+    snprintf(cdfVarName, CDF_VAR_NAME_LEN + 1, "thg_asf_%s", state->site);
+    long varNum = CDFgetVarNum(cdf, cdfVarName);
+    if (varNum < 0)
+        return ASCC_L1_FILE;
+
+    long value = 0;
+    long compressionParams[CDF_MAX_PARMS] = {0};
+    long compressionPercent = 0;
+    long dimSizes[CDF_MAX_DIMS] = {0};
+    long encoding = 0;
+    bool littleEndian = false;
+    long maxRecord = 0;
+
+    if (CDFgetCompression(cdf, &value, compressionParams, &compressionPercent) != CDF_OK || value != NO_COMPRESSION)
+        return ASCC_L1_FILE;
+    if (CDFgetzVarCompression(cdf, varNum, &value, compressionParams, &compressionPercent) != CDF_OK || value != NO_COMPRESSION)
+        return ASCC_L1_FILE;
+    if (CDFgetzVarDataType(cdf, varNum, &value) != CDF_OK || (value != CDF_UINT2 && value != CDF_INT2))
+        return ASCC_L1_FILE;
+    if (CDFgetzVarNumDims(cdf, varNum, &value) != CDF_OK || value != 2)
+        return ASCC_L1_FILE;
+    if (CDFgetzVarDimSizes(cdf, varNum, dimSizes) != CDF_OK || dimSizes[0] != IMAGE_COLUMNS || dimSizes[1] != IMAGE_ROWS)
+        return ASCC_L1_FILE;
+    if (CDFgetMajority(cdf, &value) != CDF_OK || value != ROW_MAJOR)
+        return ASCC_L1_FILE;
+    if (CDFgetEncoding(cdf, &encoding) != CDF_OK || !littleEndianEncoding(encoding, &littleEndian))
+        return ASCC_L1_FILE;
+    if (CDFgetzVarMaxWrittenRecNum(cdf, varNum, &maxRecord) != CDF_OK || maxRecord < 0)
+        return ASCC_L1_FILE;
+
+    int fd = open(l1file, O_RDONLY);
+    if (fd < 0)
+        return ASCC_L1_FILE;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < 8)
+    {
+        close(fd);
+        return ASCC_L1_FILE;
+    }
+    void *base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return ASCC_L1_FILE;
+    madvise(base, (size_t)st.st_size, MADV_SEQUENTIAL);
+
+    map->base = base;
+    map->length = (size_t)st.st_size;
+    map->nRecords = maxRecord + 1;
+    map->swapBytes = littleEndian != (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__);
+
+    int status = ASCC_L1_FILE;
+    uint32_t magic = 0;
+    uint32_t type = 0;
+    uint64_t gdr = 0;
+    uint64_t vdr = 0;
+    uint32_t flags = 0;
+    uint64_t vxr = 0;
+
+    map->recordOffsets = calloc(map->nRecords, sizeof *map->recordOffsets);
+    if (map->recordOffsets == NULL)
+    {
+        status = ASCC_MEM;
+        goto cleanup;
+    }
+
+    // Version 3 single-file CDF without whole-file compression
+    if (!readBigEndian32(map, 0, &magic) || magic != CDF3_MAGIC || !readBigEndian32(map, 4, &magic) || magic != CDF3_UNCOMPRESSED_MAGIC)
+        goto cleanup;
+    if (!recordType(map, 8, &type) || type != CDF3_CDR || !readBigEndian64(map, 8 + 12, &gdr))
+        goto cleanup;
+    if (!recordType(map, gdr, &type) || type != CDF3_GDR || !readBigEndian64(map, gdr + 20, &vdr))
+        goto cleanup;
+
+    // Find the image variable in the zVariable descriptor chain
+    for (long nVdrs = 0; vdr != 0; nVdrs++)
+    {
+        if (nVdrs > CDF3_MAX_VDRS || !recordType(map, vdr, &type) || type != CDF3_ZVDR || vdr + 84 + CDF_VAR_NAME_LEN > map->length)
+            goto cleanup;
+        if (strncmp((const char *)map->base + vdr + 84, cdfVarName, CDF_VAR_NAME_LEN) == 0)
+            break;
+        if (!readBigEndian64(map, vdr + 12, &vdr))
+            goto cleanup;
+    }
+    if (vdr == 0 || !readBigEndian32(map, vdr + 44, &flags) || (flags & CDF3_VDR_COMPRESSION_FLAG) != 0 || !readBigEndian64(map, vdr + 28, &vxr))
+        goto cleanup;
+
+    if (!indexRecords(map, vxr, 0))
+        goto cleanup;
+
+    map->mapped = true;
+    status = ASCC_OK;
+
+cleanup:
+    if (status != ASCC_OK)
+        closeL1FrameMap(map);
+
+    return status;
+}
+
+// Pixels of a record in file byte order, or NULL if the record must be read through the CDF library
+const uint16_t *l1Frame(L1FrameMap *map, long record)
+{
+    if (map == NULL || !map->mapped || record < 0 || record >= map->nRecords || map->recordOffsets[record] == 0)
+        return NULL;
+
+    // Pixels are read in place only if they are aligned for uint16_t
+    const uint8_t *frame = map->base + map->recordOffsets[record];
+    if (((uintptr_t)frame & (sizeof(uint16_t) - 1)) != 0)
+        return NULL;
+
+    return (const uint16_t *)frame;
+}
+
+void closeL1FrameMap(L1FrameMap *map)
+{
+    if (map == NULL)
+        return;
+
+    if (map->base != NULL)
+        munmap((void *)map->base, map->length);
+    if (map->recordOffsets != NULL)
+        free(map->recordOffsets);
+    memset(map, 0, sizeof *map);
+
+    return;
+}
@@ -0,0 +1,67 @@
+/*
+
+    AllSkyCameraCal: l1reader.h
+
+    Copyright (C) 2022  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef _L1READER_H
+#define _L1READER_H
+
+#include "main.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include <cdf.h>
+
+// CDF version 3 internal record types used to locate the image records
+#define CDF3_MAGIC 0xCDF30001U
+#define CDF3_UNCOMPRESSED_MAGIC 0x0000FFFFU
+#define CDF3_CDR 1
+#define CDF3_GDR 2
+#define CDF3_VXR 6
+#define CDF3_VVR 7
+#define CDF3_ZVDR 8
+#define CDF3_CVVR 13
+#define CDF3_VDR_COMPRESSION_FLAG 0x4
+// Limits that stop the walk through a damaged file
+#define CDF3_MAX_VXR_DEPTH 8
+#define CDF3_MAX_VDRS 10000
+
+#define L1_FRAME_BYTES (IMAGE_COLUMNS * IMAGE_ROWS * sizeof(uint16_t))
+
+// Read-only mapping of an L1 file whose image records are stored uncompressed
+typedef struct L1FrameMap
+{
+    bool mapped;
+    const uint8_t *base;
+    size_t length;
+    long nRecords;
+    // Byte offset of each record's pixels in the file, 0 if the record is not stored
+    uint64_t *recordOffsets;
+    // File byte order differs from the host's
+    bool swapBytes;
+    // Frames already have the CCD offsets removed (frame cubes)
+    bool offsetsSubtracted;
+} L1FrameMap;
+
+int openL1FrameMap(ProgramState *state, CDFid cdf, char *l1file, L1FrameMap *map);
+const uint16_t *l1Frame(L1FrameMap *map, long record);
+void closeL1FrameMap(L1FrameMap *map);
+
+#endif // _L1READER_H
@@ -26,6 +26,16 @@
 #include "info.h"
 #include "options.h"
 #include "util.h"
+#include "platesolve.h"
+#include "globalfit.h"
+#include "sweep.h"
+#include "watch.h"
+#include "columnexport.h"
+#include "calindex.h"
+#include "shard.h"
+#include "startrack.h"
+#include "pixelindex.h"
+#include "detectability.h"
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -37,6 +47,8 @@ int main(int argc, char **argv)
     int status = ASCC_OK;
 
     ProgramState state = {0};
+    CalibrationIndex calibrationIndex = {0};
+    ShardSet shards = {0};
     status = setOptions(&state, argc, argv);
     if (status != ASCC_OK)
         return EXIT_FAILURE;
@@ -51,38 +63,91 @@ int main(int argc, char **argv)
         return EXIT_SUCCESS;
     }
 
-    if (argc - state.nOptions != 4)
+    state.mergePartialResults = argc > 1 && strcmp(argv[1], "merge") == 0;
+    if (state.mergePartialResults)
     {
-        usage(&state, argv[0]);
-        return EXIT_FAILURE;
+        if (argc - state.nOptions < 3)
+        {
+            usage(&state, argv[0]);
+            return EXIT_FAILURE;
+        }
+        // The site and calibration interval come from the partial results files
+        char **shardFilenames = calloc(argc, sizeof *shardFilenames);
+        if (shardFilenames == NULL)
+            return EXIT_FAILURE;
+        size_t nShardFilenames = 0;
+        for (int i = 2; i < argc; i++)
+            if (strncmp(argv[i], "--", 2) != 0)
+                shardFilenames[nShardFilenames++] = argv[i];
+        status = openShards(&state, shardFilenames, nShardFilenames, &shards);
+        free(shardFilenames);
+        if (status != ASCC_OK)
+        {
+            freeShards(&shards);
+            return EXIT_FAILURE;
+        }
     }
+    else
+    {
+        if (argc - state.nOptions != 4)
+        {
+            usage(&state, argv[0]);
+            return EXIT_FAILURE;
+        }
 
-    state.site = argv[1];
-    if (strlen(state.site) != 4)
+        state.site = argv[1];
+        if (strlen(state.site) != 4)
+        {
+            fprintf(stderr, "site name must be 4 letters, like \"rank\" for Rankin Inlet.\n");
+            return EXIT_FAILURE;
+        }
+
+        state.firstCalDateString = argv[2];
+        state.firstCalTime = parseEPOCH4(state.firstCalDateString);
+        if (state.firstCalTime == ILLEGAL_EPOCH_VALUE)
+        {
+            fprintf(stderr, "The first calibration date is garbage.\n");
+            return EXIT_FAILURE;
+        }
+
+        state.lastCalDateString = argv[3];
+        state.lastCalTime = parseEPOCH4(state.lastCalDateString);
+        if (state.lastCalTime == ILLEGAL_EPOCH_VALUE)
+        {
+            fprintf(stderr, "The last calibration date is garbage.\n");
+            return EXIT_FAILURE;
+        }
+
+        if (state.lastCalTime <= state.firstCalTime)
+        {
+            fprintf(stderr, "Last calibration time must be greater than first calibration time.\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (state.watchL1Dir && (state.sweepSpec != NULL || state.globalFit))
     {
-        fprintf(stderr, "site name must be 4 letters, like \"rank\" for Rankin Inlet.\n");
+        fprintf(stderr, "--watch cannot be combined with --sweep or --global-fit.\n");
         return EXIT_FAILURE;
     }
 
-    state.firstCalDateString = argv[2];
-    state.firstCalTime = parseEPOCH4(state.firstCalDateString);
-    if (state.firstCalTime == ILLEGAL_EPOCH_VALUE)
+    if ((state.exportPartialResults || state.mergePartialResults) && (state.watchL1Dir || state.sweepSpec != NULL || state.globalFit))
     {
-        fprintf(stderr, "The first calibration date is garbage.\n");
+        fprintf(stderr, "Partial results cannot be combined with --watch, --sweep or --global-fit.\n");
         return EXIT_FAILURE;
     }
 
-    state.lastCalDateString = argv[3];
-    state.lastCalTime = parseEPOCH4(state.lastCalDateString);
-    if (state.lastCalTime == ILLEGAL_EPOCH_VALUE)
+    // Stars skipped depend on the statistics gathered over the whole run, so
+    // partial results would not merge into the result of a single run
+    if ((state.exportPartialResults || state.mergePartialResults) && state.starDetectabilityDir != NULL)
     {
-        fprintf(stderr, "The last calibration date is garbage.\n");
+        fprintf(stderr, "Partial results cannot be combined with --star-detectability-dir.\n");
         return EXIT_FAILURE;
     }
 
-    if (state.lastCalTime <= state.firstCalTime)
+    if (state.exportPartialResults && state.mergePartialResults)
     {
-        fprintf(stderr, "Last calibration time must be greater than first calibration time.\n");
+        fprintf(stderr, "merge cannot write partial results.\n");
         return EXIT_FAILURE;
     }
 
@@ -92,6 +157,18 @@ int main(int argc, char **argv)
         return EXIT_FAILURE;
     }
 
+    if (state.frameCacheDir != NULL && access(state.frameCacheDir, W_OK) != 0)
+    {
+        fprintf(stderr, "Frame cache directory %s not found or not writable.\n", state.frameCacheDir);
+        return EXIT_FAILURE;
+    }
+
+    if (state.starDetectabilityDir != NULL && access(state.starDetectabilityDir, W_OK) != 0)
+    {
+        fprintf(stderr, "Star detectability directory %s not found or not writable.\n", state.starDetectabilityDir);
+        return EXIT_FAILURE;
+    }
+
     if (!state.skymap && (access(state.l2dir, F_OK) != 0))
     {
         fprintf(stderr, "Level 2 directory %s not found.\n", state.l2dir);
@@ -112,10 +189,15 @@ int main(int argc, char **argv)
         }
     }
 
+    status = openCalibrationIndex(&calibrationIndex, state.calibrationIndexFile);
+    if (status != ASCC_OK)
+        return EXIT_FAILURE;
+    state.calibrationIndex = &calibrationIndex;
+
     // Read in pixel elevations and azimuths and site geodetic position from calibration file.
     if (state.skymap)
     {
-        status = loadSkymap(&state);
+        status = loadSkymap(&state, state.firstCalTime);
         if (status != ASCC_OK && state.verbose)
         {
             fprintf(stderr, "Could not load skymap file %s.\n", state.skymapfilename);
@@ -124,7 +206,7 @@ int main(int argc, char **argv)
     }
     else
     {
-        status = loadThemisLevel2(&state);
+        status = loadThemisLevel2(&state, state.firstCalTime);
         if (status != ASCC_OK && state.verbose)
         {
             fprintf(stderr, "Could not load THEMIS level 2 calibration file %s.\n", state.l2filename);
@@ -132,6 +214,33 @@ int main(int argc, char **argv)
         }
     }
 
+    // A batch run uses one reference; watch mode switches as it goes
+    if (state.siteModelFromIndex && !state.watchL1Dir && state.verbose)
+    {
+        char *root = state.skymap ? state.skymapdir : state.l2dir;
+        const CalibrationFile *last = bestCalibrationFile(&calibrationIndex, state.site, state.skymap ? CALIBRATION_SKYMAP : CALIBRATION_L2, state.lastCalTime, indexedDirectoryPath(&calibrationIndex, root));
+        const char *name = last != NULL ? strrchr(last->path, '/') : NULL;
+        name = name != NULL ? name + 1 : (last != NULL ? last->path : NULL);
+        const char *current = state.skymap ? state.skymapfilename : state.l2filename;
+        if (last != NULL && strcmp(state.skymap ? last->path : name, current) != 0)
+            fprintf(stderr, "%s applies from a later time in the requested interval; using %s throughout.\n", last->path, current);
+    }
+
+    if (state.mergePartialResults)
+    {
+        status = mergeShards(&state, &shards);
+        state.processingStopEpoch = currentEpoch();
+        if (status != ASCC_OK)
+        {
+            if (state.verbose)
+                fprintf(stderr, "Could not merge the partial results.\n");
+            goto cleanup;
+        }
+        if (state.verbose)
+            fprintf(stderr, "Merged %zu images from %zu partial results files.\n", state.nImages, shards.nShards);
+        goto exportResults;
+    }
+
     if (state.verbose)
         fprintf(stderr, "Estimating THEMIS %s ASI optical calibration using %s %s for level 1 imagery between %s UT and %s UT\n", state.site, state.skymap ? "SKYMAP" : "L2", state.skymap ? state.skymapfilename : state.l2filename, state.firstCalDateString, state.lastCalDateString);
 
@@ -156,6 +265,54 @@ int main(int argc, char **argv)
         fprintf(stderr, "Read %d stars from BSC5ra database in %s\n", state.nStars, state.stardir);
     }
 
+    if (state.sweepSpec != NULL)
+    {
+        // A sweep compares centroiding and fit settings on the same images
+        // Configurations take the first stars of one selection, so the stars
+        // cannot be spread over sectors for each configuration's star count
+        if (state.verbose && (state.decimationStride > 1 || state.trackStars || state.pyramidSearch || state.blindSolve || state.globalFit || state.starSectors > 0 || state.earlyStop))
+            fprintf(stderr, "Decimation, star tracking, pyramid search, blind solving, the global fit, star sectors and the early stop are not used in a sweep.\n");
+        state.starSectors = 0;
+        state.earlyStop = false;
+        state.decimationStride = 1;
+        state.trackStars = false;
+        state.pyramidSearch = false;
+        state.blindSolve = false;
+        state.globalFit = false;
+        status = buildSweep(&state, state.sweepSpec);
+        if (status != ASCC_OK)
+            goto cleanup;
+        if (state.verbose)
+            fprintf(stderr, "Sweeping %d configurations.\n", state.sweep->nRuns);
+    }
+
+    if (state.blindSolve)
+    {
+        status = loadPlateSolveIndex(&state);
+        if (status != ASCC_OK)
+        {
+            if (state.verbose)
+                fprintf(stderr, "Could not build the plate solving index.\n");
+            goto cleanup;
+        }
+    }
+
+    // A sweep compares settings on the same stars
+    if (state.starDetectabilityDir != NULL && state.sweepSpec == NULL)
+    {
+        status = loadStarDetectability(&state);
+        if (status != ASCC_OK)
+            goto cleanup;
+        if (state.verbose)
+            fprintf(stderr, "Star detectability statistics for %zu stars and sky regions.\n", state.starDetectability->nEntries);
+    }
+
+    if (state.watchL1Dir)
+    {
+        status = watchL1Directory(&state);
+        goto cleanup;
+    }
+
     // Estimate the calibration for each time
     status = analyzeImagery(&state);
     if (state.showProgress && state.expectedNumberOfImages > 0)
@@ -164,10 +321,69 @@ int main(int argc, char **argv)
     state.processingStopEpoch = currentEpoch();
 
     if (state.verbose)
+    {
         fprintf(stderr, "Processed %zu images.\n", state.expectedNumberOfImages);
+        if (state.skipDaylight || state.skipMoonlight)
+            fprintf(stderr, "Skipped %zu L1 files and %zu images recorded in a bright sky.\n", state.nL1FilesSkippedTooBright, state.nImagesSkippedTooBright);
+        if (state.trackStars)
+            fprintf(stderr, "Star tracking: %zu locks acquired, %zu lost, %zu tracked measurements, %zu global searches.\n", state.nLocksAcquired, state.nLocksLost, state.nTrackedMeasurements, state.nGlobalSearches);
+        if (state.earlyStop)
+            fprintf(stderr, "Early stop: %zu of %zu images stopped early, %.1f stars measured per image.\n", state.nEarlyStops, state.nImagesAnalyzed, state.nImagesAnalyzed > 0 ? (double)state.nStarsMeasured / (double)state.nImagesAnalyzed : 0.0);
+        if (state.starDetectability != NULL)
+            fprintf(stderr, "Star detectability: %zu attempts recorded, %zu stars passed over, %zu of %zu re-probes found the star.\n", state.starDetectability->nAttemptsRecorded, state.starDetectability->nStarsSkipped, state.starDetectability->nReprobesDetected, state.starDetectability->nReprobes);
+        if (state.blindSolve)
+            fprintf(stderr, "Blind solving: %zu of %zu attempts solved, %.1f ms per attempt.\n", state.nBlindSolvesSucceeded, state.nBlindSolves, state.nBlindSolves > 0 ? 1000.0 * state.blindSolveSeconds / (double)state.nBlindSolves : 0.0);
+        if (state.frameCacheDir != NULL)
+            fprintf(stderr, "Frame cache: %zu L1 files read from cubes, %zu cubes made, %zu evicted.\n", state.nFrameCubeHits, state.nFrameCubesBuilt, state.nFrameCubesEvicted);
+        if (state.nL1FilesPrefetched > 0)
+            fprintf(stderr, "Prefetched %zu L1 files (%.1f MB), analysis waited %.2f s for files.\n", state.nL1FilesPrefetched, (double)state.l1BytesPrefetched / 1e6, state.l1PrefetchStallSeconds);
+        if (state.nL1FramesMapped + state.nL1FramesReadByLibrary > 0)
+            fprintf(stderr, "L1 images: %zu read from mapped files, %zu through the CDF library, %.1f us per image.\n", state.nL1FramesMapped, state.nL1FramesReadByLibrary, 1e6 * state.l1FrameReadSeconds / (double)(state.nL1FramesMapped + state.nL1FramesReadByLibrary));
+        if (state.decimationStride > 1)
+            fprintf(stderr, "Analyzed %zu images and interpolated attitudes for %zu images.\n", state.nImagesAnalyzed, state.nImagesInterpolated);
+        if (state.starTracks != NULL)
+            fprintf(stderr, "Star tracks: %zu fitted, %zu positions evaluated, largest fit error %.1e degrees.\n", state.starTracks->nFits, state.starTracks->nPredictions, state.starTracks->maxFitErrorDegrees);
+        if (state.referencePixelIndex != NULL && state.referencePixelIndex->nSearches > 0)
+            fprintf(stderr, "Reference pixel searches: %zu, %.1f pixels compared per search.\n", state.referencePixelIndex->nSearches, (double)state.referencePixelIndex->nPixelsVisited / (double)state.referencePixelIndex->nSearches);
+        fprintf(stderr, "Scratch memory: %zu heap allocations (%.1f MB) for %zu L1 files, per-image arrays resized %zu times.\n", state.nScratchHeapAllocations, (double)state.scratchBytes / 1e6, state.nl1filenames, state.nImageArrayResizes);
+    }
+
+    if (state.sweep != NULL)
+    {
+        status = exportSweepTable(&state);
+        if (state.verbose)
+        {
+            if (status != ASCC_OK)
+                fprintf(stderr, "Could not create the sweep table.\n");
+            else
+                fprintf(stderr, "Created %s\n", state.sweepTableFilename);
+        }
+        goto cleanup;
+    }
+
+    if (state.exportPartialResults)
+    {
+        status = exportShard(&state);
+        if (state.verbose)
+        {
+            if (status != ASCC_OK)
+                fprintf(stderr, "Could not create the partial results file.\n");
+            else
+                fprintf(stderr, "Created %s\n", state.shardFilename);
+        }
+        goto cleanup;
+    }
 
     status = updateCalibration(&state);
 
+    if (state.globalFit)
+    {
+        if (solveGlobalCameraModel(&state) != ASCC_OK && state.verbose)
+            fprintf(stderr, "Could not fit the global camera model to %zu observations.\n", state.nGlobalObservations);
+        updateGlobalCalibration(&state);
+    }
+
+exportResults:
     // Export error DCMs to CDF file
     status = exportCdf(&state);
     
@@ -180,6 +396,18 @@ int main(int argc, char **argv)
 
     }
 
+    if (status == ASCC_OK && state.exportColumns)
+    {
+        status = exportColumns(&state);
+        if (state.verbose)
+        {
+            if (status != ASCC_OK)
+                fprintf(stderr, "Could not create the columnar file.\n");
+            else
+                fprintf(stderr, "Created %s\n", state.columnFilename);
+        }
+    }
+
 
 cleanup:
 
@@ -188,12 +416,24 @@ cleanup:
         free(state.starData);
     if (state.imageTimes != NULL)
         free(state.imageTimes);
-    if (state.pointingErrorDcms != NULL)
-        free(state.pointingErrorDcms);
-    if (state.rotationVectors != NULL)
-        free(state.rotationVectors);
-    if (state.rotationAngles != NULL)
-        free(state.rotationAngles);
+    if (state.attitudeQuaternions != NULL)
+        free(state.attitudeQuaternions);
+    if (state.nCalibrationStarsUsed != NULL)
+        free(state.nCalibrationStarsUsed);
+    if (state.attitudeInterpolated != NULL)
+        free(state.attitudeInterpolated);
+    if (state.globalObservations != NULL)
+        free(state.globalObservations);
+    if (state.sweep != NULL)
+    {
+        freeSweep(state.sweep);
+        free(state.sweep);
+    }
+    if (state.plateSolveIndex != NULL)
+    {
+        freePlateSolveIndex(state.plateSolveIndex);
+        free(state.plateSolveIndex);
+    }
     for (int i = 0; i < state.nl1filenames; i++)
     {
         if (state.l1filenames[i] != NULL)
@@ -201,6 +441,15 @@ cleanup:
     }
     if (state.l1filenames != NULL)
         free(state.l1filenames);
+    freeCalibrationIndex(&calibrationIndex);
+    freeShards(&shards);
+    freeAnalysisScratch(&state);
+    freeStarTracks(&state);
+    freeReferencePixelIndex(&state);
+    // Every run that analyzed images updates the statistics, including watch mode
+    if (state.starDetectability != NULL && state.starDetectability->nAttemptsRecorded > 0 && saveStarDetectability(&state) != ASCC_OK && state.verbose)
+        fprintf(stderr, "Could not save the star detectability statistics to %s\n", state.starDetectabilityDir);
+    freeStarDetectability(&state);
 
     return status;
 }
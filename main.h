@@ -21,6 +21,7 @@
 #ifndef _MAIN_H
 #define _MAIN_H
 
+#include "ascc.h"
 #include "star.h"
 
 #include <stdlib.h>
@@ -40,26 +41,56 @@
 #define MAX_PEAK_SIGNAL_FOR_MOMENTS 30000
 #define MAX_BACKGROUND_SIGNAL_FOR_MOMENTS 4000
 #define STAR_MAX_PIXEL_JITTER 2.0
+#define TRACKING_BOX_HALF_WIDTH 2
+// Pixels from the predicted position searched with the coarse-to-fine image pyramid
+#define PYRAMID_SEARCH_RADIUS 24
+// L1 files read ahead of the one being analyzed
+#define L1_PREFETCH_DEPTH 2
+// Images in an hourly L1 file at the 3 s cadence, for sizing scratch memory
+#define L1_FILE_IMAGES 1200
+// Size limit of the frame cube cache
+#define FRAME_CACHE_MAX_MEGABYTES 20000
 #define J200EPOCH 63113947200000.0
 
 // How close to the horizon to look for calibration stars
 #define CALIBRATION_ELEVATION_BOUND 20
 
-enum ASCC_STATUS
-{
-    ASCC_OK = 0,
-    ASCC_L1_FILE = 1,
-    ASCC_L2_FILE = 2,
-    ASCC_BSC5_FILE = 3,
-    ASCC_MEM = 4,
-    ASCC_ARGUMENTS = 5,
-    ASCC_CDF_READ = 6,
-    ASCC_STAR_FILE = 7,
-    ASCC_SKYMAP_FILE = 8,
-    ASCC_CDF_EXPORT_NO_DATA = 9,
-    ASCC_CDF_WRITE = 10,
-    ASCC_NO_CALIBRATION_DATA = 11
-};
+// Coverage-aware star selection: the sky above CALIBRATION_ELEVATION_BOUND is
+// split into STAR_SECTORS azimuth sectors, each in a low and a high band
+// divided at STAR_SECTOR_BAND_ELEVATION degrees, with equal star budgets
+#define STAR_SECTORS 8
+#define MAX_STAR_SECTORS 36
+#define STAR_SECTOR_BAND_ELEVATION 50.0
+
+// Early stop: stars are centroided in batches, starting with EARLY_STOP_FIRST_BATCH
+// stars and growing by half, until the fitted attitude changes by less than
+// EARLY_STOP_ROTATION_CHANGE degrees from one batch to the next and the fit
+// conditioning (see fitConditioning()) is at least EARLY_STOP_CONDITIONING
+#define EARLY_STOP_FIRST_BATCH 8
+#define EARLY_STOP_ROTATION_CHANGE 0.005
+#define EARLY_STOP_CONDITIONING 0.25
+
+// Star detectability: a star is left out of the selection in a region of the
+// sky once it was found in fewer than STAR_DETECTABILITY_MIN_RATE of at least
+// STAR_DETECTABILITY_MIN_ATTEMPTS attempts there, and tried again once every
+// STAR_DETECTABILITY_REPROBE_INTERVAL selections. Counts are halved at
+// STAR_DETECTABILITY_MAX_ATTEMPTS so that recent nights count for more.
+#define STAR_DETECTABILITY_MIN_ATTEMPTS 50
+#define STAR_DETECTABILITY_MIN_RATE 0.05
+#define STAR_DETECTABILITY_REPROBE_INTERVAL 100
+#define STAR_DETECTABILITY_MAX_ATTEMPTS 10000
+
+// Sun depression angle below which stars can be found (nautical twilight)
+#define SUN_DEPRESSION_ANGLE 12.0
+// Moon elevation above which imagery is skipped when the lunar filter is enabled
+#define MOON_MAX_ELEVATION 0.0
+
+// Adaptive temporal decimation: interpolate attitudes between anchor images
+// DECIMATION_STRIDE images apart unless the attitude changes by more than
+// DECIMATION_MAX_ROTATION_CHANGE degrees or more than DECIMATION_MAX_STAR_COUNT_DROP stars are lost
+#define DECIMATION_STRIDE 10
+#define DECIMATION_MAX_ROTATION_CHANGE 0.1
+#define DECIMATION_MAX_STAR_COUNT_DROP 2
 
 typedef struct ProgramState
 {
@@ -79,9 +110,99 @@ typedef struct ProgramState
     int nCalibrationStars;
     int starSearchBoxWidth;
     float starMaxJitterPixels;
+    int maxBackgroundSignalForMoments;
+    int maxPeakSignalForMoments;
+
+    // Number of azimuth sectors for coverage-aware star selection, 0 for the brightest stars
+    int starSectors;
+    bool earlyStop;
+    float earlyStopRotationChange;
+    float earlyStopConditioning;
+    size_t nStarsMeasured;
+    size_t nEarlyStops;
+
+    // Per-site star detection statistics, kept in starDetectabilityDir
+    char *starDetectabilityDir;
+    struct StarDetectability *starDetectability;
+
+    bool skipDaylight;
+    float sunDepressionAngle;
+    bool skipMoonlight;
+    float moonMaxElevation;
+    size_t nL1FilesSkippedTooBright;
+    size_t nImagesSkippedTooBright;
+
+    int decimationStride;
+    float decimationMaxRotationChange;
+    size_t nImagesAnalyzed;
+    size_t nImagesInterpolated;
+
+    bool pyramidSearch;
+    int pyramidSearchRadius;
+
+    bool trackStars;
+    size_t nLocksAcquired;
+    size_t nLocksLost;
+    size_t nTrackedMeasurements;
+    size_t nGlobalSearches;
+
+    char *siteModelCacheDir;
+
+    char *frameCacheDir;
+    size_t frameCacheMaxMegabytes;
+    bool frameCacheSubtractOffsets;
+    size_t nFrameCubeHits;
+    size_t nFrameCubesBuilt;
+    size_t nFrameCubesEvicted;
+
+    int prefetchDepth;
+    size_t nL1FilesPrefetched;
+    size_t l1BytesPrefetched;
+    double l1PrefetchStallSeconds;
+
+    bool directL1Reads;
+    size_t nL1FramesMapped;
+    size_t nL1FramesReadByLibrary;
+    double l1FrameReadSeconds;
+
+    bool globalFit;
+    int globalFitThreads;
+    struct GlobalObservation *globalObservations;
+    size_t nGlobalObservations;
+    size_t globalObservationCapacity;
+    bool globalFitSolved;
+    double globalDcm[9];
+    double globalRadialDistortion[2];
+    double globalOpticalAxis[3];
+    float globalFitResidualRms;
+    size_t nGlobalFitObservationsUsed;
+    float globalCalibratedElevations[IMAGE_COLUMNS][IMAGE_ROWS];
+    float globalCalibratedAzimuths[IMAGE_COLUMNS][IMAGE_ROWS];
+
+    bool watchL1Dir;
+    size_t nL1FilesWatched;
+    char rollingAttitudeFilename[FILENAME_MAX];
+    char latestAttitudeFilename[FILENAME_MAX];
+
+    char *sweepSpec;
+    struct Sweep *sweep;
+    char sweepTableFilename[FILENAME_MAX];
+
+    bool blindSolve;
+    char *plateSolveIndexFile;
+    struct PlateSolveIndex *plateSolveIndex;
+    // Attitude applied to predicted star positions when searching for stars
+    bool haveSeedAttitude;
+    double seedDcm[9];
+    size_t nBlindSolves;
+    size_t nBlindSolvesSucceeded;
+    double blindSolveSeconds;
 
     char *stardir;
     Star *starData;
+    // Calibration star positions from per-night Chebyshev tracks, or exact per image
+    bool exactStarPositions;
+    struct StarTrackTable *starTracks;
     int32_t nStars;
     int32_t starSequenceOffset;
     int32_t firstStarNumber;
@@ -93,8 +214,19 @@ typedef struct ProgramState
     char *exportdir;
     char cdfFullFilename[CDF_PATHNAME_LEN + 5];
     bool overwriteCdf;
+    char *exportCompression;
+    bool compareExportProfiles;
+    double exportSeconds;
+    size_t exportBytes;
+    bool exportColumns;
+    char columnFilename[FILENAME_MAX];
+    // Write a shard of partial results instead of the CDF, or merge shards into the CDF
+    bool exportPartialResults;
+    char shardFilename[FILENAME_MAX];
+    bool mergePartialResults;
 
     char *l1dir;
+    char *l1PathTemplate;
     char **l1filenames;
     size_t nl1filenames;
 
@@ -105,6 +237,11 @@ typedef struct ProgramState
     char *skymapfilename;
     bool skymap;
 
+    // Known L2 and skymap files, and whether the reference came from them
+    char *calibrationIndexFile;
+    struct CalibrationIndex *calibrationIndex;
+    bool siteModelFromIndex;
+
     char *calibrationDateUsed;
     char *calibrationDateGenerated;
     float siteLatitudeGeodetic;
@@ -123,14 +260,22 @@ typedef struct ProgramState
     float pixelX[IMAGE_COLUMNS][IMAGE_ROWS];
     float pixelY[IMAGE_COLUMNS][IMAGE_ROWS];
     float pixelZ[IMAGE_COLUMNS][IMAGE_ROWS];
+    // Reference pixels by direction, for locating predicted star positions
+    struct ReferencePixelIndex *referencePixelIndex;
+
+    // Scratch for analyzing L1 files, and heap use for the report
+    struct AnalysisScratch *analysisScratch;
+    size_t nScratchHeapAllocations;
+    size_t scratchBytes;
+    size_t nImageArrayResizes;
 
     size_t nImages;
+    size_t imageCapacity;
     double *imageTimes;
-    float *pointingErrorDcms;
-    float *rotationVectors;
-    float *rotationAngles;
+    // Unit quaternion (w, x, y, z) per image, expanded to DCM, axis and angle on export
+    float *attitudeQuaternions;
     uint16_t *nCalibrationStarsUsed;
-
+    uint8_t *attitudeInterpolated;
 
     bool printStarInfo;
 
@@ -0,0 +1,428 @@
+/*
+
+    AllSkyCameraCal: measure.c
+
+    Copyright (C) 2022  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "measure.h"
+
+#include "main.h"
+#include "star.h"
+
+#include <math.h>
+#include <string.h>
+
+// Star measurement kernels working on a padded image. They give the same results as
+// calculateMeanSignal(), calculatePositionOfMax() and calculateMoments(),
+// pixel for pixel and in the same order, without per-pixel bounds checks.
+// Row sums and row maxima run over contiguous memory and are vectorized by the compiler.
+// Centroid moments keep float accumulation in the original order so that
+// results are identical to calculateMoments().
+
+// The halo of padded must be zero: allocate it with calloc. Only the image is overwritten.
+void loadPaddedImage(PaddedImage *padded, uint16_t image[IMAGE_COLUMNS][IMAGE_ROWS], uint16_t offsets[IMAGE_COLUMNS][IMAGE_ROWS])
+{
+    for (int c = 0; c < IMAGE_COLUMNS; c++)
+    {
+        const uint16_t *raw = image[c];
+        const uint16_t *offset = offsets[c];
+        uint16_t *pixel = &padded->pixels[c + IMAGE_HALO][IMAGE_HALO];
+        for (int r = 0; r < IMAGE_ROWS; r++)
+            pixel[r] = raw[r] > offset[r] ? raw[r] - offset[r] : 0;
+    }
+
+    return;
+}
+
+// As loadPaddedImage, for images that already have the offsets removed
+void copyPaddedImage(PaddedImage *padded, uint16_t image[IMAGE_COLUMNS][IMAGE_ROWS])
+{
+    for (int c = 0; c < IMAGE_COLUMNS; c++)
+        memcpy(&padded->pixels[c + IMAGE_HALO][IMAGE_HALO], image[c], IMAGE_ROWS * sizeof(uint16_t));
+
+    return;
+}
+
+// As loadPaddedImage, for raw images stored in the opposite byte order
+void loadPaddedImageByteSwapped(PaddedImage *padded, uint16_t image[IMAGE_COLUMNS][IMAGE_ROWS], uint16_t offsets[IMAGE_COLUMNS][IMAGE_ROWS])
+{
+    for (int c = 0; c < IMAGE_COLUMNS; c++)
+    {
+        const uint16_t *raw = image[c];
+        const uint16_t *offset = offsets[c];
+        uint16_t *pixel = &padded->pixels[c + IMAGE_HALO][IMAGE_HALO];
+        for (int r = 0; r < IMAGE_ROWS; r++)
+        {
+            uint16_t value = __builtin_bswap16(raw[r]);
+            pixel[r] = value > offset[r] ? value - offset[r] : 0;
+        }
+    }
+
+    return;
+}
+
+// Number of pixels of a box side that fall inside the image
+static int clippedLength(int center, int halfWidth, int size)
+{
+    int first = center - halfWidth;
+    int last = center + halfWidth;
+    if (first < 0)
+        first = 0;
+    if (last > size - 1)
+        last = size - 1;
+
+    return last >= first ? last - first + 1 : 0;
+}
+
+static inline bool boxInHalo(int c0, int r0, int halfWidth)
+{
+    return halfWidth <= IMAGE_HALO && c0 - halfWidth >= -IMAGE_HALO && c0 + halfWidth < IMAGE_COLUMNS + IMAGE_HALO && r0 - halfWidth >= -IMAGE_HALO && r0 + halfWidth < IMAGE_ROWS + IMAGE_HALO;
+}
+
+static inline uint32_t rowSum(const uint16_t *row, int n)
+{
+    uint32_t sum = 0;
+    for (int r = 0; r < n; r++)
+        sum += row[r];
+
+    return sum;
+}
+
+static inline uint16_t rowMax(const uint16_t *row, int n)
+{
+    uint16_t max = 0;
+    for (int r = 0; r < n; r++)
+        max = row[r] > max ? row[r] : max;
+
+    return max;
+}
+
+// Mean signal and brightest pixel of a window that fits inside the halo.
+// Inlined with constant half widths for the common box sizes.
+// The brightest pixel is the first strict maximum in column-then-row order,
+// as in calculatePositionOfMax(). Halo pixels are zero and are never a maximum.
+static inline void windowKernel(PaddedImage *image, int c0, int r0, int backgroundHalfWidth, int peakHalfWidth, StarWindow *window)
+{
+    uint32_t total = 0;
+    int max = 0;
+    int cm = 0;
+    int rm = 0;
+    const uint16_t *row = NULL;
+    uint16_t m = 0;
+
+    if (backgroundHalfWidth == peakHalfWidth)
+    {
+        // Fused background and peak pass
+        for (int c = c0 - backgroundHalfWidth; c <= c0 + backgroundHalfWidth; c++)
+        {
+            row = &image->pixels[c + IMAGE_HALO][r0 - backgroundHalfWidth + IMAGE_HALO];
+            total += rowSum(row, 2 * backgroundHalfWidth + 1);
+            m = rowMax(row, 2 * backgroundHalfWidth + 1);
+            if (m > max)
+            {
+                int r = 0;
+                while (row[r] != m)
+                    r++;
+                max = m;
+                cm = c;
+                rm = r0 - backgroundHalfWidth + r;
+            }
+        }
+    }
+    else
+    {
+        for (int c = c0 - backgroundHalfWidth; c <= c0 + backgroundHalfWidth; c++)
+        {
+            row = &image->pixels[c + IMAGE_HALO][r0 - backgroundHalfWidth + IMAGE_HALO];
+            total += rowSum(row, 2 * backgroundHalfWidth + 1);
+        }
+        for (int c = c0 - peakHalfWidth; c <= c0 + peakHalfWidth; c++)
+        {
+            row = &image->pixels[c + IMAGE_HALO][r0 - peakHalfWidth + IMAGE_HALO];
+            m = rowMax(row, 2 * peakHalfWidth + 1);
+            if (m > max)
+            {
+                int r = 0;
+                while (row[r] != m)
+                    r++;
+                max = m;
+                cm = c;
+                rm = r0 - peakHalfWidth + r;
+            }
+        }
+    }
+
+    int nBackgroundPixels = clippedLength(c0, backgroundHalfWidth, IMAGE_COLUMNS) * clippedLength(r0, backgroundHalfWidth, IMAGE_ROWS);
+    window->meanSignal = NAN;
+    if (nBackgroundPixels > 0 && total > 0)
+        window->meanSignal = (float)total / (float)nBackgroundPixels;
+
+    window->nPeakPixels = clippedLength(c0, peakHalfWidth, IMAGE_COLUMNS) * clippedLength(r0, peakHalfWidth, IMAGE_ROWS);
+    window->peakColumn = 0;
+    window->peakRow = 0;
+    if (window->nPeakPixels > 0)
+    {
+        window->peakColumn = cm;
+        window->peakRow = rm;
+    }
+
+    return;
+}
+
+// Bounds-checked version for windows wider than the halo
+static void windowGeneric(PaddedImage *image, int c0, int r0, int backgroundHalfWidth, int peakHalfWidth, StarWindow *window)
+{
+    int total = 0;
+    int nBackgroundPixels = 0;
+    int max = 0;
+    int cm = 0;
+    int rm = 0;
+    int pixVal = 0;
+
+    for (int c = c0 - backgroundHalfWidth; c <= c0 + backgroundHalfWidth; c++)
+        for (int r = r0 - backgroundHalfWidth; r <= r0 + backgroundHalfWidth; r++)
+            if (c >= 0 && c < IMAGE_COLUMNS && r >= 0 && r < IMAGE_ROWS)
+            {
+                nBackgroundPixels++;
+                total += image->pixels[c + IMAGE_HALO][r + IMAGE_HALO];
+            }
+
+    window->nPeakPixels = 0;
+    for (int c = c0 - peakHalfWidth; c <= c0 + peakHalfWidth; c++)
+        for (int r = r0 - peakHalfWidth; r <= r0 + peakHalfWidth; r++)
+            if (c >= 0 && c < IMAGE_COLUMNS && r >= 0 && r < IMAGE_ROWS)
+            {
+                window->nPeakPixels++;
+                pixVal = image->pixels[c + IMAGE_HALO][r + IMAGE_HALO];
+                if (pixVal > max)
+                {
+                    max = pixVal;
+                    cm = c;
+                    rm = r;
+                }
+            }
+
+    window->meanSignal = NAN;
+    if (nBackgroundPixels > 0 && total > 0)
+        window->meanSignal = (float)total / (float)nBackgroundPixels;
+
+    window->peakColumn = 0;
+    window->peakRow = 0;
+    if (window->nPeakPixels > 0)
+    {
+        window->peakColumn = cm;
+        window->peakRow = rm;
+    }
+
+    return;
+}
+
+void measureStarWindow(PaddedImage *image, StarWindow *window)
+{
+    int c0 = floorf(window->centerColumn);
+    int r0 = floorf(window->centerRow);
+    int bhw = window->backgroundHalfWidth;
+    int phw = window->peakHalfWidth;
+
+    if (!boxInHalo(c0, r0, bhw > phw ? bhw : phw))
+        windowGeneric(image, c0, r0, bhw, phw, window);
+    // Specializations for the default star search box width (9) and tracking box
+    else if (bhw == 4 && phw == 4)
+        windowKernel(image, c0, r0, 4, 4, window);
+    else if (bhw == 4 && phw == 2)
+        windowKernel(image, c0, r0, 4, 2, window);
+    else if (bhw == 2 && phw == 2)
+        windowKernel(image, c0, r0, 2, 2, window);
+    else
+        windowKernel(image, c0, r0, bhw, phw, window);
+
+    return;
+}
+
+// Measure all of an image's star windows
+void measureStarWindows(PaddedImage *image, StarWindow *windows, int nWindows)
+{
+    for (int i = 0; i < nWindows; i++)
+        if (windows[i].active)
+            measureStarWindow(image, &windows[i]);
+
+    return;
+}
+
+void buildImagePyramid(ImagePyramid *pyramid, PaddedImage *image)
+{
+    for (int c = 0; c < IMAGE_COLUMNS / 2; c++)
+    {
+        const uint16_t *row0 = &image->pixels[2 * c + IMAGE_HALO][IMAGE_HALO];
+        const uint16_t *row1 = &image->pixels[2 * c + 1 + IMAGE_HALO][IMAGE_HALO];
+        for (int r = 0; r < IMAGE_ROWS / 2; r++)
+            pyramid->level1[c][r] = (uint32_t)row0[2 * r] + row0[2 * r + 1] + row1[2 * r] + row1[2 * r + 1];
+    }
+    for (int c = 0; c < IMAGE_COLUMNS / 4; c++)
+        for (int r = 0; r < IMAGE_ROWS / 4; r++)
+            pyramid->level2[c][r] = pyramid->level1[2 * c][2 * r] + pyramid->level1[2 * c][2 * r + 1] + pyramid->level1[2 * c + 1][2 * r] + pyramid->level1[2 * c + 1][2 * r + 1];
+
+    return;
+}
+
+// Brightest bin of a level, first strict maximum in column-then-row order.
+// Returns false if the box lies outside the level.
+static bool levelPeak(uint32_t *level, int columns, int rows, int firstColumn, int lastColumn, int firstRow, int lastRow, int *peakColumn, int *peakRow)
+{
+    if (firstColumn < 0)
+        firstColumn = 0;
+    if (lastColumn > columns - 1)
+        lastColumn = columns - 1;
+    if (firstRow < 0)
+        firstRow = 0;
+    if (lastRow > rows - 1)
+        lastRow = rows - 1;
+    if (firstColumn > lastColumn || firstRow > lastRow)
+        return false;
+
+    uint32_t max = 0;
+    *peakColumn = firstColumn;
+    *peakRow = firstRow;
+    for (int c = firstColumn; c <= lastColumn; c++)
+        for (int r = firstRow; r <= lastRow; r++)
+            if (level[c * rows + r] > max)
+            {
+                max = level[c * rows + r];
+                *peakColumn = c;
+                *peakRow = r;
+            }
+
+    return true;
+}
+
+// Brightest pixel within radius pixels of the centre, found at 4x binning and refined at
+// 2x and full resolution. The cost does not depend much on the radius.
+// Returns 0 if the search box is outside the image.
+int pyramidPeakSearch(ImagePyramid *pyramid, PaddedImage *image, int centerColumn, int centerRow, int radius, int *peakColumn, int *peakRow)
+{
+    int c2 = 0;
+    int r2 = 0;
+    int c1 = 0;
+    int r1 = 0;
+    int c0 = 0;
+    int r0 = 0;
+
+    // Binned pixels with any part inside the search box
+    if (!levelPeak(&pyramid->level2[0][0], IMAGE_COLUMNS / 4, IMAGE_ROWS / 4, (int)floorf((centerColumn - radius) / 4.0), (int)floorf((centerColumn + radius) / 4.0), (int)floorf((centerRow - radius) / 4.0), (int)floorf((centerRow + radius) / 4.0), &c2, &r2))
+        return 0;
+
+    // A star on the edge of a 4x bin can peak in a neighbouring 2x bin
+    if (!levelPeak(&pyramid->level1[0][0], IMAGE_COLUMNS / 2, IMAGE_ROWS / 2, 2 * c2 - 1, 2 * c2 + 2, 2 * r2 - 1, 2 * r2 + 2, &c1, &r1))
+        return 0;
+
+    uint32_t max = 0;
+    for (int c = 2 * c1 - 1; c <= 2 * c1 + 2; c++)
+        for (int r = 2 * r1 - 1; r <= 2 * r1 + 2; r++)
+            if (c >= 0 && c < IMAGE_COLUMNS && r >= 0 && r < IMAGE_ROWS && image->pixels[c + IMAGE_HALO][r + IMAGE_HALO] > max)
+            {
+                max = image->pixels[c + IMAGE_HALO][r + IMAGE_HALO];
+                c0 = c;
+                r0 = r;
+            }
+    if (max == 0)
+        return 0;
+
+    *peakColumn = c0;
+    *peakRow = r0;
+
+    return 1;
+}
+
+static inline int momentsKernel(ProgramState *state, PaddedImage *image, CalibrationStar *cal, int boxHalfWidth, int cc, int rc, int pixelThreshold, bool checkBounds)
+{
+    int c0 = 0;
+    int r0 = 0;
+    float c1 = 0;
+    float r1 = 0;
+    int pixVal = 0.0;
+    int momentCounter = 0;
+    int boxTotal = 0;
+    int maxSignalAboveThreshold = 0;
+    float meanAzElX = 0.0;
+    float meanAzElY = 0.0;
+    float meanAzElZ = 0.0;
+
+    for (int c = -boxHalfWidth; c <= boxHalfWidth; c++)
+    {
+        for (int r = -boxHalfWidth; r <= boxHalfWidth; r++)
+        {
+            c0 = cc + c;
+            r0 = rc + r;
+            if (checkBounds && !(c0 >=0 && c0 < IMAGE_COLUMNS && r0 >= 0 && r0 < IMAGE_ROWS))
+                continue;
+            // Halo pixels are zero, below any positive threshold
+            pixVal = image->pixels[c0 + IMAGE_HALO][r0 + IMAGE_HALO];
+            if (pixVal < pixelThreshold || pixVal > state->maxPeakSignalForMoments)
+                continue;
+            pixVal -= pixelThreshold;
+            if (pixVal < 0)
+                pixVal = 0;
+            momentCounter++;
+            boxTotal += pixVal;
+            c1 += (float)c0 * (float)pixVal;
+            r1 += (float)r0 * (float)pixVal;
+            meanAzElX += state->pixelX[c0][r0] * (float)pixVal;
+            meanAzElY += state->pixelY[c0][r0] * (float)pixVal;
+            meanAzElZ += state->pixelZ[c0][r0] * (float)pixVal;
+            if (pixVal > maxSignalAboveThreshold)
+                maxSignalAboveThreshold = pixVal;
+        }
+    }
+    if (momentCounter > 0 && boxTotal > 0)
+    {
+        cal->imageMomentColumn = c1 / (float)boxTotal + 0.5;
+        cal->imageMomentRow = r1 / (float)boxTotal + 0.5;
+        cal->measuredAzElX = meanAzElX / (float)boxTotal;
+        cal->measuredAzElY = meanAzElY / (float)boxTotal;
+        cal->measuredAzElZ = meanAzElZ / (float)boxTotal;
+        cal->meanImageSignalAboveThreshold = (float)boxTotal / (float)momentCounter;
+    }
+    else
+    {
+        cal->imageMomentColumn = 0.0;
+        cal->imageMomentRow = 0.0;
+        cal->measuredAzElX = 0.0;
+        cal->measuredAzElY = 0.0;
+        cal->measuredAzElZ = 0.0;
+        cal->meanImageSignalAboveThreshold = 0.0;
+    }
+
+    return momentCounter;
+}
+
+// Returns number of pixels used to construct moments
+int calculatePaddedMoments(ProgramState *state, PaddedImage *image, CalibrationStar *cal, int boxHalfWidth, float boxCenterColumn, float boxCenterRow, int pixelThreshold)
+{
+    if (state == NULL || image == NULL || cal == NULL)
+        return 0;
+
+    int cc = floorf(boxCenterColumn);
+    int rc = floorf(boxCenterRow);
+
+    // Halo pixels can only be skipped without bounds checks if they are below the threshold
+    if (pixelThreshold <= 0 || !boxInHalo(cc, rc, boxHalfWidth))
+        return momentsKernel(state, image, cal, boxHalfWidth, cc, rc, pixelThreshold, true);
+    else if (boxHalfWidth == 2)
+        return momentsKernel(state, image, cal, 2, cc, rc, pixelThreshold, false);
+    else
+        return momentsKernel(state, image, cal, boxHalfWidth, cc, rc, pixelThreshold, false);
+}
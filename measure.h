@@ -0,0 +1,81 @@
+/*
+
+    AllSkyCameraCal: measure.h
+
+    Copyright (C) 2022  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef _MEASURE_H
+#define _MEASURE_H
+
+#include "main.h"
+#include "star.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Width of the zero border around padded images. Star windows with half widths
+// up to this size need no bounds checks.
+#define IMAGE_HALO 16
+#define PADDED_IMAGE_COLUMNS (IMAGE_COLUMNS + 2 * IMAGE_HALO)
+#define PADDED_IMAGE_ROWS (IMAGE_ROWS + 2 * IMAGE_HALO)
+
+// Offset-corrected image surrounded by IMAGE_HALO pixels of zeros.
+// Pixel (c, r) of the image is pixels[c + IMAGE_HALO][r + IMAGE_HALO].
+typedef struct PaddedImage
+{
+    uint16_t pixels[PADDED_IMAGE_COLUMNS][PADDED_IMAGE_ROWS];
+} PaddedImage;
+
+// A star search window: the background (mean signal) box and the box
+// searched for the brightest pixel share a centre
+typedef struct StarWindow
+{
+    // Inactive windows are skipped by measureStarWindows()
+    bool active;
+    float centerColumn;
+    float centerRow;
+    int backgroundHalfWidth;
+    int peakHalfWidth;
+
+    // Same as calculateMeanSignal()
+    float meanSignal;
+    // Same as calculatePositionOfMax()
+    int peakColumn;
+    int peakRow;
+    int nPeakPixels;
+} StarWindow;
+
+// 2x and 4x binned sums of a padded image's pixels, for coarse-to-fine star searches
+typedef struct ImagePyramid
+{
+    uint32_t level1[IMAGE_COLUMNS / 2][IMAGE_ROWS / 2];
+    uint32_t level2[IMAGE_COLUMNS / 4][IMAGE_ROWS / 4];
+} ImagePyramid;
+
+void loadPaddedImage(PaddedImage *padded, uint16_t image[IMAGE_COLUMNS][IMAGE_ROWS], uint16_t offsets[IMAGE_COLUMNS][IMAGE_ROWS]);
+void copyPaddedImage(PaddedImage *padded, uint16_t image[IMAGE_COLUMNS][IMAGE_ROWS]);
+void loadPaddedImageByteSwapped(PaddedImage *padded, uint16_t image[IMAGE_COLUMNS][IMAGE_ROWS], uint16_t offsets[IMAGE_COLUMNS][IMAGE_ROWS]);
+
+void measureStarWindows(PaddedImage *image, StarWindow *windows, int nWindows);
+void measureStarWindow(PaddedImage *image, StarWindow *window);
+
+void buildImagePyramid(ImagePyramid *pyramid, PaddedImage *image);
+int pyramidPeakSearch(ImagePyramid *pyramid, PaddedImage *image, int centerColumn, int centerRow, int radius, int *peakColumn, int *peakRow);
+
+int calculatePaddedMoments(ProgramState *state, PaddedImage *image, CalibrationStar *cal, int boxHalfWidth, float boxCenterColumn, float boxCenterRow, int pixelThreshold);
+
+#endif // _MEASURE_H
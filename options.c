@@ -1,9 +1,11 @@
 #include "main.h"
 #include "util.h"
+#include "export.h"
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 int setOptions(ProgramState *state, int argc, char **argv)
 {
@@ -11,6 +13,19 @@ int setOptions(ProgramState *state, int argc, char **argv)
     state->nCalibrationStars = N_CALIBRATION_STARS;
     state->starSearchBoxWidth = STAR_SEARCH_BOX_WIDTH;
     state->starMaxJitterPixels = STAR_MAX_PIXEL_JITTER;
+    state->maxBackgroundSignalForMoments = MAX_BACKGROUND_SIGNAL_FOR_MOMENTS;
+    state->maxPeakSignalForMoments = MAX_PEAK_SIGNAL_FOR_MOMENTS;
+    state->sunDepressionAngle = SUN_DEPRESSION_ANGLE;
+    state->moonMaxElevation = MOON_MAX_ELEVATION;
+    state->decimationStride = 1;
+    state->pyramidSearchRadius = PYRAMID_SEARCH_RADIUS;
+    state->globalFitThreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    state->directL1Reads = true;
+    state->prefetchDepth = L1_PREFETCH_DEPTH;
+    state->frameCacheMaxMegabytes = FRAME_CACHE_MAX_MEGABYTES;
+    state->decimationMaxRotationChange = DECIMATION_MAX_ROTATION_CHANGE;
+    state->earlyStopRotationChange = EARLY_STOP_ROTATION_CHANGE;
+    state->earlyStopConditioning = EARLY_STOP_CONDITIONING;
     state->exportdir = ".";
     state->l1dir = ".";
     state->l2dir = ".";
@@ -70,11 +85,231 @@ int setOptions(ProgramState *state, int argc, char **argv)
                 return EXIT_FAILURE;
             }
         }
+        else if (strncmp(argv[i], "--max-background-signal=", 24) == 0)
+        {
+            state->nOptions++;
+            state->maxBackgroundSignalForMoments = atoi(argv[i]+24);
+            if (state->maxBackgroundSignalForMoments <= 0)
+            {
+                fprintf(stderr, "Maximum background signal must be greater than 0.\n");
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strncmp(argv[i], "--max-peak-signal=", 18) == 0)
+        {
+            state->nOptions++;
+            state->maxPeakSignalForMoments = atoi(argv[i]+18);
+            if (state->maxPeakSignalForMoments <= 0)
+            {
+                fprintf(stderr, "Maximum peak signal must be greater than 0.\n");
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp(argv[i], "--watch") == 0)
+        {
+            state->nOptions++;
+            state->watchL1Dir = true;
+        }
+        else if (strncmp(argv[i], "--sweep=", 8) == 0)
+        {
+            state->nOptions++;
+            state->sweepSpec = argv[i]+8;
+        }
+        else if (strcmp(argv[i], "--track-stars") == 0)
+        {
+            state->nOptions++;
+            state->trackStars = true;
+        }
+        else if (strcmp(argv[i], "--exact-star-positions") == 0)
+        {
+            state->nOptions++;
+            state->exactStarPositions = true;
+        }
+        else if (strcmp(argv[i], "--spread-stars") == 0)
+        {
+            state->nOptions++;
+            state->starSectors = STAR_SECTORS;
+        }
+        else if (strncmp(argv[i], "--star-sectors=", 15) == 0)
+        {
+            state->nOptions++;
+            state->starSectors = atoi(argv[i]+15);
+            if (state->starSectors < 1 || state->starSectors > MAX_STAR_SECTORS)
+            {
+                fprintf(stderr, "Number of star sectors must be from 1 to %d.\n", MAX_STAR_SECTORS);
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp(argv[i], "--early-stop") == 0)
+        {
+            state->nOptions++;
+            state->earlyStop = true;
+        }
+        else if (strncmp(argv[i], "--early-stop-rotation-change=", 29) == 0)
+        {
+            state->nOptions++;
+            state->earlyStop = true;
+            state->earlyStopRotationChange = atof(argv[i]+29);
+            if (state->earlyStopRotationChange <= 0.0)
+            {
+                fprintf(stderr, "Early stop rotation change must be greater than 0.0 degrees.\n");
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strncmp(argv[i], "--early-stop-conditioning=", 26) == 0)
+        {
+            state->nOptions++;
+            state->earlyStop = true;
+            state->earlyStopConditioning = atof(argv[i]+26);
+            if (state->earlyStopConditioning < 0.0 || state->earlyStopConditioning > 2.0 / 3.0)
+            {
+                fprintf(stderr, "Early stop conditioning must be from 0.0 to 0.667.\n");
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strncmp(argv[i], "--star-detectability-dir=", 25) == 0)
+        {
+            state->nOptions++;
+            state->starDetectabilityDir = argv[i]+25;
+        }
+        else if (strcmp(argv[i], "--pyramid-search") == 0)
+        {
+            state->nOptions++;
+            state->pyramidSearch = true;
+        }
+        else if (strncmp(argv[i], "--pyramid-search-radius=", 24) == 0)
+        {
+            state->nOptions++;
+            state->pyramidSearchRadius = atoi(argv[i]+24);
+            if (state->pyramidSearchRadius < 1)
+            {
+                fprintf(stderr, "Pyramid search radius must be at least 1 pixel.\n");
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strncmp(argv[i], "--site-model-cache-dir=", 23) == 0)
+        {
+            state->nOptions++;
+            state->siteModelCacheDir = argv[i]+23;
+        }
+        else if (strncmp(argv[i], "--frame-cache-dir=", 18) == 0)
+        {
+            state->nOptions++;
+            state->frameCacheDir = argv[i]+18;
+        }
+        else if (strncmp(argv[i], "--frame-cache-size-mb=", 22) == 0)
+        {
+            state->nOptions++;
+            long megabytes = atol(argv[i]+22);
+            if (megabytes < 1)
+            {
+                fprintf(stderr, "Frame cache size must be at least 1 MB.\n");
+                return EXIT_FAILURE;
+            }
+            state->frameCacheMaxMegabytes = (size_t)megabytes;
+        }
+        else if (strcmp(argv[i], "--frame-cache-subtract-offsets") == 0)
+        {
+            state->nOptions++;
+            state->frameCacheSubtractOffsets = true;
+        }
+        else if (strncmp(argv[i], "--prefetch-depth=", 17) == 0)
+        {
+            state->nOptions++;
+            state->prefetchDepth = atoi(argv[i]+17);
+            if (state->prefetchDepth < 0)
+            {
+                fprintf(stderr, "Prefetch depth must be 0 or more.\n");
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp(argv[i], "--cdf-library-reads") == 0)
+        {
+            state->nOptions++;
+            state->directL1Reads = false;
+        }
+        else if (strcmp(argv[i], "--global-fit") == 0)
+        {
+            state->nOptions++;
+            state->globalFit = true;
+        }
+        else if (strncmp(argv[i], "--global-fit-threads=", 21) == 0)
+        {
+            state->nOptions++;
+            state->globalFitThreads = atoi(argv[i]+21);
+            if (state->globalFitThreads < 1)
+            {
+                fprintf(stderr, "Number of global fit threads must be at least 1.\n");
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp(argv[i], "--blind-solve") == 0)
+        {
+            state->nOptions++;
+            state->blindSolve = true;
+        }
+        else if (strncmp(argv[i], "--plate-solve-index-file=", 25) == 0)
+        {
+            state->nOptions++;
+            state->plateSolveIndexFile = argv[i]+25;
+        }
+        else if (strcmp(argv[i], "--decimate") == 0)
+        {
+            state->nOptions++;
+            state->decimationStride = DECIMATION_STRIDE;
+        }
+        else if (strncmp(argv[i], "--decimation-stride=", 20) == 0)
+        {
+            state->nOptions++;
+            state->decimationStride = atoi(argv[i]+20);
+            if (state->decimationStride < 1)
+            {
+                fprintf(stderr, "Decimation stride must be at least 1 image.\n");
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strncmp(argv[i], "--decimation-max-rotation-change=", 33) == 0)
+        {
+            state->nOptions++;
+            state->decimationMaxRotationChange = atof(argv[i]+33);
+            if (state->decimationMaxRotationChange <= 0.0)
+            {
+                fprintf(stderr, "Decimation maximum rotation change must be greater than 0.0 degrees.\n");
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp(argv[i], "--skip-daylight") == 0)
+        {
+            state->nOptions++;
+            state->skipDaylight = true;
+        }
+        else if (strncmp(argv[i], "--sun-depression-angle=", 23) == 0)
+        {
+            state->nOptions++;
+            state->skipDaylight = true;
+            state->sunDepressionAngle = atof(argv[i]+23);
+        }
+        else if (strcmp(argv[i], "--skip-moonlight") == 0)
+        {
+            state->nOptions++;
+            state->skipMoonlight = true;
+        }
+        else if (strncmp(argv[i], "--moon-max-elevation=", 21) == 0)
+        {
+            state->nOptions++;
+            state->skipMoonlight = true;
+            state->moonMaxElevation = atof(argv[i]+21);
+        }
         else if (strncmp(argv[i], "--exportdir=", 12) == 0)
         {
             state->nOptions++;
             state->exportdir = argv[i]+12;
         }
+        else if (strncmp(argv[i], "--l1-path-template=", 19) == 0)
+        {
+            state->nOptions++;
+            state->l1PathTemplate = argv[i]+19;
+        }
         else if (strncmp(argv[i], "--l1dir=", 8) == 0)
         {
             state->nOptions++;
@@ -90,6 +325,11 @@ int setOptions(ProgramState *state, int argc, char **argv)
             state->nOptions++;
             state->skymapdir = argv[i]+12;
         }
+        else if (strncmp(argv[i], "--calibration-index=", 20) == 0)
+        {
+            state->nOptions++;
+            state->calibrationIndexFile = argv[i]+20;
+        }
         else if (strncmp(argv[i], "--skymap=", 9) == 0)
         {
             state->nOptions++;
@@ -126,6 +366,35 @@ int setOptions(ProgramState *state, int argc, char **argv)
             state->nOptions++;
             state->overwriteCdf = true;
         }
+        else if (strncmp(argv[i], "--export-compression=", 21) == 0)
+        {
+            state->nOptions++;
+            state->exportCompression = argv[i]+21;
+            ExportProfile profile;
+            if (parseExportProfile(state->exportCompression, &profile) != ASCC_OK)
+            {
+                if (profile.unknownVariable[0] != '\0')
+                    fprintf(stderr, "Invalid export compression %s: %s is not an exported variable\n", state->exportCompression, profile.unknownVariable);
+                else
+                    fprintf(stderr, "Invalid export compression %s\n", state->exportCompression);
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp(argv[i], "--export-columns") == 0)
+        {
+            state->nOptions++;
+            state->exportColumns = true;
+        }
+        else if (strcmp(argv[i], "--partial-results") == 0)
+        {
+            state->nOptions++;
+            state->exportPartialResults = true;
+        }
+        else if (strcmp(argv[i], "--compare-export-profiles") == 0)
+        {
+            state->nOptions++;
+            state->compareExportProfiles = true;
+        }
         else if (strcmp(argv[i], "--verbose") == 0)
         {
             state->nOptions++;
@@ -0,0 +1,241 @@
+/*
+
+    AllSkyCameraCal: pixelindex.c
+
+    Copyright (C) 2022  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "pixelindex.h"
+
+#include "main.h"
+
+#include <stdlib.h>
+#include <math.h>
+
+#define PIXEL_INDEX_CELL_WIDTH (2.0 / PIXEL_INDEX_CELLS)
+// Allowance for float rounding of the distances when deciding that no
+// pixel beyond the searched cells can be nearer
+#define PIXEL_INDEX_DISTANCE_MARGIN 1e-5
+
+static inline int pixelIndexCell(float component)
+{
+    int cell = (int)floorf((component + 1.0f) * (PIXEL_INDEX_CELLS / 2));
+    if (cell < 0)
+        return 0;
+    if (cell >= PIXEL_INDEX_CELLS)
+        return PIXEL_INDEX_CELLS - 1;
+
+    return cell;
+}
+
+static inline bool validReferencePixel(ProgramState *state, int c, int r)
+{
+    return isfinite(state->referenceAzimuths[c][r]) && isfinite(state->referenceElevations[c][r]);
+}
+
+// Counting sort of the valid pixels by cell, in column-major order within each cell
+int buildReferencePixelIndex(ProgramState *state)
+{
+    if (state == NULL)
+        return ASCC_ARGUMENTS;
+
+    freeReferencePixelIndex(state);
+
+    ReferencePixelIndex *index = calloc(1, sizeof *index);
+    if (index == NULL)
+        return ASCC_MEM;
+
+    int32_t *cellOfPixel = malloc(IMAGE_COLUMNS * IMAGE_ROWS * sizeof *cellOfPixel);
+    if (cellOfPixel == NULL)
+    {
+        free(index);
+        return ASCC_MEM;
+    }
+
+    for (int c = 0; c < IMAGE_COLUMNS; c++)
+    {
+        for (int r = 0; r < IMAGE_ROWS; r++)
+        {
+            int32_t cell = -1;
+            if (validReferencePixel(state, c, r))
+            {
+                cell = pixelIndexCell(state->pixelX[c][r]) * PIXEL_INDEX_CELLS + pixelIndexCell(state->pixelY[c][r]);
+                index->cellStart[cell + 1]++;
+                index->nPixels++;
+            }
+            cellOfPixel[c * IMAGE_ROWS + r] = cell;
+        }
+    }
+    for (int cell = 0; cell < PIXEL_INDEX_CELLS * PIXEL_INDEX_CELLS; cell++)
+        index->cellStart[cell + 1] += index->cellStart[cell];
+
+    size_t nEntries = index->nPixels > 0 ? index->nPixels : 1;
+    index->pixels = malloc(nEntries * sizeof *index->pixels);
+    index->x = malloc(nEntries * sizeof *index->x);
+    index->y = malloc(nEntries * sizeof *index->y);
+    index->z = malloc(nEntries * sizeof *index->z);
+    int32_t *next = malloc(PIXEL_INDEX_CELLS * PIXEL_INDEX_CELLS * sizeof *next);
+    if (index->pixels == NULL || index->x == NULL || index->y == NULL || index->z == NULL || next == NULL)
+    {
+        free(next);
+        free(cellOfPixel);
+        state->referencePixelIndex = index;
+        freeReferencePixelIndex(state);
+        return ASCC_MEM;
+    }
+
+    for (int cell = 0; cell < PIXEL_INDEX_CELLS * PIXEL_INDEX_CELLS; cell++)
+        next[cell] = index->cellStart[cell];
+    for (int32_t p = 0; p < IMAGE_COLUMNS * IMAGE_ROWS; p++)
+    {
+        int32_t cell = cellOfPixel[p];
+        if (cell < 0)
+            continue;
+        int c = p / IMAGE_ROWS;
+        int r = p % IMAGE_ROWS;
+        int32_t entry = next[cell]++;
+        index->pixels[entry] = p;
+        index->x[entry] = state->pixelX[c][r];
+        index->y[entry] = state->pixelY[c][r];
+        index->z[entry] = state->pixelZ[c][r];
+    }
+
+    free(next);
+    free(cellOfPixel);
+    state->referencePixelIndex = index;
+
+    return ASCC_OK;
+}
+
+static inline void scanPixelIndexCell(ReferencePixelIndex *index, int cell, const float *direction, float *minDistance, int32_t *nearest)
+{
+    float dx = 0.0;
+    float dy = 0.0;
+    float dz = 0.0;
+    float distance = 0.0;
+    int32_t last = index->cellStart[cell + 1];
+
+    for (int32_t e = index->cellStart[cell]; e < last; e++)
+    {
+        dx = direction[0] - index->x[e];
+        dy = direction[1] - index->y[e];
+        dz = direction[2] - index->z[e];
+        distance = sqrt(dx * dx + dy * dy + dz * dz);
+        if (distance < *minDistance || (distance == *minDistance && index->pixels[e] < *nearest))
+        {
+            *minDistance = distance;
+            *nearest = index->pixels[e];
+        }
+    }
+    index->nPixelsVisited += last - index->cellStart[cell];
+
+    return;
+}
+
+// Searches rings of cells around the direction's cell. Pixels outside the
+// first k rings are more than k cell widths away in x or y, so the search
+// ends once the nearest pixel found is closer than that.
+// Returns false if the reference map has no valid pixels.
+bool nearestReferencePixel(ProgramState *state, const float *direction, int32_t *column, int32_t *row)
+{
+    if (!isfinite(direction[0]) || !isfinite(direction[1]) || !isfinite(direction[2]))
+        return false;
+
+    if (state->referencePixelIndex == NULL && buildReferencePixelIndex(state) != ASCC_OK)
+        return nearestReferencePixelExhaustive(state, direction, column, row);
+
+    ReferencePixelIndex *index = state->referencePixelIndex;
+    index->nSearches++;
+
+    float minDistance = 10000000000.0;
+    int32_t nearest = -1;
+    int ci = pixelIndexCell(direction[0]);
+    int cj = pixelIndexCell(direction[1]);
+
+    for (int k = 0; k < PIXEL_INDEX_CELLS; k++)
+    {
+        for (int i = ci - k; i <= ci + k; i++)
+        {
+            if (i < 0 || i >= PIXEL_INDEX_CELLS)
+                continue;
+            // Whole first and last rows of the ring, only its ends in between
+            int step = (i == ci - k || i == ci + k) ? 1 : 2 * k;
+            for (int j = cj - k; j <= cj + k; j += step)
+            {
+                if (j < 0 || j >= PIXEL_INDEX_CELLS)
+                    continue;
+                scanPixelIndexCell(index, i * PIXEL_INDEX_CELLS + j, direction, &minDistance, &nearest);
+            }
+        }
+        if (nearest >= 0 && minDistance < k * PIXEL_INDEX_CELL_WIDTH - PIXEL_INDEX_DISTANCE_MARGIN)
+            break;
+    }
+    if (nearest < 0)
+        return false;
+
+    *column = nearest / IMAGE_ROWS;
+    *row = nearest % IMAGE_ROWS;
+
+    return true;
+}
+
+// Scan of the whole reference map, for when the index cannot be allocated
+bool nearestReferencePixelExhaustive(ProgramState *state, const float *direction, int32_t *column, int32_t *row)
+{
+    float distance = 0.0;
+    float minDistance = 10000000000.0;
+    float dx = 0.0;
+    float dy = 0.0;
+    float dz = 0.0;
+    bool found = false;
+
+    for (int c = 0; c < IMAGE_COLUMNS; c++)
+    {
+        for (int r = 0; r < IMAGE_ROWS; r++)
+        {
+            if (!validReferencePixel(state, c, r))
+                continue;
+            dx = direction[0] - state->pixelX[c][r];
+            dy = direction[1] - state->pixelY[c][r];
+            dz = direction[2] - state->pixelZ[c][r];
+            distance = sqrt(dx * dx + dy * dy + dz * dz);
+            if (distance < minDistance)
+            {
+                minDistance = distance;
+                *column = c;
+                *row = r;
+                found = true;
+            }
+        }
+    }
+
+    return found;
+}
+
+void freeReferencePixelIndex(ProgramState *state)
+{
+    if (state == NULL || state->referencePixelIndex == NULL)
+        return;
+
+    free(state->referencePixelIndex->pixels);
+    free(state->referencePixelIndex->x);
+    free(state->referencePixelIndex->y);
+    free(state->referencePixelIndex->z);
+    free(state->referencePixelIndex);
+    state->referencePixelIndex = NULL;
+
+    return;
+}
@@ -0,0 +1,59 @@
+/*
+
+    AllSkyCameraCal: pixelindex.h
+
+    Copyright (C) 2022  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// Reference map pixels bucketed on a grid of their direction's x and y
+// components, so the pixel nearest to a star's predicted direction is found
+// from a few neighbouring cells instead of a scan of the whole map. Results
+// are the same as for the scan, including ties, which go to the first pixel
+// in column-major order.
+
+#ifndef _PIXELINDEX_H
+#define _PIXELINDEX_H
+
+#include "main.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Cells per axis over [-1, 1]: a few reference pixels per cell near zenith
+#define PIXEL_INDEX_CELLS 128
+
+typedef struct ReferencePixelIndex
+{
+    // First entry of each cell; cellStart[PIXEL_INDEX_CELLS * PIXEL_INDEX_CELLS] is nPixels
+    int32_t cellStart[PIXEL_INDEX_CELLS * PIXEL_INDEX_CELLS + 1];
+    // Per entry: column * IMAGE_ROWS + row, increasing within a cell, and the
+    // pixel direction, so that a cell is scanned contiguously
+    int32_t *pixels;
+    float *x;
+    float *y;
+    float *z;
+    int32_t nPixels;
+
+    size_t nSearches;
+    size_t nPixelsVisited;
+} ReferencePixelIndex;
+
+int buildReferencePixelIndex(ProgramState *state);
+bool nearestReferencePixel(ProgramState *state, const float *direction, int32_t *column, int32_t *row);
+bool nearestReferencePixelExhaustive(ProgramState *state, const float *direction, int32_t *column, int32_t *row);
+void freeReferencePixelIndex(ProgramState *state);
+
+#endif // _PIXELINDEX_H
@@ -0,0 +1,649 @@
+/*
+
+    AllSkyCameraCal: platesolve.c
+
+    Copyright (C) 2022  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "platesolve.h"
+
+#include "main.h"
+#include "star.h"
+#include "measure.h"
+#include "analysis.h"
+#include "attitude.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+// Lost-in-space attitude determination. Angular separations between stars do not
+// depend on the camera orientation, so triangles of bright sources in an image can
+// be looked up in an index of catalog star triangles. Each match gives a candidate
+// rotation, which is kept if it lines up enough of the other sources with catalog stars.
+
+// Cached index file header
+typedef struct PlateSolveIndexHeader
+{
+    char magic[8];
+    int32_t nCatalogStars;
+    int32_t nIndexStars;
+    uint32_t catalogChecksum;
+    float minSideDegrees;
+    float maxSideDegrees;
+    float sideToleranceDegrees;
+    uint64_t nTriangles;
+} PlateSolveIndexHeader;
+
+static int numberOfBins(void)
+{
+    return (int)(PLATE_SOLVE_MAX_SIDE_DEGREES / PLATE_SOLVE_SIDE_TOLERANCE_DEGREES) + 2;
+}
+
+static int64_t binKey(int shortBin, int middleBin, int longBin)
+{
+    int nBins = numberOfBins();
+    if (shortBin < 0 || middleBin < 0 || longBin < 0 || shortBin >= nBins || middleBin >= nBins || longBin >= nBins)
+        return -1;
+
+    return ((int64_t)longBin * nBins + middleBin) * nBins + shortBin;
+}
+
+static int sideBin(double side)
+{
+    return (int)floor(side / PLATE_SOLVE_SIDE_TOLERANCE_DEGREES);
+}
+
+static int compareTriangles(const void *first, const void *second)
+{
+    uint32_t a = ((TriangleIndexEntry*)first)->key;
+    uint32_t b = ((TriangleIndexEntry*)second)->key;
+
+    return a < b ? -1 : (a > b ? 1 : 0);
+}
+
+static double separationDegrees(const double *a, const double *b)
+{
+    double dot = a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+    if (dot > 1.0)
+        dot = 1.0;
+    else if (dot < -1.0)
+        dot = -1.0;
+
+    return acos(dot) / M_PI * 180.0;
+}
+
+// Orders a triangle's vertices by the length of the opposite side, shortest first
+static void sortTriangle(int *vertices, double *sides)
+{
+    int v = 0;
+    double s = 0.0;
+    for (int i = 1; i < 3; i++)
+    {
+        for (int j = i; j > 0 && sides[j] < sides[j - 1]; j--)
+        {
+            s = sides[j];
+            sides[j] = sides[j - 1];
+            sides[j - 1] = s;
+            v = vertices[j];
+            vertices[j] = vertices[j - 1];
+            vertices[j - 1] = v;
+        }
+    }
+
+    return;
+}
+
+static uint32_t catalogChecksum(ProgramState *state, int nStars)
+{
+    uint32_t checksum = 0;
+    for (int i = 0; i < nStars; i++)
+        checksum = checksum * 31 + (uint32_t)state->starData[i].catalogNumber;
+
+    return checksum;
+}
+
+static int numberOfIndexStars(ProgramState *state)
+{
+    int nStars = PLATE_SOLVE_N_INDEX_STARS;
+    if (state->nStars < nStars)
+        nStars = state->nStars;
+
+    return nStars;
+}
+
+// Reads the cached index, or builds it and caches it
+int loadPlateSolveIndex(ProgramState *state)
+{
+    if (state == NULL)
+        return ASCC_ARGUMENTS;
+
+    char defaultFilename[FILENAME_MAX + 1];
+    char *filename = state->plateSolveIndexFile;
+    if (filename == NULL)
+    {
+        snprintf(defaultFilename, FILENAME_MAX, "%s/%s", state->stardir, PLATE_SOLVE_INDEX_FILENAME);
+        filename = defaultFilename;
+    }
+
+    PlateSolveIndex *index = calloc(1, sizeof *index);
+    if (index == NULL)
+        return ASCC_MEM;
+
+    int status = readPlateSolveIndex(state, filename, index);
+    if (status == ASCC_OK)
+    {
+        if (state->verbose)
+            fprintf(stderr, "Read plate solving index of %zu triangles from %s\n", index->nTriangles, filename);
+    }
+    else
+    {
+        status = buildPlateSolveIndex(state, index);
+        if (status != ASCC_OK)
+        {
+            freePlateSolveIndex(index);
+            free(index);
+            return status;
+        }
+        if (writePlateSolveIndex(state, filename, index) != ASCC_OK)
+        {
+            if (state->verbose)
+                fprintf(stderr, "Could not cache plate solving index in %s\n", filename);
+        }
+        else if (state->verbose)
+            fprintf(stderr, "Built plate solving index of %zu triangles in %s\n", index->nTriangles, filename);
+    }
+
+    state->plateSolveIndex = index;
+
+    return ASCC_OK;
+}
+
+int buildPlateSolveIndex(ProgramState *state, PlateSolveIndex *index)
+{
+    if (state == NULL || index == NULL || state->starData == NULL)
+        return ASCC_ARGUMENTS;
+
+    int status = ASCC_OK;
+
+    int nStars = numberOfIndexStars(state);
+    double *xyz = NULL;
+    float *separations = NULL;
+    size_t capacity = 0;
+    void *mem = NULL;
+
+    index->nStars = nStars;
+    index->nTriangles = 0;
+    index->triangles = NULL;
+
+    xyz = calloc(nStars, 3 * sizeof *xyz);
+    separations = calloc((size_t)nStars * nStars, sizeof *separations);
+    if (xyz == NULL || separations == NULL)
+    {
+        status = ASCC_MEM;
+        goto cleanup;
+    }
+
+    // J2000 directions. Separations change too little with proper motion to matter here.
+    for (int i = 0; i < nStars; i++)
+    {
+        double ra = state->starData[i].rightAscensionRadian;
+        double dec = state->starData[i].declinationRadian;
+        xyz[i * 3] = cos(ra) * cos(dec);
+        xyz[i * 3 + 1] = sin(ra) * cos(dec);
+        xyz[i * 3 + 2] = sin(dec);
+    }
+    for (int i = 0; i < nStars; i++)
+        for (int j = 0; j < nStars; j++)
+            separations[i * nStars + j] = separationDegrees(&xyz[i * 3], &xyz[j * 3]);
+
+    int vertices[3] = {0};
+    double sides[3] = {0.0};
+    TriangleIndexEntry *entry = NULL;
+    for (int i = 0; i < nStars; i++)
+    {
+        for (int j = i + 1; j < nStars; j++)
+        {
+            if (separations[i * nStars + j] < PLATE_SOLVE_MIN_SIDE_DEGREES || separations[i * nStars + j] > PLATE_SOLVE_MAX_SIDE_DEGREES)
+                continue;
+            for (int k = j + 1; k < nStars; k++)
+            {
+                vertices[0] = i;
+                vertices[1] = j;
+                vertices[2] = k;
+                sides[0] = separations[j * nStars + k];
+                sides[1] = separations[i * nStars + k];
+                sides[2] = separations[i * nStars + j];
+                sortTriangle(vertices, sides);
+                if (sides[0] < PLATE_SOLVE_MIN_SIDE_DEGREES || sides[2] > PLATE_SOLVE_MAX_SIDE_DEGREES)
+                    continue;
+
+                if (index->nTriangles == capacity)
+                {
+                    capacity = capacity == 0 ? 65536 : 2 * capacity;
+                    mem = realloc(index->triangles, capacity * sizeof *index->triangles);
+                    if (mem == NULL)
+                    {
+                        status = ASCC_MEM;
+                        goto cleanup;
+                    }
+                    index->triangles = mem;
+                }
+                entry = &index->triangles[index->nTriangles++];
+                entry->key = (uint32_t)binKey(sideBin(sides[0]), sideBin(sides[1]), sideBin(sides[2]));
+                for (int n = 0; n < 3; n++)
+                {
+                    entry->stars[n] = (uint16_t)vertices[n];
+                    entry->sides[n] = (float)sides[n];
+                }
+            }
+        }
+    }
+
+    qsort(index->triangles, index->nTriangles, sizeof *index->triangles, &compareTriangles);
+
+cleanup:
+    if (xyz != NULL)
+        free(xyz);
+    if (separations != NULL)
+        free(separations);
+    if (status != ASCC_OK)
+        freePlateSolveIndex(index);
+
+    return status;
+}
+
+// Returns ASCC_OK only if the file exists and was built with the current catalog and settings
+int readPlateSolveIndex(ProgramState *state, char *filename, PlateSolveIndex *index)
+{
+    if (state == NULL || filename == NULL || index == NULL)
+        return ASCC_ARGUMENTS;
+
+    int status = ASCC_OK;
+    PlateSolveIndexHeader header = {0};
+    int nStars = numberOfIndexStars(state);
+
+    FILE *indexFile = fopen(filename, "r");
+    if (indexFile == NULL)
+        return ASCC_BLIND_SOLVE;
+
+    if (fread(&header, sizeof header, 1, indexFile) != 1)
+    {
+        status = ASCC_BLIND_SOLVE;
+        goto cleanup;
+    }
+    if (memcmp(header.magic, PLATE_SOLVE_INDEX_MAGIC, 8) != 0 || header.nCatalogStars != state->nStars || header.nIndexStars != nStars || header.catalogChecksum != catalogChecksum(state, nStars) || header.minSideDegrees != (float)PLATE_SOLVE_MIN_SIDE_DEGREES || header.maxSideDegrees != (float)PLATE_SOLVE_MAX_SIDE_DEGREES || header.sideToleranceDegrees != (float)PLATE_SOLVE_SIDE_TOLERANCE_DEGREES)
+    {
+        status = ASCC_BLIND_SOLVE;
+        goto cleanup;
+    }
+
+    index->nStars = nStars;
+    index->nTriangles = (size_t)header.nTriangles;
+    index->triangles = calloc(index->nTriangles > 0 ? index->nTriangles : 1, sizeof *index->triangles);
+    if (index->triangles == NULL)
+    {
+        status = ASCC_MEM;
+        goto cleanup;
+    }
+    if (fread(index->triangles, sizeof *index->triangles, index->nTriangles, indexFile) != index->nTriangles)
+    {
+        freePlateSolveIndex(index);
+        status = ASCC_BLIND_SOLVE;
+        goto cleanup;
+    }
+
+cleanup:
+    fclose(indexFile);
+
+    return status;
+}
+
+// Writes to a temporary file first so that an interrupted write never leaves a truncated cache
+int writePlateSolveIndex(ProgramState *state, char *filename, PlateSolveIndex *index)
+{
+    if (state == NULL || filename == NULL || index == NULL)
+        return ASCC_ARGUMENTS;
+
+    char tmpFilename[FILENAME_MAX + 1];
+    snprintf(tmpFilename, FILENAME_MAX, "%s.tmp.%ld", filename, (long)getpid());
+
+    PlateSolveIndexHeader header = {0};
+    memcpy(header.magic, PLATE_SOLVE_INDEX_MAGIC, 8);
+    header.nCatalogStars = state->nStars;
+    header.nIndexStars = index->nStars;
+    header.catalogChecksum = catalogChecksum(state, index->nStars);
+    header.minSideDegrees = PLATE_SOLVE_MIN_SIDE_DEGREES;
+    header.maxSideDegrees = PLATE_SOLVE_MAX_SIDE_DEGREES;
+    header.sideToleranceDegrees = PLATE_SOLVE_SIDE_TOLERANCE_DEGREES;
+    header.nTriangles = index->nTriangles;
+
+    FILE *indexFile = fopen(tmpFilename, "w");
+    if (indexFile == NULL)
+        return ASCC_BLIND_SOLVE;
+
+    bool written = fwrite(&header, sizeof header, 1, indexFile) == 1 && fwrite(index->triangles, sizeof *index->triangles, index->nTriangles, indexFile) == index->nTriangles;
+    if (fclose(indexFile) != 0 || !written || rename(tmpFilename, filename) != 0)
+    {
+        remove(tmpFilename);
+        return ASCC_BLIND_SOLVE;
+    }
+
+    return ASCC_OK;
+}
+
+void freePlateSolveIndex(PlateSolveIndex *index)
+{
+    if (index == NULL)
+        return;
+
+    if (index->triangles != NULL)
+        free(index->triangles);
+    index->triangles = NULL;
+    index->nTriangles = 0;
+
+    return;
+}
+
+// Finds the brightest local maxima above the calibration elevation bound and returns
+// their directions, brightest first
+int extractSources(ProgramState *state, PaddedImage *image, PlateSolveSource *sources, int maxSources)
+{
+    if (state == NULL || image == NULL || sources == NULL)
+        return 0;
+
+    int nSources = 0;
+    int v = 0;
+    int signal = 0;
+    int momentCounter = 0;
+    float backgrounds[maxSources];
+    StarWindow window = {0};
+    CalibrationStar cal = {0};
+    uint16_t (*pixels)[PADDED_IMAGE_ROWS] = image->pixels;
+
+    for (int c = 1; c < IMAGE_COLUMNS - 1; c++)
+    {
+        for (int r = 1; r < IMAGE_ROWS - 1; r++)
+        {
+            v = pixels[c + IMAGE_HALO][r + IMAGE_HALO];
+            if (v < PLATE_SOLVE_MIN_SOURCE_SIGNAL || v > state->maxPeakSignalForMoments)
+                continue;
+            if (!isfinite(state->referenceElevations[c][r]) || state->referenceElevations[c][r] < CALIBRATION_ELEVATION_BOUND)
+                continue;
+            // Strict maximum over pixels already scanned, so that a flat top counts once
+            if (v <= pixels[c - 1 + IMAGE_HALO][r - 1 + IMAGE_HALO] || v <= pixels[c - 1 + IMAGE_HALO][r + IMAGE_HALO] || v <= pixels[c - 1 + IMAGE_HALO][r + 1 + IMAGE_HALO] || v <= pixels[c + IMAGE_HALO][r - 1 + IMAGE_HALO])
+                continue;
+            if (v < pixels[c + IMAGE_HALO][r + 1 + IMAGE_HALO] || v < pixels[c + 1 + IMAGE_HALO][r - 1 + IMAGE_HALO] || v < pixels[c + 1 + IMAGE_HALO][r + IMAGE_HALO] || v < pixels[c + 1 + IMAGE_HALO][r + 1 + IMAGE_HALO])
+                continue;
+
+            window.centerColumn = c;
+            window.centerRow = r;
+            window.backgroundHalfWidth = STAR_SEARCH_BOX_WIDTH / 2;
+            window.peakHalfWidth = 0;
+            measureStarWindow(image, &window);
+            if (!isfinite(window.meanSignal) || window.meanSignal > state->maxBackgroundSignalForMoments)
+                continue;
+            signal = v - (int)roundf(window.meanSignal);
+            if (signal < PLATE_SOLVE_MIN_SOURCE_SIGNAL || (nSources == maxSources && signal <= sources[nSources - 1].signal))
+                continue;
+
+            // Insert into the list sorted by signal
+            int s = nSources < maxSources ? nSources++ : maxSources - 1;
+            for (; s > 0 && sources[s - 1].signal < signal; s--)
+            {
+                sources[s] = sources[s - 1];
+                backgrounds[s] = backgrounds[s - 1];
+            }
+            sources[s].column = c;
+            sources[s].row = r;
+            sources[s].signal = signal;
+            backgrounds[s] = window.meanSignal;
+        }
+    }
+
+    // Centroid directions, as for calibration stars
+    int nCentroided = 0;
+    double norm = 0.0;
+    for (int s = 0; s < nSources; s++)
+    {
+        momentCounter = calculatePaddedMoments(state, image, &cal, 2, (float)sources[s].column, (float)sources[s].row, roundf(backgrounds[s]) + 10);
+        norm = sqrt(cal.measuredAzElX * cal.measuredAzElX + cal.measuredAzElY * cal.measuredAzElY + cal.measuredAzElZ * cal.measuredAzElZ);
+        if (momentCounter == 0 || norm == 0.0)
+            continue;
+        sources[nCentroided] = sources[s];
+        sources[nCentroided].xyz[0] = cal.measuredAzElX / norm;
+        sources[nCentroided].xyz[1] = cal.measuredAzElY / norm;
+        sources[nCentroided].xyz[2] = cal.measuredAzElZ / norm;
+        nCentroided++;
+    }
+
+    return nCentroided;
+}
+
+// Number of sources within the match radius of a rotated visible index star.
+// If pairs is not NULL, the matching star of each source is stored there (-1 if none).
+static int scoreAttitude(PlateSolveSource *sources, int nSources, double (*starXYZ)[3], bool *visible, int nStars, const double *dcm, int *pairs)
+{
+    double rotated[PLATE_SOLVE_N_INDEX_STARS][3];
+    double cosRadius = cos(PLATE_SOLVE_MATCH_RADIUS_DEGREES * M_PI / 180.0);
+    double dot = 0.0;
+    double bestDot = 0.0;
+    int bestStar = 0;
+    int score = 0;
+
+    for (int i = 0; i < nStars; i++)
+        if (visible[i])
+            rotateVector(dcm, starXYZ[i], rotated[i]);
+
+    for (int s = 0; s < nSources; s++)
+    {
+        bestDot = cosRadius;
+        bestStar = -1;
+        for (int i = 0; i < nStars; i++)
+        {
+            if (!visible[i])
+                continue;
+            dot = sources[s].xyz[0] * rotated[i][0] + sources[s].xyz[1] * rotated[i][1] + sources[s].xyz[2] * rotated[i][2];
+            if (dot >= bestDot)
+            {
+                bestDot = dot;
+                bestStar = i;
+            }
+        }
+        if (bestStar >= 0)
+            score++;
+        if (pairs != NULL)
+            pairs[s] = bestStar;
+    }
+
+    return score;
+}
+
+// Lost-in-space attitude: dcm takes predicted star directions to measured directions,
+// as for the pointing error DCMs. Returns ASCC_OK if a solution was found.
+int blindSolveAttitude(ProgramState *state, PaddedImage *image, double imageTime, double *dcm, int *nMatched)
+{
+    if (state == NULL || image == NULL || dcm == NULL || state->plateSolveIndex == NULL)
+        return ASCC_ARGUMENTS;
+
+    PlateSolveIndex *index = state->plateSolveIndex;
+    PlateSolveSource sources[PLATE_SOLVE_N_SOURCES];
+    int nSources = extractSources(state, image, sources, PLATE_SOLVE_N_SOURCES);
+    if (nSources < PLATE_SOLVE_MIN_MATCHES)
+        return ASCC_BLIND_SOLVE;
+
+    // Index star directions in the local east, north, up frame at the image time
+    double starXYZ[PLATE_SOLVE_N_INDEX_STARS][3];
+    bool visible[PLATE_SOLVE_N_INDEX_STARS];
+    Star *star = NULL;
+    float starRa = 0.0;
+    float starDec = 0.0;
+    float starAz = 0.0;
+    float starEl = 0.0;
+    float yearsSinceJ2000 = (float) (imageTime - J200EPOCH) / 1000.0 / 86400. / 365.25;
+    for (int i = 0; i < index->nStars; i++)
+    {
+        star = &state->starData[i];
+        starRa = fmod(star->rightAscensionRadian + star->raProperMotionRadianPerYear * yearsSinceJ2000, 2.0 * M_PI);
+        starDec = fmod(star->declinationRadian + star->decProperMotionRadianPerYear * yearsSinceJ2000, 2.0 * M_PI);
+        radecToazel(imageTime, state->siteLatitudeGeodetic, state->siteLongitudeGeodetic, state->siteAltitudeMetres, starRa, starDec, &starAz, &starEl);
+        // Allow for a camera tilted toward the horizon
+        visible[i] = starEl > 0.0;
+        starXYZ[i][0] = cos((90.0 - starAz)*M_PI/180.0) * cos(starEl*M_PI/180.0);
+        starXYZ[i][1] = sin((90.0 - starAz)*M_PI/180.0) * cos(starEl*M_PI/180.0);
+        starXYZ[i][2] = sin(starEl*M_PI/180.0);
+    }
+
+    static const int permutations[6][3] = {{0, 1, 2}, {0, 2, 1}, {1, 0, 2}, {1, 2, 0}, {2, 0, 1}, {2, 1, 0}};
+    int earlyStop = (2 * nSources) / 3;
+    if (earlyStop < PLATE_SOLVE_MIN_MATCHES)
+        earlyStop = PLATE_SOLVE_MIN_MATCHES;
+    int bestScore = 0;
+    double bestDcm[9] = {0.0};
+    double hypothesis[9] = {0.0};
+    double predicted[3 * PLATE_SOLVE_N_SOURCES];
+    double measured[3 * PLATE_SOLVE_N_SOURCES];
+    int vertices[3] = {0};
+    double sides[3] = {0.0};
+    int score = 0;
+    int64_t key = 0;
+    size_t first = 0;
+    size_t last = 0;
+    size_t mid = 0;
+    TriangleIndexEntry *entry = NULL;
+    bool sidesMatch = false;
+    const int *p = NULL;
+
+    // Brightest source triangles first
+    for (int i = 0; i < nSources && bestScore < earlyStop; i++)
+    {
+        for (int j = i + 1; j < nSources && bestScore < earlyStop; j++)
+        {
+            for (int k = j + 1; k < nSources && bestScore < earlyStop; k++)
+            {
+                vertices[0] = i;
+                vertices[1] = j;
+                vertices[2] = k;
+                sides[0] = separationDegrees(sources[j].xyz, sources[k].xyz);
+                sides[1] = separationDegrees(sources[i].xyz, sources[k].xyz);
+                sides[2] = separationDegrees(sources[i].xyz, sources[j].xyz);
+                sortTriangle(vertices, sides);
+                if (sides[0] < PLATE_SOLVE_MIN_SIDE_DEGREES - PLATE_SOLVE_SIDE_TOLERANCE_DEGREES || sides[2] > PLATE_SOLVE_MAX_SIDE_DEGREES + PLATE_SOLVE_SIDE_TOLERANCE_DEGREES)
+                    continue;
+
+                // Neighbouring bins cover sides within the tolerance of a bin edge
+                for (int d = 0; d < 27 && bestScore < earlyStop; d++)
+                {
+                    key = binKey(sideBin(sides[0]) + d % 3 - 1, sideBin(sides[1]) + (d / 3) % 3 - 1, sideBin(sides[2]) + d / 9 - 1);
+                    if (key < 0)
+                        continue;
+                    first = 0;
+                    last = index->nTriangles;
+                    while (first < last)
+                    {
+                        mid = first + (last - first) / 2;
+                        if (index->triangles[mid].key < (uint32_t)key)
+                            first = mid + 1;
+                        else
+                            last = mid;
+                    }
+                    for (; first < index->nTriangles && index->triangles[first].key == (uint32_t)key && bestScore < earlyStop; first++)
+                    {
+                        entry = &index->triangles[first];
+                        if (!visible[entry->stars[0]] || !visible[entry->stars[1]] || !visible[entry->stars[2]])
+                            continue;
+                        // Nearly equal sides make the vertex order ambiguous: try each consistent one
+                        for (int n = 0; n < 6; n++)
+                        {
+                            p = permutations[n];
+                            sidesMatch = true;
+                            for (int m = 0; m < 3; m++)
+                                if (fabs(sides[p[m]] - entry->sides[m]) > PLATE_SOLVE_SIDE_TOLERANCE_DEGREES)
+                                    sidesMatch = false;
+                            if (!sidesMatch)
+                                continue;
+                            for (int m = 0; m < 3; m++)
+                            {
+                                memcpy(&predicted[3 * m], starXYZ[entry->stars[m]], 3 * sizeof(double));
+                                memcpy(&measured[3 * m], sources[vertices[p[m]]].xyz, 3 * sizeof(double));
+                            }
+                            if (fitRotation(predicted, measured, 3, hypothesis) != ASCC_OK)
+                                continue;
+                            score = scoreAttitude(sources, nSources, starXYZ, visible, index->nStars, hypothesis, NULL);
+                            if (score > bestScore)
+                            {
+                                bestScore = score;
+                                memcpy(bestDcm, hypothesis, sizeof bestDcm);
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    if (bestScore < PLATE_SOLVE_MIN_MATCHES)
+        return ASCC_BLIND_SOLVE;
+
+    // Refine using all matched sources
+    int pairs[PLATE_SOLVE_N_SOURCES];
+    int nPairs = 0;
+    scoreAttitude(sources, nSources, starXYZ, visible, index->nStars, bestDcm, pairs);
+    for (int s = 0; s < nSources; s++)
+    {
+        if (pairs[s] < 0)
+            continue;
+        memcpy(&predicted[3 * nPairs], starXYZ[pairs[s]], 3 * sizeof(double));
+        memcpy(&measured[3 * nPairs], sources[s].xyz, 3 * sizeof(double));
+        nPairs++;
+    }
+    if (fitRotation(predicted, measured, nPairs, hypothesis) == ASCC_OK)
+    {
+        score = scoreAttitude(sources, nSources, starXYZ, visible, index->nStars, hypothesis, NULL);
+        if (score >= bestScore)
+        {
+            bestScore = score;
+            memcpy(bestDcm, hypothesis, sizeof bestDcm);
+        }
+    }
+
+    memcpy(dcm, bestDcm, sizeof bestDcm);
+    if (nMatched != NULL)
+        *nMatched = bestScore;
+
+    return ASCC_OK;
+}
+
+// Number of the n measured directions within radiusDegrees of the rotated predicted directions
+int countConsistentStars(double *predicted, double *measured, int n, const double *dcm, double radiusDegrees)
+{
+    int nConsistent = 0;
+    double rotated[3] = {0.0};
+    double norm = 0.0;
+    double cosRadius = cos(radiusDegrees * M_PI / 180.0);
+
+    for (int i = 0; i < n; i++)
+    {
+        rotateVector(dcm, &predicted[3 * i], rotated);
+        norm = sqrt(measured[3 * i] * measured[3 * i] + measured[3 * i + 1] * measured[3 * i + 1] + measured[3 * i + 2] * measured[3 * i + 2]);
+        if (norm > 0.0 && (rotated[0] * measured[3 * i] + rotated[1] * measured[3 * i + 1] + rotated[2] * measured[3 * i + 2]) / norm >= cosRadius)
+            nConsistent++;
+    }
+
+    return nConsistent;
+}
@@ -0,0 +1,88 @@
+/*
+
+    AllSkyCameraCal: platesolve.h
+
+    Copyright (C) 2022  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef _PLATESOLVE_H
+#define _PLATESOLVE_H
+
+#include "main.h"
+#include "measure.h"
+
+#include <stdint.h>
+
+// Triangle index: all triangles of the brightest catalog stars with sides
+// between the minimum and maximum angular separations
+#define PLATE_SOLVE_N_INDEX_STARS 250
+#define PLATE_SOLVE_MIN_SIDE_DEGREES 3.0
+#define PLATE_SOLVE_MAX_SIDE_DEGREES 60.0
+// Side matching tolerance, also the width of an index bin
+#define PLATE_SOLVE_SIDE_TOLERANCE_DEGREES 0.3
+#define PLATE_SOLVE_INDEX_MAGIC "ASCCTRI1"
+#define PLATE_SOLVE_INDEX_FILENAME "BSC5ra.triangles"
+
+// Source extraction
+#define PLATE_SOLVE_N_SOURCES 12
+#define PLATE_SOLVE_MIN_SOURCE_SIGNAL 50
+
+// Hypothesis verification
+#define PLATE_SOLVE_MATCH_RADIUS_DEGREES 1.0
+#define PLATE_SOLVE_MIN_MATCHES 5
+
+// Blind solving is triggered when fewer than this fraction of the
+// calibration stars agree with the fitted attitude
+#define PLATE_SOLVE_MIN_MATCH_FRACTION 0.5
+
+typedef struct TriangleIndexEntry
+{
+    // Bin key of the sorted sides
+    uint32_t key;
+    // Catalog indices of the stars opposite the shortest, middle and longest sides
+    uint16_t stars[3];
+    // Sides in degrees, shortest first
+    float sides[3];
+} TriangleIndexEntry;
+
+typedef struct PlateSolveIndex
+{
+    int nStars;
+    size_t nTriangles;
+    // Sorted by key
+    TriangleIndexEntry *triangles;
+} PlateSolveIndex;
+
+typedef struct PlateSolveSource
+{
+    int column;
+    int row;
+    int signal;
+    double xyz[3];
+} PlateSolveSource;
+
+int loadPlateSolveIndex(ProgramState *state);
+int buildPlateSolveIndex(ProgramState *state, PlateSolveIndex *index);
+int readPlateSolveIndex(ProgramState *state, char *filename, PlateSolveIndex *index);
+int writePlateSolveIndex(ProgramState *state, char *filename, PlateSolveIndex *index);
+void freePlateSolveIndex(PlateSolveIndex *index);
+
+int extractSources(ProgramState *state, PaddedImage *image, PlateSolveSource *sources, int maxSources);
+int blindSolveAttitude(ProgramState *state, PaddedImage *image, double imageTime, double *dcm, int *nMatched);
+
+int countConsistentStars(double *predicted, double *measured, int n, const double *dcm, double radiusDegrees);
+
+#endif // _PLATESOLVE_H
@@ -0,0 +1,162 @@
+/*
+
+    AllSkyCameraCal: prefetch.c
+
+    Copyright (C) 2022  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "prefetch.h"
+
+#include "main.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// posix_fadvise is only a hint and network file systems may ignore it, so
+// each file is also read through once. The CDF library then finds it in the
+// page cache.
+static size_t prefetchFile(char *filename, char *buffer)
+{
+    size_t nBytes = 0;
+    ssize_t nRead = 0;
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return 0;
+
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    while ((nRead = read(fd, buffer, L1_PREFETCH_READ_BYTES)) > 0)
+        nBytes += (size_t)nRead;
+    close(fd);
+
+    return nBytes;
+}
+
+static void *prefetchL1Files(void *arg)
+{
+    L1Prefetcher *prefetcher = (L1Prefetcher*)arg;
+    size_t index = 0;
+    size_t nBytes = 0;
+
+    char *buffer = malloc(L1_PREFETCH_READ_BYTES);
+    if (buffer == NULL)
+    {
+        // Release any waiting analysis
+        pthread_mutex_lock(&prefetcher->mutex);
+        prefetcher->nextFile = prefetcher->nFiles;
+        pthread_cond_broadcast(&prefetcher->changed);
+        pthread_mutex_unlock(&prefetcher->mutex);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&prefetcher->mutex);
+    while (!prefetcher->stop && prefetcher->nextFile < prefetcher->nFiles)
+    {
+        // Stay at most depth files ahead of the file being analyzed
+        if (prefetcher->nextFile > prefetcher->currentFile + prefetcher->depth)
+        {
+            pthread_cond_wait(&prefetcher->changed, &prefetcher->mutex);
+            continue;
+        }
+        index = prefetcher->nextFile;
+        pthread_mutex_unlock(&prefetcher->mutex);
+
+        nBytes = prefetchFile(prefetcher->files[index], buffer);
+
+        pthread_mutex_lock(&prefetcher->mutex);
+        prefetcher->nFilesPrefetched++;
+        prefetcher->bytesPrefetched += nBytes;
+        prefetcher->nextFile = index + 1;
+        pthread_cond_broadcast(&prefetcher->changed);
+    }
+    pthread_mutex_unlock(&prefetcher->mutex);
+
+    free(buffer);
+
+    return NULL;
+}
+
+int startL1Prefetcher(L1Prefetcher *prefetcher, char **files, size_t nFiles, int depth)
+{
+    if (prefetcher == NULL || (files == NULL && nFiles > 0) || depth < 1)
+        return ASCC_ARGUMENTS;
+
+    memset(prefetcher, 0, sizeof *prefetcher);
+    prefetcher->files = files;
+    prefetcher->nFiles = nFiles;
+    prefetcher->depth = depth;
+
+    if (pthread_mutex_init(&prefetcher->mutex, NULL) != 0)
+        return ASCC_MEM;
+    if (pthread_cond_init(&prefetcher->changed, NULL) != 0)
+    {
+        pthread_mutex_destroy(&prefetcher->mutex);
+        return ASCC_MEM;
+    }
+    if (pthread_create(&prefetcher->thread, NULL, prefetchL1Files, prefetcher) != 0)
+    {
+        pthread_cond_destroy(&prefetcher->changed);
+        pthread_mutex_destroy(&prefetcher->mutex);
+        return ASCC_MEM;
+    }
+    prefetcher->threadStarted = true;
+
+    return ASCC_OK;
+}
+
+// Marks file index as the one being analyzed, letting the prefetcher move on,
+// and waits until it has been read ahead
+void waitForL1File(L1Prefetcher *prefetcher, size_t index)
+{
+    if (prefetcher == NULL || !prefetcher->threadStarted)
+        return;
+
+    double waitStart = monotonicSeconds();
+
+    pthread_mutex_lock(&prefetcher->mutex);
+    prefetcher->currentFile = index;
+    pthread_cond_broadcast(&prefetcher->changed);
+    while (prefetcher->nextFile <= index && prefetcher->nextFile < prefetcher->nFiles)
+        pthread_cond_wait(&prefetcher->changed, &prefetcher->mutex);
+    pthread_mutex_unlock(&prefetcher->mutex);
+
+    prefetcher->stallSeconds += monotonicSeconds() - waitStart;
+
+    return;
+}
+
+void stopL1Prefetcher(L1Prefetcher *prefetcher)
+{
+    if (prefetcher == NULL || !prefetcher->threadStarted)
+        return;
+
+    pthread_mutex_lock(&prefetcher->mutex);
+    prefetcher->stop = true;
+    pthread_cond_broadcast(&prefetcher->changed);
+    pthread_mutex_unlock(&prefetcher->mutex);
+
+    pthread_join(prefetcher->thread, NULL);
+    pthread_cond_destroy(&prefetcher->changed);
+    pthread_mutex_destroy(&prefetcher->mutex);
+    prefetcher->threadStarted = false;
+
+    return;
+}
@@ -0,0 +1,63 @@
+/*
+
+    AllSkyCameraCal: prefetch.h
+
+    Copyright (C) 2022  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef _PREFETCH_H
+#define _PREFETCH_H
+
+#include "main.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+// Size of the prefetch thread's read buffer
+#define L1_PREFETCH_READ_BYTES (1 << 20)
+
+// Reads the next files of the analysis list into the page cache while the
+// current file is analyzed. At most depth files are read ahead.
+typedef struct L1Prefetcher
+{
+    char **files;
+    size_t nFiles;
+    int depth;
+
+    pthread_t thread;
+    bool threadStarted;
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+
+    // Guarded by mutex
+    size_t nextFile;
+    size_t currentFile;
+    bool stop;
+
+    // Updated by the prefetch thread only
+    size_t nFilesPrefetched;
+    size_t bytesPrefetched;
+
+    // Time the analysis waited for files, seconds
+    double stallSeconds;
+} L1Prefetcher;
+
+int startL1Prefetcher(L1Prefetcher *prefetcher, char **files, size_t nFiles, int depth);
+void waitForL1File(L1Prefetcher *prefetcher, size_t index);
+void stopL1Prefetcher(L1Prefetcher *prefetcher);
+
+#endif // _PREFETCH_H
@@ -0,0 +1,346 @@
+/*
+
+    AllSkyCameraCal: shard.c
+
+    Copyright (C) 2022  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include "shard.h"
+
+#include "main.h"
+#include "analysis.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+#include <cdf.h>
+
+// A long interval can be analyzed as time shards on several nodes, each
+// writing its per-image results and the calibration sums to a shard file.
+// Merging the shards gives the calibration CDF of a single run over the
+// whole interval: the per-image arrays are concatenated in time order and
+// the calibration sums add exactly.
+
+// Identifies the reference site model, which every shard of a merge must share
+uint64_t referenceSiteModelHash(ProgramState *state)
+{
+    uint64_t hashes[10] = {0};
+    float position[3] = {state->siteLatitudeGeodetic, state->siteLongitudeGeodetic, state->siteAltitudeMetres};
+
+    hashes[0] = fnv1a64(position, sizeof position);
+    hashes[1] = fnv1a64(state->sitePixelOffsets, sizeof state->sitePixelOffsets);
+    hashes[2] = fnv1a64(state->referenceElevations, sizeof state->referenceElevations);
+    hashes[3] = fnv1a64(state->referenceAzimuths, sizeof state->referenceAzimuths);
+    hashes[4] = fnv1a64(state->pixelX, sizeof state->pixelX);
+    hashes[5] = fnv1a64(state->pixelY, sizeof state->pixelY);
+    hashes[6] = fnv1a64(state->pixelZ, sizeof state->pixelZ);
+    if (state->calibrationDateGenerated != NULL)
+        hashes[7] = fnv1a64(state->calibrationDateGenerated, strlen(state->calibrationDateGenerated));
+    if (state->calibrationDateUsed != NULL)
+        hashes[8] = fnv1a64(state->calibrationDateUsed, strlen(state->calibrationDateUsed));
+    hashes[9] = state->skymap;
+
+    return fnv1a64(hashes, sizeof hashes);
+}
+
+// Writes the images analyzed in this run to
+// <exportdir>/themis_<site>_partial_results_<first>_<last>.shard
+int exportShard(ProgramState *state)
+{
+    if (state == NULL)
+        return ASCC_ARGUMENTS;
+
+    char firstTime[EPOCHx_STRING_MAX];
+    char lastTime[EPOCHx_STRING_MAX];
+    char format[EPOCHx_FORMAT_MAX] = "<year><mm.02><dom.02>T<hour><min><sec>";
+    encodeEPOCHx(state->firstCalTime, format, firstTime);
+    encodeEPOCHx(state->lastCalTime, format, lastTime);
+    snprintf(state->shardFilename, FILENAME_MAX, "%s/themis_%s_partial_results_%s_%s%s", state->exportdir, state->site, firstTime, lastTime, SHARD_FILE_EXTENSION);
+
+    char tmpFilename[FILENAME_MAX + 1];
+    snprintf(tmpFilename, FILENAME_MAX, "%s.tmp.%ld", state->shardFilename, (long)getpid());
+
+    ShardHeader header;
+    memset(&header, 0, sizeof header);
+    memcpy(header.magic, SHARD_MAGIC, 8);
+    header.byteOrder = SHARD_BYTE_ORDER;
+    header.headerBytes = sizeof header;
+    strncpy(header.site, state->site, sizeof header.site - 1);
+    header.firstCalTime = state->firstCalTime;
+    header.lastCalTime = state->lastCalTime;
+    header.referenceHash = referenceSiteModelHash(state);
+    header.nImages = state->nImages;
+    header.nl1filenames = state->nl1filenames;
+    for (size_t i = 0; i < state->nl1filenames; i++)
+        header.l1filenamesBytes += strlen(state->l1filenames[i]) + 1;
+    for (size_t i = 0; i < state->nImages; i++)
+        addImageToCalibrationSums(&header.sums, state->imageTimes[i], &state->attitudeQuaternions[i*4]);
+
+    FILE *shard = fopen(tmpFilename, "w");
+    if (shard == NULL)
+        return ASCC_PARTIAL_RESULTS;
+
+    size_t n = state->nImages;
+    bool written = fwrite(&header, sizeof header, 1, shard) == 1;
+    written = written && fwrite(state->imageTimes, sizeof *state->imageTimes, n, shard) == n;
+    written = written && fwrite(state->attitudeQuaternions, 4 * sizeof *state->attitudeQuaternions, n, shard) == n;
+    written = written && fwrite(state->nCalibrationStarsUsed, sizeof *state->nCalibrationStarsUsed, n, shard) == n;
+    written = written && fwrite(state->attitudeInterpolated, sizeof *state->attitudeInterpolated, n, shard) == n;
+    for (size_t i = 0; i < state->nl1filenames && written; i++)
+        written = fwrite(state->l1filenames[i], strlen(state->l1filenames[i]) + 1, 1, shard) == 1;
+    if (fclose(shard) != 0)
+        written = false;
+
+    // A merge only ever sees complete shards
+    if (!written || rename(tmpFilename, state->shardFilename) != 0)
+    {
+        remove(tmpFilename);
+        return ASCC_PARTIAL_RESULTS;
+    }
+
+    return ASCC_OK;
+}
+
+static int readShardHeader(const char *filename, FILE *shard, ShardHeader *header)
+{
+    if (fread(header, sizeof *header, 1, shard) != 1)
+        return ASCC_PARTIAL_RESULTS;
+
+    bool valid = memcmp(header->magic, SHARD_MAGIC, 8) == 0 && header->byteOrder == SHARD_BYTE_ORDER && header->headerBytes == sizeof *header;
+    valid = valid && memchr(header->site, '\0', sizeof header->site) != NULL && strlen(header->site) == 4;
+    valid = valid && header->sums.nImages == header->nImages && header->sums.nAttitudes <= header->nImages;
+    if (!valid)
+    {
+        fprintf(stderr, "%s is not a partial results file.\n", filename);
+        return ASCC_PARTIAL_RESULTS;
+    }
+
+    return ASCC_OK;
+}
+
+static int compareShards(const void *a, const void *b)
+{
+    const ShardFile *s1 = (const ShardFile *)a;
+    const ShardFile *s2 = (const ShardFile *)b;
+
+    if (s1->header.firstCalTime < s2->header.firstCalTime)
+        return -1;
+    if (s1->header.firstCalTime > s2->header.firstCalTime)
+        return 1;
+    return 0;
+}
+
+// Reads the shard headers and sets the site and calibration interval of the merged run
+int openShards(ProgramState *state, char **filenames, size_t nFiles, ShardSet *set)
+{
+    if (state == NULL || filenames == NULL || set == NULL || nFiles == 0)
+        return ASCC_ARGUMENTS;
+
+    set->shards = calloc(nFiles, sizeof *set->shards);
+    if (set->shards == NULL)
+        return ASCC_MEM;
+
+    for (size_t i = 0; i < nFiles; i++)
+    {
+        ShardFile *s = &set->shards[set->nShards];
+        FILE *shard = fopen(filenames[i], "r");
+        if (shard == NULL)
+        {
+            fprintf(stderr, "Could not open partial results file %s.\n", filenames[i]);
+            return ASCC_PARTIAL_RESULTS;
+        }
+        int status = readShardHeader(filenames[i], shard, &s->header);
+        fclose(shard);
+        if (status != ASCC_OK)
+            return status;
+        s->filename = filenames[i];
+        set->nShards++;
+
+        if (i == 0)
+            snprintf(set->site, sizeof set->site, "%s", s->header.site);
+        else if (strcmp(set->site, s->header.site) != 0)
+        {
+            fprintf(stderr, "%s is for site %s, not %s.\n", filenames[i], s->header.site, set->site);
+            return ASCC_PARTIAL_RESULTS;
+        }
+    }
+
+    qsort(set->shards, set->nShards, sizeof *set->shards, compareShards);
+
+    state->site = set->site;
+    state->firstCalTime = set->shards[0].header.firstCalTime;
+    state->lastCalTime = set->shards[0].header.lastCalTime;
+    for (size_t i = 1; i < set->nShards; i++)
+    {
+        const ShardHeader *previous = &set->shards[i-1].header;
+        const ShardHeader *header = &set->shards[i].header;
+        if (header->firstCalTime < previous->lastCalTime)
+        {
+            fprintf(stderr, "The intervals of %s and %s overlap.\n", set->shards[i-1].filename, set->shards[i].filename);
+            return ASCC_PARTIAL_RESULTS;
+        }
+        if (state->verbose && header->firstCalTime > previous->lastCalTime + 1.0)
+        {
+            char gapStart[EPOCH4_STRING_LEN + 1];
+            char gapStop[EPOCH4_STRING_LEN + 1];
+            encodeEPOCH4(previous->lastCalTime, gapStart);
+            encodeEPOCH4(header->firstCalTime, gapStop);
+            fprintf(stderr, "No partial results between %s and %s.\n", gapStart, gapStop);
+        }
+        state->lastCalTime = header->lastCalTime;
+    }
+
+    return ASCC_OK;
+}
+
+static int appendShard(ProgramState *state, ShardFile *s, size_t first)
+{
+    FILE *shard = fopen(s->filename, "r");
+    if (shard == NULL)
+        return ASCC_PARTIAL_RESULTS;
+
+    int status = ASCC_OK;
+    char *names = NULL;
+    ShardHeader header;
+    status = readShardHeader(s->filename, shard, &header);
+    if (status != ASCC_OK)
+        goto cleanup;
+    if (memcmp(&header, &s->header, sizeof header) != 0)
+    {
+        fprintf(stderr, "%s changed during the merge.\n", s->filename);
+        status = ASCC_PARTIAL_RESULTS;
+        goto cleanup;
+    }
+
+    size_t n = header.nImages;
+    bool read = fread(&state->imageTimes[first], sizeof *state->imageTimes, n, shard) == n;
+    read = read && fread(&state->attitudeQuaternions[first * 4], 4 * sizeof *state->attitudeQuaternions, n, shard) == n;
+    read = read && fread(&state->nCalibrationStarsUsed[first], sizeof *state->nCalibrationStarsUsed, n, shard) == n;
+    read = read && fread(&state->attitudeInterpolated[first], sizeof *state->attitudeInterpolated, n, shard) == n;
+    if (!read)
+    {
+        fprintf(stderr, "%s is truncated.\n", s->filename);
+        status = ASCC_PARTIAL_RESULTS;
+        goto cleanup;
+    }
+
+    names = malloc(header.l1filenamesBytes + 1);
+    if (names == NULL)
+    {
+        status = ASCC_MEM;
+        goto cleanup;
+    }
+    if (fread(names, 1, header.l1filenamesBytes, shard) != header.l1filenamesBytes)
+    {
+        fprintf(stderr, "%s is truncated.\n", s->filename);
+        status = ASCC_PARTIAL_RESULTS;
+        goto cleanup;
+    }
+    names[header.l1filenamesBytes] = '\0';
+
+    void *mem = realloc(state->l1filenames, (state->nl1filenames + header.nl1filenames) * sizeof(char*));
+    if (mem == NULL)
+    {
+        status = ASCC_MEM;
+        goto cleanup;
+    }
+    state->l1filenames = mem;
+    const char *name = names;
+    for (size_t i = 0; i < header.nl1filenames; i++)
+    {
+        if (name >= names + header.l1filenamesBytes)
+        {
+            fprintf(stderr, "%s is truncated.\n", s->filename);
+            status = ASCC_PARTIAL_RESULTS;
+            goto cleanup;
+        }
+        state->l1filenames[state->nl1filenames] = strdup(name);
+        if (state->l1filenames[state->nl1filenames] == NULL)
+        {
+            status = ASCC_MEM;
+            goto cleanup;
+        }
+        state->nl1filenames++;
+        name += strlen(name) + 1;
+    }
+
+cleanup:
+    fclose(shard);
+    free(names);
+
+    return status;
+}
+
+// Concatenates the per-image results of the shards and computes the
+// calibration of the whole interval from the summed statistics
+int mergeShards(ProgramState *state, ShardSet *set)
+{
+    if (state == NULL || set == NULL)
+        return ASCC_ARGUMENTS;
+
+    uint64_t referenceHash = referenceSiteModelHash(state);
+    size_t nImages = 0;
+    CalibrationSums sums = {0};
+    for (size_t i = 0; i < set->nShards; i++)
+    {
+        if (set->shards[i].header.referenceHash != referenceHash)
+        {
+            fprintf(stderr, "%s was analyzed with a different reference calibration than %s.\n", set->shards[i].filename, state->skymap ? state->skymapfilename : state->l2filename);
+            return ASCC_PARTIAL_RESULTS;
+        }
+        nImages += set->shards[i].header.nImages;
+        addCalibrationSums(&sums, &set->shards[i].header.sums);
+    }
+
+    int status = resizeImageArrays(state, nImages);
+    if (status != ASCC_OK)
+        return status;
+
+    size_t first = 0;
+    for (size_t i = 0; i < set->nShards; i++)
+    {
+        status = appendShard(state, &set->shards[i], first);
+        if (status != ASCC_OK)
+            return status;
+        // The same image in two shards would be counted twice
+        if (first > 0 && set->shards[i].header.nImages > 0 && state->imageTimes[first] <= state->imageTimes[first - 1])
+        {
+            fprintf(stderr, "The images of %s overlap those of the previous partial results file.\n", set->shards[i].filename);
+            return ASCC_PARTIAL_RESULTS;
+        }
+        first += set->shards[i].header.nImages;
+        state->nImages = first;
+    }
+
+    return calibrationFromSums(state, &sums);
+}
+
+void freeShards(ShardSet *set)
+{
+    if (set == NULL)
+        return;
+
+    free(set->shards);
+    set->shards = NULL;
+    set->nShards = 0;
+
+    return;
+}
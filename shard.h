@@ -0,0 +1,76 @@
+/*
+
+    AllSkyCameraCal: shard.h
+
+    Copyright (C) 2022  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef _SHARD_H
+#define _SHARD_H
+
+#include "main.h"
+#include "analysis.h"
+
+#include <stdint.h>
+
+#define SHARD_MAGIC "ASCCSHD1"
+#define SHARD_FILE_EXTENSION ".shard"
+// Written in host byte order; shards can only be merged on a host of the same order
+#define SHARD_BYTE_ORDER 0x01020304U
+
+// Partial results of a run over one time shard: this header, then nImages
+// image times (double), attitude quaternions (4 float each), calibration
+// star counts (uint16) and interpolation flags (uint8), then the
+// nl1filenames L1 filenames, each terminated by a NUL
+typedef struct ShardHeader
+{
+    char magic[8];
+    uint32_t byteOrder;
+    uint32_t headerBytes;
+    char site[8];
+    // Requested calibration interval of the run
+    double firstCalTime;
+    double lastCalTime;
+    // Reference site model the images were analyzed with
+    uint64_t referenceHash;
+    uint64_t nImages;
+    uint64_t nl1filenames;
+    uint64_t l1filenamesBytes;
+    CalibrationSums sums;
+} ShardHeader;
+
+typedef struct ShardFile
+{
+    char *filename;
+    ShardHeader header;
+} ShardFile;
+
+// Shards to merge, in time order
+typedef struct ShardSet
+{
+    char site[5];
+    size_t nShards;
+    ShardFile *shards;
+} ShardSet;
+
+uint64_t referenceSiteModelHash(ProgramState *state);
+int exportShard(ProgramState *state);
+int openShards(ProgramState *state, char **filenames, size_t nFiles, ShardSet *set);
+int mergeShards(ProgramState *state, ShardSet *set);
+void freeShards(ShardSet *set);
+
+#endif // _SHARD_H
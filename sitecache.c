@@ -0,0 +1,201 @@
+/*
+
+    AllSkyCameraCal: sitecache.c
+
+    Copyright (C) 2022  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include "sitecache.h"
+
+#include "main.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// The site model read from an L2 CDF or skymap file is compiled into a file
+// named after the site and the hash of the source file, so a changed source
+// file gets a new model. The arrays are stored ready to use: flipped to L2
+// layout, with the pixel unit vectors already computed.
+
+static void siteModelFilename(ProgramState *state, uint64_t sourceHash, char *modelFile)
+{
+    snprintf(modelFile, FILENAME_MAX, "%s/themis_%s_site_model_%016llx%s", state->siteModelCacheDir, state->site, (unsigned long long)sourceHash, SITE_MODEL_EXTENSION);
+
+    return;
+}
+
+static size_t siteModelBytes(void)
+{
+    return SITE_MODEL_ALIGNMENT + IMAGE_COLUMNS * IMAGE_ROWS * (sizeof(uint16_t) + 5 * sizeof(float));
+}
+
+int hashSiteModelSource(const char *sourceFile, uint64_t *hash)
+{
+    if (sourceFile == NULL || hash == NULL)
+        return ASCC_ARGUMENTS;
+
+    int fd = open(sourceFile, O_RDONLY);
+    if (fd < 0)
+        return ASCC_SITE_MODEL_CACHE;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        close(fd);
+        return ASCC_SITE_MODEL_CACHE;
+    }
+    void *base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return ASCC_SITE_MODEL_CACHE;
+
+    *hash = fnv1a64(base, (size_t)st.st_size);
+    munmap(base, (size_t)st.st_size);
+
+    return ASCC_OK;
+}
+
+// Fills the site position, dates and arrays of state from the compiled model, if there is one
+int loadSiteModelCache(ProgramState *state, uint64_t sourceHash)
+{
+    if (state == NULL || state->siteModelCacheDir == NULL)
+        return ASCC_ARGUMENTS;
+
+    char modelFile[FILENAME_MAX + 1];
+    siteModelFilename(state, sourceHash, modelFile);
+
+    int fd = open(modelFile, O_RDONLY);
+    if (fd < 0)
+        return ASCC_SITE_MODEL_CACHE;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size != siteModelBytes())
+    {
+        close(fd);
+        return ASCC_SITE_MODEL_CACHE;
+    }
+    uint8_t *base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return ASCC_SITE_MODEL_CACHE;
+
+    const SiteModelHeader *header = (const SiteModelHeader *)base;
+    bool valid = memcmp(header->magic, SITE_MODEL_MAGIC, 8) == 0 && header->byteOrder == SITE_MODEL_BYTE_ORDER && header->columns == IMAGE_COLUMNS && header->rows == IMAGE_ROWS;
+    valid = valid && header->sourceHash == sourceHash && header->arraysOffset == SITE_MODEL_ALIGNMENT && strncmp(header->site, state->site, sizeof header->site) == 0;
+    valid = valid && memchr(header->calibrationDateGenerated, '\0', SITE_MODEL_STRING_LEN) != NULL && memchr(header->calibrationDateUsed, '\0', SITE_MODEL_STRING_LEN) != NULL;
+    if (!valid)
+    {
+        munmap(base, (size_t)st.st_size);
+        return ASCC_SITE_MODEL_CACHE;
+    }
+
+    char *dateGenerated = strdup(header->calibrationDateGenerated);
+    char *dateUsed = strdup(header->calibrationDateUsed);
+    if (dateGenerated == NULL || dateUsed == NULL)
+    {
+        free(dateGenerated);
+        free(dateUsed);
+        munmap(base, (size_t)st.st_size);
+        return ASCC_MEM;
+    }
+    free(state->calibrationDateGenerated);
+    free(state->calibrationDateUsed);
+    state->calibrationDateGenerated = dateGenerated;
+    state->calibrationDateUsed = dateUsed;
+    state->siteLatitudeGeodetic = header->siteLatitudeGeodetic;
+    state->siteLongitudeGeodetic = header->siteLongitudeGeodetic;
+    state->siteAltitudeMetres = header->siteAltitudeMetres;
+
+    const uint8_t *arrays = base + header->arraysOffset;
+    memcpy(state->sitePixelOffsets, arrays, sizeof state->sitePixelOffsets);
+    arrays += sizeof state->sitePixelOffsets;
+    memcpy(state->referenceElevations, arrays, sizeof state->referenceElevations);
+    arrays += sizeof state->referenceElevations;
+    memcpy(state->referenceAzimuths, arrays, sizeof state->referenceAzimuths);
+    arrays += sizeof state->referenceAzimuths;
+    memcpy(state->pixelX, arrays, sizeof state->pixelX);
+    arrays += sizeof state->pixelX;
+    memcpy(state->pixelY, arrays, sizeof state->pixelY);
+    arrays += sizeof state->pixelY;
+    memcpy(state->pixelZ, arrays, sizeof state->pixelZ);
+
+    munmap(base, (size_t)st.st_size);
+
+    return ASCC_OK;
+}
+
+// Compiles the site model in state, loaded from the source file with hash sourceHash
+int saveSiteModelCache(ProgramState *state, uint64_t sourceHash)
+{
+    if (state == NULL || state->siteModelCacheDir == NULL)
+        return ASCC_ARGUMENTS;
+
+    char modelFile[FILENAME_MAX + 1];
+    char tmpFilename[FILENAME_MAX + 1];
+    siteModelFilename(state, sourceHash, modelFile);
+    snprintf(tmpFilename, FILENAME_MAX, "%s.tmp.%ld", modelFile, (long)getpid());
+
+    SiteModelHeader header;
+    uint8_t *headerBlock = calloc(1, SITE_MODEL_ALIGNMENT);
+    if (headerBlock == NULL)
+        return ASCC_MEM;
+    memset(&header, 0, sizeof header);
+    memcpy(header.magic, SITE_MODEL_MAGIC, 8);
+    header.byteOrder = SITE_MODEL_BYTE_ORDER;
+    header.columns = IMAGE_COLUMNS;
+    header.rows = IMAGE_ROWS;
+    header.sourceHash = sourceHash;
+    header.arraysOffset = SITE_MODEL_ALIGNMENT;
+    strncpy(header.site, state->site, sizeof header.site);
+    header.siteLatitudeGeodetic = state->siteLatitudeGeodetic;
+    header.siteLongitudeGeodetic = state->siteLongitudeGeodetic;
+    header.siteAltitudeMetres = state->siteAltitudeMetres;
+    snprintf(header.calibrationDateGenerated, SITE_MODEL_STRING_LEN, "%s", state->calibrationDateGenerated != NULL ? state->calibrationDateGenerated : "");
+    snprintf(header.calibrationDateUsed, SITE_MODEL_STRING_LEN, "%s", state->calibrationDateUsed != NULL ? state->calibrationDateUsed : "");
+    memcpy(headerBlock, &header, sizeof header);
+
+    int status = ASCC_OK;
+    FILE *model = fopen(tmpFilename, "w");
+    if (model == NULL)
+    {
+        free(headerBlock);
+        return ASCC_SITE_MODEL_CACHE;
+    }
+    bool written = fwrite(headerBlock, SITE_MODEL_ALIGNMENT, 1, model) == 1;
+    written = written && fwrite(state->sitePixelOffsets, sizeof state->sitePixelOffsets, 1, model) == 1;
+    written = written && fwrite(state->referenceElevations, sizeof state->referenceElevations, 1, model) == 1;
+    written = written && fwrite(state->referenceAzimuths, sizeof state->referenceAzimuths, 1, model) == 1;
+    written = written && fwrite(state->pixelX, sizeof state->pixelX, 1, model) == 1;
+    written = written && fwrite(state->pixelY, sizeof state->pixelY, 1, model) == 1;
+    written = written && fwrite(state->pixelZ, sizeof state->pixelZ, 1, model) == 1;
+    if (fclose(model) != 0)
+        written = false;
+    free(headerBlock);
+
+    // Readers only ever see a complete model
+    if (!written || rename(tmpFilename, modelFile) != 0)
+    {
+        remove(tmpFilename);
+        status = ASCC_SITE_MODEL_CACHE;
+    }
+
+    return status;
+}
@@ -0,0 +1,62 @@
+/*
+
+    AllSkyCameraCal: sitecache.h
+
+    Copyright (C) 2022  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef _SITECACHE_H
+#define _SITECACHE_H
+
+#include "main.h"
+
+#include <stdint.h>
+
+#define SITE_MODEL_MAGIC "ASCCSIT1"
+#define SITE_MODEL_EXTENSION ".model"
+// Written in host byte order; a model from a host of the other order is rebuilt
+#define SITE_MODEL_BYTE_ORDER 0x01020304U
+#define SITE_MODEL_ALIGNMENT 4096
+#define SITE_MODEL_STRING_LEN 64
+
+// A compiled site model: this header, then at arraysOffset the CCD offsets
+// (uint16) and the reference elevations, azimuths and pixel unit vectors
+// x, y and z (float), each 256x256 in L2 layout
+typedef struct SiteModelHeader
+{
+    char magic[8];
+    uint32_t byteOrder;
+    uint32_t columns;
+    uint32_t rows;
+    uint32_t reserved;
+    // FNV-1a hash of the L2 CDF or skymap file the model was compiled from
+    uint64_t sourceHash;
+    uint64_t arraysOffset;
+    char site[8];
+    float siteLatitudeGeodetic;
+    float siteLongitudeGeodetic;
+    float siteAltitudeMetres;
+    uint32_t reserved2;
+    char calibrationDateGenerated[SITE_MODEL_STRING_LEN];
+    char calibrationDateUsed[SITE_MODEL_STRING_LEN];
+} SiteModelHeader;
+
+int hashSiteModelSource(const char *sourceFile, uint64_t *hash);
+int loadSiteModelCache(ProgramState *state, uint64_t sourceHash);
+int saveSiteModelCache(ProgramState *state, uint64_t sourceHash);
+
+#endif // _SITECACHE_H
@@ -35,39 +35,46 @@ typedef struct Star
     float decProperMotionRadianPerYear;
 } Star;
 
+// Per-image working set of a calibration star: only what the reference map
+// search, centroiding and attitude fit touch, one cache line per star
 typedef struct CalibrationStar
 {
-    Star *star;
     long catalogIndex;
     float predictedAzElX;
     float predictedAzElY;
     float predictedAzElZ;
-    float predictedAz;
-    float predictedEl;
     float measuredAzElX;
     float measuredAzElY;
     float measuredAzElZ;
-    float measuredAz;
-    float measuredEl;
-    float deltaAz;
-    float deltaEl;
-    float magnitude;
-
-    long predictedImageColumn;
-    long predictedImageRow;
     float imageMomentColumn;
     float imageMomentRow;
     float previousImageMomentColumn;
     float previousImageMomentRow;
-    float backgroundThreshold;
     float meanImageSignalAboveThreshold;
+    int32_t predictedImageColumn;
+    int32_t predictedImageRow;
     bool newStarAtThisIndex;
-
-    
+    // Tracked from the previous image's centroid instead of the reference map prediction
+    bool locked;
     bool includeInCalibration;
-
-
+    // Region of the sky for the star detectability statistics
+    uint8_t skyRegion;
 } CalibrationStar;
 
+// Catalog values and angles of a calibration star for --print-star-info,
+// indexed like the CalibrationStar array and only filled when printing
+typedef struct CalibrationStarDiagnostics
+{
+    Star *star;
+    float predictedAz;
+    float predictedEl;
+    float measuredAz;
+    float measuredEl;
+    float deltaAz;
+    float deltaEl;
+    float magnitude;
+    float backgroundThreshold;
+} CalibrationStarDiagnostics;
+
 
 #endif // _STAR_H
@@ -0,0 +1,249 @@
+/*
+
+    AllSkyCameraCal: startrack.c
+
+    Copyright (C) 2022  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include "startrack.h"
+
+#include "main.h"
+#include "star.h"
+#include "analysis.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+
+#define DAY_MILLISECONDS 86400000.0
+#define SEGMENT_WIDTH (2.0 * M_PI / STAR_TRACK_SEGMENTS)
+
+// Earth rotation angle since J2000 plus the site longitude, in [0, 2 pi), as in radecToazel()
+double localSiderealAngle(double time, float longitudeDeg)
+{
+    double deltat = (time - J200EPOCH) / 1000.0 / 86400.0;
+    double angle = fmod(2.0 * M_PI * (0.7790572732640 + 1.00273781191135448 * deltat) + longitudeDeg * M_PI / 180.0, 2.0 * M_PI);
+    if (angle < 0)
+        angle += 2.0 * M_PI;
+
+    return angle;
+}
+
+// Local mean solar days starting at noon, so a night is never split
+static long localNight(double time, float longitudeDeg)
+{
+    return (long)floor((time + longitudeDeg / 360.0 * DAY_MILLISECONDS - 0.5 * DAY_MILLISECONDS) / DAY_MILLISECONDS);
+}
+
+// East, north and up components of a star's direction, in the frame of radecToazel()
+static void hourAngleToEnu(double hourAngle, double sinLat, double cosLat, double sinDec, double cosDec, double *enu)
+{
+    enu[0] = -sin(hourAngle) * cosDec;
+    enu[1] = cosLat * sinDec - sinLat * cos(hourAngle) * cosDec;
+    enu[2] = sinLat * sinDec + cosLat * cos(hourAngle) * cosDec;
+
+    return;
+}
+
+static double chebyshevValue(const float *c, double x)
+{
+    double b1 = 0.0;
+    double b2 = 0.0;
+    for (int j = STAR_TRACK_COEFFICIENTS - 1; j > 0; j--)
+    {
+        double b0 = 2.0 * x * b1 - b2 + c[j];
+        b2 = b1;
+        b1 = b0;
+    }
+
+    return x * b1 - b2 + c[0];
+}
+
+static void evaluateTrack(const StarTrack *track, int segment, double x, double *enu)
+{
+    for (int m = 0; m < 3; m++)
+        enu[m] = chebyshevValue(track->coefficients[segment][m], x);
+
+    return;
+}
+
+// Tables are fitted for the latitude of the site and the local night of time
+int prepareStarTracks(ProgramState *state, double time)
+{
+    if (state == NULL || state->starData == NULL || state->nStars <= 0)
+        return ASCC_ARGUMENTS;
+
+    StarTrackTable *table = state->starTracks;
+    if (table == NULL)
+    {
+        table = calloc(1, sizeof *table);
+        if (table == NULL)
+            return ASCC_MEM;
+        state->starTracks = table;
+    }
+    if (table->nStars != state->nStars)
+    {
+        void *mem = realloc(table->trackIndex, state->nStars * sizeof *table->trackIndex);
+        if (mem == NULL)
+            return ASCC_MEM;
+        table->trackIndex = mem;
+        table->nStars = state->nStars;
+        // Force a refit
+        table->night = 0;
+        table->latitude = NAN;
+    }
+
+    double latitude = state->siteLatitudeGeodetic;
+    long night = localNight(time, state->siteLongitudeGeodetic);
+    if (latitude == table->latitude && night == table->night)
+        return ASCC_OK;
+
+    // Tracks are fitted when a star is first needed
+    for (int32_t i = 0; i < table->nStars; i++)
+        table->trackIndex[i] = STAR_TRACK_NOT_FITTED;
+    table->nTracks = 0;
+    table->latitude = latitude;
+    table->night = night;
+    // Proper motion as in selectStars(), for the start of the night, so that
+    // the tracks do not depend on which image of the night comes first
+    double nightStart = (night + 0.5) * DAY_MILLISECONDS - state->siteLongitudeGeodetic / 360.0 * DAY_MILLISECONDS;
+    table->yearsSinceJ2000 = (float) (nightStart - J200EPOCH) / 1000.0 / 86400. / 365.25;
+
+    return ASCC_OK;
+}
+
+static int fitStarTrack(ProgramState *state, StarTrackTable *table, int32_t starIndex)
+{
+    Star *star = &state->starData[starIndex];
+    float starRa = fmod(star->rightAscensionRadian + star->raProperMotionRadianPerYear * table->yearsSinceJ2000, 2.0 * M_PI);
+    float starDec = fmod(star->declinationRadian + star->decProperMotionRadianPerYear * table->yearsSinceJ2000, 2.0 * M_PI);
+
+    // Highest elevation at culmination
+    double latRad = table->latitude * M_PI / 180.0;
+    if (90.0 - fabs(latRad - starDec) * 180.0 / M_PI <= CALIBRATION_ELEVATION_BOUND)
+    {
+        table->trackIndex[starIndex] = STAR_TRACK_NEVER_VISIBLE;
+        return ASCC_OK;
+    }
+
+    if (table->nTracks == table->capacity)
+    {
+        size_t capacity = table->capacity > 0 ? 2 * table->capacity : 4 * N_CALIBRATION_STARS;
+        void *mem = realloc(table->tracks, capacity * sizeof *table->tracks);
+        if (mem == NULL)
+            return ASCC_MEM;
+        table->tracks = mem;
+        table->capacity = capacity;
+    }
+    StarTrack *track = &table->tracks[table->nTracks];
+    track->rightAscension = starRa;
+
+    double sinLat = sin(latRad);
+    double cosLat = cos(latRad);
+    double sinDec = sin(starDec);
+    double cosDec = cos(starDec);
+    double values[STAR_TRACK_COEFFICIENTS][3];
+    double enu[3];
+    double fitted[3];
+    int n = STAR_TRACK_COEFFICIENTS;
+    for (int s = 0; s < STAR_TRACK_SEGMENTS; s++)
+    {
+        double start = s * SEGMENT_WIDTH;
+        // Interpolate at the Chebyshev nodes
+        for (int k = 0; k < n; k++)
+            hourAngleToEnu(start + 0.5 * SEGMENT_WIDTH * (cos(M_PI * (k + 0.5) / n) + 1.0), sinLat, cosLat, sinDec, cosDec, values[k]);
+        for (int m = 0; m < 3; m++)
+        {
+            for (int j = 0; j < n; j++)
+            {
+                double sum = 0.0;
+                for (int k = 0; k < n; k++)
+                    sum += values[k][m] * cos(M_PI * j * (k + 0.5) / n);
+                track->coefficients[s][m][j] = (float)(sum * (j == 0 ? 1.0 : 2.0) / n);
+            }
+        }
+        // |T_j(x)| <= 1 bounds the up component over the segment
+        double maxUp = track->coefficients[s][2][0];
+        for (int j = 1; j < n; j++)
+            maxUp += fabs(track->coefficients[s][2][j]);
+        track->maxUp[s] = (float)maxUp + FLT_EPSILON;
+
+        // Check the fit between the nodes and at the segment ends
+        for (double x = -1.0; x <= 1.0; x += 0.25)
+        {
+            hourAngleToEnu(start + 0.5 * SEGMENT_WIDTH * (x + 1.0), sinLat, cosLat, sinDec, cosDec, enu);
+            evaluateTrack(track, s, x, fitted);
+            double d = sqrt((enu[0] - fitted[0]) * (enu[0] - fitted[0]) + (enu[1] - fitted[1]) * (enu[1] - fitted[1]) + (enu[2] - fitted[2]) * (enu[2] - fitted[2]));
+            table->maxFitErrorDegrees = fmax(table->maxFitErrorDegrees, d * 180.0 / M_PI);
+        }
+    }
+
+    table->trackIndex[starIndex] = (int32_t)table->nTracks;
+    table->nTracks++;
+    table->nFits++;
+
+    return ASCC_OK;
+}
+
+// Azimuth and elevation in degrees of a catalog star as radecToazel() gives
+// them, if the star is above the calibration elevation bound
+bool predictStarAzEl(ProgramState *state, int32_t starIndex, double siderealAngle, float *az, float *el)
+{
+    StarTrackTable *table = state->starTracks;
+    if (table->trackIndex[starIndex] == STAR_TRACK_NOT_FITTED && fitStarTrack(state, table, starIndex) != ASCC_OK)
+        return false;
+    if (table->trackIndex[starIndex] == STAR_TRACK_NEVER_VISIBLE)
+        return false;
+
+    const StarTrack *track = &table->tracks[table->trackIndex[starIndex]];
+    double hourAngle = fmod(siderealAngle - track->rightAscension, 2.0 * M_PI);
+    if (hourAngle < 0)
+        hourAngle += 2.0 * M_PI;
+    int segment = (int)(hourAngle / SEGMENT_WIDTH);
+    if (segment >= STAR_TRACK_SEGMENTS)
+        segment = STAR_TRACK_SEGMENTS - 1;
+    // Below the bound for the whole segment
+    if (track->maxUp[segment] < sin(CALIBRATION_ELEVATION_BOUND * M_PI / 180.0))
+        return false;
+
+    double enu[3];
+    evaluateTrack(track, segment, 2.0 * (hourAngle - segment * SEGMENT_WIDTH) / SEGMENT_WIDTH - 1.0, enu);
+    table->nPredictions++;
+
+    float elVal = atan(enu[2] / sqrt(enu[0] * enu[0] + enu[1] * enu[1])) / M_PI * 180.0;
+    if (!(elVal > CALIBRATION_ELEVATION_BOUND))
+        return false;
+
+    *el = elVal;
+    *az = 90 - atan2(enu[1], enu[0]) / M_PI * 180.0;
+
+    return true;
+}
+
+void freeStarTracks(ProgramState *state)
+{
+    if (state == NULL || state->starTracks == NULL)
+        return;
+
+    free(state->starTracks->trackIndex);
+    free(state->starTracks->tracks);
+    free(state->starTracks);
+    state->starTracks = NULL;
+
+    return;
+}
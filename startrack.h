@@ -0,0 +1,77 @@
+/*
+
+    AllSkyCameraCal: startrack.h
+
+    Copyright (C) 2022  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+// Star positions in the sky of a site from short Chebyshev series instead of
+// a full RA/Dec to az/el conversion per star per image. A star's east, north
+// and up components depend only on its local hour angle for a given
+// latitude, so its track is fitted once per night over a sidereal day of
+// hour angle.
+
+#ifndef _STARTRACK_H
+#define _STARTRACK_H
+
+#include "main.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// One hour of hour angle per segment, degree 5: the fit error is far below float precision
+#define STAR_TRACK_SEGMENTS 24
+#define STAR_TRACK_COEFFICIENTS 6
+
+typedef struct StarTrack
+{
+    // Right ascension in radian with proper motion applied for the night
+    double rightAscension;
+    // Chebyshev coefficients of the east, north and up components per segment
+    float coefficients[STAR_TRACK_SEGMENTS][3][STAR_TRACK_COEFFICIENTS];
+    // Upper bound of the up component over each segment
+    float maxUp[STAR_TRACK_SEGMENTS];
+} StarTrack;
+
+typedef struct StarTrackTable
+{
+    // Site latitude in degrees, and local night number the proper motion is applied for
+    double latitude;
+    long night;
+    float yearsSinceJ2000;
+    int32_t nStars;
+    // Per catalog star: index of its track, STAR_TRACK_NOT_FITTED or STAR_TRACK_NEVER_VISIBLE
+    int32_t *trackIndex;
+    StarTrack *tracks;
+    size_t nTracks;
+    size_t capacity;
+
+    size_t nFits;
+    size_t nPredictions;
+    // Largest difference from the exact position at test points, degrees
+    double maxFitErrorDegrees;
+} StarTrackTable;
+
+#define STAR_TRACK_NOT_FITTED -1
+#define STAR_TRACK_NEVER_VISIBLE -2
+
+int prepareStarTracks(ProgramState *state, double time);
+double localSiderealAngle(double time, float longitudeDeg);
+bool predictStarAzEl(ProgramState *state, int32_t starIndex, double siderealAngle, float *az, float *el);
+void freeStarTracks(ProgramState *state);
+
+#endif // _STARTRACK_H
@@ -0,0 +1,384 @@
+/*
+
+    AllSkyCameraCal: sweep.c
+
+    Copyright (C) 2022  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "sweep.h"
+
+#include "main.h"
+#include "analysis.h"
+#include "attitude.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <cdf.h>
+
+// Parameter sweep: each image is read once and its calibration stars are
+// selected and located in the reference map once, for the largest number of
+// stars in the grid. Only the centroiding and the attitude fit run for each
+// configuration, each with its own star history.
+
+static int parseValues(char *values, float *parsed, int *nParsed)
+{
+    char *save = NULL;
+    char *value = strtok_r(values, ",", &save);
+    *nParsed = 0;
+    while (value != NULL)
+    {
+        if (*nParsed == SWEEP_MAX_VALUES)
+            return ASCC_ARGUMENTS;
+        char *end = NULL;
+        parsed[*nParsed] = strtof(value, &end);
+        if (end == value || *end != '\0')
+            return ASCC_ARGUMENTS;
+        (*nParsed)++;
+        value = strtok_r(NULL, ",", &save);
+    }
+
+    return *nParsed > 0 ? ASCC_OK : ASCC_ARGUMENTS;
+}
+
+static void applyConfig(ProgramState *state, const AnalysisConfig *config)
+{
+    state->starSearchBoxWidth = config->starSearchBoxWidth;
+    state->starMaxJitterPixels = config->starMaxJitterPixels;
+    state->maxBackgroundSignalForMoments = config->maxBackgroundSignalForMoments;
+    state->maxPeakSignalForMoments = config->maxPeakSignalForMoments;
+
+    return;
+}
+
+// Builds the configurations of a grid such as "stars=10,20:box=7,9:jitter=1,2:background=4000:peak=30000".
+// Settings not in the grid keep their command line values.
+int buildSweep(ProgramState *state, char *spec)
+{
+    if (state == NULL || spec == NULL)
+        return ASCC_ARGUMENTS;
+
+    float stars[SWEEP_MAX_VALUES] = {(float)state->nCalibrationStars};
+    float boxes[SWEEP_MAX_VALUES] = {(float)state->starSearchBoxWidth};
+    float jitters[SWEEP_MAX_VALUES] = {state->starMaxJitterPixels};
+    float backgrounds[SWEEP_MAX_VALUES] = {(float)state->maxBackgroundSignalForMoments};
+    float peaks[SWEEP_MAX_VALUES] = {(float)state->maxPeakSignalForMoments};
+    int nStars = 1;
+    int nBoxes = 1;
+    int nJitters = 1;
+    int nBackgrounds = 1;
+    int nPeaks = 1;
+    int status = ASCC_OK;
+
+    char *grid = strdup(spec);
+    if (grid == NULL)
+        return ASCC_MEM;
+
+    char *save = NULL;
+    char *parameter = strtok_r(grid, ":", &save);
+    while (parameter != NULL && status == ASCC_OK)
+    {
+        char *values = strchr(parameter, '=');
+        if (values == NULL)
+        {
+            status = ASCC_ARGUMENTS;
+            break;
+        }
+        *values++ = '\0';
+        if (strcmp(parameter, "stars") == 0)
+            status = parseValues(values, stars, &nStars);
+        else if (strcmp(parameter, "box") == 0)
+            status = parseValues(values, boxes, &nBoxes);
+        else if (strcmp(parameter, "jitter") == 0)
+            status = parseValues(values, jitters, &nJitters);
+        else if (strcmp(parameter, "background") == 0)
+            status = parseValues(values, backgrounds, &nBackgrounds);
+        else if (strcmp(parameter, "peak") == 0)
+            status = parseValues(values, peaks, &nPeaks);
+        else
+            status = ASCC_ARGUMENTS;
+        parameter = strtok_r(NULL, ":", &save);
+    }
+    free(grid);
+    if (status != ASCC_OK)
+    {
+        fprintf(stderr, "Could not parse sweep grid %s.\n", spec);
+        return status;
+    }
+
+    long nRuns = (long)nStars * nBoxes * nJitters * nBackgrounds * nPeaks;
+    if (nRuns > SWEEP_MAX_CONFIGURATIONS)
+    {
+        fprintf(stderr, "Sweep grid has %ld configurations, at most %d are allowed.\n", nRuns, SWEEP_MAX_CONFIGURATIONS);
+        return ASCC_ARGUMENTS;
+    }
+
+    Sweep *sweep = calloc(1, sizeof *sweep);
+    if (sweep == NULL)
+        return ASCC_MEM;
+    sweep->runs = calloc(nRuns, sizeof *sweep->runs);
+    if (sweep->runs == NULL)
+    {
+        free(sweep);
+        return ASCC_MEM;
+    }
+
+    int n = 0;
+    for (int a = 0; a < nStars; a++)
+        for (int b = 0; b < nBoxes; b++)
+            for (int c = 0; c < nJitters; c++)
+                for (int d = 0; d < nBackgrounds; d++)
+                    for (int e = 0; e < nPeaks; e++)
+                    {
+                        AnalysisConfig *config = &sweep->runs[n++].config;
+                        config->nCalibrationStars = (int)stars[a];
+                        config->starSearchBoxWidth = (int)boxes[b];
+                        config->starMaxJitterPixels = jitters[c];
+                        config->maxBackgroundSignalForMoments = (int)backgrounds[d];
+                        config->maxPeakSignalForMoments = (int)peaks[e];
+                    }
+    sweep->nRuns = n;
+
+    for (int r = 0; r < sweep->nRuns && status == ASCC_OK; r++)
+    {
+        AnalysisConfig *config = &sweep->runs[r].config;
+        if (config->nCalibrationStars < MIN_N_CALIBRATION_STARS_PER_IMAGE || config->starSearchBoxWidth < MIN_STAR_SEARCH_BOX_WIDTH || config->starSearchBoxWidth / 2 > IMAGE_HALO || config->starMaxJitterPixels <= 0.0 || config->maxBackgroundSignalForMoments <= 0 || config->maxPeakSignalForMoments <= 0)
+        {
+            fprintf(stderr, "Sweep configuration %d is out of range.\n", r + 1);
+            status = ASCC_ARGUMENTS;
+        }
+        if (config->nCalibrationStars > sweep->maxCalibrationStars)
+            sweep->maxCalibrationStars = config->nCalibrationStars;
+    }
+
+    for (int r = 0; r < sweep->nRuns && status == ASCC_OK; r++)
+    {
+        SweepRun *run = &sweep->runs[r];
+        int nCalStars = run->config.nCalibrationStars;
+        run->calStars = calloc(nCalStars, sizeof *run->calStars);
+        run->windows = calloc(nCalStars, sizeof *run->windows);
+        run->predictedAzElXYZ = calloc(nCalStars, 3 * sizeof *run->predictedAzElXYZ);
+        run->measuredAzElXYZ = calloc(nCalStars, 3 * sizeof *run->measuredAzElXYZ);
+        if (run->calStars == NULL || run->windows == NULL || run->predictedAzElXYZ == NULL || run->measuredAzElXYZ == NULL)
+            status = ASCC_MEM;
+    }
+    sweep->starLocated = calloc(sweep->maxCalibrationStars, sizeof *sweep->starLocated);
+    if (sweep->starLocated == NULL)
+        status = ASCC_MEM;
+
+    if (status != ASCC_OK)
+    {
+        freeSweep(sweep);
+        free(sweep);
+        return status;
+    }
+
+    // The shared star selection must cover the largest configuration
+    state->nCalibrationStars = sweep->maxCalibrationStars;
+    state->sweep = sweep;
+
+    return ASCC_OK;
+}
+
+void freeSweep(Sweep *sweep)
+{
+    if (sweep == NULL)
+        return;
+
+    for (int r = 0; r < sweep->nRuns && sweep->runs != NULL; r++)
+    {
+        free(sweep->runs[r].calStars);
+        free(sweep->runs[r].windows);
+        free(sweep->runs[r].predictedAzElXYZ);
+        free(sweep->runs[r].measuredAzElXYZ);
+    }
+    free(sweep->runs);
+    free(sweep->starLocated);
+    sweep->runs = NULL;
+    sweep->starLocated = NULL;
+    sweep->nRuns = 0;
+
+    return;
+}
+
+// Centroids and fits one configuration using the shared star predictions.
+// Follows the search path of estimatePointingError.
+static int sweepConfiguration(ProgramState *state, PaddedImage *padded, CalibrationStar *sharedStars, bool *starLocated, int nSelected, bool firstImageOfFile, SweepRun *run)
+{
+    CalibrationStar *cal = NULL;
+    CalibrationStar *shared = NULL;
+    StarWindow *window = NULL;
+    int nCalStars = run->config.nCalibrationStars < nSelected ? run->config.nCalibrationStars : nSelected;
+    int nCalStarsKept = 0;
+    int momentCounter = 0;
+    int statCounter = 0;
+    float previousColumn = 0.0;
+    float previousRow = 0.0;
+    double dcmArr[9] = {0.0};
+    double rotationVectorArr[3] = {0.0};
+    double rotationAngle = 0.0;
+    float dcm[9] = {0.0};
+
+    run->nImages++;
+    if (firstImageOfFile)
+        run->havePreviousDcm = false;
+
+    for (int i = 0; i < nCalStars; i++)
+    {
+        cal = &run->calStars[i];
+        shared = &sharedStars[i];
+        previousColumn = cal->imageMomentColumn;
+        previousRow = cal->imageMomentRow;
+        cal->newStarAtThisIndex = cal->catalogIndex != shared->catalogIndex;
+        cal->catalogIndex = shared->catalogIndex;
+        cal->predictedAzElX = shared->predictedAzElX;
+        cal->predictedAzElY = shared->predictedAzElY;
+        cal->predictedAzElZ = shared->predictedAzElZ;
+        cal->predictedImageColumn = shared->predictedImageColumn;
+        cal->predictedImageRow = shared->predictedImageRow;
+        cal->previousImageMomentColumn = previousColumn;
+        cal->previousImageMomentRow = previousRow;
+        cal->includeInCalibration = false;
+
+        window = &run->windows[i];
+        window->active = starLocated[i];
+        window->centerColumn = cal->predictedImageColumn;
+        window->centerRow = cal->predictedImageRow;
+        window->backgroundHalfWidth = state->starSearchBoxWidth / 2;
+        window->peakHalfWidth = state->starSearchBoxWidth / 2;
+    }
+    measureStarWindows(padded, run->windows, nCalStars);
+
+    for (int i = 0; i < nCalStars; i++)
+    {
+        cal = &run->calStars[i];
+        window = &run->windows[i];
+        if (!window->active || !isfinite(window->meanSignal) || window->meanSignal > state->maxBackgroundSignalForMoments || window->nPeakPixels == 0)
+            continue;
+        momentCounter = calculatePaddedMoments(state, padded, cal, 2, (float)window->peakColumn, (float)window->peakRow, roundf(window->meanSignal) + 10);
+        if (momentCounter > 0 && cal->meanImageSignalAboveThreshold > 0.0)
+        {
+            nCalStarsKept++;
+            cal->includeInCalibration = true;
+        }
+    }
+    if (nCalStarsKept < MIN_N_CALIBRATION_STARS_PER_IMAGE)
+        return ASCC_OK;
+
+    for (int i = 0; i < nCalStars; i++)
+    {
+        cal = &run->calStars[i];
+        if (cal->includeInCalibration && (firstImageOfFile || cal->newStarAtThisIndex || (fabsf(cal->imageMomentColumn - cal->previousImageMomentColumn) < state->starMaxJitterPixels && fabsf(cal->imageMomentRow - cal->previousImageMomentRow) < state->starMaxJitterPixels)))
+        {
+            run->predictedAzElXYZ[statCounter*3] = (double)cal->predictedAzElX;
+            run->predictedAzElXYZ[statCounter*3 + 1] = (double)cal->predictedAzElY;
+            run->predictedAzElXYZ[statCounter*3 + 2] = (double)cal->predictedAzElZ;
+            run->measuredAzElXYZ[statCounter*3] = (double)cal->measuredAzElX;
+            run->measuredAzElXYZ[statCounter*3 + 1] = (double)cal->measuredAzElY;
+            run->measuredAzElXYZ[statCounter*3 + 2] = (double)cal->measuredAzElZ;
+            statCounter++;
+        }
+    }
+    if (statCounter == 0 || fitRotation(run->predictedAzElXYZ, run->measuredAzElXYZ, statCounter, dcmArr) != ASCC_OK)
+        return ASCC_OK;
+
+    dcmToAxisAngle(dcmArr, rotationVectorArr, &rotationAngle);
+    for (int m = 0; m < 9; m++)
+        dcm[m] = (float)dcmArr[m];
+
+    run->nImagesFitted++;
+    run->nStarsUsed += statCounter;
+    run->sumRotationAngle += rotationAngle;
+    run->sumRotationAngleSquared += rotationAngle * rotationAngle;
+    if (run->havePreviousDcm)
+    {
+        double change = dcmAngleBetween(run->previousDcm, dcm);
+        run->sumChangeSquared += change * change;
+        run->nChanges++;
+    }
+    memcpy(run->previousDcm, dcm, sizeof dcm);
+    run->havePreviousDcm = true;
+
+    return ASCC_OK;
+}
+
+// Analyzes the offset-corrected image in the workspace with every configuration of the sweep
+int sweepImage(ProgramState *state, ImageWorkspace *work, double imageTime, bool firstImageOfFile)
+{
+    Sweep *sweep = state->sweep;
+    if (sweep == NULL)
+        return ASCC_ARGUMENTS;
+
+    state->nImagesAnalyzed++;
+
+    // Shared by all configurations: star predictions and reference map search
+    int nSelected = selectStars(state, imageTime, work->calStars, NULL);
+    for (int i = 0; i < nSelected; i++)
+        sweep->starLocated[i] = findNearestPixel(state, &work->calStars[i]);
+
+    // The measurement functions read their settings from the program state
+    AnalysisConfig commandLine = {
+        .nCalibrationStars = state->nCalibrationStars,
+        .starSearchBoxWidth = state->starSearchBoxWidth,
+        .starMaxJitterPixels = state->starMaxJitterPixels,
+        .maxBackgroundSignalForMoments = state->maxBackgroundSignalForMoments,
+        .maxPeakSignalForMoments = state->maxPeakSignalForMoments
+    };
+    for (int r = 0; r < sweep->nRuns; r++)
+    {
+        applyConfig(state, &sweep->runs[r].config);
+        sweepConfiguration(state, work->padded, work->calStars, sweep->starLocated, nSelected, firstImageOfFile, &sweep->runs[r]);
+    }
+    applyConfig(state, &commandLine);
+
+    return ASCC_OK;
+}
+
+// Writes one row of star yield and attitude scatter per configuration
+int exportSweepTable(ProgramState *state)
+{
+    if (state == NULL || state->sweep == NULL)
+        return ASCC_ARGUMENTS;
+
+    Sweep *sweep = state->sweep;
+    char firstTime[EPOCHx_STRING_MAX];
+    char lastTime[EPOCHx_STRING_MAX];
+    char format[EPOCHx_FORMAT_MAX] = "<year><mm.02><dom.02>T<hour><min><sec>";
+    encodeEPOCHx(state->firstCalTime, format, firstTime);
+    encodeEPOCHx(state->lastCalTime, format, lastTime);
+    snprintf(state->sweepTableFilename, FILENAME_MAX, "%s/themis_%s_analysis_sweep_%s_%s.txt", state->exportdir, state->site, firstTime, lastTime);
+
+    FILE *table = fopen(state->sweepTableFilename, "w");
+    if (table == NULL)
+        return ASCC_CDF_WRITE;
+
+    fprintf(table, "# configuration nCalibrationStars starSearchBoxWidth starMaxJitterPixels maxBackgroundSignal maxPeakSignal imagesAnalyzed imagesFitted fitFraction meanStarsPerFit meanRotationAngleDeg rotationAngleStdDeg rmsImageToImageChangeDeg\n");
+    for (int r = 0; r < sweep->nRuns; r++)
+    {
+        SweepRun *run = &sweep->runs[r];
+        double nFitted = (double)run->nImagesFitted;
+        double meanAngle = nFitted > 0 ? run->sumRotationAngle / nFitted : NAN;
+        double angleVariance = nFitted > 1 ? (run->sumRotationAngleSquared - nFitted * meanAngle * meanAngle) / (nFitted - 1.0) : NAN;
+        fprintf(table, "%d %d %d %.2f %d %d %zu %zu %.4f %.2f %.5f %.5f %.5f\n", r + 1, run->config.nCalibrationStars, run->config.starSearchBoxWidth, run->config.starMaxJitterPixels, run->config.maxBackgroundSignalForMoments, run->config.maxPeakSignalForMoments, run->nImages, run->nImagesFitted, run->nImages > 0 ? nFitted / (double)run->nImages : NAN, nFitted > 0 ? (double)run->nStarsUsed / nFitted : NAN, meanAngle, angleVariance > 0.0 ? sqrt(angleVariance) : (nFitted > 1 ? 0.0 : NAN), run->nChanges > 0 ? sqrt(run->sumChangeSquared / (double)run->nChanges) : NAN);
+    }
+
+    if (fclose(table) != 0)
+        return ASCC_CDF_WRITE;
+
+    return ASCC_OK;
+}
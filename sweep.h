@@ -0,0 +1,80 @@
+/*
+
+    AllSkyCameraCal: sweep.h
+
+    Copyright (C) 2022  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef _SWEEP_H
+#define _SWEEP_H
+
+#include "main.h"
+#include "star.h"
+#include "measure.h"
+#include "analysis.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define SWEEP_MAX_CONFIGURATIONS 256
+#define SWEEP_MAX_VALUES 32
+
+// Settings that can differ between configurations of a sweep
+typedef struct AnalysisConfig
+{
+    int nCalibrationStars;
+    int starSearchBoxWidth;
+    float starMaxJitterPixels;
+    int maxBackgroundSignalForMoments;
+    int maxPeakSignalForMoments;
+} AnalysisConfig;
+
+// One configuration's stars, measurements and statistics
+typedef struct SweepRun
+{
+    AnalysisConfig config;
+    CalibrationStar *calStars;
+    StarWindow *windows;
+    double *predictedAzElXYZ;
+    double *measuredAzElXYZ;
+
+    size_t nImages;
+    size_t nImagesFitted;
+    size_t nStarsUsed;
+    double sumRotationAngle;
+    double sumRotationAngleSquared;
+    // Rotation between consecutive fitted images of a file
+    bool havePreviousDcm;
+    float previousDcm[9];
+    double sumChangeSquared;
+    size_t nChanges;
+} SweepRun;
+
+typedef struct Sweep
+{
+    SweepRun *runs;
+    int nRuns;
+    // Stars are selected and located once per image for the largest configuration
+    int maxCalibrationStars;
+    bool *starLocated;
+} Sweep;
+
+int buildSweep(ProgramState *state, char *spec);
+void freeSweep(Sweep *sweep);
+int sweepImage(ProgramState *state, ImageWorkspace *work, double imageTime, bool firstImageOfFile);
+int exportSweepTable(ProgramState *state);
+
+#endif // _SWEEP_H
@@ -0,0 +1,234 @@
+/*
+
+    AllSkyCameraCal: test_frame_cache.c
+
+    Copyright (C) 2022  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// The frame cube cache: two runs over one L1 file, where the first makes the
+// cube and the second must map it without reading the L1 file again; the
+// cube's epochs and frames against those read through the CDF library; a
+// changed modification time or size of the L1 file must make a new cube; and
+// the least recently used cube must be evicted when the cache is full.
+
+#include "main.h"
+
+#include "framecache.h"
+#include "l1reader.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <cdf.h>
+
+static bool copyFile(const char *from, const char *to)
+{
+    char buffer[65536];
+    size_t n = 0;
+    bool copied = true;
+
+    FILE *in = fopen(from, "r");
+    if (in == NULL)
+        return false;
+    FILE *out = fopen(to, "w");
+    if (out == NULL)
+    {
+        fclose(in);
+        return false;
+    }
+    while ((n = fread(buffer, 1, sizeof buffer, in)) > 0)
+        copied = copied && fwrite(buffer, 1, n, out) == n;
+    fclose(in);
+    if (fclose(out) != 0)
+        copied = false;
+
+    return copied;
+}
+
+// The epochs and frames of a cube are those read through the CDF library
+static bool sameAsCdf(ProgramState *state, char *l1file, L1FrameMap *frames, const double *epochs, long nFrames)
+{
+    CDFid cdf = NULL;
+    char cdfVarName[CDF_VAR_NAME_LEN + 1] = {0};
+    long maxFileRecord = 0;
+    double epoch = 0.0;
+    uint16_t (*image)[IMAGE_ROWS] = calloc(IMAGE_COLUMNS, sizeof *image);
+    bool same = image != NULL && CDFopen(l1file, &cdf) == CDF_OK;
+
+    snprintf(cdfVarName, CDF_VAR_NAME_LEN + 1, "thg_asf_%s_epoch", state->site);
+    same = same && CDFgetzVarMaxWrittenRecNum(cdf, CDFgetVarNum(cdf, cdfVarName), &maxFileRecord) == CDF_OK && maxFileRecord + 1 == nFrames;
+    for (long r = 0; r < nFrames && same; r++)
+        same = CDFgetVarRangeRecordsByVarName(cdf, cdfVarName, r, r, &epoch) == CDF_OK && epoch == epochs[r];
+
+    snprintf(cdfVarName, CDF_VAR_NAME_LEN + 1, "thg_asf_%s", state->site);
+    for (long r = 0; r < nFrames && same; r++)
+    {
+        const uint16_t *frame = l1Frame(frames, r);
+        same = frame != NULL && CDFgetVarRangeRecordsByVarName(cdf, cdfVarName, r, r, &image[0][0]) == CDF_OK && memcmp(frame, &image[0][0], L1_FRAME_BYTES) == 0;
+    }
+
+    if (cdf != NULL)
+        CDFclose(cdf);
+    free(image);
+
+    return same;
+}
+
+// Loads a file through the cache, then drops the frames
+static int loadAndClose(ProgramState *state, char *l1file)
+{
+    L1FrameMap frames = {0};
+    double *epochs = NULL;
+    long nFrames = 0;
+
+    int status = loadFrameCube(state, l1file, &frames, &epochs, &nFrames);
+    if (status == ASCC_OK)
+    {
+        free(epochs);
+        closeL1FrameMap(&frames);
+    }
+
+    return status;
+}
+
+static bool setModified(const char *filename, time_t seconds, long nanoseconds)
+{
+    struct timespec times[2] = {{0, UTIME_OMIT}, {seconds, nanoseconds}};
+
+    return utimensat(AT_FDCWD, filename, times, 0) == 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 4)
+    {
+        fprintf(stderr, "Usage: %s <site> <l1file> <cachedir>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    ProgramState state = {0};
+    state.site = argv[1];
+    state.frameCacheDir = argv[3];
+    state.frameCacheMaxMegabytes = FRAME_CACHE_MAX_MEGABYTES;
+
+    char cubeFile[FILENAME_MAX + 1];
+    frameCubeFilename(&state, argv[2], cubeFile);
+    remove(cubeFile);
+
+    L1FrameMap frames[2] = {0};
+    double *epochs[2] = {NULL};
+    long nFrames[2] = {0};
+    int status[2] = {0};
+    size_t nBuilt[2] = {0};
+    size_t nHits[2] = {0};
+    for (int run = 0; run < 2; run++)
+    {
+        status[run] = loadFrameCube(&state, argv[2], &frames[run], &epochs[run], &nFrames[run]);
+        nBuilt[run] = state.nFrameCubesBuilt;
+        nHits[run] = state.nFrameCubeHits;
+        printf("Run %d: status %d, %ld frames, %zu cubes made, %zu read from cubes\n", run + 1, status[run], nFrames[run], nBuilt[run], nHits[run]);
+    }
+
+    bool passed = status[0] == ASCC_OK && status[1] == ASCC_OK && access(cubeFile, R_OK) == 0;
+    passed = passed && nBuilt[0] == 1 && nHits[0] == 0 && nBuilt[1] == 1 && nHits[1] == 1;
+    passed = passed && nFrames[0] > 0 && nFrames[0] == nFrames[1] && memcmp(epochs[0], epochs[1], nFrames[0] * sizeof *epochs[0]) == 0;
+    passed = passed && frames[0].length == frames[1].length && memcmp(frames[0].base, frames[1].base, frames[0].length) == 0;
+
+    bool sameFrames = passed && sameAsCdf(&state, argv[2], &frames[1], epochs[1], nFrames[1]);
+    printf("Cube %s the CDF library's epochs and frames\n", sameFrames ? "has" : "does not have");
+    passed = passed && sameFrames;
+
+    for (int run = 0; run < 2; run++)
+    {
+        free(epochs[run]);
+        closeL1FrameMap(&frames[run]);
+    }
+
+    // Copies of the L1 file that can be changed, and a cache of their own for eviction
+    char l1dir[FILENAME_MAX + 1];
+    char lruDir[FILENAME_MAX + 1];
+    char copies[4][FILENAME_MAX + 1];
+    char copyCubes[4][FILENAME_MAX + 1];
+    static const char *prefixes[4] = {"m", "a", "b", "c"};
+    char l1Copy[FILENAME_MAX + 1];
+    snprintf(l1Copy, FILENAME_MAX, "%s", argv[2]);
+    snprintf(l1dir, FILENAME_MAX, "%s/l1", argv[3]);
+    snprintf(lruDir, FILENAME_MAX, "%s/lru", argv[3]);
+    mkdir(l1dir, 0755);
+    mkdir(lruDir, 0755);
+    bool copied = true;
+    for (int i = 0; i < 4; i++)
+    {
+        snprintf(copies[i], FILENAME_MAX, "%s/%s_%s", l1dir, prefixes[i], basename(l1Copy));
+        copied = copyFile(argv[2], copies[i]) && copied;
+    }
+    passed = passed && copied;
+
+    // A new modification time, then a new size with the old time, each make a new cube
+    struct stat st;
+    bool changeReady = copied && loadAndClose(&state, copies[0]) == ASCC_OK && stat(copies[0], &st) == 0;
+
+    size_t hitsBefore = state.nFrameCubeHits;
+    size_t builtBefore = state.nFrameCubesBuilt;
+    bool remadeForTime = changeReady && setModified(copies[0], st.st_mtim.tv_sec + 1, st.st_mtim.tv_nsec);
+    remadeForTime = remadeForTime && loadAndClose(&state, copies[0]) == ASCC_OK && state.nFrameCubeHits == hitsBefore && state.nFrameCubesBuilt == builtBefore + 1;
+    printf("Changed modification time: %s\n", remadeForTime ? "new cube" : "stale cube used");
+    passed = passed && remadeForTime;
+
+    hitsBefore = state.nFrameCubeHits;
+    builtBefore = state.nFrameCubesBuilt;
+    FILE *grow = changeReady ? fopen(copies[0], "a") : NULL;
+    bool grown = grow != NULL && fputc(0, grow) == 0;
+    if (grow != NULL && fclose(grow) != 0)
+        grown = false;
+    grown = grown && setModified(copies[0], st.st_mtim.tv_sec + 1, st.st_mtim.tv_nsec);
+    int changedStatus = grown ? loadAndClose(&state, copies[0]) : ASCC_ARGUMENTS;
+    // The CDF library may not read the longer file: either way the old cube must not be used
+    bool remadeForSize = grown && state.nFrameCubeHits == hitsBefore && (changedStatus != ASCC_OK || state.nFrameCubesBuilt == builtBefore + 1);
+    printf("Changed size: %s\n", remadeForSize ? (changedStatus == ASCC_OK ? "new cube" : "not cached") : "stale cube used");
+    passed = passed && remadeForSize;
+
+    // Room for two cubes: making the third evicts the least recently used one
+    state.frameCacheDir = lruDir;
+    for (int i = 1; i < 4; i++)
+        frameCubeFilename(&state, copies[i], copyCubes[i]);
+    bool evictionReady = loadAndClose(&state, copies[1]) == ASCC_OK && loadAndClose(&state, copies[2]) == ASCC_OK && stat(copyCubes[1], &st) == 0;
+    evictionReady = evictionReady && setModified(copyCubes[1], st.st_mtim.tv_sec - 20, 0) && setModified(copyCubes[2], st.st_mtim.tv_sec - 10, 0);
+    size_t cubeBytes = evictionReady ? (size_t)st.st_size : 0;
+    state.frameCacheMaxMegabytes = (2 * cubeBytes + 999999) / 1000000;
+    if (evictionReady && state.frameCacheMaxMegabytes * 1000000 >= 3 * cubeBytes)
+    {
+        printf("Cubes of %zu bytes are too small to test eviction\n", cubeBytes);
+        evictionReady = false;
+    }
+    size_t evictedBefore = state.nFrameCubesEvicted;
+    bool evictedOldest = evictionReady && loadAndClose(&state, copies[3]) == ASCC_OK;
+    evictedOldest = evictedOldest && state.nFrameCubesEvicted == evictedBefore + 1 && access(copyCubes[1], F_OK) != 0 && access(copyCubes[2], F_OK) == 0 && access(copyCubes[3], F_OK) == 0;
+    printf("Full cache: %s\n", evictedOldest ? "least recently used cube evicted" : "wrong cubes evicted");
+    passed = passed && evictedOldest;
+
+    for (int i = 0; i < 4; i++)
+        remove(copies[i]);
+
+    printf("%s\n", passed ? "PASSED" : "FAILED");
+
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,191 @@
+/*
+
+    AllSkyCameraCal: test_global_fit.c
+
+    Copyright (C) 2022  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+// A distortion-free global camera model must reproduce the calibration map
+// made from the per-image pointing error: stars of a synthetic fisheye
+// reference map are rotated by a known DCM, the rotation is fitted per image
+// and globally, and both calibrated maps are compared with the rotated
+// reference directions.
+
+#include "main.h"
+
+#include "analysis.h"
+#include "attitude.h"
+#include "globalfit.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+
+#define TEST_STAR_SPACING 8
+#define TEST_ROTATION_DEGREES 0.5
+#define TEST_TOLERANCE_DEGREES 1e-3
+
+// Equidistant fisheye with the horizon 125 pixels from the centre
+static void syntheticReferenceMap(ProgramState *state)
+{
+    for (int c = 0; c < IMAGE_COLUMNS; c++)
+    {
+        for (int r = 0; r < IMAGE_ROWS; r++)
+        {
+            double dc = c - (IMAGE_COLUMNS - 1) / 2.0;
+            double dr = r - (IMAGE_ROWS - 1) / 2.0;
+            double el = 90.0 - hypot(dc, dr) * 90.0 / 125.0;
+            double az = atan2(dc, dr) / M_PI * 180.0;
+            if (el < 0.0)
+            {
+                state->pixelX[c][r] = NAN;
+                state->pixelY[c][r] = NAN;
+                state->pixelZ[c][r] = NAN;
+                continue;
+            }
+            state->pixelX[c][r] = cos((90.0 - az)*M_PI/180.0) * cos(el*M_PI/180.0);
+            state->pixelY[c][r] = sin((90.0 - az)*M_PI/180.0) * cos(el*M_PI/180.0);
+            state->pixelZ[c][r] = sin(el*M_PI/180.0);
+        }
+    }
+
+    return;
+}
+
+// Angle in degrees between two directions given as elevation and azimuth
+static double separation(double el1, double az1, double el2, double az2)
+{
+    double degree = M_PI / 180.0;
+    double cosAngle = sin(el1 * degree) * sin(el2 * degree) + cos(el1 * degree) * cos(el2 * degree) * cos((az1 - az2) * degree);
+    if (cosAngle > 1.0)
+        cosAngle = 1.0;
+
+    return acos(cosAngle) / degree;
+}
+
+int main(void)
+{
+    ProgramState *state = calloc(1, sizeof *state);
+    double *predicted = calloc(IMAGE_COLUMNS * IMAGE_ROWS, 3 * sizeof *predicted);
+    double *measured = calloc(IMAGE_COLUMNS * IMAGE_ROWS, 3 * sizeof *measured);
+    if (state == NULL || predicted == NULL || measured == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return EXIT_FAILURE;
+    }
+    state->globalFitThreads = 2;
+    syntheticReferenceMap(state);
+
+    // Pointing error about a tilted axis
+    double halfAngle = TEST_ROTATION_DEGREES / 2.0 * M_PI / 180.0;
+    double axis[3] = {0.3, -0.5, 0.8};
+    double axisNorm = sqrt(axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2]);
+    double q[4] = {cos(halfAngle), 0.0, 0.0, 0.0};
+    for (int i = 0; i < 3; i++)
+        q[i + 1] = sin(halfAngle) * axis[i] / axisNorm;
+    double dcm[9] = {0.0};
+    quaternionToDcm(q, dcm);
+
+    // Catalog direction of each star is the DCM applied to its reference direction
+    int n = 0;
+    int status = ASCC_OK;
+    bool passed = false;
+    CalibrationStar cal = {0};
+    for (int c = 0; c < IMAGE_COLUMNS; c += TEST_STAR_SPACING)
+    {
+        for (int r = 0; r < IMAGE_ROWS; r += TEST_STAR_SPACING)
+        {
+            double reference[3] = {state->pixelX[c][r], state->pixelY[c][r], state->pixelZ[c][r]};
+            if (!isfinite(reference[0]))
+                continue;
+            for (int i = 0; i < 3; i++)
+            {
+                measured[n * 3 + i] = reference[i];
+                predicted[n * 3 + i] = dcm[i * 3] * reference[0] + dcm[i * 3 + 1] * reference[1] + dcm[i * 3 + 2] * reference[2];
+            }
+            cal.imageMomentColumn = c;
+            cal.imageMomentRow = r;
+            cal.measuredAzElX = measured[n * 3];
+            cal.measuredAzElY = measured[n * 3 + 1];
+            cal.measuredAzElZ = measured[n * 3 + 2];
+            cal.predictedAzElX = predicted[n * 3];
+            cal.predictedAzElY = predicted[n * 3 + 1];
+            cal.predictedAzElZ = predicted[n * 3 + 2];
+            status = addGlobalObservation(state, &cal);
+            if (status != ASCC_OK)
+                goto cleanup;
+            n++;
+        }
+    }
+
+    // Per-image map
+    double fittedDcm[9] = {0.0};
+    float attitude[4] = {0.0};
+    CalibrationSums sums = {0};
+    status = fitRotation(predicted, measured, n, fittedDcm);
+    if (status != ASCC_OK)
+        goto cleanup;
+    storeAttitudeQuaternion(fittedDcm, attitude);
+    addImageToCalibrationSums(&sums, 0.0, attitude);
+    status = calibrationFromSums(state, &sums);
+    if (status != ASCC_OK)
+        goto cleanup;
+
+    // Global map
+    status = solveGlobalCameraModel(state);
+    if (status != ASCC_OK)
+        goto cleanup;
+    updateGlobalCalibration(state);
+
+    double maxPerImageError = 0.0;
+    double maxGlobalError = 0.0;
+    double maxDifference = 0.0;
+    int nPixels = 0;
+    for (int c = 0; c < IMAGE_COLUMNS; c++)
+    {
+        for (int r = 0; r < IMAGE_ROWS; r++)
+        {
+            if (!isfinite(state->pixelX[c][r]))
+                continue;
+            double x = dcm[0] * state->pixelX[c][r] + dcm[1] * state->pixelY[c][r] + dcm[2] * state->pixelZ[c][r];
+            double y = dcm[3] * state->pixelX[c][r] + dcm[4] * state->pixelY[c][r] + dcm[5] * state->pixelZ[c][r];
+            double z = dcm[6] * state->pixelX[c][r] + dcm[7] * state->pixelY[c][r] + dcm[8] * state->pixelZ[c][r];
+            double el = atan(z / sqrt(x * x + y * y)) / M_PI * 180.0;
+            double az = 90.0 - atan2(y, x) / M_PI * 180.0;
+            maxPerImageError = fmax(maxPerImageError, separation(el, az, state->calibratedElevations[c][r], state->calibratedAzimuths[c][r]));
+            maxGlobalError = fmax(maxGlobalError, separation(el, az, state->globalCalibratedElevations[c][r], state->globalCalibratedAzimuths[c][r]));
+            maxDifference = fmax(maxDifference, separation(state->calibratedElevations[c][r], state->calibratedAzimuths[c][r], state->globalCalibratedElevations[c][r], state->globalCalibratedAzimuths[c][r]));
+            nPixels++;
+        }
+    }
+
+    printf("%d stars, %d pixels, k1 = %.3g, k2 = %.3g\n", n, nPixels, state->globalRadialDistortion[0], state->globalRadialDistortion[1]);
+    printf("Largest error: per-image map %.2e deg, global map %.2e deg, difference %.2e deg\n", maxPerImageError, maxGlobalError, maxDifference);
+
+    passed = nPixels > 0 && maxPerImageError < TEST_TOLERANCE_DEGREES && maxGlobalError < TEST_TOLERANCE_DEGREES && maxDifference < TEST_TOLERANCE_DEGREES;
+    printf("%s\n", passed ? "PASSED" : "FAILED");
+
+cleanup:
+    if (status != ASCC_OK)
+        printf("Status %d\nFAILED\n", status);
+    free(state->globalObservations);
+    free(state);
+    free(predicted);
+    free(measured);
+
+    return status == ASCC_OK && passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -64,8 +64,8 @@ int main(int argc, char **argv)
 
     int nOptions = 0;
 
-    int statusL2 = loadThemisLevel2(&stateL2);
-    int statusIdl = loadSkymap(&stateIdl);
+    int statusL2 = loadThemisLevel2(&stateL2, stateL2.firstCalTime);
+    int statusIdl = loadSkymap(&stateIdl, stateIdl.firstCalTime);
 
     for (int c = 0; c < IMAGE_COLUMNS; c++)
     {
@@ -21,6 +21,7 @@
 #include "util.h"
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
@@ -35,6 +36,27 @@ double currentEpoch(void)
     return epoch;
 }
 
+// Seconds on a monotonic clock, for timing
+double monotonicSeconds(void)
+{
+    struct timespec now = {0};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+// 64-bit FNV-1a hash of a byte buffer
+uint64_t fnv1a64(const void *data, size_t nBytes)
+{
+    const uint8_t *bytes = (const uint8_t *)data;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < nBytes; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
 void printOptMsg(char *option, char *message)
 {
     size_t n = strlen(option);
@@ -21,7 +21,12 @@
 #ifndef _UTIL_H
 #define _UTIL_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 double currentEpoch(void);
+double monotonicSeconds(void);
+uint64_t fnv1a64(const void *data, size_t nBytes);
 
 void printOptMsg(char *option, char *message);
 
@@ -0,0 +1,387 @@
+/*
+
+    AllSkyCameraCal: watch.c
+
+    Copyright (C) 2022  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "watch.h"
+
+#include "main.h"
+#include "analysis.h"
+#include "import.h"
+#include "ephemeris.h"
+#include "util.h"
+#include "attitude.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <limits.h>
+#include <fts.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#include <cdf.h>
+
+static volatile sig_atomic_t stopRequested = 0;
+
+static void requestStop(int signalNumber)
+{
+    (void)signalNumber;
+    stopRequested = 1;
+
+    return;
+}
+
+static int addDirectoryWatch(L1Watch *watch, const char *path)
+{
+    int wd = inotify_add_watch(watch->fd, path, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_ONLYDIR);
+    if (wd < 0)
+        return ASCC_L1_FILE;
+
+    // inotify returns the same descriptor for a directory watched twice
+    for (size_t i = 0; i < watch->nDirectories; i++)
+        if (watch->directories[i].wd == wd)
+            return ASCC_OK;
+
+    void *mem = realloc(watch->directories, (watch->nDirectories + 1) * sizeof *watch->directories);
+    if (mem == NULL)
+        return ASCC_MEM;
+    watch->directories = mem;
+    watch->directories[watch->nDirectories].wd = wd;
+    watch->directories[watch->nDirectories].path = strdup(path);
+    if (watch->directories[watch->nDirectories].path == NULL)
+        return ASCC_MEM;
+    watch->nDirectories++;
+
+    return ASCC_OK;
+}
+
+// L1 files may be organized in subdirectories, as for the batch analysis
+static int addDirectoryTree(L1Watch *watch, char *root)
+{
+    int status = ASCC_OK;
+    char *dir[2] = {root, NULL};
+
+    FTS *fts = fts_open(dir, FTS_LOGICAL | FTS_NOSTAT, NULL);
+    if (fts == NULL)
+        return ASCC_L1_FILE;
+
+    FTSENT *e = fts_read(fts);
+    while (e != NULL && status == ASCC_OK)
+    {
+        if (e->fts_info == FTS_D)
+            status = addDirectoryWatch(watch, e->fts_path);
+        e = fts_read(fts);
+    }
+    fts_close(fts);
+
+    return status;
+}
+
+static const char *watchedDirectoryPath(L1Watch *watch, int wd)
+{
+    for (size_t i = 0; i < watch->nDirectories; i++)
+        if (watch->directories[i].wd == wd)
+            return watch->directories[i].path;
+
+    return NULL;
+}
+
+// Returns true if this version of the file was analyzed already, otherwise remembers it
+static bool alreadyAnalyzed(L1Watch *watch, const char *path, struct stat *info)
+{
+    RecentL1File *recent = NULL;
+
+    for (size_t i = 0; i < WATCH_RECENT_FILES; i++)
+    {
+        recent = &watch->recent[i];
+        if (recent->path != NULL && strcmp(recent->path, path) == 0 && recent->size == (int64_t)info->st_size && recent->modified.tv_sec == info->st_mtim.tv_sec && recent->modified.tv_nsec == info->st_mtim.tv_nsec)
+            return true;
+    }
+
+    recent = &watch->recent[watch->nextRecent];
+    free(recent->path);
+    recent->path = strdup(path);
+    recent->size = (int64_t)info->st_size;
+    recent->modified = info->st_mtim;
+    watch->nextRecent = (watch->nextRecent + 1) % WATCH_RECENT_FILES;
+
+    return false;
+}
+
+// Same selection as the batch analysis, plus the site, which the batch analysis takes from the directory
+static bool wantedL1File(ProgramState *state, char *name)
+{
+    double fileStartEpoch = epochFromL1Filename(name);
+    if (fileStartEpoch == ILLEGAL_EPOCH_VALUE)
+        return false;
+
+    // thg_l1_asf_<site>_<yyyymmddhh>_v01.cdf
+    if (strlen(state->site) != 4 || strncmp(name + 11, state->site, 4) != 0)
+        return false;
+
+    double fileStopEpoch = fileStartEpoch + 3600000; // one hour: L1 files cover 1 hour intervals
+    if ((fileStartEpoch < state->firstCalTime && fileStopEpoch <= state->firstCalTime) || (fileStartEpoch >= state->lastCalTime && fileStopEpoch > state->lastCalTime))
+        return false;
+
+    if (l1FileTooBright(state, fileStartEpoch, fileStopEpoch))
+    {
+        state->nL1FilesSkippedTooBright++;
+        return false;
+    }
+
+    return true;
+}
+
+static void writeAttitudeHeader(FILE *file)
+{
+    fprintf(file, "# Timestamp RotationAngle RotationAxisX RotationAxisY RotationAxisZ CalibrationStarCount AttitudeInterpolated PointingErrorDCM[9] ReferenceCalibration\n");
+
+    return;
+}
+
+static void writeAttitudeRow(FILE *file, ProgramState *state, size_t i)
+{
+    char timeString[EPOCH4_STRING_LEN+1];
+    float dcm[9];
+    float axis[3];
+    float angle = 0.0;
+    encodeEPOCH4(state->imageTimes[i], timeString);
+    expandAttitudeQuaternion(&state->attitudeQuaternions[i*4], dcm, axis, &angle);
+
+    fprintf(file, "%s %.5f %.6f %.6f %.6f %u %u", timeString, angle, axis[0], axis[1], axis[2], (unsigned int)state->nCalibrationStarsUsed[i], (unsigned int)state->attitudeInterpolated[i]);
+    for (int m = 0; m < 9; m++)
+        fprintf(file, " %.7f", dcm[m]);
+    // The reference map the pointing error is relative to, which can change while watching
+    const char *reference = state->skymap ? state->skymapfilename : state->l2filename;
+    fprintf(file, " %s\n", reference != NULL ? reference : "unknown");
+
+    return;
+}
+
+// Appends the analyzed images to the rolling attitude file and replaces the latest attitude file,
+// then drops the results so that memory use does not grow while watching
+int publishWatchResults(ProgramState *state, double latencySeconds)
+{
+    if (state == NULL)
+        return ASCC_ARGUMENTS;
+
+    int status = ASCC_OK;
+    char latestTemporary[FILENAME_MAX + 5];
+    long latest = -1;
+
+    if (state->nImages > 0)
+    {
+        FILE *rolling = fopen(state->rollingAttitudeFilename, "a");
+        if (rolling == NULL)
+            return ASCC_CDF_WRITE;
+        if (ftell(rolling) == 0)
+            writeAttitudeHeader(rolling);
+        for (size_t i = 0; i < state->nImages; i++)
+        {
+            writeAttitudeRow(rolling, state, i);
+            if (isfinite(state->attitudeQuaternions[i*4]))
+                latest = (long)i;
+        }
+        if (fclose(rolling) != 0)
+            status = ASCC_CDF_WRITE;
+    }
+
+    // Readers of the latest attitude always see a complete file
+    if (latest >= 0)
+    {
+        snprintf(latestTemporary, FILENAME_MAX + 5, "%s.tmp", state->latestAttitudeFilename);
+        FILE *file = fopen(latestTemporary, "w");
+        if (file == NULL)
+            status = ASCC_CDF_WRITE;
+        else
+        {
+            writeAttitudeHeader(file);
+            writeAttitudeRow(file, state, (size_t)latest);
+            if (isfinite(latencySeconds))
+                fprintf(file, "# Published %.3f s after the L1 file arrived\n", latencySeconds);
+            if (fclose(file) != 0 || rename(latestTemporary, state->latestAttitudeFilename) != 0)
+                status = ASCC_CDF_WRITE;
+        }
+    }
+
+    state->nImages = 0;
+    for (size_t i = 0; i < state->nl1filenames; i++)
+        free(state->l1filenames[i]);
+    state->nl1filenames = 0;
+
+    return status;
+}
+
+static int analyzeArrivedL1File(ProgramState *state, L1Watch *watch, const char *directory, char *name, double arrivalTime)
+{
+    char path[FILENAME_MAX + 1];
+    struct stat info;
+
+    if (!wantedL1File(state, name))
+        return ASCC_OK;
+    snprintf(path, FILENAME_MAX + 1, "%s/%s", directory, name);
+    if (stat(path, &info) != 0 || !S_ISREG(info.st_mode) || alreadyAnalyzed(watch, path, &info))
+        return ASCC_OK;
+
+    bool switched = false;
+    int status = selectSiteModel(state, epochFromL1Filename(name), &switched);
+    if (status != ASCC_OK)
+    {
+        fprintf(stderr, "Could not load the reference calibration for %s.\n", name);
+        return status;
+    }
+    if (switched && state->verbose)
+        fprintf(stderr, "Reference calibration for %s: %s\n", name, state->skymap ? state->skymapfilename : state->l2filename);
+
+    status = analyzeL1FileImages(state, path);
+    if (status == ASCC_MEM)
+        return status;
+    if (status != ASCC_OK && state->verbose)
+        fprintf(stderr, "Could not analyze %s.\n", path);
+
+    size_t nImages = state->nImages;
+    double latency = monotonicSeconds() - arrivalTime;
+    status = publishWatchResults(state, latency);
+    if (status != ASCC_OK)
+        fprintf(stderr, "Could not write %s or %s.\n", state->rollingAttitudeFilename, state->latestAttitudeFilename);
+    else if (state->verbose)
+        fprintf(stderr, "%s: %zu images analyzed, published %.2f s after arrival.\n", name, nImages, latency);
+    state->nL1FilesWatched++;
+
+    return status;
+}
+
+// Analyzes the L1 files already in l1dir, then each L1 file written or moved into it,
+// until SIGINT or SIGTERM. The star catalog and reference calibration stay loaded.
+int watchL1Directory(ProgramState *state)
+{
+    if (state == NULL)
+        return ASCC_ARGUMENTS;
+
+    int status = ASCC_OK;
+    L1Watch watch = {0};
+    struct sigaction stopAction = {0};
+    struct sigaction previousInterrupt;
+    struct sigaction previousTerminate;
+    // Room for many events per read
+    char events[64 * (sizeof(struct inotify_event) + NAME_MAX + 1)] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    snprintf(state->rollingAttitudeFilename, FILENAME_MAX, "%s/themis_%s_attitude_rolling.txt", state->exportdir, state->site);
+    snprintf(state->latestAttitudeFilename, FILENAME_MAX, "%s/themis_%s_attitude_latest.txt", state->exportdir, state->site);
+
+    // No SA_RESTART: a stop request interrupts poll()
+    stopRequested = 0;
+    stopAction.sa_handler = requestStop;
+    sigemptyset(&stopAction.sa_mask);
+    sigaction(SIGINT, &stopAction, &previousInterrupt);
+    sigaction(SIGTERM, &stopAction, &previousTerminate);
+
+    // Watch before the backlog so that no file arriving in between is missed
+    watch.fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (watch.fd < 0)
+    {
+        fprintf(stderr, "Could not watch %s: %s\n", state->l1dir, strerror(errno));
+        status = ASCC_L1_FILE;
+        goto cleanup;
+    }
+    status = addDirectoryTree(&watch, state->l1dir);
+    if (status != ASCC_OK)
+    {
+        fprintf(stderr, "Could not watch %s.\n", state->l1dir);
+        goto cleanup;
+    }
+
+    status = analyzeImagery(state);
+    if (status == ASCC_MEM)
+        goto cleanup;
+    status = publishWatchResults(state, NAN);
+    if (status != ASCC_OK)
+    {
+        fprintf(stderr, "Could not write %s or %s.\n", state->rollingAttitudeFilename, state->latestAttitudeFilename);
+        goto cleanup;
+    }
+    if (state->verbose)
+        fprintf(stderr, "Watching %zu directories under %s for new L1 files.\n", watch.nDirectories, state->l1dir);
+
+    struct pollfd pfd = {.fd = watch.fd, .events = POLLIN};
+    while (!stopRequested && status != ASCC_MEM)
+    {
+        int ready = poll(&pfd, 1, WATCH_POLL_MILLISECONDS);
+        if (ready <= 0)
+            continue;
+
+        ssize_t nRead = read(watch.fd, events, sizeof events);
+        if (nRead <= 0)
+            continue;
+        double arrivalTime = monotonicSeconds();
+
+        for (char *p = events; p < events + nRead && !stopRequested; )
+        {
+            struct inotify_event *event = (struct inotify_event*)p;
+            p += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW)
+            {
+                fprintf(stderr, "Watch queue overflowed: L1 files may have been missed.\n");
+                continue;
+            }
+            const char *directory = watchedDirectoryPath(&watch, event->wd);
+            if (directory == NULL || event->len == 0)
+                continue;
+
+            if (event->mask & IN_ISDIR)
+            {
+                // New day or month directory
+                char path[FILENAME_MAX + 1];
+                snprintf(path, FILENAME_MAX + 1, "%s/%s", directory, event->name);
+                status = addDirectoryTree(&watch, path);
+                if (status == ASCC_MEM)
+                    break;
+                status = ASCC_OK;
+            }
+            else if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+                status = analyzeArrivedL1File(state, &watch, directory, event->name, arrivalTime);
+        }
+    }
+    if (status != ASCC_MEM)
+        status = ASCC_OK;
+
+    if (state->verbose)
+        fprintf(stderr, "Stopped watching %s after %zu new L1 files.\n", state->l1dir, state->nL1FilesWatched);
+
+cleanup:
+    sigaction(SIGINT, &previousInterrupt, NULL);
+    sigaction(SIGTERM, &previousTerminate, NULL);
+
+    if (watch.fd >= 0)
+        close(watch.fd);
+    for (size_t i = 0; i < watch.nDirectories; i++)
+        free(watch.directories[i].path);
+    if (watch.directories != NULL)
+        free(watch.directories);
+    for (size_t i = 0; i < WATCH_RECENT_FILES; i++)
+        free(watch.recent[i].path);
+
+    return status;
+}
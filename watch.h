@@ -0,0 +1,60 @@
+/*
+
+    AllSkyCameraCal: watch.h
+
+    Copyright (C) 2022  Johnathan K Burchill
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef _WATCH_H
+#define _WATCH_H
+
+#include "main.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+// Completed files remembered so that a file closed twice is analyzed once
+#define WATCH_RECENT_FILES 64
+// How often a blocked watch checks for a stop request
+#define WATCH_POLL_MILLISECONDS 1000
+
+typedef struct WatchedDirectory
+{
+    int wd;
+    char *path;
+} WatchedDirectory;
+
+typedef struct RecentL1File
+{
+    char *path;
+    int64_t size;
+    struct timespec modified;
+} RecentL1File;
+
+typedef struct L1Watch
+{
+    int fd;
+    WatchedDirectory *directories;
+    size_t nDirectories;
+    RecentL1File recent[WATCH_RECENT_FILES];
+    size_t nextRecent;
+} L1Watch;
+
+int watchL1Directory(ProgramState *state);
+int publishWatchResults(ProgramState *state, double latencySeconds);
+
+#endif // _WATCH_H